@@ -1,26 +1,152 @@
+#define _GNU_SOURCE  // REG_RIP, to find the JIT-compiled function that trapped
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-#define MAX_IDENTIFIER_LENGTH 50
 #define MAX_KEYWORDS 10
-#define MAX_TOKENS 100
+#define INITIAL_TOKEN_CAPACITY 1024
+#define MAX_SOURCE_SIZE 0xFFFFFFFFu  // Token offsets are 32-bit
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define INITIAL_SYMBOL_CAPACITY 256  // Must be a power of two
+#define NO_SYMBOL (-1)
+#define LOOKAHEAD_SIZE 4             // Tokens buffered ahead of the parser; a power of two
+#define TOKEN_QUEUE_SIZE 4096        // Tokens in flight between the lexer thread and the parser
+#define QUEUE_SPIN_LIMIT 64          // Polls of a full or empty token queue before the thread blocks
+#define RELEASE_CHUNK_SIZE (8 << 20) // Consumed source is handed back to the OS in chunks this large
+#define END_OFFSET 0xFFFFFFFFu       // Offset reported for the END_OF_INPUT token
+#define OUTPUT_FLUSH_SIZE (1 << 20)  // Streaming output is written in blocks this large
+#define MAX_NESTING_DEPTH 1000       // Nested statements or expressions the recursive parser accepts
+#define COMPILER_VERSION "1.0"       // Part of every cache key, together with the build date and time
+#define CACHE_MAGIC "MCCACHE1"       // First bytes of a cache entry; the digit is the format version
+#define DEFAULT_CACHE_MEGABYTES 256  // Size limit of the compilation cache
+#define SERVER_MAGIC 0x5243434Du     // "MCCR" at the start of every compile server request
+#define MAX_REQUEST_SIZE (256u << 20) // Source bytes a compile server request may carry
+#define SERVER_IO_TIMEOUT 10         // Seconds a server connection may stall inside a request or answer
+#define IMAGE_MAGIC "MCCIMAGE"       // First bytes of a program image
+#define JIT_SIGNAL_STACK_SIZE (64 * 1024)  // Stack the JIT trap handler runs on after a stack overflow
+#define IMAGE_VERSION 1              // Bump when TreeNode, IntermediateCode or their enums change
+
+// Stage tracing (token listing, parser productions) costs one branch on
+// traceEnabled; build with -DENABLE_TRACE=0 to compile it out entirely
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE 1
+#endif
+#define TRACE(...) do { if (ENABLE_TRACE && traceEnabled) printf(__VA_ARGS__); } while (0)
+
+// Output modes
+enum {
+    OUTPUT_VERBOSE,  // Staged listing of every phase (the default)
+    OUTPUT_SILENT,   // Results only: the assembly, diagnostics on stderr
+    OUTPUT_JSON      // One JSON document with a dump of every stage
+};
+
+// Code generation targets
+enum {
+    TARGET_PSEUDO,  // Readable register-level pseudo-assembly (the default)
+    TARGET_X86_64   // x86-64 System V assembly for GNU as
+};
+
+// Ways to run the compiled program instead of printing its assembly
+enum {
+    EXECUTE_NONE,
+    EXECUTE_JIT,  // Machine code encoded in memory
+    EXECUTE_VM    // Bytecode interpreted by the VM
+};
 
-// Structure to represent a token
+// Forms of the --time-report output
+enum {
+    TIME_REPORT_NONE,
+    TIME_REPORT_TABLE,  // Human-readable table on stderr
+    TIME_REPORT_JSON    // JSON object on stderr (a member of the document with --json)
+};
+
+// Command line options
+typedef struct {
+    int outputMode;
+    const char *outputPath;  // Assembly goes to this file when set
+    int optimize;            // Run the optimization passes over each function (-O0 turns them off)
+    int target;
+    int execute;             // Run main right away instead of printing assembly
+    int jobs;                // Threads sharing the functions of one file
+    int maxErrors;           // Parsing stops after this many errors, 0 for no limit
+    int timeReport;          // Print the phase times, memory and counts (--time-report)
+    const char *tracePath;   // Chrome trace of the phases goes to this file when set
+    const char *cacheDirectory;  // Compiled assembly is kept here, keyed by the source bytes (--cache)
+    size_t cacheBytes;           // Least recently used entries are evicted past this size
+    int cacheStats;              // Print the hit and miss counts at exit
+    const char *imagePath;       // The symbols, AST and intermediate code are written here (--emit-image)
+} CompilerOptions;
+
+CompilerOptions options = { OUTPUT_VERBOSE, NULL, 1, TARGET_PSEUDO, EXECUTE_NONE, 1, 20, TIME_REPORT_NONE, NULL, NULL,
+                            (size_t)DEFAULT_CACHE_MEGABYTES << 20, 0, NULL };
+int traceEnabled = 1;
+FILE *diagnosticOutput;  // stdout in verbose mode, stderr otherwise
+#define READ_BLOCK_SIZE (1 << 20)  // Chunk size used when the input cannot be mapped
+
+// Structure to represent a token; the lexeme stays in the source buffer
 typedef struct {
-    char lexeme[MAX_IDENTIFIER_LENGTH];
     int tokenType;
+    unsigned int offset;  // Byte offset of the lexeme in the source buffer
+    unsigned int length;  // Length of the lexeme in bytes
+    int symbolId;         // Interned id for keywords and identifiers, NO_SYMBOL otherwise
 } Token;
 
-// Enumeration of token types
+// Growable token stream; tokens[count] always holds an END_OF_INPUT sentinel
+typedef struct {
+    Token *tokens;
+    int count;
+    int capacity;
+    const char *source;  // Text that the token offsets point into
+} TokenStream;
+
+// Enumeration of token types; the keyword kinds come first, in keywords[] order
 enum {
-    KEYWORD,
+    KW_IF, KW_ELSE, KW_WHILE, KW_FOR, KW_INT, KW_FLOAT, KW_CHAR, KW_RETURN, KW_BREAK, KW_CONTINUE,
     IDENTIFIER,
     INTEGER,
     RELATIONAL_OPERATOR,
     STRING,  // Added STRING token type
-    SEMICOLON, LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE, SLASH, BACKSLASH
+    SEMICOLON, LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE, SLASH, BACKSLASH,
+    PLUS, MINUS, STAR, ASSIGN,
+    END_OF_INPUT  // Sentinel after the last token
+};
+
+#define IS_KEYWORD_TOKEN(type) ((type) <= KW_CONTINUE)
+#define IS_TYPE_TOKEN(type) ((type) == KW_INT || (type) == KW_FLOAT || (type) == KW_CHAR)
+
+// Printable names of the token types, indexed by token type
+const char *tokenTypeNames[] = {
+    "KEYWORD", "KEYWORD", "KEYWORD", "KEYWORD", "KEYWORD",
+    "KEYWORD", "KEYWORD", "KEYWORD", "KEYWORD", "KEYWORD",
+    "IDENTIFIER", "INTEGER", "RELATIONAL_OPERATOR", "STRING",
+    "SEMICOLON", "LEFT_PAREN", "RIGHT_PAREN", "LEFT_BRACE", "RIGHT_BRACE", "SLASH", "BACKSLASH",
+    "PLUS", "MINUS", "STAR", "ASSIGN",
+    "END_OF_INPUT"
 };
 
 // Keyword array
@@ -28,651 +154,11227 @@ char *keywords[MAX_KEYWORDS] = {
     "if", "else", "while", "for", "int", "float", "char", "return", "break", "continue"
 };
 
-// Symbol table entry structure
-typedef struct {
-    char lexeme[MAX_IDENTIFIER_LENGTH];
-} SymbolEntry;
+// One block of arena memory; allocations are bumped out of data[]
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
 
-// Symbol table
-SymbolEntry symbolTable[MAX_KEYWORDS];
-int symbolTableSize = 0;
-
-// Function to check if a string is a keyword
-int isKeyword(char *str) {
-    for (int i = 0; i < MAX_KEYWORDS; i++) {
-        if (strcmp(str, keywords[i]) == 0) {
-            return 1;
+// Bump-pointer arena: everything allocated from it is released at once
+typedef struct {
+    ArenaChunk *head;
+    size_t allocations;    // Number of arenaAlloc calls
+    size_t bytesUsed;      // Bytes handed out, including alignment padding
+    size_t bytesReserved;  // Bytes obtained from malloc for chunks
+    size_t chunks;         // Number of malloc calls made for chunks
+} Arena;
+
+// Function to allocate memory from an arena
+void* arenaAlloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->head;
+
+    size = (size + 7) & ~(size_t)7;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
         }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena->head = chunk;
+        arena->bytesReserved += chunkSize;
+        arena->chunks++;
     }
-    return 0;
-}
 
-// Function to add an entry to the symbol table
-void addToSymbolTable(char *lexeme) {
-    if (symbolTableSize < MAX_KEYWORDS) {
-        strcpy(symbolTable[symbolTableSize].lexeme, lexeme);
-        symbolTableSize++;
-    }
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocations++;
+    arena->bytesUsed += size;
+    return memory;
 }
 
-// Function to display the symbol table
-void displaySymbolTable() {
-    printf("\nSymbol Table:\n");
-    for (int i = 0; i < symbolTableSize; i++) {
-        printf("%d: %s\n", i + 1, symbolTable[i].lexeme);
+// Function to free every chunk owned by an arena
+void arenaRelease(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    arena->head = NULL;
 }
 
-// Function to perform lexical analysis
-void lexicalAnalysis(FILE *inputFile, Token *tokens, int *numTokens) {
-    char currentChar;
-    char lexeme[MAX_IDENTIFIER_LENGTH];
-    int lexemeIndex = 0;
-
-    while ((currentChar = fgetc(inputFile)) != EOF) {
-        if (isalpha(currentChar)) { // Start of a keyword or identifier
-            lexemeIndex = 0;
-            lexeme[lexemeIndex++] = currentChar;
-
-            while (isalnum(currentChar = fgetc(inputFile)) || currentChar == '_') {
-                lexeme[lexemeIndex++] = currentChar;
-            }
-            lexeme[lexemeIndex] = '\0';
-
-            ungetc(currentChar, inputFile); // Put back the non-alphanumeric character
-
-            if (isKeyword(lexeme)) {
-                printf("<KEYWORD, %s>\n", lexeme);
-                tokens[*numTokens].tokenType = KEYWORD;
-            } else {
-                printf("<IDENTIFIER, %s>\n", lexeme);
-                tokens[*numTokens].tokenType = IDENTIFIER;
-                addToSymbolTable(lexeme);
-            }
-
-            strcpy(tokens[*numTokens].lexeme, lexeme);
-            (*numTokens)++;
-        } else if (isdigit(currentChar)) { // Integer
-            lexemeIndex = 0;
-            lexeme[lexemeIndex++] = currentChar;
-
-            while (isdigit(currentChar = fgetc(inputFile))) {
-                lexeme[lexemeIndex++] = currentChar;
-            }
-            lexeme[lexemeIndex] = '\0';
+// Function to empty an arena, keeping its newest chunk for the next user
+void arenaReset(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
 
-            printf("<INTEGER, %s>\n", lexeme);
-            ungetc(currentChar, inputFile); // Put back the non-digit character
+    if (chunk == NULL) {
+        return;
+    }
+    while (chunk->next != NULL) {
+        ArenaChunk *next = chunk->next->next;
+        arena->bytesReserved -= chunk->next->size;
+        free(chunk->next);
+        chunk->next = next;
+    }
+    chunk->used = 0;
+    arena->allocations = 0;
+    arena->bytesUsed = 0;
+}
 
-            strcpy(tokens[*numTokens].lexeme, lexeme);
-            tokens[*numTokens].tokenType = INTEGER;
-            (*numTokens)++;
-        } else if (currentChar == '<' || currentChar == '>' || currentChar == '=' || currentChar == '!') {
-            lexemeIndex = 0;
-            lexeme[lexemeIndex++] = currentChar;
+// Function to create an empty arena
+void initArena(Arena *arena) {
+    arena->head = NULL;
+    arena->allocations = 0;
+    arena->bytesUsed = 0;
+    arena->bytesReserved = 0;
+    arena->chunks = 0;
+}
 
-            if ((currentChar = fgetc(inputFile)) == '=') {
-                lexeme[lexemeIndex++] = currentChar;
-                lexeme[lexemeIndex] = '\0';
-                printf("<RELATIONAL_OPERATOR, %s>\n", lexeme);
-            } else {
-                lexeme[lexemeIndex] = '\0';
-                printf("<RELATIONAL_OPERATOR, %s>\n", lexeme);
-                ungetc(currentChar, inputFile); // Put back the non-'=' character
-            }
+// Growable text buffer that is written out with as few write calls as possible
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int fd;         // Descriptor the buffer is flushed to
+    int autoFlush;  // Flush whenever OUTPUT_FLUSH_SIZE bytes are pending (streaming)
+} OutputBuffer;
+
+// Function to create an empty output buffer for a descriptor
+void initOutputBuffer(OutputBuffer *buffer, int fd, int autoFlush) {
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->fd = fd;
+    buffer->autoFlush = autoFlush;
+}
 
-            strcpy(tokens[*numTokens].lexeme, lexeme);
-            tokens[*numTokens].tokenType = RELATIONAL_OPERATOR;
-            (*numTokens)++;
-        } else if (currentChar == '"') { // String
-            lexemeIndex = 0;
-            lexeme[lexemeIndex++] = currentChar;
+// Function to write everything pending in a buffer; returns 0 on a write error
+int flushOutputBuffer(OutputBuffer *buffer) {
+    size_t written = 0;
 
-            while ((currentChar = fgetc(inputFile)) != '"') {
-                if (currentChar == '\\') {
-                    lexeme[lexemeIndex++] = currentChar; // Include the escape character
-                    currentChar = fgetc(inputFile);
-                }
-                lexeme[lexemeIndex++] = currentChar;
-            }
+    if (buffer->fd == STDOUT_FILENO) {
+        fflush(stdout);  // Keep ordering with anything printed through stdio
+    }
+    while (written < buffer->length) {
+        ssize_t count = write(buffer->fd, buffer->data + written, buffer->length - written);
+        if (count < 0) {
+            return 0;
+        }
+        written += (size_t)count;
+    }
+    buffer->length = 0;
+    return 1;
+}
 
-            lexeme[lexemeIndex++] = currentChar; // Include the closing double quote
-            lexeme[lexemeIndex] = '\0';
-            printf("<STRING, %s>\n", lexeme);
+// Function to make room for more bytes in an output buffer
+void reserveOutput(OutputBuffer *buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) {
+        return;
+    }
 
-            strcpy(tokens[*numTokens].lexeme, lexeme);
-            tokens[*numTokens].tokenType = STRING;
-            (*numTokens)++;
-        } else if (currentChar == ';') {
-            printf("<SEMICOLON, ;>\n");
+    size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+    while (capacity < buffer->length + extra) {
+        capacity *= 2;
+    }
+    buffer->data = (char*)realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+        fprintf(stderr, "Error: Out of memory for output\n");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
 
-            strcpy(tokens[*numTokens].lexeme, ";");
-            tokens[*numTokens].tokenType = SEMICOLON;
-            (*numTokens)++;
-        } else if (currentChar == '(') {
-            printf("<LEFT_PAREN, (>\n");
+// Function to append bytes to an output buffer
+void bufferAppend(OutputBuffer *buffer, const char *text, size_t length) {
+    reserveOutput(buffer, length);
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    if (buffer->autoFlush && buffer->length >= OUTPUT_FLUSH_SIZE) {
+        flushOutputBuffer(buffer);
+    }
+}
 
-            strcpy(tokens[*numTokens].lexeme, "(");
-            tokens[*numTokens].tokenType = LEFT_PAREN;
-            (*numTokens)++;
-        } else if (currentChar == ')') {
-            printf("<RIGHT_PAREN, )>\n");
+// Function to append a NUL-terminated string to an output buffer
+void bufferPuts(OutputBuffer *buffer, const char *text) {
+    bufferAppend(buffer, text, strlen(text));
+}
 
-            strcpy(tokens[*numTokens].lexeme, ")");
-            tokens[*numTokens].tokenType = RIGHT_PAREN;
-            (*numTokens)++;
-        } else if (currentChar == '{') {
-            printf("<LEFT_BRACE, {>\n");
+// Function to append formatted text to an output buffer
+void bufferPrintf(OutputBuffer *buffer, const char *format, ...) {
+    va_list arguments;
 
-            strcpy(tokens[*numTokens].lexeme, "{");
-            tokens[*numTokens].tokenType = LEFT_BRACE;
-            (*numTokens)++;
-        } else if (currentChar == '}') {
-            printf("<RIGHT_BRACE, }>\n");
+    va_start(arguments, format);
+    int needed = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
 
-            strcpy(tokens[*numTokens].lexeme, "}");
-            tokens[*numTokens].tokenType = RIGHT_BRACE;
-            (*numTokens)++;
-        } else if (currentChar == '/') {
-            printf("<SLASH, />\n");
+    reserveOutput(buffer, (size_t)needed + 1);
+    va_start(arguments, format);
+    vsnprintf(buffer->data + buffer->length, (size_t)needed + 1, format, arguments);
+    va_end(arguments);
+    buffer->length += (size_t)needed;
 
-            strcpy(tokens[*numTokens].lexeme, "/");
-            tokens[*numTokens].tokenType = SLASH;
-            (*numTokens)++;
-        } else if (currentChar == '\\') {
-            printf("<BACKSLASH, \\>\n");
+    if (buffer->autoFlush && buffer->length >= OUTPUT_FLUSH_SIZE) {
+        flushOutputBuffer(buffer);
+    }
+}
 
-            strcpy(tokens[*numTokens].lexeme, "\\");
-            tokens[*numTokens].tokenType = BACKSLASH;
-            (*numTokens)++;
-        } else if (currentChar != ' ' && currentChar != '\n' && currentChar != '\r') {
-            // Ignore whitespace characters
-            printf("Error: Unknown character '%c'\n", currentChar);
+// Function to append a string as a quoted, escaped JSON string
+void bufferAppendJsonString(OutputBuffer *buffer, const char *text, size_t length) {
+    bufferAppend(buffer, "\"", 1);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            bufferAppend(buffer, escaped, 2);
+        } else if (c == '\n') {
+            bufferAppend(buffer, "\\n", 2);
+        } else if (c < 0x20 || c >= 0x7F) {
+            bufferPrintf(buffer, "\\u%04x", c);
+        } else {
+            bufferAppend(buffer, (const char*)&c, 1);
         }
     }
+    bufferAppend(buffer, "\"", 1);
 }
 
-// Enumeration of non-terminal types
-enum {
-    PROGRAM,
-    DECLARATION,
-    TYPE,
-    VARIABLE,
-    STATEMENT,
-    EXPRESSION
-};
-
-// Function to perform parsing
-void parse(Token *tokens, int numTokens);
-
-// Function to parse the program
-void parseProgram(Token *tokens, int *currentTokenIndex, int numTokens);
-
-// Function to parse variable declarations
-void parseDeclaration(Token *tokens, int *currentTokenIndex, int numTokens);
-
-// Function to parse types
-void parseType(Token *tokens, int *currentTokenIndex, int numTokens);
+// Function to free an output buffer
+void freeOutputBuffer(OutputBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
 
-// Function to parse variables
-void parseVariable(Token *tokens, int *currentTokenIndex, int numTokens);
+// Symbol table entry structure; the text lives in the table's arena
+typedef struct {
+    const char *lexeme;
+    unsigned int length;
+    unsigned int hash;
+    int isIdentifier;  // 0 for keywords and literals, which are interned but not listed
+    int localScope;    // Serial of the function whose local it currently names, -1 if none
+    int localBlock;    // Serial of the block that declared that local
+    int isGlobal;      // Declared as a global variable
+    int isFunction;    // Defined as a function
+} SymbolEntry;
 
+// Scope of a name before a local declaration in an inner block shadowed it
+typedef struct {
+    int symbolId;
+    int localScope;
+    int localBlock;
+} ShadowedName;
 
+// Interning symbol table: entries are indexed by symbol id, and slots is an
+// open-addressing hash of ids (NO_SYMBOL marks an empty slot)
+typedef struct {
+    SymbolEntry *entries;
+    int count;
+    int capacity;
+    int *slots;
+    unsigned int slotMask;
+    Arena strings;
+    ShadowedName *shadowed;  // Restored as the parser closes each block
+    int shadowedCount;
+    int shadowedCapacity;
+} SymbolTable;
+
+// State of one compilation. A context is used by one thread at a time and the
+// compiler reaches it through that thread's symbolTable, so units compiled on
+// different threads share nothing mutable.
+typedef struct {
+    SymbolTable symbols;
+    long units;  // Units compiled through this context
+} CompilationContext;
 
-void parse(Token *tokens, int numTokens) {
-    int currentTokenIndex = 0;
+// Symbol table of the context the calling thread is compiling with
+_Thread_local SymbolTable *symbolTable;
 
-    // Start parsing the program
-    parseProgram(tokens, &currentTokenIndex, numTokens);
+// Function to check if a string of the given length is a keyword by trying
+// every entry of keywords[] (reference loop, kept for --bench-keywords)
+int isKeyword(const char *str, size_t length) {
+    for (int i = 0; i < MAX_KEYWORDS; i++) {
+        if (strncmp(str, keywords[i], length) == 0 && keywords[i][length] == '\0') {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void parseProgram(Token *tokens, int *currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize the structure of a program.
-    // For simplicity, let's assume a program consists of variable declarations.
-
-    while (*currentTokenIndex < numTokens) {
-        parseDeclaration(tokens, currentTokenIndex, numTokens);
+// Function to classify an identifier-shaped lexeme with a single dispatch on
+// its length and first character; returns the KW_* kind or IDENTIFIER.
+// Keep in sync with keywords[].
+int classifyKeyword(const char *str, size_t length) {
+    switch (length) {
+        case 2:
+            return str[0] == 'i' && str[1] == 'f' ? KW_IF : IDENTIFIER;
+        case 3:
+            if (str[0] == 'f') return memcmp(str, "for", 3) == 0 ? KW_FOR : IDENTIFIER;
+            if (str[0] == 'i') return memcmp(str, "int", 3) == 0 ? KW_INT : IDENTIFIER;
+            return IDENTIFIER;
+        case 4:
+            if (str[0] == 'e') return memcmp(str, "else", 4) == 0 ? KW_ELSE : IDENTIFIER;
+            if (str[0] == 'c') return memcmp(str, "char", 4) == 0 ? KW_CHAR : IDENTIFIER;
+            return IDENTIFIER;
+        case 5:
+            if (str[0] == 'w') return memcmp(str, "while", 5) == 0 ? KW_WHILE : IDENTIFIER;
+            if (str[0] == 'f') return memcmp(str, "float", 5) == 0 ? KW_FLOAT : IDENTIFIER;
+            if (str[0] == 'b') return memcmp(str, "break", 5) == 0 ? KW_BREAK : IDENTIFIER;
+            return IDENTIFIER;
+        case 6:
+            return memcmp(str, "return", 6) == 0 ? KW_RETURN : IDENTIFIER;
+        case 8:
+            return memcmp(str, "continue", 8) == 0 ? KW_CONTINUE : IDENTIFIER;
+        default:
+            return IDENTIFIER;
     }
 }
 
-void parseDeclaration(Token *tokens, int *currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize variable declarations.
-    // For simplicity, let's assume a declaration consists of a type and a variable.
-
-    parseType(tokens, currentTokenIndex, numTokens);
-    parseVariable(tokens, currentTokenIndex, numTokens);
+// Function to hash a lexeme (FNV-1a)
+unsigned int hashLexeme(const char *lexeme, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)lexeme[i]) * 16777619u;
+    }
+    return hash;
+}
 
-    // For simplicity, let's assume a declaration ends with a semicolon.
-    if (tokens[*currentTokenIndex].tokenType == SEMICOLON) {
-        printf("Parsed: Declaration\n");
-        (*currentTokenIndex)++;
-    } else {
-        printf("Error: Expected semicolon after declaration\n");
+// Function to create an empty symbol table
+void initSymbolTable(SymbolTable *table) {
+    table->entries = (SymbolEntry*)malloc(INITIAL_SYMBOL_CAPACITY * sizeof(SymbolEntry));
+    table->count = 0;
+    table->capacity = INITIAL_SYMBOL_CAPACITY;
+    table->slots = (int*)malloc(INITIAL_SYMBOL_CAPACITY * 2 * sizeof(int));
+    table->slotMask = INITIAL_SYMBOL_CAPACITY * 2 - 1;
+    initArena(&table->strings);
+    for (unsigned int i = 0; i <= table->slotMask; i++) {
+        table->slots[i] = NO_SYMBOL;
     }
+    table->shadowed = NULL;
+    table->shadowedCount = 0;
+    table->shadowedCapacity = 0;
 }
 
-void parseType(Token *tokens, int *currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize types.
-    // For simplicity, let's assume only basic types like int, float, char.
+// Function to free a symbol table and all of its strings
+void freeSymbolTable(SymbolTable *table) {
+    free(table->entries);
+    free(table->slots);
+    free(table->shadowed);
+    arenaRelease(&table->strings);
+    table->entries = NULL;
+    table->slots = NULL;
+    table->shadowed = NULL;
+    table->shadowedCapacity = 0;
+    table->count = 0;
+    table->capacity = 0;
+}
 
-    if (tokens[*currentTokenIndex].tokenType == KEYWORD) {
-        printf("Parsed: Type - %s\n", tokens[*currentTokenIndex].lexeme);
-        (*currentTokenIndex)++;
-    } else {
-        printf("Error: Expected type\n");
+// Function to empty a symbol table, keeping its arrays and string arena for reuse
+void resetSymbolTable(SymbolTable *table) {
+    table->count = 0;
+    table->shadowedCount = 0;
+    for (unsigned int i = 0; i <= table->slotMask; i++) {
+        table->slots[i] = NO_SYMBOL;
     }
+    arenaReset(&table->strings);
 }
 
-void parseVariable(Token *tokens, int *currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize variables.
-    // For simplicity, let's assume a variable is an identifier.
+// Function to create a compilation context
+void initCompilationContext(CompilationContext *context) {
+    initSymbolTable(&context->symbols);
+    context->units = 0;
+}
 
-    if (tokens[*currentTokenIndex].tokenType == IDENTIFIER) {
-        printf("Parsed: Variable - %s\n", tokens[*currentTokenIndex].lexeme);
-        (*currentTokenIndex)++;
-    } else {
-        printf("Error: Expected variable\n");
+// Function to start compiling a unit with a context on the calling thread;
+// the symbols of the previous unit are dropped but their memory is reused
+void beginCompilation(CompilationContext *context) {
+    if (context->units++ > 0) {
+        resetSymbolTable(&context->symbols);
     }
+    symbolTable = &context->symbols;
 }
 
-typedef struct TreeNode {
-    char lexeme[MAX_IDENTIFIER_LENGTH];
-    int nodeType;  // Represents the type of AST node
-    struct TreeNode* children[2];  // Assume at most two children for simplicity
-} TreeNode;
+// Function to free a compilation context
+void freeCompilationContext(CompilationContext *context) {
+    if (symbolTable == &context->symbols) {
+        symbolTable = NULL;
+    }
+    freeSymbolTable(&context->symbols);
+}
 
-enum {
-    AST_PROGRAM,
-    AST_DECLARATION,
-    AST_TYPE,
-    AST_VARIABLE
-};
+// Function to double the hash slots once the table is half full
+void growSymbolSlots(SymbolTable *table) {
+    unsigned int newMask = table->slotMask * 2 + 1;
+    int *newSlots = (int*)malloc(((size_t)newMask + 1) * sizeof(int));
 
-// Function to create a new AST node
-TreeNode* createNode(char* lexeme, int nodeType) {
-    TreeNode* newNode = (TreeNode*)malloc(sizeof(TreeNode));
-    strcpy(newNode->lexeme, lexeme);
-    newNode->nodeType = nodeType;
-    newNode->children[0] = NULL;
-    newNode->children[1] = NULL;
-    return newNode;
-}
+    if (newSlots == NULL) {
+        fprintf(stderr, "Error: Out of memory for symbols\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i <= newMask; i++) {
+        newSlots[i] = NO_SYMBOL;
+    }
 
-// Function to free the AST
-void freeAST(TreeNode* root) {
-    if (root == NULL) {
-        return;
+    // Reinsert ids using the stored hashes; no strings are touched
+    for (int id = 0; id < table->count; id++) {
+        unsigned int slot = table->entries[id].hash & newMask;
+        while (newSlots[slot] != NO_SYMBOL) {
+            slot = (slot + 1) & newMask;
+        }
+        newSlots[slot] = id;
     }
 
-    freeAST(root->children[0]);
-    freeAST(root->children[1]);
-    free(root);
+    free(table->slots);
+    table->slots = newSlots;
+    table->slotMask = newMask;
 }
 
-// Function to perform parsing and build AST
-TreeNode* parseAndBuildAST(Token* tokens, int numTokens);
-
-// Function to parse the program and build AST
-TreeNode* parseProgramAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens);
+// Function to find the symbol id of a lexeme without interning it; returns
+// NO_SYMBOL if the table does not hold it
+int findSymbol(const SymbolTable *table, const char *lexeme, size_t length) {
+    unsigned int hash = hashLexeme(lexeme, length);
 
-// Function to parse variable declarations and build AST
-TreeNode* parseDeclarationAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens);
-
-// Function to parse types and build AST
-TreeNode* parseTypeAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens);
+    for (unsigned int slot = hash & table->slotMask; table->slots[slot] != NO_SYMBOL;
+         slot = (slot + 1) & table->slotMask) {
+        const SymbolEntry *entry = &table->entries[table->slots[slot]];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->lexeme, lexeme, length) == 0) {
+            return table->slots[slot];
+        }
+    }
+    return NO_SYMBOL;
+}
 
-// Function to parse variables and build AST
-TreeNode* parseVariableAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens);
+// Function to intern a lexeme and return its stable symbol id
+int internSymbol(SymbolTable *table, const char *lexeme, size_t length, int isIdentifier) {
+    unsigned int hash = hashLexeme(lexeme, length);
+    unsigned int slot = hash & table->slotMask;
 
-// Function to display the AST
-void displayAST(TreeNode* root, int level);
+    // Linear probing; an existing entry must match hash, length and bytes
+    while (table->slots[slot] != NO_SYMBOL) {
+        SymbolEntry *entry = &table->entries[table->slots[slot]];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->lexeme, lexeme, length) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & table->slotMask;
+    }
 
-TreeNode* parseAndBuildAST(Token* tokens, int numTokens) {
-    int currentTokenIndex = 0;
+    if (table->count == table->capacity) {
+        SymbolEntry *grown = (SymbolEntry*)realloc(table->entries, (size_t)table->capacity * 2 * sizeof(SymbolEntry));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Out of memory for symbols\n");
+            exit(1);
+        }
+        table->entries = grown;
+        table->capacity *= 2;
+    }
 
-    // Start parsing the program and build AST
-    return parseProgramAndBuildAST(tokens, &currentTokenIndex, numTokens);
+    char *text = (char*)arenaAlloc(&table->strings, length + 1);
+    memcpy(text, lexeme, length);
+    text[length] = '\0';
+
+    int id = table->count++;
+    table->entries[id].lexeme = text;
+    table->entries[id].length = (unsigned int)length;
+    table->entries[id].hash = hash;
+    table->entries[id].isIdentifier = isIdentifier;
+    table->entries[id].localScope = -1;
+    table->entries[id].localBlock = -1;
+    table->entries[id].isGlobal = 0;
+    table->entries[id].isFunction = 0;
+    table->slots[slot] = id;
+
+    if ((unsigned int)table->count * 2 > table->slotMask) {
+        growSymbolSlots(table);
+    }
+    return id;
 }
 
-TreeNode* parseProgramAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens) {
-    TreeNode* programNode = createNode("Program", AST_PROGRAM);
+// Function to get the null-terminated text of a symbol
+const char* symbolName(int symbolId) {
+    return symbolTable->entries[symbolId].lexeme;
+}
 
-    while (*currentTokenIndex < numTokens) {
-        TreeNode* declarationNode = parseDeclarationAndBuildAST(tokens, currentTokenIndex, numTokens);
+// Function to display the symbol table
+void displaySymbolTable() {
+    int row = 1;
 
-        // Add declaration to program node
-        if (declarationNode != NULL) {
-            if (programNode->children[0] == NULL) {
-                programNode->children[0] = declarationNode;
-            } else {
-                programNode->children[1] = declarationNode;
-            }
+    printf("\nSymbol Table:\n");
+    for (int i = 0; i < symbolTable->count; i++) {
+        if (symbolTable->entries[i].isIdentifier) {
+            printf("%d: %s\n", row++, symbolTable->entries[i].lexeme);
         }
     }
+}
 
-    return programNode;
+// Function to dump the identifiers of the symbol table as a JSON array
+void jsonSymbolTable(OutputBuffer *json) {
+    int first = 1;
+
+    bufferPuts(json, "[");
+    for (int i = 0; i < symbolTable->count; i++) {
+        if (symbolTable->entries[i].isIdentifier) {
+            bufferPrintf(json, "%s{\"id\":%d,\"name\":", first ? "" : ",", i);
+            bufferAppendJsonString(json, symbolTable->entries[i].lexeme, symbolTable->entries[i].length);
+            bufferPuts(json, "}");
+            first = 0;
+        }
+    }
+    bufferPuts(json, "]");
 }
 
-TreeNode* parseDeclarationAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens) {
-    TreeNode* declarationNode = createNode("Declaration", AST_DECLARATION);
+// Structure to hold the whole source file in one contiguous buffer
+typedef struct {
+    char *data;
+    size_t length;
+    int isMapped;  // 1 if data points into an mmap'd region, 0 if it was read into the heap
+} SourceBuffer;
 
-    // In a real parser, you would have rules to recognize variable declarations.
-    // For simplicity, let's assume a declaration consists of a type and a variable.
+// Results of loading a source file
+enum {
+    LOAD_FAILED,    // The file could not be opened or read
+    LOAD_OK,
+    LOAD_TOO_LARGE  // The source exceeds MAX_SOURCE_SIZE
+};
 
-    TreeNode* typeNode = parseTypeAndBuildAST(tokens, currentTokenIndex, numTokens);
-    TreeNode* variableNode = parseVariableAndBuildAST(tokens, currentTokenIndex, numTokens);
+// Function to read a descriptor that cannot be mapped (pipes, terminals) in large blocks
+int readSourceBlocks(int fd, SourceBuffer *source) {
+    size_t capacity = READ_BLOCK_SIZE;
+    size_t length = 0;
+    char *data = (char*)malloc(capacity);
 
-    // Add type and variable to declaration node
-    if (typeNode != NULL && variableNode != NULL) {
-        declarationNode->children[0] = typeNode;
-        declarationNode->children[1] = variableNode;
-    } else {
-        // Error handling if either type or variable is not present
-        printf("Error: Incomplete declaration\n");
-        freeAST(declarationNode);
-        return NULL;
+    if (data == NULL) {
+        return LOAD_FAILED;
     }
 
-    // For simplicity, let's assume a declaration ends with a semicolon.
-    if (tokens[*currentTokenIndex].tokenType == SEMICOLON) {
-        (*currentTokenIndex)++;
-    } else {
-        printf("Error: Expected semicolon after declaration\n");
-        freeAST(declarationNode);
-        return NULL;
+    for (;;) {
+        if (capacity - length < READ_BLOCK_SIZE) {
+            char *grown = (char*)realloc(data, capacity * 2);
+            if (grown == NULL) {
+                free(data);
+                return LOAD_FAILED;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+
+        ssize_t bytesRead = read(fd, data + length, capacity - length);
+        if (bytesRead < 0) {
+            free(data);
+            return LOAD_FAILED;
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+        length += (size_t)bytesRead;
+
+        // Stop as soon as the limit is passed instead of reading the rest of a pipe
+        if (length > MAX_SOURCE_SIZE) {
+            free(data);
+            return LOAD_TOO_LARGE;
+        }
     }
 
-    return declarationNode;
+    source->data = data;
+    source->length = length;
+    source->isMapped = 0;
+    return LOAD_OK;
 }
 
-TreeNode* parseTypeAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize types.
-    // For simplicity, let's assume only basic types like int, float, char.
+// Function to load a source file, mapping it when possible; returns LOAD_OK or the reason it failed
+int loadSourceFile(const char *path, SourceBuffer *source) {
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    int loaded = LOAD_FAILED;
 
-    if (tokens[*currentTokenIndex].tokenType == KEYWORD) {
-        TreeNode* typeNode = createNode(tokens[*currentTokenIndex].lexeme, AST_TYPE);
-        (*currentTokenIndex)++;
-        return typeNode;
-    } else {
-        printf("Error: Expected type\n");
-        return NULL;
+    if (fd < 0) {
+        return LOAD_FAILED;
     }
-}
 
-TreeNode* parseVariableAndBuildAST(Token* tokens, int* currentTokenIndex, int numTokens) {
-    // In a real parser, you would have rules to recognize variables.
-    // For simplicity, let's assume a variable is an identifier.
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return LOAD_FAILED;
+    }
 
-    if (tokens[*currentTokenIndex].tokenType == IDENTIFIER) {
-        TreeNode* variableNode = createNode(tokens[*currentTokenIndex].lexeme, AST_VARIABLE);
-        (*currentTokenIndex)++;
-        return variableNode;
-    } else {
-        printf("Error: Expected variable\n");
-        return NULL;
+    // Token offsets are 32-bit, so larger sources are rejected up front
+    if (S_ISREG(info.st_mode) && (unsigned long long)info.st_size > MAX_SOURCE_SIZE) {
+        close(fd);
+        return LOAD_TOO_LARGE;
     }
-}
 
-void displayAST(TreeNode* root, int level) {
-    if (root == NULL) {
-        return;
+    if (S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+            source->data = (char*)mapping;
+            source->length = (size_t)info.st_size;
+            source->isMapped = 1;
+            loaded = LOAD_OK;
+        }
     }
 
-    // Indentation based on the level
-    for (int i = 0; i < level; i++) {
-        printf("  ");
+    // Empty files, pipes and anything mmap refuses fall back to block reads
+    if (loaded != LOAD_OK) {
+        loaded = readSourceBlocks(fd, source);
     }
 
-    // Display node information
-    printf("%s (%d)\n", root->lexeme, root->nodeType);
+    close(fd);
+    return loaded;
+}
+
+// Function to describe why loadSourceFile failed
+const char* loadErrorText(int status) {
+    if (status == LOAD_TOO_LARGE) {
+        return "Error: input file exceeds the 4 GB source size limit.";
+    }
+    return "Error opening input file.";
+}
 
-    // Recursively display children
-    displayAST(root->children[0], level + 1);
-    displayAST(root->children[1], level + 1);
+// Function to release a source buffer
+void releaseSource(SourceBuffer *source) {
+    if (source->isMapped) {
+        munmap(source->data, source->length);
+    } else {
+        free(source->data);
+    }
+    source->data = NULL;
+    source->length = 0;
 }
+
+// Character classes used by the lexer's DFA
 enum {
-    OP_ASSIGN,
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    OP_LABEL,
-    OP_JUMP,
-    OP_IF,
-    OP_GOTO,
-    OP_READ,
-    OP_WRITE,
-    OP_RETURN
+    CC_OTHER,       // Not valid in any token
+    CC_SPACE,       // ' ', '\n', '\r' (tabs are reported as unknown characters)
+    CC_ALPHA,
+    CC_DIGIT,
+    CC_UNDERSCORE,
+    CC_RELOP,       // '<', '>', '!'
+    CC_EQUALS,
+    CC_QUOTE,
+    CC_BACKSLASH,
+    CC_PUNCT,       // ';', '(', ')', '{', '}', '/', '+', '-', '*'
+    CC_COUNT
 };
+
+// DFA states; the states from LS_ACCEPT on are terminal
 enum {
-    ASM_MOVE,   // Move operation (similar to assignment)
-    ASM_ADD,    // Add operation
-    ASM_SUB,    // Subtract operation
-    ASM_MUL,    // Multiply operation
-    ASM_DIV,
-    ASM_STR,
-    ASM_LOAD,    // Divide operation
-    // Add more operations as needed
+    LS_START,
+    LS_IDENTIFIER,
+    LS_NUMBER,
+    LS_RELOP,
+    LS_STRING,
+    LS_ESCAPE,
+    LS_ACCEPT,          // Token ends before the current character
+    LS_ACCEPT_CONSUME,  // Token ends with the current character
+    LS_SKIP,            // Whitespace; no token
+    LS_ERROR            // Unknown character
+};
+
+// Transition table of the lexer DFA, indexed by [state][character class]
+const unsigned char lexTransitions[LS_ACCEPT][CC_COUNT] = {
+    //                OTHER       SPACE       ALPHA          DIGIT          UNDERSCORE     RELOP      EQUALS             QUOTE              BACKSLASH          PUNCT
+    [LS_START]      = { LS_ERROR,  LS_SKIP,    LS_IDENTIFIER, LS_NUMBER,     LS_ERROR,      LS_RELOP,  LS_RELOP,          LS_STRING,         LS_ACCEPT_CONSUME, LS_ACCEPT_CONSUME },
+    [LS_IDENTIFIER] = { LS_ACCEPT, LS_ACCEPT,  LS_IDENTIFIER, LS_IDENTIFIER, LS_IDENTIFIER, LS_ACCEPT, LS_ACCEPT,         LS_ACCEPT,         LS_ACCEPT,         LS_ACCEPT },
+    [LS_NUMBER]     = { LS_ACCEPT, LS_ACCEPT,  LS_ACCEPT,     LS_NUMBER,     LS_ACCEPT,     LS_ACCEPT, LS_ACCEPT,         LS_ACCEPT,         LS_ACCEPT,         LS_ACCEPT },
+    [LS_RELOP]      = { LS_ACCEPT, LS_ACCEPT,  LS_ACCEPT,     LS_ACCEPT,     LS_ACCEPT,     LS_ACCEPT, LS_ACCEPT_CONSUME, LS_ACCEPT,         LS_ACCEPT,         LS_ACCEPT },
+    [LS_STRING]     = { LS_STRING, LS_STRING,  LS_STRING,     LS_STRING,     LS_STRING,     LS_STRING, LS_STRING,         LS_ACCEPT_CONSUME, LS_ESCAPE,         LS_STRING },
+    [LS_ESCAPE]     = { LS_STRING, LS_STRING,  LS_STRING,     LS_STRING,     LS_STRING,     LS_STRING, LS_STRING,         LS_STRING,         LS_STRING,         LS_STRING }
 };
 
+// Character class and single-character token type of every byte value
+unsigned char charClass[256];
+unsigned char singleCharToken[256];
 
+// Bulk scanning kernels: each returns the first position in [p, end) that is
+// not whitespace / an identifier character / a digit respectively
 typedef struct {
-    int op; // Operation type
-    char arg1[MAX_IDENTIFIER_LENGTH];
-    char arg2[MAX_IDENTIFIER_LENGTH];
-    char result[MAX_IDENTIFIER_LENGTH];
-} IntermediateCode;
-
-// Function to generate intermediate code for the AST
-void generateIntermediateCode(TreeNode* root, IntermediateCode* code, int* codeIndex);
+    const char *name;
+    const char* (*skipWhitespace)(const char *p, const char *end);
+    const char* (*skipIdentifier)(const char *p, const char *end);
+    const char* (*skipDigits)(const char *p, const char *end);
+} ScanKernels;
+
+const char* scalarSkipWhitespace(const char *p, const char *end) {
+    while (p < end && charClass[(unsigned char)*p] == CC_SPACE) {
+        p++;
+    }
+    return p;
+}
 
-// Helper function to create temporary variables
-char* createTempVar(int index);
+const char* scalarSkipIdentifier(const char *p, const char *end) {
+    while (p < end && (charClass[(unsigned char)*p] == CC_ALPHA || charClass[(unsigned char)*p] == CC_DIGIT ||
+                       charClass[(unsigned char)*p] == CC_UNDERSCORE)) {
+        p++;
+    }
+    return p;
+}
 
-// Helper function to generate three-address code for variable declarations
-void generateDeclarationCode(TreeNode* declarationNode, IntermediateCode* code, int* codeIndex);
+const char* scalarSkipDigits(const char *p, const char *end) {
+    while (p < end && charClass[(unsigned char)*p] == CC_DIGIT) {
+        p++;
+    }
+    return p;
+}
 
-// Helper function to generate three-address code for assignments
-void generateAssignmentCode(TreeNode* assignmentNode, IntermediateCode* code, int* codeIndex);
+const ScanKernels scalarKernels = { "scalar", scalarSkipWhitespace, scalarSkipIdentifier, scalarSkipDigits };
+
+#ifdef HAVE_X86_SIMD
+// Most whitespace, identifier and digit runs are a few bytes long, and for
+// those the setup of a vector compare costs more than the scalar loop. The
+// vector kernels therefore scan this many bytes with the scalar kernel first
+// and only switch to the vector loop for a run that is still going.
+#define SIMD_MIN_RUN 16
+
+// Byte-wise lo <= c <= hi; bytes >= 0x80 compare as negative and never match
+#define SSE2_IN_RANGE(c, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8((c), _mm_set1_epi8((char)((lo) - 1))), _mm_cmplt_epi8((c), _mm_set1_epi8((char)((hi) + 1))))
+#define AVX2_IN_RANGE(c, lo, hi) \
+    _mm256_and_si256(_mm256_cmpgt_epi8((c), _mm256_set1_epi8((char)((lo) - 1))), \
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8((char)((hi) + 1)), (c)))
+
+__attribute__((target("sse2")))
+const char* sse2SkipWhitespace(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipWhitespace(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
+    }
+    while (end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                     _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))));
+        unsigned int miss = ~(unsigned int)_mm_movemask_epi8(match) & 0xFFFFu;
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 16;
+    }
+    return scalarSkipWhitespace(p, end);
+}
 
-// Helper function to generate three-address code for expressions
-void generateExpressionCode(TreeNode* expressionNode, IntermediateCode* code, int* codeIndex);
+__attribute__((target("sse2")))
+const char* sse2SkipIdentifier(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipIdentifier(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
+    }
+    while (end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));  // 'A'..'Z' -> 'a'..'z'
+        __m128i match = _mm_or_si128(SSE2_IN_RANGE(folded, 'a', 'z'),
+                                     _mm_or_si128(SSE2_IN_RANGE(c, '0', '9'), _mm_cmpeq_epi8(c, _mm_set1_epi8('_'))));
+        unsigned int miss = ~(unsigned int)_mm_movemask_epi8(match) & 0xFFFFu;
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 16;
+    }
+    return scalarSkipIdentifier(p, end);
+}
 
-void generateIntermediateCode(TreeNode* root, IntermediateCode* code, int* codeIndex) {
-    if (root == NULL) {
-        return;
+__attribute__((target("sse2")))
+const char* sse2SkipDigits(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipDigits(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
     }
+    while (end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        unsigned int miss = ~(unsigned int)_mm_movemask_epi8(SSE2_IN_RANGE(c, '0', '9')) & 0xFFFFu;
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 16;
+    }
+    return scalarSkipDigits(p, end);
+}
 
-    switch (root->nodeType) {
-        case AST_PROGRAM:
-            // Traverse children
-            generateIntermediateCode(root->children[0], code, codeIndex);
-            generateIntermediateCode(root->children[1], code, codeIndex);
-            break;
+__attribute__((target("avx2")))
+const char* avx2SkipWhitespace(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipWhitespace(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
+    }
+    while (end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')),
+                                                        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r'))));
+        unsigned int miss = ~(unsigned int)_mm256_movemask_epi8(match);
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 32;
+    }
+    return sse2SkipWhitespace(p, end);
+}
 
-        case AST_DECLARATION:
-            generateDeclarationCode(root, code, codeIndex);
-            break;
+__attribute__((target("avx2")))
+const char* avx2SkipIdentifier(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipIdentifier(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
+    }
+    while (end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i match = _mm256_or_si256(AVX2_IN_RANGE(folded, 'a', 'z'),
+                                        _mm256_or_si256(AVX2_IN_RANGE(c, '0', '9'),
+                                                        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'))));
+        unsigned int miss = ~(unsigned int)_mm256_movemask_epi8(match);
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 32;
+    }
+    return sse2SkipIdentifier(p, end);
+}
 
-        case AST_TYPE:
-            // Nothing to do for types in this example
-            break;
+__attribute__((target("avx2")))
+const char* avx2SkipDigits(const char *p, const char *end) {
+    const char *prefixEnd = end - p > SIMD_MIN_RUN ? p + SIMD_MIN_RUN : end;
+    p = scalarSkipDigits(p, prefixEnd);
+    if (p < prefixEnd) {
+        return p;
+    }
+    while (end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int miss = ~(unsigned int)_mm256_movemask_epi8(AVX2_IN_RANGE(c, '0', '9'));
+        if (miss != 0) {
+            return p + __builtin_ctz(miss);
+        }
+        p += 32;
+    }
+    return sse2SkipDigits(p, end);
+}
 
-        case AST_VARIABLE:
-            // Nothing to do for variables in this example
-            break;
+const ScanKernels sse2Kernels = { "sse2", sse2SkipWhitespace, sse2SkipIdentifier, sse2SkipDigits };
+const ScanKernels avx2Kernels = { "avx2", avx2SkipWhitespace, avx2SkipIdentifier, avx2SkipDigits };
+#endif
 
-        // Add cases for other node types as needed
+// Kernels used by the lexer. Scalar by default: on typical sources most runs
+// are shorter than SIMD_MIN_RUN and the vector kernels measure a few percent
+// slower; build with -DLEXER_SIMD to pick the widest one the CPU supports.
+const ScanKernels *activeKernels = &scalarKernels;
 
-        default:
-            printf("Error: Unknown AST node type\n");
-            break;
+// Function to build the character class tables and select the scanning kernels
+void initLexerTables() {
+    for (int c = 0; c < 256; c++) {
+        charClass[c] = CC_OTHER;
+        singleCharToken[c] = END_OF_INPUT;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        charClass[c] = CC_ALPHA;
+        charClass[c - 'a' + 'A'] = CC_ALPHA;
     }
+    for (int c = '0'; c <= '9'; c++) {
+        charClass[c] = CC_DIGIT;
+    }
+    charClass[' '] = charClass['\n'] = charClass['\r'] = CC_SPACE;
+    charClass['_'] = CC_UNDERSCORE;
+    charClass['<'] = charClass['>'] = charClass['!'] = CC_RELOP;
+    charClass['='] = CC_EQUALS;
+    charClass['"'] = CC_QUOTE;
+    charClass['\\'] = CC_BACKSLASH;
+    charClass[';'] = charClass['('] = charClass[')'] = CC_PUNCT;
+    charClass['{'] = charClass['}'] = charClass['/'] = CC_PUNCT;
+    charClass['+'] = charClass['-'] = charClass['*'] = CC_PUNCT;
+
+    singleCharToken[';'] = SEMICOLON;
+    singleCharToken['('] = LEFT_PAREN;
+    singleCharToken[')'] = RIGHT_PAREN;
+    singleCharToken['{'] = LEFT_BRACE;
+    singleCharToken['}'] = RIGHT_BRACE;
+    singleCharToken['/'] = SLASH;
+    singleCharToken['\\'] = BACKSLASH;
+    singleCharToken['+'] = PLUS;
+    singleCharToken['-'] = MINUS;
+    singleCharToken['*'] = STAR;
+
+#if defined(HAVE_X86_SIMD) && defined(LEXER_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        activeKernels = &avx2Kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        activeKernels = &sse2Kernels;
+    }
+#endif
+}
+
+// Structure to hold the lexer state: a cursor into the source buffer
+typedef struct {
+    const char *base;
+    const char *cursor;
+    const char *end;
+    const ScanKernels *kernels;
+    int errors;             // Unknown characters reported so far
+    OutputBuffer *messages; // When set, unknown characters are reported here, prefixed with name
+    const char *name;
+} Lexer;
+
+// Function to start a lexer at the beginning of a source buffer
+void initLexer(Lexer *lexer, const SourceBuffer *source) {
+    lexer->base = source->data;
+    lexer->cursor = source->data;
+    lexer->end = source->data + source->length;
+    lexer->kernels = activeKernels;
+    lexer->errors = 0;
+    lexer->messages = NULL;
+    lexer->name = NULL;
 }
 
-void generateDeclarationCode(TreeNode* declarationNode, IntermediateCode* code, int* codeIndex) {
-    TreeNode* typeNode = declarationNode->children[0];
-    TreeNode* variableNode = declarationNode->children[1];
+// Function to record where a token's lexeme lies in the source buffer
+void setTokenLexeme(Token *token, const Lexer *lexer, const char *start, const char *end) {
+    token->offset = (unsigned int)(start - lexer->base);
+    token->length = (unsigned int)(end - start);
+    token->symbolId = NO_SYMBOL;
+}
 
-    // For simplicity, let's assume a variable declaration initializes the variable to zero
-    strcpy(code[*codeIndex].result, variableNode->lexeme);
-    strcpy(code[*codeIndex].arg1, "0");
-    code[*codeIndex].op = OP_ASSIGN;
-    (*codeIndex)++;
+// Function to create an empty token stream over the given source text
+void initTokenStream(TokenStream *stream, const char *source) {
+    stream->tokens = (Token*)malloc(INITIAL_TOKEN_CAPACITY * sizeof(Token));
+    stream->count = 0;
+    stream->capacity = INITIAL_TOKEN_CAPACITY;
+    stream->source = source;
+    stream->tokens[0].tokenType = END_OF_INPUT;
 }
 
-// Helper function to create temporary variables
-char* createTempVar(int index) {
-    char* tempVar = (char*)malloc(MAX_IDENTIFIER_LENGTH);
-    snprintf(tempVar, MAX_IDENTIFIER_LENGTH, "temp%d", index);
-    return tempVar;
+// Function to reserve room for one more token plus the sentinel; returns the new slot.
+// Tokens are indexed by int, so a stream stops growing at INT_MAX entries.
+Token* reserveToken(TokenStream *stream) {
+    if (stream->count + 1 >= stream->capacity) {
+        if (stream->capacity == INT_MAX) {
+            fprintf(stderr, "Error: The source has more than %d tokens\n", INT_MAX - 2);
+            exit(1);
+        }
+        int capacity = stream->capacity > INT_MAX / 2 ? INT_MAX : stream->capacity * 2;
+        Token *grown = (Token*)realloc(stream->tokens, (size_t)capacity * sizeof(Token));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Out of memory for tokens\n");
+            exit(1);
+        }
+        stream->tokens = grown;
+        stream->capacity = capacity;
+    }
+    return &stream->tokens[stream->count];
 }
 
-void generateAssignmentCode(TreeNode* assignmentNode, IntermediateCode* code, int* codeIndex) {
-    // Assuming the assignment node has two children: variable and expression
-    TreeNode* variableNode = assignmentNode->children[0];
-    TreeNode* expressionNode = assignmentNode->children[1];
+// Function to terminate the stream with the END_OF_INPUT sentinel
+void finishTokenStream(TokenStream *stream) {
+    Token *sentinel = reserveToken(stream);
+    sentinel->tokenType = END_OF_INPUT;
+    sentinel->offset = 0;
+    sentinel->length = 0;
+    sentinel->symbolId = NO_SYMBOL;
+}
 
-    // Generate intermediate code for the expression
-    generateExpressionCode(expressionNode, code, codeIndex);
+// Function to free a token stream
+void freeTokenStream(TokenStream *stream) {
+    free(stream->tokens);
+    stream->tokens = NULL;
+    stream->count = 0;
+    stream->capacity = 0;
+}
 
-    // Create a new temporary variable to store the result of the expression
-    code[*codeIndex].op = ASM_MOVE;
-    strcpy(code[*codeIndex].arg1, expressionNode->lexeme);
-    strcpy(code[*codeIndex].result, variableNode->lexeme);
-    (*codeIndex)++;
+// Function to get a pointer to a token's lexeme (not null-terminated)
+const char* tokenText(const TokenStream *stream, int index) {
+    return stream->source + stream->tokens[index].offset;
 }
 
-void generateExpressionCode(TreeNode* expressionNode, IntermediateCode* code, int* codeIndex) {
-    if (expressionNode == NULL) {
-        return;
+// Function to report an unknown character, or with character 0 that the
+// error limit was passed: into the lexer's messages when it has them,
+// otherwise on diagnosticOutput
+void reportUnknownCharacter(const Lexer *lexer, unsigned char character) {
+    const char *tooMany = "Too many unknown characters, the others are not reported";
+
+    if (lexer->messages == NULL && character != 0) {
+        fprintf(diagnosticOutput, "Error: Unknown character '%c'\n", character);
+    } else if (lexer->messages == NULL) {
+        fprintf(diagnosticOutput, "Error: %s\n", tooMany);
+    } else if (character != 0) {
+        bufferPrintf(lexer->messages, "%s: Error: Unknown character '%c'\n", lexer->name, character);
+    } else {
+        bufferPrintf(lexer->messages, "%s: Error: %s\n", lexer->name, tooMany);
     }
+}
 
-    switch (expressionNode->nodeType) {
-        case AST_VARIABLE:
-            // If the expression is a variable, use its name as the argument
-            //strcpy(code[*codeIndex].result, expressionNode->lexeme);
+// Function to scan the next token; returns 0 at the end of the input
+int nextToken(Lexer *lexer, Token *token) {
+    const char *end = lexer->end;
+    const ScanKernels *kernels = lexer->kernels;
+
+    while (lexer->cursor < end) {
+        const char *start = lexer->cursor;
+        const char *p = start + 1;
+        unsigned char firstChar = (unsigned char)*start;
+        int firstState = lexTransitions[LS_START][charClass[firstChar]];
+        int state = firstState;
+
+        if (state == LS_SKIP) {
+            lexer->cursor = kernels->skipWhitespace(p, end);
+            continue;
+        }
+        if (state == LS_ERROR) {
+            // Past the error limit unknown characters are skipped silently
+            if (options.maxErrors == 0 || lexer->errors < options.maxErrors) {
+                reportUnknownCharacter(lexer, firstChar);
+            } else if (lexer->errors == options.maxErrors) {
+                reportUnknownCharacter(lexer, 0);
+            }
+            lexer->errors++;
+            lexer->cursor = p;
+            continue;
+        }
+
+        // Run the DFA to a terminal state; identifier and digit runs are skipped in bulk
+        while (state < LS_ACCEPT) {
+            if (state == LS_IDENTIFIER) {
+                p = kernels->skipIdentifier(p, end);
+            } else if (state == LS_NUMBER) {
+                p = kernels->skipDigits(p, end);
+            }
+            if (p >= end) {
+                break;  // An unterminated string ends with the input
+            }
+            state = lexTransitions[state][charClass[(unsigned char)*p]];
+            if (state != LS_ACCEPT) {
+                p++;
+            }
+        }
+
+        setTokenLexeme(token, lexer, start, p);
+        switch (firstState) {
+            case LS_IDENTIFIER: token->tokenType = classifyKeyword(start, (size_t)(p - start)); break;
+            case LS_NUMBER: token->tokenType = INTEGER; break;
+            case LS_RELOP: token->tokenType = firstChar == '=' && p - start == 1 ? ASSIGN : RELATIONAL_OPERATOR; break;
+            case LS_STRING: token->tokenType = STRING; break;
+            default: token->tokenType = singleCharToken[firstChar]; break;
+        }
+
+        lexer->cursor = p;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Function to perform lexical analysis; returns the number of unknown characters.
+// With messages they are reported there, prefixed with name, instead of on
+// diagnosticOutput, so concurrent compilations keep their reports apart.
+int lexicalAnalysis(const SourceBuffer *source, TokenStream *stream, OutputBuffer *messages, const char *name) {
+    Lexer lexer;
+    initLexer(&lexer, source);
+    lexer.messages = messages;
+    lexer.name = name;
+
+    while (nextToken(&lexer, reserveToken(stream))) {
+        Token *token = &stream->tokens[stream->count];
+        const char *lexeme = source->data + token->offset;
+
+        TRACE("<%s, %.*s>\n", tokenTypeNames[token->tokenType], (int)token->length, lexeme);
+        if (token->tokenType == IDENTIFIER || IS_KEYWORD_TOKEN(token->tokenType)) {
+            token->symbolId = internSymbol(symbolTable, lexeme, token->length, token->tokenType == IDENTIFIER);
+        }
+        stream->count++;
+    }
+
+    finishTokenStream(stream);
+    return lexer.errors;
+}
+
+// Function to dump a token stream as a JSON array
+void jsonTokens(OutputBuffer *json, const TokenStream *stream) {
+    bufferPuts(json, "[");
+    for (int i = 0; i < stream->count; i++) {
+        const Token *token = &stream->tokens[i];
+        bufferPrintf(json, "%s{\"type\":\"%s\",\"offset\":%u,\"lexeme\":", i == 0 ? "" : ",",
+                     tokenTypeNames[token->tokenType], token->offset);
+        bufferAppendJsonString(json, stream->source + token->offset, token->length);
+        bufferPuts(json, "}");
+    }
+    bufferPuts(json, "]");
+}
+
+// Bounded single-producer/single-consumer queue fed by a lexer thread. A side
+// that finds the queue full (lexer) or empty (parser) polls it briefly, then
+// sleeps on moved. The other side looks for sleepers only when the queue
+// passes the half-full mark (or the lexer is done), so the threads trade
+// batches of tokens rather than one context switch per token.
+typedef struct {
+    Token tokens[TOKEN_QUEUE_SIZE];
+    _Atomic unsigned int head;  // Next slot the parser reads
+    _Atomic unsigned int tail;  // Next slot the lexer writes
+    _Atomic int finished;       // Set once the lexer reached the end of the input
+    _Atomic int sleepers;       // Threads waiting on moved
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    Lexer lexer;
+    pthread_t thread;
+} TokenQueue;
+
+// Function to test whether the lexer (full queue) or the parser (empty queue) has to wait
+int tokenQueueStalled(TokenQueue *queue, int lexerSide) {
+    unsigned int head = atomic_load(&queue->head);
+    unsigned int tail = atomic_load(&queue->tail);
+
+    if (lexerSide) {
+        return tail - head == TOKEN_QUEUE_SIZE;
+    }
+    return head == tail && !atomic_load(&queue->finished);
+}
+
+// Function to wait until the other side of the queue moves. The sleeper count
+// is published before the queue is rechecked, and the other side moves head
+// or tail before reading the count, all sequentially consistent, so one always
+// sees the other. A sleeping parser finds the queue empty and a sleeping lexer finds it
+// full, so the other side always passes the half-full mark after they sleep.
+void waitTokenQueue(TokenQueue *queue, int lexerSide) {
+    for (int spin = 0; spin < QUEUE_SPIN_LIMIT; spin++) {
+        if (!tokenQueueStalled(queue, lexerSide)) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&queue->lock);
+    atomic_fetch_add(&queue->sleepers, 1);
+    while (tokenQueueStalled(queue, lexerSide)) {
+        pthread_cond_wait(&queue->moved, &queue->lock);
+    }
+    atomic_fetch_sub(&queue->sleepers, 1);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Function to wake the other side after moving head, tail or finished
+void notifyTokenQueue(TokenQueue *queue) {
+    if (atomic_load(&queue->sleepers) > 0) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->moved);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+// Function run by the lexer thread: lex the whole input into the queue
+void* lexerThreadMain(void *argument) {
+    TokenQueue *queue = (TokenQueue*)argument;
+    Token token;
+
+    while (nextToken(&queue->lexer, &token)) {
+        unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == TOKEN_QUEUE_SIZE) {
+            waitTokenQueue(queue, 1);  // Queue full: the parser is behind
+        }
+        queue->tokens[tail % TOKEN_QUEUE_SIZE] = token;
+        atomic_store(&queue->tail, tail + 1);
+        if (tail + 1 - atomic_load(&queue->head) == TOKEN_QUEUE_SIZE / 2) {
+            notifyTokenQueue(queue);
+        }
+    }
+
+    atomic_store(&queue->finished, 1);
+    notifyTokenQueue(queue);
+    return NULL;
+}
+
+// Function to start a lexer thread over a source buffer
+int startTokenQueue(TokenQueue *queue, const SourceBuffer *source) {
+    initLexer(&queue->lexer, source);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->finished, 0);
+    atomic_init(&queue->sleepers, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->moved, NULL);
+    if (pthread_create(&queue->thread, NULL, lexerThreadMain, queue) != 0) {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->moved);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to wait for the lexer thread and release the queue's synchronization
+void finishTokenQueue(TokenQueue *queue) {
+    pthread_join(queue->thread, NULL);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->moved);
+}
+
+// Function to take the next token from the queue; returns 0 once the lexer is done
+int dequeueToken(TokenQueue *queue, Token *token) {
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        waitTokenQueue(queue, 0);  // Queue empty: the lexer is behind
+        if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+            return 0;  // Finished, and every token was taken
+        }
+    }
+
+    *token = queue->tokens[head % TOKEN_QUEUE_SIZE];
+    atomic_store(&queue->head, head + 1);
+    if (atomic_load(&queue->tail) - (head + 1) == TOKEN_QUEUE_SIZE / 2) {
+        notifyTokenQueue(queue);
+    }
+    return 1;
+}
+
+// Pull-based token source for the parser. Tokens come from a materialized
+// TokenStream, or are produced on demand (directly by a lexer or through a
+// lexer thread's queue) into a small lookahead ring.
+typedef struct {
+    const TokenStream *stream;  // Materialized tokens, or NULL when streaming
+    Lexer *lexer;               // Streaming on the parser's thread
+    TokenQueue *queue;          // Streaming from a lexer thread
+    Token ring[LOOKAHEAD_SIZE];
+    unsigned int head;          // Ring slot of the current token
+    unsigned int filled;        // Tokens buffered from head on
+    int position;               // Index of the current token in the input
+    const char *text;           // Source text the token offsets point into
+    unsigned int textLength;
+} TokenSource;
+
+// Function to read tokens from a materialized token stream
+void initStreamTokenSource(TokenSource *source, const TokenStream *stream) {
+    memset(source, 0, sizeof(TokenSource));
+    source->stream = stream;
+    source->text = stream->source;
+}
+
+// Function to read tokens on demand from a lexer (queue == NULL) or a lexer thread's queue
+void initLexerTokenSource(TokenSource *source, Lexer *lexer, TokenQueue *queue, const SourceBuffer *buffer) {
+    memset(source, 0, sizeof(TokenSource));
+    source->lexer = lexer;
+    source->queue = queue;
+    source->text = buffer->data;
+    source->textLength = (unsigned int)buffer->length;
+}
+
+// Function to lex one more token into the lookahead ring
+void fillTokenRing(TokenSource *source) {
+    Token *token = &source->ring[(source->head + source->filled) % LOOKAHEAD_SIZE];
+    int produced = source->queue != NULL ? dequeueToken(source->queue, token) : nextToken(source->lexer, token);
+
+    if (!produced) {
+        token->tokenType = END_OF_INPUT;
+        token->offset = source->textLength;
+        token->length = 0;
+        token->symbolId = NO_SYMBOL;
+    } else if (token->tokenType == IDENTIFIER || IS_KEYWORD_TOKEN(token->tokenType)) {
+        // Interning happens on the consumer side, so the lexer thread never touches the symbol table
+        token->symbolId = internSymbol(symbolTable, source->text + token->offset, token->length,
+                                       token->tokenType == IDENTIFIER);
+    }
+    source->filled++;
+}
+
+// Function to look k tokens ahead of the current one (k < LOOKAHEAD_SIZE)
+const Token* peekToken(TokenSource *source, int k) {
+    if (source->stream != NULL) {
+        int index = source->position + k;
+        return &source->stream->tokens[index < source->stream->count ? index : source->stream->count];
+    }
+
+    while (source->filled <= (unsigned int)k) {
+        fillTokenRing(source);
+    }
+    return &source->ring[(source->head + (unsigned int)k) % LOOKAHEAD_SIZE];
+}
+
+// Function to move past the current token
+void advanceToken(TokenSource *source) {
+    if (peekToken(source, 0)->tokenType == END_OF_INPUT) {
+        return;
+    }
+    if (source->stream == NULL) {
+        source->head = (source->head + 1) % LOOKAHEAD_SIZE;
+        source->filled--;
+    }
+    source->position++;
+}
+
+// Function to get a monotonic timestamp in seconds
+double nowSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Function to compare the strcmp loop in isKeyword with classifyKeyword
+void benchmarkKeywords(long iterations) {
+    static const char *samples[] = {
+        "counter", "int", "value", "while", "x", "return", "name_12", "for",
+        "total", "char", "ratio", "if", "break_flag", "continue", "idx", "float"
+    };
+    const int sampleCount = (int)(sizeof(samples) / sizeof(samples[0]));
+    size_t lengths[sizeof(samples) / sizeof(samples[0])];
+    long loopHits = 0;
+    long dispatchHits = 0;
+
+    for (int i = 0; i < sampleCount; i++) {
+        lengths[i] = strlen(samples[i]);
+        int expected = isKeyword(samples[i], lengths[i]);
+        if (expected != (classifyKeyword(samples[i], lengths[i]) != IDENTIFIER)) {
+            fprintf(stderr, "Error: classifyKeyword disagrees with keywords[] on '%s'\n", samples[i]);
+            return;
+        }
+    }
+
+    double start = nowSeconds();
+    for (long n = 0; n < iterations; n++) {
+        int i = (int)(n % sampleCount);
+        loopHits += isKeyword(samples[i], lengths[i]);
+    }
+    double loopSeconds = nowSeconds() - start;
+
+    start = nowSeconds();
+    for (long n = 0; n < iterations; n++) {
+        int i = (int)(n % sampleCount);
+        dispatchHits += classifyKeyword(samples[i], lengths[i]) != IDENTIFIER;
+    }
+    double dispatchSeconds = nowSeconds() - start;
+
+    printf("%-22s %12s %10s\n", "Method", "ns/lexeme", "Keywords");
+    printf("%-22s %12.2f %10ld\n", "strcmp loop", loopSeconds * 1e9 / iterations, loopHits);
+    printf("%-22s %12.2f %10ld\n", "length/first-char", dispatchSeconds * 1e9 / iterations, dispatchHits);
+    printf("Speedup: %.2fx\n", loopSeconds / dispatchSeconds);
+}
+
+// Function to write a synthetic source file of roughly the requested size
+int writeSyntheticSource(const char *path, size_t targetBytes) {
+    static const char *lines[] = {
+        "int counter%zu;\n",
+        "char name_%zu;\n",
+        "while (value%zu <= 4096) { total = \"text\\n\"; }\n",
+        "float ratio%zu; if (a%zu != b) { return; }\n"
+    };
+    FILE *out = fopen(path, "w");
+    size_t written = 0;
+    size_t line = 0;
+
+    if (out == NULL) {
+        return 0;
+    }
+
+    while (written < targetBytes) {
+        int count = fprintf(out, lines[line % 4], line, line);
+        if (count < 0) {
+            fclose(out);
+            return 0;
+        }
+        written += (size_t)count;
+        line++;
+    }
+
+    return fclose(out) == 0;
+}
+
+// Function to count tokens with the original fgetc/ungetc scanning loop (benchmark reference)
+size_t countTokensStdio(FILE *inputFile) {
+    size_t count = 0;
+    int currentChar;
+
+    while ((currentChar = fgetc(inputFile)) != EOF) {
+        if (isalpha(currentChar)) {
+            while (isalnum(currentChar = fgetc(inputFile)) || currentChar == '_') {
+            }
+            ungetc(currentChar, inputFile);
+            count++;
+        } else if (isdigit(currentChar)) {
+            while (isdigit(currentChar = fgetc(inputFile))) {
+            }
+            ungetc(currentChar, inputFile);
+            count++;
+        } else if (currentChar == '<' || currentChar == '>' || currentChar == '=' || currentChar == '!') {
+            if ((currentChar = fgetc(inputFile)) != '=') {
+                ungetc(currentChar, inputFile);
+            }
+            count++;
+        } else if (currentChar == '"') {
+            while ((currentChar = fgetc(inputFile)) != '"' && currentChar != EOF) {
+                if (currentChar == '\\') {
+                    fgetc(inputFile);
+                }
+            }
+            count++;
+        } else if (strchr(";(){}/\\", currentChar) != NULL) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Function to lex a whole buffer with the given kernels; returns the token count
+// and folds every token into a checksum so kernels can be compared
+size_t countTokensWithKernels(const SourceBuffer *source, const ScanKernels *kernels, unsigned int *checksum) {
+    Lexer lexer;
+    Token token;
+    size_t count = 0;
+    unsigned int hash = 0;
+
+    initLexer(&lexer, source);
+    lexer.kernels = kernels;
+    while (nextToken(&lexer, &token)) {
+        hash = (hash * 31 + token.offset) * 31 + (unsigned int)token.tokenType;
+        count++;
+    }
+    *checksum = hash;
+    return count;
+}
+
+#define LEX_BENCH_RUNS 5
+
+// Function to benchmark lexer throughput on synthetic inputs from 1 MB up to maxMegabytes
+void benchmarkLexer(size_t maxMegabytes) {
+    const ScanKernels *kernelSets[3] = { &scalarKernels, NULL, NULL };
+    char path[] = "/tmp/lexbenchXXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+        fprintf(stderr, "Error creating benchmark file.\n");
+        return;
+    }
+    close(fd);
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    kernelSets[1] = &sse2Kernels;
+    if (__builtin_cpu_supports("avx2")) {
+        kernelSets[2] = &avx2Kernels;
+    }
+#endif
+
+    printf("Active kernels: %s\n", activeKernels->name);
+    printf("%10s %12s %12s %12s %12s %12s\n", "Size(MB)", "Tokens", "stdio MB/s", "scalar MB/s", "sse2 MB/s", "avx2 MB/s");
+    for (size_t megabytes = 1; megabytes <= maxMegabytes; megabytes *= 4) {
+        SourceBuffer source;
+        double rates[3] = { 0, 0, 0 };
+        unsigned int checksums[3];
+        size_t tokens = 0;
+
+        if (!writeSyntheticSource(path, megabytes << 20)) {
+            fprintf(stderr, "Error writing benchmark file.\n");
+            break;
+        }
+
+        double start = nowSeconds();
+        FILE *inputFile = fopen(path, "r");
+        size_t stdioTokens = countTokensStdio(inputFile);
+        fclose(inputFile);
+        double stdioSeconds = nowSeconds() - start;
+
+        if (loadSourceFile(path, &source) != LOAD_OK) {
+            fprintf(stderr, "Error loading benchmark file.\n");
+            break;
+        }
+        double size = (double)source.length / (1 << 20);
+
+        for (int k = 0; k < 3; k++) {
+            if (kernelSets[k] == NULL) {
+                continue;
+            }
+            // Best of a few runs, so one preempted run does not decide the comparison
+            for (int run = 0; run < LEX_BENCH_RUNS; run++) {
+                start = nowSeconds();
+                tokens = countTokensWithKernels(&source, kernelSets[k], &checksums[k]);
+                double rate = size / (nowSeconds() - start);
+                rates[k] = rate > rates[k] ? rate : rates[k];
+            }
+            if (checksums[k] != checksums[0]) {
+                printf("Warning: %s kernels produced different tokens\n", kernelSets[k]->name);
+            }
+        }
+        releaseSource(&source);
+
+        if (stdioTokens != tokens) {
+            printf("Warning: token counts differ (%zu vs %zu)\n", stdioTokens, tokens);
+        }
+        printf("%10zu %12zu %12.1f %12.1f", megabytes, tokens, size / stdioSeconds, rates[0]);
+        for (int k = 1; k < 3; k++) {
+            if (kernelSets[k] != NULL) {
+                printf(" %12.1f", rates[k]);
+            } else {
+                printf(" %12s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    unlink(path);
+}
+
+// Enumeration of non-terminal types
+enum {
+    PROGRAM,
+    DECLARATION,
+    TYPE,
+    VARIABLE,
+    STATEMENT,
+    EXPRESSION
+};
+
+#define NO_NODE (-1)
+#define INITIAL_AST_CAPACITY 1024
+
+// AST node; nodes live in one flat array and link to each other by index,
+// so a node can have any number of children
+typedef struct {
+    int nodeType;     // Represents the type of AST node
+    int symbolId;     // Interned name for type/variable nodes, NO_SYMBOL otherwise
+    int firstChild;
+    int nextSibling;
+    int lastChild;    // Lets children be appended in O(1)
+} TreeNode;
+
+// Flat AST of one compilation unit; freeing it is a single free
+typedef struct {
+    TreeNode *nodes;
+    int count;
+    int capacity;
+    int root;
+} AST;
+
+enum {
+    AST_PROGRAM,
+    AST_DECLARATION,  // Type, variable and an optional initializer
+    AST_TYPE,
+    AST_VARIABLE,
+    AST_FUNCTION,     // Named by its symbol; type and body block
+    AST_BLOCK,
+    AST_ASSIGN,       // Variable and value
+    AST_IF,           // Condition, then statement and an optional else statement
+    AST_WHILE,        // Condition and body
+    AST_FOR,          // Init, condition, step (each possibly Empty) and body
+    AST_BREAK,
+    AST_CONTINUE,
+    AST_RETURN,       // Optional value
+    AST_EMPTY,
+    AST_NUMBER,       // Named by the interned literal
+    AST_CALL,         // Named by the called function
+    AST_NEGATE,
+    AST_ADD, AST_SUB, AST_MUL, AST_DIV,                   // Binary operators, in binaryOperations[] order
+    AST_LT, AST_GT, AST_LE, AST_GE, AST_EQ, AST_NE
+};
+
+// Display names of the AST node types that carry no symbol
+const char *astNodeNames[] = {
+    "Program", "Declaration", "Type", "Variable", "Function", "Block", "Assign", "If", "While", "For",
+    "Break", "Continue", "Return", "Empty", "Number", "Call", "Negate",
+    "+", "-", "*", "/", "<", ">", "<=", ">=", "==", "!="
+};
+
+// Function to create an empty AST
+void initAST(AST* ast) {
+    ast->nodes = (TreeNode*)malloc(INITIAL_AST_CAPACITY * sizeof(TreeNode));
+    ast->count = 0;
+    ast->capacity = INITIAL_AST_CAPACITY;
+    ast->root = NO_NODE;
+}
+
+// Function to free the AST
+void freeAST(AST* ast) {
+    free(ast->nodes);
+    ast->nodes = NULL;
+    ast->count = 0;
+    ast->capacity = 0;
+    ast->root = NO_NODE;
+}
+
+// Function to create a new AST node; returns its index
+int createNode(AST* ast, int symbolId, int nodeType) {
+    if (ast->count == ast->capacity) {
+        TreeNode* grown = (TreeNode*)realloc(ast->nodes, (size_t)ast->capacity * 2 * sizeof(TreeNode));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Out of memory for AST\n");
+            exit(1);
+        }
+        ast->nodes = grown;
+        ast->capacity *= 2;
+    }
+
+    TreeNode* newNode = &ast->nodes[ast->count];
+    newNode->nodeType = nodeType;
+    newNode->symbolId = symbolId;
+    newNode->firstChild = NO_NODE;
+    newNode->nextSibling = NO_NODE;
+    newNode->lastChild = NO_NODE;
+    return ast->count++;
+}
+
+// Function to append a child to an AST node
+void addChild(AST* ast, int parent, int child) {
+    TreeNode* parentNode = &ast->nodes[parent];
+
+    if (parentNode->lastChild == NO_NODE) {
+        parentNode->firstChild = child;
+    } else {
+        ast->nodes[parentNode->lastChild].nextSibling = child;
+    }
+    parentNode->lastChild = child;
+}
+
+// Function to get the display label of an AST node
+const char* nodeLabel(const AST* ast, int node) {
+    const TreeNode* treeNode = &ast->nodes[node];
+    return treeNode->symbolId != NO_SYMBOL ? symbolName(treeNode->symbolId) : astNodeNames[treeNode->nodeType];
+}
+
+// Kinds of parser diagnostics
+enum {
+    DIAG_EXPECTED_TYPE,
+    DIAG_EXPECTED_VARIABLE,
+    DIAG_EXPECTED_SEMICOLON,
+    DIAG_EXPECTED_STATEMENT_SEMICOLON,
+    DIAG_EXPECTED_FUNCTION_NAME,
+    DIAG_EXPECTED_LEFT_PAREN,
+    DIAG_EXPECTED_RIGHT_PAREN,
+    DIAG_EXPECTED_LEFT_BRACE,
+    DIAG_EXPECTED_RIGHT_BRACE,
+    DIAG_EXPECTED_ASSIGN,
+    DIAG_EXPECTED_EXPRESSION,
+    DIAG_EXPECTED_STATEMENT,
+    DIAG_UNDECLARED_VARIABLE,
+    DIAG_NOT_IN_LOOP,
+    DIAG_NESTING_TOO_DEEP,
+    DIAG_EXPECTED_CONSTANT,
+    DIAG_ALREADY_DECLARED,
+    DIAG_UNDEFINED_FUNCTION,
+    DIAG_TOO_MANY_ERRORS
+};
+
+// Messages of the diagnostic kinds, indexed by kind
+const char *diagnosticMessages[] = {
+    "Expected type",
+    "Expected variable",
+    "Expected semicolon after declaration",
+    "Expected semicolon after statement",
+    "Expected function name",
+    "Expected '('",
+    "Expected ')'",
+    "Expected '{'",
+    "Expected '}'",
+    "Expected '='",
+    "Expected expression",
+    "Expected statement",
+    "Undeclared variable",
+    "break or continue outside a loop",
+    "Nesting too deep",
+    "Expected constant expression",
+    "Name already declared in this scope",
+    "Call of an undefined function",
+    "Too many errors, parsing stopped"
+};
+
+// One parser diagnostic, located by the token it was reported at
+typedef struct {
+    int kind;
+    int tokenIndex;
+    unsigned int offset;  // Source offset of that token, END_OFFSET at the end of input
+} Diagnostic;
+
+// Growable list of diagnostics in the order they were reported
+typedef struct {
+    Diagnostic *items;
+    int count;
+    int capacity;
+} DiagnosticList;
+
+// Call of a name that was not defined as a function when it was parsed
+typedef struct {
+    int symbolId;
+    int tokenIndex;
+    unsigned int offset;
+} PendingCall;
+
+// Parser state: the token stream is checked and the AST is built in one pass
+typedef struct {
+    TokenSource *tokens;
+    AST *ast;
+    DiagnosticList *diagnostics;
+    // When set, each declaration or function is handed over as soon as it is parsed and
+    // its nodes are dropped afterwards instead of being kept under the program
+    void (*onDeclaration)(void *context, AST *ast, int declarationNode);
+    void *handlerContext;
+    int inFunction;      // Declarations are locals of the current function
+    int functionSerial;  // Changes on entering and leaving every function
+    int blockSerial;     // Identifies the innermost open block
+    int blocksOpened;    // Source of block serials
+    int loopDepth;       // break and continue are only valid inside loops
+    int depth;           // Nesting of statements and parenthesized or negated expressions
+    int panicking;       // An error was reported and the parser has not resynchronized yet
+    int abandoned;       // The error limit was reached; the rest of the input is skipped
+    long work;           // Productions entered, bounded by a multiple of the token count
+    PendingCall *calls;  // Calls that may precede their function, checked once the program is parsed
+    int callCount;
+    int callCapacity;
+} Parser;
+
+// Function to record a diagnostic at the current token. Errors that follow
+// the first one before the parser resynchronizes are consequences of it and
+// are dropped; past the error limit the parser gives up.
+void reportDiagnostic(Parser *parser, int kind) {
+    DiagnosticList *list = parser->diagnostics;
+
+    if (parser->panicking || parser->abandoned) {
+        return;
+    }
+    parser->panicking = 1;
+    if (options.maxErrors > 0 && list->count == options.maxErrors) {
+        kind = DIAG_TOO_MANY_ERRORS;
+        parser->abandoned = 1;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->items = (Diagnostic*)realloc(list->items, (size_t)list->capacity * sizeof(Diagnostic));
+        if (list->items == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+    }
+
+    const Token *token = peekToken(parser->tokens, 0);
+    Diagnostic *diagnostic = &list->items[list->count++];
+    diagnostic->kind = kind;
+    diagnostic->tokenIndex = parser->tokens->position;
+    diagnostic->offset = token->tokenType == END_OF_INPUT ? END_OFFSET : token->offset;
+}
+
+// Line counter that only moves forward through the source
+typedef struct {
+    const char *text;
+    unsigned int scanned;
+    unsigned int lineStart;
+    int line;
+} SourceLocator;
+
+// Function to start a locator at the beginning of a source text
+void initSourceLocator(SourceLocator *locator, const char *text) {
+    locator->text = text;
+    locator->scanned = 0;
+    locator->lineStart = 0;
+    locator->line = 1;
+}
+
+// Function to count the lines up to an offset; an offset before the current
+// line starts the count over
+void advanceSourceLocator(SourceLocator *locator, unsigned int offset) {
+    if (offset < locator->lineStart) {
+        initSourceLocator(locator, locator->text);
+    }
+    for (; locator->scanned < offset; locator->scanned++) {
+        if (locator->text[locator->scanned] == '\n') {
+            locator->line++;
+            locator->lineStart = locator->scanned + 1;
+        }
+    }
+}
+
+// Function to print diagnostics with line and column numbers; the source is
+// scanned once because diagnostics are reported in source order (only a
+// streaming compilation reports undefined calls after the rest)
+void printDiagnostics(const DiagnosticList *list, SourceLocator *locator) {
+    for (int i = 0; i < list->count; i++) {
+        const Diagnostic *diagnostic = &list->items[i];
+
+        if (diagnostic->offset == END_OFFSET) {
+            fprintf(diagnosticOutput, "Error (end of input): %s\n", diagnosticMessages[diagnostic->kind]);
+            continue;
+        }
+        advanceSourceLocator(locator, diagnostic->offset);
+        fprintf(diagnosticOutput, "Error (line %d, column %u): %s\n", locator->line,
+                diagnostic->offset - locator->lineStart + 1, diagnosticMessages[diagnostic->kind]);
+    }
+}
+
+// Function to append diagnostics to a buffer, each line prefixed with the file name
+void appendDiagnostics(OutputBuffer *out, const char *path, const DiagnosticList *list, SourceLocator *locator) {
+    for (int i = 0; i < list->count; i++) {
+        const Diagnostic *diagnostic = &list->items[i];
+
+        if (diagnostic->offset == END_OFFSET) {
+            bufferPrintf(out, "%s: Error (end of input): %s\n", path, diagnosticMessages[diagnostic->kind]);
+            continue;
+        }
+        advanceSourceLocator(locator, diagnostic->offset);
+        bufferPrintf(out, "%s: Error (line %d, column %u): %s\n", path, locator->line,
+                     diagnostic->offset - locator->lineStart + 1, diagnosticMessages[diagnostic->kind]);
+    }
+}
+
+// Function to dump diagnostics as a JSON array
+void jsonDiagnostics(OutputBuffer *json, const DiagnosticList *list, SourceLocator *locator) {
+    bufferPuts(json, "[");
+    for (int i = 0; i < list->count; i++) {
+        const Diagnostic *diagnostic = &list->items[i];
+        bufferPrintf(json, "%s{\"message\":\"%s\",\"token\":%d", i == 0 ? "" : ",",
+                     diagnosticMessages[diagnostic->kind], diagnostic->tokenIndex);
+        if (diagnostic->offset != END_OFFSET) {
+            advanceSourceLocator(locator, diagnostic->offset);
+            bufferPrintf(json, ",\"line\":%d,\"column\":%u", locator->line, diagnostic->offset - locator->lineStart + 1);
+        }
+        bufferPuts(json, "}");
+    }
+    bufferPuts(json, "]");
+}
+
+// Function to free a diagnostic list
+void freeDiagnostics(DiagnosticList *list) {
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// Function to perform parsing and build the AST
+void parse(TokenStream *stream, AST *ast, DiagnosticList *diagnostics);
+
+// Function to parse tokens pulled from a token source
+void parseTokens(Parser *parser);
+
+// Function to parse the program
+int parseProgram(Parser *parser);
+
+// Function to parse variable declarations
+int parseDeclaration(Parser *parser);
+
+// Function to parse types
+int parseType(Parser *parser);
+
+// Function to parse variables
+int parseVariable(Parser *parser);
+
+// Function to parse a function definition
+int parseFunction(Parser *parser);
+
+// Function to parse a braced block of statements
+int parseBlock(Parser *parser);
+
+// Function to parse one statement
+int parseStatement(Parser *parser);
+
+// Function to parse an expression
+int parseExpression(Parser *parser);
+
+// Function to display the AST
+void displayAST(const AST* ast);
+
+void parse(TokenStream *stream, AST *ast, DiagnosticList *diagnostics) {
+    TokenSource tokens;
+    Parser parser = { .tokens = &tokens, .ast = ast, .diagnostics = diagnostics };
+
+    initStreamTokenSource(&tokens, stream);
+    parseTokens(&parser);
+}
+
+void checkCalls(Parser *parser);
+
+void parseTokens(Parser *parser) {
+    // Start parsing the program
+    parser->ast->root = parseProgram(parser);
+    checkCalls(parser);
+}
+
+// Function to consume the current token if it has the given type
+int acceptToken(Parser *parser, int tokenType) {
+    if (peekToken(parser->tokens, 0)->tokenType != tokenType) {
+        return 0;
+    }
+    advanceToken(parser->tokens);
+    return 1;
+}
+
+// Function to consume a required token, reporting a diagnostic when it is missing
+int expectToken(Parser *parser, int tokenType, int kind) {
+    if (acceptToken(parser, tokenType)) {
+        return 1;
+    }
+    reportDiagnostic(parser, kind);
+    return 0;
+}
+
+// Function to recover from a syntax error in panic mode: skip to just past
+// the next ';', or up to the '}' that closes the enclosing block. Braced
+// blocks on the way are skipped whole, so an error in front of a block does
+// not let its '}' close the enclosing one.
+void synchronize(Parser *parser) {
+    int braces = 0;
+
+    for (;;) {
+        int tokenType = peekToken(parser->tokens, 0)->tokenType;
+        if (tokenType == END_OF_INPUT || (tokenType == RIGHT_BRACE && braces == 0)) {
+            break;
+        }
+        advanceToken(parser->tokens);
+        if (tokenType == LEFT_BRACE) {
+            braces++;
+        } else if (tokenType == RIGHT_BRACE && --braces == 0) {
+            break;
+        } else if (tokenType == SEMICOLON && braces == 0) {
+            break;
+        }
+    }
+    parser->panicking = 0;
+}
+
+// Function to enter a nested statement or expression; fails with a diagnostic
+// once the nesting would exhaust the stack. A success is paired with leaveNesting.
+int enterNesting(Parser *parser) {
+    if (parser->depth == MAX_NESTING_DEPTH) {
+        reportDiagnostic(parser, DIAG_NESTING_TOO_DEEP);
+        return 0;
+    }
+    parser->depth++;
+    return 1;
+}
+
+// Function to leave a nested statement or expression
+void leaveNesting(Parser *parser) {
+    parser->depth--;
+}
+
+int parseProgram(Parser *parser) {
+    // A program is a sequence of global variable declarations and function
+    // definitions; a type, a name and '(' start a function
+    int programNode = createNode(parser->ast, NO_SYMBOL, AST_PROGRAM);
+
+    while (peekToken(parser->tokens, 0)->tokenType != END_OF_INPUT && !parser->abandoned) {
+        int start = parser->tokens->position;
+        int declarationNode = peekToken(parser->tokens, 2)->tokenType == LEFT_PAREN ? parseFunction(parser)
+                                                                                  : parseDeclaration(parser);
+
+        if (declarationNode != NO_NODE && parser->onDeclaration != NULL) {
+            // Streaming: hand the declaration on, then drop its nodes
+            parser->onDeclaration(parser->handlerContext, parser->ast, declarationNode);
+            parser->ast->count = programNode + 1;
+        } else if (declarationNode != NO_NODE) {
+            // Add declaration to program node
+            addChild(parser->ast, programNode, declarationNode);
+        }
+
+        if (parser->panicking) {
+            synchronize(parser);
+        }
+        // A declaration that matched nothing skips one token so parsing always moves on
+        if (parser->tokens->position == start) {
+            advanceToken(parser->tokens);
+        }
+    }
+
+    // Past the error limit the remaining tokens are still drained, so a lexer thread never blocks
+    while (peekToken(parser->tokens, 0)->tokenType != END_OF_INPUT) {
+        advanceToken(parser->tokens);
+    }
+    return programNode;
+}
+
+int evaluateConstant(const AST* ast, int expressionNode, long* value);
+void* reserveArray(void* data, int* capacity, int needed, size_t elementSize);
+
+// Function to test whether a declaration of a name would redeclare it: a local
+// declared in the same block, or a global variable or function of the same name
+int isDeclaredInScope(const Parser *parser, int symbolId) {
+    const SymbolEntry *entry = &symbolTable->entries[symbolId];
+
+    if (parser->inFunction) {
+        return entry->localScope == parser->functionSerial && entry->localBlock == parser->blockSerial;
+    }
+    return entry->isGlobal || entry->isFunction;
+}
+
+int parseDeclaration(Parser *parser) {
+    // A declaration is a type, a variable and an optional initializer, which
+    // must be a constant expression outside a function
+    AST *ast = parser->ast;
+    int mark = ast->count;  // Nodes of a rejected declaration are dropped by rolling back
+    parser->work++;
+    int declarationNode = createNode(ast, NO_SYMBOL, AST_DECLARATION);
+    int initializerNode = NO_NODE;
+    long value;
+
+    int typeNode = parseType(parser);
+    const Token *name = peekToken(parser->tokens, 0);
+
+    if (typeNode != NO_NODE && name->tokenType == IDENTIFIER && isDeclaredInScope(parser, name->symbolId)) {
+        reportDiagnostic(parser, DIAG_ALREADY_DECLARED);
+        ast->count = mark;
+        return NO_NODE;
+    }
+    int variableNode = parseVariable(parser);
+
+    if (variableNode != NO_NODE && acceptToken(parser, ASSIGN)) {
+        initializerNode = parseExpression(parser);
+        if (initializerNode == NO_NODE) {
+            ast->count = mark;
+            return NO_NODE;
+        }
+        if (!parser->inFunction && !evaluateConstant(ast, initializerNode, &value)) {
+            reportDiagnostic(parser, DIAG_EXPECTED_CONSTANT);
+            ast->count = mark;
+            return NO_NODE;
+        }
+    }
+
+    // A declaration ends with a semicolon
+    if (peekToken(parser->tokens, 0)->tokenType != SEMICOLON) {
+        reportDiagnostic(parser, DIAG_EXPECTED_SEMICOLON);
+        ast->count = mark;
+        return NO_NODE;
+    }
+    advanceToken(parser->tokens);
+
+    // Error handling if either type or variable is not present
+    if (typeNode == NO_NODE || variableNode == NO_NODE) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+
+    // Record the scope so later uses of the name can be checked; a local
+    // keeps the scope it shadows until its block closes
+    int symbolId = ast->nodes[variableNode].symbolId;
+    SymbolEntry *entry = &symbolTable->entries[symbolId];
+    if (parser->inFunction) {
+        symbolTable->shadowed = (ShadowedName*)reserveArray(symbolTable->shadowed, &symbolTable->shadowedCapacity,
+                                                            symbolTable->shadowedCount + 1, sizeof(ShadowedName));
+        symbolTable->shadowed[symbolTable->shadowedCount++] = (ShadowedName){ symbolId, entry->localScope,
+                                                                              entry->localBlock };
+        entry->localScope = parser->functionSerial;
+        entry->localBlock = parser->blockSerial;
+    } else {
+        entry->isGlobal = 1;
+    }
+
+    TRACE("Parsed: Declaration\n");
+    addChild(ast, declarationNode, typeNode);
+    addChild(ast, declarationNode, variableNode);
+    if (initializerNode != NO_NODE) {
+        addChild(ast, declarationNode, initializerNode);
+    }
+    return declarationNode;
+}
+
+int parseType(Parser *parser) {
+    // Types are the basic types int, float and char
+    const Token *token = peekToken(parser->tokens, 0);
+
+    if (IS_TYPE_TOKEN(token->tokenType)) {
+        int typeNode = createNode(parser->ast, token->symbolId, AST_TYPE);
+        TRACE("Parsed: Type - %.*s\n", (int)token->length, parser->tokens->text + token->offset);
+        advanceToken(parser->tokens);
+        return typeNode;
+    } else {
+        reportDiagnostic(parser, DIAG_EXPECTED_TYPE);
+        return NO_NODE;
+    }
+}
+
+int parseVariable(Parser *parser) {
+    // In a real parser, you would have rules to recognize variables.
+    // For simplicity, let's assume a variable is an identifier.
+    const Token *token = peekToken(parser->tokens, 0);
+
+    if (token->tokenType == IDENTIFIER) {
+        int variableNode = createNode(parser->ast, token->symbolId, AST_VARIABLE);
+        TRACE("Parsed: Variable - %.*s\n", (int)token->length, parser->tokens->text + token->offset);
+        advanceToken(parser->tokens);
+        return variableNode;
+    } else {
+        reportDiagnostic(parser, DIAG_EXPECTED_VARIABLE);
+        return NO_NODE;
+    }
+}
+
+// Function to parse a use of a variable, which must be a global or a local of
+// the current function declared before it
+int parseVariableUse(Parser *parser) {
+    const Token *token = peekToken(parser->tokens, 0);
+
+    if (token->tokenType != IDENTIFIER) {
+        reportDiagnostic(parser, DIAG_EXPECTED_VARIABLE);
+        return NO_NODE;
+    }
+
+    const SymbolEntry *entry = &symbolTable->entries[token->symbolId];
+    if (entry->localScope != parser->functionSerial && !entry->isGlobal) {
+        reportDiagnostic(parser, DIAG_UNDECLARED_VARIABLE);
+        return NO_NODE;
+    }
+
+    int variableNode = createNode(parser->ast, token->symbolId, AST_VARIABLE);
+    advanceToken(parser->tokens);
+    return variableNode;
+}
+
+int parseFunction(Parser *parser) {
+    // A function is a type, a name, an empty parameter list and a body
+    AST *ast = parser->ast;
+    int mark = ast->count;
+    parser->work++;
+    int typeNode = parseType(parser);
+    const Token *name = peekToken(parser->tokens, 0);
+
+    if (typeNode == NO_NODE || name->tokenType != IDENTIFIER) {
+        if (typeNode != NO_NODE) {
+            reportDiagnostic(parser, DIAG_EXPECTED_FUNCTION_NAME);
+        }
+        ast->count = mark;
+        return NO_NODE;
+    }
+    if (isDeclaredInScope(parser, name->symbolId)) {
+        reportDiagnostic(parser, DIAG_ALREADY_DECLARED);
+        ast->count = mark;
+        return NO_NODE;
+    }
+    int functionNode = createNode(ast, name->symbolId, AST_FUNCTION);
+    advanceToken(parser->tokens);
+    advanceToken(parser->tokens);  // '(' was seen by parseProgram
+    if (!expectToken(parser, RIGHT_PAREN, DIAG_EXPECTED_RIGHT_PAREN)) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+
+    // Every function opens a fresh scope for its locals
+    parser->inFunction = 1;
+    parser->functionSerial++;
+    int bodyNode = parseBlock(parser);
+    parser->inFunction = 0;
+    parser->functionSerial++;
+    if (bodyNode == NO_NODE) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+
+    symbolTable->entries[ast->nodes[functionNode].symbolId].isFunction = 1;
+    TRACE("Parsed: Function - %s\n", symbolName(ast->nodes[functionNode].symbolId));
+    addChild(ast, functionNode, typeNode);
+    addChild(ast, functionNode, bodyNode);
+    return functionNode;
+}
+
+int parseBlock(Parser *parser) {
+    AST *ast = parser->ast;
+    int mark = ast->count;
+
+    if (!expectToken(parser, LEFT_BRACE, DIAG_EXPECTED_LEFT_BRACE)) {
+        return NO_NODE;
+    }
+    int blockNode = createNode(ast, NO_SYMBOL, AST_BLOCK);
+    int outerBlock = parser->blockSerial;
+    int shadowedBase = symbolTable->shadowedCount;
+    parser->blockSerial = ++parser->blocksOpened;
+
+    while (peekToken(parser->tokens, 0)->tokenType != RIGHT_BRACE &&
+           peekToken(parser->tokens, 0)->tokenType != END_OF_INPUT && !parser->abandoned) {
+        int start = parser->tokens->position;
+        int statementNode = parseStatement(parser);
+
+        if (statementNode != NO_NODE) {
+            addChild(ast, blockNode, statementNode);
+        }
+        if (parser->panicking) {
+            synchronize(parser);
+        }
+
+        // A statement that matched nothing skips one token so parsing always moves on
+        if (parser->tokens->position == start) {
+            advanceToken(parser->tokens);
+        }
+    }
+
+    // The locals of the block go out of scope, uncovering the names they shadowed
+    while (symbolTable->shadowedCount > shadowedBase) {
+        const ShadowedName *shadowed = &symbolTable->shadowed[--symbolTable->shadowedCount];
+        symbolTable->entries[shadowed->symbolId].localScope = shadowed->localScope;
+        symbolTable->entries[shadowed->symbolId].localBlock = shadowed->localBlock;
+    }
+    parser->blockSerial = outerBlock;
+
+    if (!expectToken(parser, RIGHT_BRACE, DIAG_EXPECTED_RIGHT_BRACE)) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+    return blockNode;
+}
+
+// Function to parse an assignment "variable = expression" (no semicolon)
+int parseAssignment(Parser *parser) {
+    AST *ast = parser->ast;
+    int mark = ast->count;
+    int assignNode = createNode(ast, NO_SYMBOL, AST_ASSIGN);
+    int variableNode = parseVariableUse(parser);
+
+    if (variableNode == NO_NODE) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+    if (!expectToken(parser, ASSIGN, DIAG_EXPECTED_ASSIGN)) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+    int valueNode = parseExpression(parser);
+    if (valueNode == NO_NODE) {
+        ast->count = mark;
+        return NO_NODE;
+    }
+
+    addChild(ast, assignNode, variableNode);
+    addChild(ast, assignNode, valueNode);
+    return assignNode;
+}
+
+// Function to parse "( expression )" as used by if and while
+int parseCondition(Parser *parser) {
+    int mark = parser->ast->count;
+
+    if (!expectToken(parser, LEFT_PAREN, DIAG_EXPECTED_LEFT_PAREN)) {
+        return NO_NODE;
+    }
+    int conditionNode = parseExpression(parser);
+    if (conditionNode == NO_NODE || !expectToken(parser, RIGHT_PAREN, DIAG_EXPECTED_RIGHT_PAREN)) {
+        parser->ast->count = mark;
+        return NO_NODE;
+    }
+    return conditionNode;
+}
+
+// Function to parse the body of a loop, where break and continue are allowed
+int parseLoopBody(Parser *parser) {
+    parser->loopDepth++;
+    int bodyNode = parseStatement(parser);
+    parser->loopDepth--;
+    return bodyNode;
+}
+
+// Function to parse an optional part of a for header; an absent part is an Empty node
+int parseForPart(Parser *parser, int terminator, int isCondition) {
+    if (peekToken(parser->tokens, 0)->tokenType == terminator) {
+        return createNode(parser->ast, NO_SYMBOL, AST_EMPTY);
+    }
+    return isCondition ? parseExpression(parser) : parseAssignment(parser);
+}
+
+// Function to parse the statement selected by the current token
+int parseStatementForm(Parser *parser) {
+    AST *ast = parser->ast;
+    int mark = ast->count;
+    int tokenType = peekToken(parser->tokens, 0)->tokenType;
+    int statementNode = NO_NODE;
+
+    switch (tokenType) {
+        case LEFT_BRACE:
+            return parseBlock(parser);
+
+        case KW_INT:
+        case KW_FLOAT:
+        case KW_CHAR:
+            return parseDeclaration(parser);
+
+        case SEMICOLON:
+            advanceToken(parser->tokens);
+            return createNode(ast, NO_SYMBOL, AST_EMPTY);
+
+        case KW_IF: {
+            advanceToken(parser->tokens);
+            statementNode = createNode(ast, NO_SYMBOL, AST_IF);
+            int conditionNode = parseCondition(parser);
+            int thenNode = conditionNode != NO_NODE ? parseStatement(parser) : NO_NODE;
+            int elseNode = NO_NODE;
+            if (thenNode != NO_NODE && acceptToken(parser, KW_ELSE)) {
+                elseNode = parseStatement(parser);
+                if (elseNode == NO_NODE) {
+                    thenNode = NO_NODE;
+                }
+            }
+            if (thenNode == NO_NODE) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            addChild(ast, statementNode, conditionNode);
+            addChild(ast, statementNode, thenNode);
+            if (elseNode != NO_NODE) {
+                addChild(ast, statementNode, elseNode);
+            }
+            break;
+        }
+
+        case KW_WHILE: {
+            advanceToken(parser->tokens);
+            statementNode = createNode(ast, NO_SYMBOL, AST_WHILE);
+            int conditionNode = parseCondition(parser);
+            int bodyNode = conditionNode != NO_NODE ? parseLoopBody(parser) : NO_NODE;
+            if (bodyNode == NO_NODE) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            addChild(ast, statementNode, conditionNode);
+            addChild(ast, statementNode, bodyNode);
+            break;
+        }
+
+        case KW_FOR: {
+            // for (init; condition; step) body, where each header part may be empty
+            int parts[3];
+            advanceToken(parser->tokens);
+            statementNode = createNode(ast, NO_SYMBOL, AST_FOR);
+            if (!expectToken(parser, LEFT_PAREN, DIAG_EXPECTED_LEFT_PAREN) ||
+                (parts[0] = parseForPart(parser, SEMICOLON, 0)) == NO_NODE ||
+                !expectToken(parser, SEMICOLON, DIAG_EXPECTED_STATEMENT_SEMICOLON) ||
+                (parts[1] = parseForPart(parser, SEMICOLON, 1)) == NO_NODE ||
+                !expectToken(parser, SEMICOLON, DIAG_EXPECTED_STATEMENT_SEMICOLON) ||
+                (parts[2] = parseForPart(parser, RIGHT_PAREN, 0)) == NO_NODE ||
+                !expectToken(parser, RIGHT_PAREN, DIAG_EXPECTED_RIGHT_PAREN)) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            int bodyNode = parseLoopBody(parser);
+            if (bodyNode == NO_NODE) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            for (int i = 0; i < 3; i++) {
+                addChild(ast, statementNode, parts[i]);
+            }
+            addChild(ast, statementNode, bodyNode);
+            break;
+        }
+
+        case KW_BREAK:
+        case KW_CONTINUE:
+            if (parser->loopDepth == 0) {
+                reportDiagnostic(parser, DIAG_NOT_IN_LOOP);
+                advanceToken(parser->tokens);
+                return NO_NODE;
+            }
+            advanceToken(parser->tokens);
+            statementNode = createNode(ast, NO_SYMBOL, tokenType == KW_BREAK ? AST_BREAK : AST_CONTINUE);
+            if (!expectToken(parser, SEMICOLON, DIAG_EXPECTED_STATEMENT_SEMICOLON)) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            break;
+
+        case KW_RETURN: {
+            advanceToken(parser->tokens);
+            statementNode = createNode(ast, NO_SYMBOL, AST_RETURN);
+            if (peekToken(parser->tokens, 0)->tokenType != SEMICOLON) {
+                int valueNode = parseExpression(parser);
+                if (valueNode == NO_NODE) {
+                    ast->count = mark;
+                    return NO_NODE;
+                }
+                addChild(ast, statementNode, valueNode);
+            }
+            if (!expectToken(parser, SEMICOLON, DIAG_EXPECTED_STATEMENT_SEMICOLON)) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            break;
+        }
+
+        case IDENTIFIER:
+            // An assignment, or an expression evaluated for its calls
+            statementNode = peekToken(parser->tokens, 1)->tokenType == ASSIGN ? parseAssignment(parser)
+                                                                              : parseExpression(parser);
+            if (statementNode == NO_NODE || !expectToken(parser, SEMICOLON, DIAG_EXPECTED_STATEMENT_SEMICOLON)) {
+                ast->count = mark;
+                return NO_NODE;
+            }
+            break;
+
+        default:
+            reportDiagnostic(parser, DIAG_EXPECTED_STATEMENT);
+            return NO_NODE;
+    }
+
+    TRACE("Parsed: Statement - %s\n", astNodeNames[ast->nodes[statementNode].nodeType]);
+    return statementNode;
+}
+
+int parseStatement(Parser *parser) {
+    // Blocks and the bodies of if, while and for nest statements recursively
+    parser->work++;
+    if (!enterNesting(parser)) {
+        return NO_NODE;
+    }
+    int statementNode = parseStatementForm(parser);
+    leaveNesting(parser);
+    return statementNode;
+}
+
+// Function to report the calls of names the program never defines as a
+// function. A call may come before its function, so calls are checked once
+// the program is parsed, and their diagnostics are merged into the list in
+// source order, within the error limit.
+void checkCalls(Parser *parser) {
+    DiagnosticList *list = parser->diagnostics;
+    int undefined = 0;
+
+    for (int i = 0; i < parser->callCount && !parser->abandoned; i++) {
+        if (!symbolTable->entries[parser->calls[i].symbolId].isFunction) {
+            parser->calls[undefined++] = parser->calls[i];
+        }
+    }
+    if (undefined > 0) {
+        int kept = list->count;
+        list->count += undefined;
+        list->items = (Diagnostic*)reserveArray(list->items, &list->capacity, list->count, sizeof(Diagnostic));
+        // Merge from the back, so every diagnostic moves at most once
+        for (int k = list->count - 1, j = undefined - 1; j >= 0; k--) {
+            if (kept > 0 && list->items[kept - 1].tokenIndex > parser->calls[j].tokenIndex) {
+                list->items[k] = list->items[--kept];
+            } else {
+                list->items[k].kind = DIAG_UNDEFINED_FUNCTION;
+                list->items[k].tokenIndex = parser->calls[j].tokenIndex;
+                list->items[k].offset = parser->calls[j].offset;
+                j--;
+            }
+        }
+        if (options.maxErrors > 0 && list->count > options.maxErrors) {
+            list->items[options.maxErrors].kind = DIAG_TOO_MANY_ERRORS;
+            list->count = options.maxErrors + 1;
+        }
+    }
+    free(parser->calls);
+    parser->calls = NULL;
+    parser->callCount = parser->callCapacity = 0;
+}
+
+// Function to build a binary operator node over two operands
+int makeBinaryNode(AST *ast, int nodeType, int left, int right) {
+    int operatorNode = createNode(ast, NO_SYMBOL, nodeType);
+    addChild(ast, operatorNode, left);
+    addChild(ast, operatorNode, right);
+    return operatorNode;
+}
+
+// Function to parse a number, a variable, a call or a parenthesized expression
+int parsePrimary(Parser *parser) {
+    const Token *token = peekToken(parser->tokens, 0);
+    int mark = parser->ast->count;
+
+    parser->work++;
+    switch (token->tokenType) {
+        case INTEGER: {
+            // Literals are interned like names; the value is read back from the text
+            int symbolId = internSymbol(symbolTable, parser->tokens->text + token->offset, token->length, 0);
+            advanceToken(parser->tokens);
+            return createNode(parser->ast, symbolId, AST_NUMBER);
+        }
+
+        case IDENTIFIER:
+            if (peekToken(parser->tokens, 1)->tokenType == LEFT_PAREN) {
+                // Calls take no arguments; a call of a name not defined yet is checked at the end
+                if (!symbolTable->entries[token->symbolId].isFunction) {
+                    parser->calls = (PendingCall*)reserveArray(parser->calls, &parser->callCapacity,
+                                                               parser->callCount + 1, sizeof(PendingCall));
+                    parser->calls[parser->callCount].symbolId = token->symbolId;
+                    parser->calls[parser->callCount].tokenIndex = parser->tokens->position;
+                    parser->calls[parser->callCount++].offset = token->offset;
+                }
+                int callNode = createNode(parser->ast, token->symbolId, AST_CALL);
+                advanceToken(parser->tokens);
+                advanceToken(parser->tokens);
+                if (!expectToken(parser, RIGHT_PAREN, DIAG_EXPECTED_RIGHT_PAREN)) {
+                    parser->ast->count = mark;
+                    return NO_NODE;
+                }
+                return callNode;
+            }
+            return parseVariableUse(parser);
+
+        case LEFT_PAREN: {
+            advanceToken(parser->tokens);
+            if (!enterNesting(parser)) {
+                return NO_NODE;
+            }
+            int innerNode = parseExpression(parser);
+            leaveNesting(parser);
+            if (innerNode == NO_NODE || !expectToken(parser, RIGHT_PAREN, DIAG_EXPECTED_RIGHT_PAREN)) {
+                parser->ast->count = mark;
+                return NO_NODE;
+            }
+            return innerNode;
+        }
+
+        default:
+            reportDiagnostic(parser, DIAG_EXPECTED_EXPRESSION);
+            return NO_NODE;
+    }
+}
+
+// Function to parse a unary minus applied to a primary expression
+int parseUnary(Parser *parser) {
+    int mark = parser->ast->count;
+
+    parser->work++;
+    if (acceptToken(parser, MINUS)) {
+        if (!enterNesting(parser)) {
+            return NO_NODE;
+        }
+        int operandNode = parseUnary(parser);
+        leaveNesting(parser);
+        if (operandNode == NO_NODE) {
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        int negateNode = createNode(parser->ast, NO_SYMBOL, AST_NEGATE);
+        addChild(parser->ast, negateNode, operandNode);
+        return negateNode;
+    }
+    return parsePrimary(parser);
+}
+
+// Function to parse a left-associative chain of '*' and '/'
+int parseTerm(Parser *parser) {
+    int mark = parser->ast->count;
+    parser->work++;
+    int left = parseUnary(parser);
+
+    while (left != NO_NODE) {
+        int tokenType = peekToken(parser->tokens, 0)->tokenType;
+        if (tokenType != STAR && tokenType != SLASH) {
+            break;
+        }
+        advanceToken(parser->tokens);
+        int right = parseUnary(parser);
+        if (right == NO_NODE) {
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        left = makeBinaryNode(parser->ast, tokenType == STAR ? AST_MUL : AST_DIV, left, right);
+    }
+    return left;
+}
+
+// Function to parse a left-associative chain of '+' and '-'
+int parseAdditive(Parser *parser) {
+    int mark = parser->ast->count;
+    parser->work++;
+    int left = parseTerm(parser);
+
+    while (left != NO_NODE) {
+        int tokenType = peekToken(parser->tokens, 0)->tokenType;
+        if (tokenType != PLUS && tokenType != MINUS) {
+            break;
+        }
+        advanceToken(parser->tokens);
+        int right = parseTerm(parser);
+        if (right == NO_NODE) {
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        left = makeBinaryNode(parser->ast, tokenType == PLUS ? AST_ADD : AST_SUB, left, right);
+    }
+    return left;
+}
+
+// Function to map a relational operator lexeme to its AST node type, or -1
+int relationalNodeType(const char *text, unsigned int length) {
+    if (length == 1) {
+        return text[0] == '<' ? AST_LT : text[0] == '>' ? AST_GT : -1;
+    }
+    switch (text[0]) {
+        case '<': return AST_LE;
+        case '>': return AST_GE;
+        case '=': return AST_EQ;
+        case '!': return AST_NE;
+        default: return -1;
+    }
+}
+
+// Function to parse a left-associative chain of '<', '>', '<=' and '>='
+int parseRelational(Parser *parser) {
+    int mark = parser->ast->count;
+    parser->work++;
+    int left = parseAdditive(parser);
+
+    while (left != NO_NODE) {
+        const Token *token = peekToken(parser->tokens, 0);
+        if (token->tokenType != RELATIONAL_OPERATOR) {
+            break;
+        }
+        int nodeType = relationalNodeType(parser->tokens->text + token->offset, token->length);
+        if (nodeType < 0) {
+            reportDiagnostic(parser, DIAG_EXPECTED_EXPRESSION);
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        if (nodeType == AST_EQ || nodeType == AST_NE) {
+            break;
+        }
+        advanceToken(parser->tokens);
+        int right = parseAdditive(parser);
+        if (right == NO_NODE) {
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        left = makeBinaryNode(parser->ast, nodeType, left, right);
+    }
+    return left;
+}
+
+// Function to parse a left-associative chain of '==' and '!='; comparisons bind
+// loosest and yield 1 or 0, and equality binds looser than ordering, as in C
+int parseExpression(Parser *parser) {
+    int mark = parser->ast->count;
+    parser->work++;
+    int left = parseRelational(parser);
+
+    while (left != NO_NODE) {
+        const Token *token = peekToken(parser->tokens, 0);
+        if (token->tokenType != RELATIONAL_OPERATOR) {
+            break;
+        }
+        int nodeType = relationalNodeType(parser->tokens->text + token->offset, token->length);
+        if (nodeType < 0) {
+            reportDiagnostic(parser, DIAG_EXPECTED_EXPRESSION);
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        if (nodeType != AST_EQ && nodeType != AST_NE) {
+            break;
+        }
+        advanceToken(parser->tokens);
+        int right = parseRelational(parser);
+        if (right == NO_NODE) {
+            parser->ast->count = mark;
+            return NO_NODE;
+        }
+        left = makeBinaryNode(parser->ast, nodeType, left, right);
+    }
+    return left;
+}
+
+// Growable stack of node indices used by the iterative tree walks
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} NodeStack;
+
+// Function to push a node index
+void pushNode(NodeStack* stack, int node) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->items = (int*)realloc(stack->items, (size_t)stack->capacity * sizeof(int));
+        if (stack->items == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+    }
+    stack->items[stack->count++] = node;
+}
+
+void displayAST(const AST* ast) {
+    NodeStack stack = { NULL, 0, 0 };
+
+    if (ast->root == NO_NODE) {
+        return;
+    }
+
+    // Pre-order walk with an explicit stack of (node, level) pairs; the next
+    // sibling is pushed below the first child so whole subtrees print first
+    pushNode(&stack, ast->root);
+    pushNode(&stack, 0);
+    while (stack.count > 0) {
+        int level = stack.items[--stack.count];
+        int node = stack.items[--stack.count];
+        const TreeNode* treeNode = &ast->nodes[node];
+
+        // Indentation based on the level
+        for (int i = 0; i < level; i++) {
+            printf("  ");
+        }
+
+        // Display node information
+        printf("%s (%d)\n", nodeLabel(ast, node), treeNode->nodeType);
+
+        if (treeNode->nextSibling != NO_NODE) {
+            pushNode(&stack, treeNode->nextSibling);
+            pushNode(&stack, level);
+        }
+        if (treeNode->firstChild != NO_NODE) {
+            pushNode(&stack, treeNode->firstChild);
+            pushNode(&stack, level + 1);
+        }
+    }
+
+    free(stack.items);
+}
+
+// Function to dump the AST as a JSON array of nodes with child indices
+void jsonAST(OutputBuffer *json, const AST* ast) {
+    bufferPrintf(json, "{\"root\":%d,\"nodes\":[", ast->root);
+    for (int node = 0; node < ast->count; node++) {
+        const TreeNode* treeNode = &ast->nodes[node];
+        const char* label = nodeLabel(ast, node);
+
+        bufferPrintf(json, "%s{\"type\":\"%s\",\"label\":", node == 0 ? "" : ",", astNodeNames[treeNode->nodeType]);
+        bufferAppendJsonString(json, label, strlen(label));
+        bufferPuts(json, ",\"children\":[");
+        for (int child = treeNode->firstChild; child != NO_NODE; child = ast->nodes[child].nextSibling) {
+            bufferPrintf(json, "%s%d", child == treeNode->firstChild ? "" : ",", child);
+        }
+        bufferPuts(json, "]}");
+    }
+    bufferPuts(json, "]}");
+}
+
+// Pointer-linked node with per-node allocation, the layout the flat AST replaced (benchmark reference)
+typedef struct BenchmarkNode {
+    int symbolId;
+    int nodeType;
+    struct BenchmarkNode* children[2];
+} BenchmarkNode;
+
+// Function to free a malloc'd benchmark tree node by node
+void freeMallocTree(BenchmarkNode* root) {
+    if (root == NULL) {
+        return;
+    }
+
+    freeMallocTree(root->children[0]);
+    freeMallocTree(root->children[1]);
+    free(root);
+}
+
+// Function to build the node shape of one declaration with malloc or with an arena
+BenchmarkNode* buildBenchmarkDeclaration(Arena* arena, int symbolId) {
+    BenchmarkNode* nodes[3];
+
+    for (int i = 0; i < 3; i++) {
+        nodes[i] = arena != NULL ? (BenchmarkNode*)arenaAlloc(arena, sizeof(BenchmarkNode))
+                                 : (BenchmarkNode*)malloc(sizeof(BenchmarkNode));
+        nodes[i]->symbolId = symbolId;
+        nodes[i]->nodeType = i == 0 ? AST_DECLARATION : i == 1 ? AST_TYPE : AST_VARIABLE;
+        nodes[i]->children[0] = NULL;
+        nodes[i]->children[1] = NULL;
+    }
+    nodes[0]->children[0] = nodes[1];
+    nodes[0]->children[1] = nodes[2];
+    return nodes[0];
+}
+
+// Function to compare per-node malloc/free, an arena and the flat AST on a program of N declarations
+void benchmarkArena(long declarations) {
+    BenchmarkNode** roots = (BenchmarkNode**)malloc((size_t)declarations * sizeof(BenchmarkNode*));
+    Arena arena;
+    AST ast;
+
+    if (roots == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return;
+    }
+
+    double start = nowSeconds();
+    for (long i = 0; i < declarations; i++) {
+        roots[i] = buildBenchmarkDeclaration(NULL, (int)i);
+    }
+    double mallocBuild = nowSeconds() - start;
+    start = nowSeconds();
+    for (long i = 0; i < declarations; i++) {
+        freeMallocTree(roots[i]);
+    }
+    double mallocFree = nowSeconds() - start;
+
+    initArena(&arena);
+    start = nowSeconds();
+    for (long i = 0; i < declarations; i++) {
+        roots[i] = buildBenchmarkDeclaration(&arena, (int)i);
+    }
+    double arenaBuild = nowSeconds() - start;
+    size_t arenaAllocations = arena.allocations;
+    size_t arenaChunks = arena.chunks;
+    size_t arenaBytes = arena.bytesReserved;
+    start = nowSeconds();
+    arenaRelease(&arena);
+    double arenaFree = nowSeconds() - start;
+
+    free(roots);
+
+    initAST(&ast);
+    start = nowSeconds();
+    ast.root = createNode(&ast, NO_SYMBOL, AST_PROGRAM);
+    for (long i = 0; i < declarations; i++) {
+        int declarationNode = createNode(&ast, NO_SYMBOL, AST_DECLARATION);
+        addChild(&ast, declarationNode, createNode(&ast, (int)i, AST_TYPE));
+        addChild(&ast, declarationNode, createNode(&ast, (int)i, AST_VARIABLE));
+        addChild(&ast, ast.root, declarationNode);
+    }
+    double flatBuild = nowSeconds() - start;
+    size_t flatBytes = (size_t)ast.capacity * sizeof(TreeNode);
+    start = nowSeconds();
+    freeAST(&ast);
+    double flatFree = nowSeconds() - start;
+
+    printf("Declarations: %ld (%ld nodes)\n", declarations, declarations * 3);
+    printf("%-8s %12s %12s %12s %14s\n", "Method", "build ms", "free ms", "malloc calls", "ns/node");
+    printf("%-8s %12.2f %12.2f %12ld %14.2f\n", "malloc", mallocBuild * 1e3, mallocFree * 1e3, declarations * 3,
+           (mallocBuild + mallocFree) * 1e9 / (declarations * 3));
+    printf("%-8s %12.2f %12.2f %12zu %14.2f\n", "arena", arenaBuild * 1e3, arenaFree * 1e3, arenaChunks,
+           (arenaBuild + arenaFree) * 1e9 / (declarations * 3));
+    printf("%-8s %12.2f %12.2f %12s %14.2f\n", "flat", flatBuild * 1e3, flatFree * 1e3, "-",
+           (flatBuild + flatFree) * 1e9 / (declarations * 3));
+    printf("Arena: %zu allocations, %zu bytes reserved in %zu chunks\n", arenaAllocations, arenaBytes, arenaChunks);
+    printf("Flat AST: %zu bytes for %ld nodes\n", flatBytes, declarations * 3 + 1);
+}
+
+// Intermediate code operations. Results go to the result operand only; labels
+// are arg1 of OP_LABEL/OP_GOTO and arg2 of the conditional branches (condition in arg1)
+enum {
+    OP_ASSIGN,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LABEL,
+    OP_JUMP,
+    OP_IF,
+    OP_GOTO,
+    OP_READ,
+    OP_WRITE,
+    OP_RETURN,
+    OP_IF_FALSE,  // Branch when arg1 is zero
+    OP_CALL,
+    OP_LT,        // Comparisons yield 1 or 0
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_NEG,
+    OP_NOP,       // Deleted by an optimization pass, dropped when the function leaves SSA form
+    OP_PHI        // SSA merge; arg1 indexes the optimizer's phi table
+};
+
+// Operands are 32-bit references: the top two bits tag the kind and the low
+// 30 bits hold a symbol id, temporary number, constant pool index or label number
+typedef unsigned int Operand;
+
+enum {
+    OPERAND_SYMBOL,  // Variable in the symbol table
+    OPERAND_TEMP,    // Compiler temporary
+    OPERAND_CONST,   // Entry of the function's constant pool
+    OPERAND_LABEL    // Branch target
+};
+
+#define OPERAND_TAG_SHIFT 30
+#define OPERAND_PAYLOAD_MASK 0x3FFFFFFFu
+#define NO_OPERAND 0xFFFFFFFFu  // Unused operand slot
+#define MAKE_OPERAND(tag, payload) (((Operand)(tag) << OPERAND_TAG_SHIFT) | ((Operand)(payload) & OPERAND_PAYLOAD_MASK))
+#define OPERAND_TAG(operand) ((operand) >> OPERAND_TAG_SHIFT)
+#define OPERAND_PAYLOAD(operand) ((int)((operand) & OPERAND_PAYLOAD_MASK))
+#define INITIAL_IR_CAPACITY 256
+#define OPERAND_TEXT_SIZE 64  // Room for a local's name and its SSA version
+
+// Three-address instruction: 16 bytes instead of an op and three 50-byte strings
+typedef struct {
+    int op;  // Operation type
+    Operand result;
+    Operand arg1;
+    Operand arg2;
+} IntermediateCode;
+
+// Arrays of an IR function loaded from a program image
+enum {
+    BORROWED_CODE = 1,
+    BORROWED_CONSTANTS = 2,
+    BORROWED_TEMP_NAMES = 4
+};
+
+// Growable instruction stream of one function together with its constants
+typedef struct {
+    int name;         // Symbol id of the function, NO_SYMBOL for the global initializers
+    IntermediateCode *code;
+    int count;
+    int capacity;
+    long *constants;  // Constant pool, indexed by OPERAND_CONST payloads
+    int constantCount;
+    int constantCapacity;
+    int *constantSlots;            // Open-addressing index of the pool: value hash -> pool index, -1 if empty
+    unsigned int constantSlotMask;
+    int *tempNames;   // Symbol id of the local each temporary holds, NO_SYMBOL for compiler temporaries
+    int tempCount;    // Temporaries are numbered per function
+    int tempCapacity;
+    int labelCount;
+    int firstVersion; // Temporaries from here on are SSA versions of their local, -1 before SSA
+    int borrowed;     // BORROWED_* arrays still point into a program image; each is copied when first grown
+} IRFunction;
+
+// Intermediate code of a whole program
+typedef struct {
+    IRFunction globals;     // Zero-initialization of the global variables
+    IRFunction *functions;  // Function definitions in source order
+    int count;
+    int capacity;
+} IRProgram;
+
+// Function to create an empty IR function
+void initIRFunction(IRFunction *ir) {
+    ir->name = NO_SYMBOL;
+    ir->code = NULL;
+    ir->count = 0;
+    ir->capacity = 0;
+    ir->constants = NULL;
+    ir->constantCount = 0;
+    ir->constantCapacity = 0;
+    ir->constantSlots = NULL;
+    ir->constantSlotMask = 0;
+    ir->tempNames = NULL;
+    ir->tempCount = 0;
+    ir->tempCapacity = 0;
+    ir->labelCount = 0;
+    ir->firstVersion = -1;
+    ir->borrowed = 0;
+}
+
+// Function to hash a constant for the index of a constant pool
+unsigned int hashConstant(long value) {
+    unsigned long long hash = (unsigned long long)value * 0x9E3779B97F4A7C15ull;
+    return (unsigned int)(hash >> 32);
+}
+
+// Function to drop the instructions of an IR function but keep its storage
+void resetIRFunction(IRFunction *ir) {
+    ir->name = NO_SYMBOL;
+    ir->count = 0;
+    if (ir->constantSlots != NULL) {
+        // Constants were indexed in pool order, so removing them in reverse
+        // keeps the probe chains of the remaining ones intact
+        for (int i = ir->constantCount - 1; i >= 0; i--) {
+            unsigned int slot = hashConstant(ir->constants[i]) & ir->constantSlotMask;
+            while (ir->constantSlots[slot] != i) {
+                slot = (slot + 1) & ir->constantSlotMask;
+            }
+            ir->constantSlots[slot] = -1;
+        }
+    }
+    ir->constantCount = 0;
+    ir->tempCount = 0;
+    ir->labelCount = 0;
+    ir->firstVersion = -1;
+}
+
+// Function to free an IR function
+void freeIRFunction(IRFunction *ir) {
+    if (!(ir->borrowed & BORROWED_CODE)) {
+        free(ir->code);
+    }
+    if (!(ir->borrowed & BORROWED_CONSTANTS)) {
+        free(ir->constants);
+    }
+    free(ir->constantSlots);
+    if (!(ir->borrowed & BORROWED_TEMP_NAMES)) {
+        free(ir->tempNames);
+    }
+    initIRFunction(ir);
+}
+
+// Function to copy an array into memory of its own
+void* copyArray(const void *data, size_t count, size_t size) {
+    void *copy = malloc(count > 0 ? count * size : 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Out of memory for intermediate code\n");
+        exit(1);
+    }
+    memcpy(copy, data, count * size);
+    return copy;
+}
+
+// Function to give an IR function loaded from a program image its own copy
+// of one array before it is grown or replaced. Only that array moves, so
+// pointers into the others stay valid.
+void ownIRFunction(IRFunction *ir, int array) {
+    if (!(ir->borrowed & array)) {
+        return;
+    }
+    if (array == BORROWED_CODE) {
+        ir->code = (IntermediateCode*)copyArray(ir->code, (size_t)ir->count, sizeof(IntermediateCode));
+    } else if (array == BORROWED_CONSTANTS) {
+        ir->constants = (long*)copyArray(ir->constants, (size_t)ir->constantCount, sizeof(long));
+    } else {
+        ir->tempNames = (int*)copyArray(ir->tempNames, (size_t)ir->tempCount, sizeof(int));
+    }
+    ir->borrowed &= ~array;
+}
+
+// Function to drop the instruction array of an IR function that is about to
+// be replaced; an array borrowed from a program image is left to the image
+void releaseIRCode(IRFunction *ir) {
+    if (ir->borrowed & BORROWED_CODE) {
+        ir->borrowed &= ~BORROWED_CODE;
+    } else {
+        free(ir->code);
+    }
+}
+
+// Function to create an empty IR program
+void initIRProgram(IRProgram *program) {
+    initIRFunction(&program->globals);
+    program->functions = NULL;
+    program->count = 0;
+    program->capacity = 0;
+}
+
+// Function to append an empty function to an IR program
+IRFunction* addIRFunction(IRProgram *program, int name) {
+    if (program->count == program->capacity) {
+        program->capacity = program->capacity == 0 ? 16 : program->capacity * 2;
+        program->functions = (IRFunction*)realloc(program->functions, (size_t)program->capacity * sizeof(IRFunction));
+        if (program->functions == NULL) {
+            fprintf(stderr, "Error: Out of memory for intermediate code\n");
+            exit(1);
+        }
+    }
+
+    IRFunction *function = &program->functions[program->count++];
+    initIRFunction(function);
+    function->name = name;
+    return function;
+}
+
+// Function to free an IR program
+void freeIRProgram(IRProgram *program) {
+    freeIRFunction(&program->globals);
+    for (int i = 0; i < program->count; i++) {
+        freeIRFunction(&program->functions[i]);
+    }
+    free(program->functions);
+    program->functions = NULL;
+    program->count = 0;
+    program->capacity = 0;
+}
+
+// Function to append an instruction to an IR function
+void emitInstruction(IRFunction *ir, int op, Operand result, Operand arg1, Operand arg2) {
+    if (ir->count == ir->capacity) {
+        int capacity = ir->capacity == 0 ? INITIAL_IR_CAPACITY : ir->capacity * 2;
+        ownIRFunction(ir, BORROWED_CODE);
+        IntermediateCode *code = (IntermediateCode*)realloc(ir->code, (size_t)capacity * sizeof(IntermediateCode));
+        if (code == NULL) {
+            fprintf(stderr, "Error: Out of memory for intermediate code\n");
+            exit(1);
+        }
+        ir->code = code;
+        ir->capacity = capacity;
+    }
+
+    IntermediateCode *instruction = &ir->code[ir->count++];
+    instruction->op = op;
+    instruction->result = result;
+    instruction->arg1 = arg1;
+    instruction->arg2 = arg2;
+}
+
+// Function to rebuild the index of a constant pool with at most half of its
+// slots in use; a pool loaded from a program image is indexed on first use
+void indexConstants(IRFunction *ir) {
+    unsigned int size = 32;
+    while (size < (unsigned int)ir->constantCount * 4) {
+        size *= 2;
+    }
+    free(ir->constantSlots);
+    ir->constantSlots = (int*)malloc(size * sizeof(int));
+    if (ir->constantSlots == NULL) {
+        fprintf(stderr, "Error: Out of memory for constants\n");
+        exit(1);
+    }
+    ir->constantSlotMask = size - 1;
+    for (unsigned int s = 0; s < size; s++) {
+        ir->constantSlots[s] = -1;
+    }
+    for (int i = 0; i < ir->constantCount; i++) {
+        unsigned int slot = hashConstant(ir->constants[i]) & ir->constantSlotMask;
+        while (ir->constantSlots[slot] >= 0) {
+            slot = (slot + 1) & ir->constantSlotMask;
+        }
+        ir->constantSlots[slot] = i;
+    }
+}
+
+// Function to get an operand for a constant, adding it to the constant pool
+Operand constantOperand(IRFunction *ir, long value) {
+    if (ir->constantSlots == NULL || (unsigned int)ir->constantCount * 2 >= ir->constantSlotMask) {
+        indexConstants(ir);
+    }
+    unsigned int slot = hashConstant(value) & ir->constantSlotMask;
+    for (; ir->constantSlots[slot] >= 0; slot = (slot + 1) & ir->constantSlotMask) {
+        if (ir->constants[ir->constantSlots[slot]] == value) {
+            return MAKE_OPERAND(OPERAND_CONST, ir->constantSlots[slot]);
+        }
+    }
+    if (ir->constantCount == ir->constantCapacity) {
+        int capacity = ir->constantCapacity == 0 ? 16 : ir->constantCapacity * 2;
+        ownIRFunction(ir, BORROWED_CONSTANTS);
+        long *constants = (long*)realloc(ir->constants, (size_t)capacity * sizeof(long));
+        if (constants == NULL) {
+            fprintf(stderr, "Error: Out of memory for constants\n");
+            exit(1);
+        }
+        ir->constants = constants;
+        ir->constantCapacity = capacity;
+    }
+    ir->constants[ir->constantCount] = value;
+    ir->constantSlots[slot] = ir->constantCount;
+    return MAKE_OPERAND(OPERAND_CONST, ir->constantCount++);
+}
+
+// Function to get an operand for a variable of the symbol table
+Operand symbolOperand(int symbolId) {
+    return MAKE_OPERAND(OPERAND_SYMBOL, symbolId);
+}
+
+// Function to format an operand for listings; locals print by name, and buffer
+// is used for other temporaries, constants and labels
+const char* operandText(const IRFunction *ir, Operand operand, char buffer[OPERAND_TEXT_SIZE]) {
+    if (operand == NO_OPERAND) {
+        return "";
+    }
+    switch (OPERAND_TAG(operand)) {
+        case OPERAND_SYMBOL:
+            return symbolName(OPERAND_PAYLOAD(operand));
+        case OPERAND_TEMP:
+            if (ir->tempNames[OPERAND_PAYLOAD(operand)] != NO_SYMBOL) {
+                if (ir->firstVersion < 0 || OPERAND_PAYLOAD(operand) < ir->firstVersion) {
+                    return symbolName(ir->tempNames[OPERAND_PAYLOAD(operand)]);
+                }
+                snprintf(buffer, OPERAND_TEXT_SIZE, "%s.%d", symbolName(ir->tempNames[OPERAND_PAYLOAD(operand)]),
+                         OPERAND_PAYLOAD(operand) - ir->firstVersion);
+                return buffer;
+            }
+            snprintf(buffer, OPERAND_TEXT_SIZE, "temp%d", OPERAND_PAYLOAD(operand));
+            return buffer;
+        case OPERAND_CONST:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "%ld", ir->constants[OPERAND_PAYLOAD(operand)]);
+            return buffer;
+        default:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "L%d", OPERAND_PAYLOAD(operand));
+            return buffer;
+    }
+}
+
+// State of lowering one function (or the global declarations) to intermediate code
+typedef struct {
+    const AST *ast;
+    IRFunction *ir;
+    int inFunction;         // Declarations create locals rather than globals
+    int *localTemps;        // Symbol id -> temporary holding that local, -1 if it is not a local
+    int localCapacity;
+    Operand breakLabel;     // Targets of break and continue in the innermost loop
+    Operand continueLabel;
+    NodeStack operators;    // Binary operators on the left spines of the chains being lowered
+    NodeStack shadowed;     // (symbol, temporary) pairs of the locals that inner blocks shadow
+} CodeGenerator;
+
+// Function to create a code generator; its local map is reused for every function
+void initCodeGenerator(CodeGenerator *generator, const AST *ast) {
+    generator->ast = ast;
+    generator->ir = NULL;
+    generator->inFunction = 0;
+    generator->localTemps = NULL;
+    generator->localCapacity = 0;
+    generator->breakLabel = NO_OPERAND;
+    generator->continueLabel = NO_OPERAND;
+    generator->operators = (NodeStack){ NULL, 0, 0 };
+    generator->shadowed = (NodeStack){ NULL, 0, 0 };
+}
+
+// Function to free a code generator
+void freeCodeGenerator(CodeGenerator *generator) {
+    free(generator->localTemps);
+    generator->localTemps = NULL;
+    generator->localCapacity = 0;
+    free(generator->operators.items);
+    generator->operators = (NodeStack){ NULL, 0, 0 };
+    free(generator->shadowed.items);
+    generator->shadowed = (NodeStack){ NULL, 0, 0 };
+}
+
+// Function to generate intermediate code for the AST
+void generateIntermediateCode(const AST* ast, IRProgram* program);
+
+// Helper function to create temporary variables
+Operand createTempVar(IRFunction* ir);
+
+// Helper function to create a branch target
+Operand createLabel(IRFunction* ir);
+
+// Helper function to generate three-address code for variable declarations
+void generateDeclarationCode(CodeGenerator* generator, int declarationNode);
+
+// Helper function to generate three-address code for a function definition
+void generateFunctionCode(CodeGenerator* generator, int functionNode, IRFunction* ir);
+
+// Helper function to generate three-address code for statements
+void generateStatementCode(CodeGenerator* generator, int statementNode);
+
+// Helper function to generate three-address code for assignments
+void generateAssignmentCode(CodeGenerator* generator, int assignmentNode);
+
+// Helper function to generate three-address code for expressions
+Operand generateExpressionCode(CodeGenerator* generator, int expressionNode);
+
+void generateIntermediateCode(const AST* ast, IRProgram* program) {
+    NodeStack stack = { NULL, 0, 0 };
+    CodeGenerator generator;
+
+    if (ast->root == NO_NODE) {
+        return;
+    }
+    initCodeGenerator(&generator, ast);
+
+    // Iterative pre-order walk; children are pushed last-to-first so they are
+    // visited in source order
+    pushNode(&stack, ast->root);
+    while (stack.count > 0) {
+        int node = stack.items[--stack.count];
+
+        switch (ast->nodes[node].nodeType) {
+            case AST_PROGRAM: {
+                // Traverse children
+                int mark = stack.count;
+                for (int child = ast->nodes[node].firstChild; child != NO_NODE; child = ast->nodes[child].nextSibling) {
+                    pushNode(&stack, child);
+                }
+                for (int i = mark, j = stack.count - 1; i < j; i++, j--) {
+                    int swap = stack.items[i];
+                    stack.items[i] = stack.items[j];
+                    stack.items[j] = swap;
+                }
+                break;
+            }
+
+            case AST_DECLARATION:
+                generator.ir = &program->globals;
+                generateDeclarationCode(&generator, node);
+                break;
+
+            case AST_FUNCTION:
+                generateFunctionCode(&generator, node, addIRFunction(program, ast->nodes[node].symbolId));
+                break;
+
+            case AST_TYPE:
+                // Nothing to do for types in this example
+                break;
+
+            case AST_VARIABLE:
+                // Nothing to do for variables in this example
+                break;
+
+            // Add cases for other node types as needed
+
+            default:
+                fprintf(stderr, "Error: Unknown AST node type\n");
+                break;
+        }
+    }
+
+    freeCodeGenerator(&generator);
+    free(stack.items);
+}
+
+// Helper function to create temporary variables; they are just numbers, so
+// nothing is allocated
+Operand createTempVar(IRFunction* ir) {
+    if (ir->tempCount == ir->tempCapacity) {
+        ownIRFunction(ir, BORROWED_TEMP_NAMES);
+        ir->tempCapacity = ir->tempCapacity == 0 ? 64 : ir->tempCapacity * 2;
+        ir->tempNames = (int*)realloc(ir->tempNames, (size_t)ir->tempCapacity * sizeof(int));
+        if (ir->tempNames == NULL) {
+            fprintf(stderr, "Error: Out of memory for temporaries\n");
+            exit(1);
+        }
+    }
+    ir->tempNames[ir->tempCount] = NO_SYMBOL;
+    return MAKE_OPERAND(OPERAND_TEMP, ir->tempCount++);
+}
+
+Operand createLabel(IRFunction* ir) {
+    return MAKE_OPERAND(OPERAND_LABEL, ir->labelCount++);
+}
+
+// Function to give a local variable its own temporary
+Operand createLocalVar(CodeGenerator* generator, int symbolId) {
+    Operand temp = createTempVar(generator->ir);
+
+    if (symbolId >= generator->localCapacity) {
+        int capacity = generator->localCapacity == 0 ? 256 : generator->localCapacity;
+        while (capacity <= symbolId) {
+            capacity *= 2;
+        }
+        generator->localTemps = (int*)realloc(generator->localTemps, (size_t)capacity * sizeof(int));
+        if (generator->localTemps == NULL) {
+            fprintf(stderr, "Error: Out of memory for locals\n");
+            exit(1);
+        }
+        for (int i = generator->localCapacity; i < capacity; i++) {
+            generator->localTemps[i] = -1;
+        }
+        generator->localCapacity = capacity;
+    }
+    generator->ir->tempNames[OPERAND_PAYLOAD(temp)] = symbolId;
+    pushNode(&generator->shadowed, symbolId);
+    pushNode(&generator->shadowed, generator->localTemps[symbolId]);
+    generator->localTemps[symbolId] = OPERAND_PAYLOAD(temp);
+    return temp;
+}
+
+// Function to get the operand a variable name refers to: a local's temporary or the global symbol
+Operand variableOperand(const CodeGenerator* generator, int symbolId) {
+    if (symbolId < generator->localCapacity && generator->localTemps[symbolId] >= 0) {
+        return MAKE_OPERAND(OPERAND_TEMP, generator->localTemps[symbolId]);
+    }
+    return symbolOperand(symbolId);
+}
+
+void generateDeclarationCode(CodeGenerator* generator, int declarationNode) {
+    const AST* ast = generator->ast;
+    int typeNode = ast->nodes[declarationNode].firstChild;
+    int variableNode = ast->nodes[typeNode].nextSibling;
+    int initializerNode = ast->nodes[variableNode].nextSibling;
+    int symbolId = ast->nodes[variableNode].symbolId;
+
+    // Variables without an initializer start out as zero; a global's initializer
+    // was checked to be constant by the parser and becomes its initial value
+    Operand value;
+    long constant = 0;
+    if (initializerNode == NO_NODE || !generator->inFunction) {
+        if (initializerNode != NO_NODE) {
+            evaluateConstant(ast, initializerNode, &constant);
+        }
+        value = constantOperand(generator->ir, constant);
+    } else {
+        value = generateExpressionCode(generator, initializerNode);
+    }
+    Operand variable = generator->inFunction ? createLocalVar(generator, symbolId) : symbolOperand(symbolId);
+    emitInstruction(generator->ir, OP_ASSIGN, variable, value, NO_OPERAND);
+}
+
+void generateFunctionCode(CodeGenerator* generator, int functionNode, IRFunction* ir) {
+    const AST* ast = generator->ast;
+    int bodyNode = ast->nodes[ast->nodes[functionNode].firstChild].nextSibling;
+
+    ir->name = ast->nodes[functionNode].symbolId;
+    generator->ir = ir;
+    generator->inFunction = 1;
+    generateStatementCode(generator, bodyNode);
+
+    // Falling off the end of a function returns 0
+    if (ir->count == 0 || ir->code[ir->count - 1].op != OP_RETURN) {
+        emitInstruction(ir, OP_RETURN, NO_OPERAND, constantOperand(ir, 0), NO_OPERAND);
+    }
+
+    // Forget this function's locals so the map is clean for the next one
+    for (int i = 0; i < ir->tempCount; i++) {
+        if (ir->tempNames[i] != NO_SYMBOL) {
+            generator->localTemps[ir->tempNames[i]] = -1;
+        }
+    }
+    generator->inFunction = 0;
+}
+
+// Function to lower the body of a loop with its break and continue targets
+void generateLoopBodyCode(CodeGenerator* generator, int bodyNode, Operand breakLabel, Operand continueLabel) {
+    Operand outerBreak = generator->breakLabel;
+    Operand outerContinue = generator->continueLabel;
+
+    generator->breakLabel = breakLabel;
+    generator->continueLabel = continueLabel;
+    generateStatementCode(generator, bodyNode);
+    generator->breakLabel = outerBreak;
+    generator->continueLabel = outerContinue;
+}
+
+void generateStatementCode(CodeGenerator* generator, int statementNode) {
+    const AST* ast = generator->ast;
+    IRFunction* ir = generator->ir;
+    const TreeNode* node = &ast->nodes[statementNode];
+
+    switch (node->nodeType) {
+        case AST_BLOCK: {
+            int shadowedBase = generator->shadowed.count;
+            for (int child = node->firstChild; child != NO_NODE; child = ast->nodes[child].nextSibling) {
+                generateStatementCode(generator, child);
+            }
+            // Names declared in the block refer to what they shadowed again
+            while (generator->shadowed.count > shadowedBase) {
+                int temp = generator->shadowed.items[--generator->shadowed.count];
+                generator->localTemps[generator->shadowed.items[--generator->shadowed.count]] = temp;
+            }
+            break;
+        }
+
+        case AST_DECLARATION:
+            generateDeclarationCode(generator, statementNode);
+            break;
+
+        case AST_ASSIGN:
+            generateAssignmentCode(generator, statementNode);
+            break;
+
+        case AST_IF: {
+            // ifFalse condition goto else; then; goto end; else: otherwise; end:
+            int thenNode = ast->nodes[node->firstChild].nextSibling;
+            int elseNode = ast->nodes[thenNode].nextSibling;
+            Operand elseLabel = createLabel(ir);
+            Operand condition = generateExpressionCode(generator, node->firstChild);
+
+            emitInstruction(ir, OP_IF_FALSE, NO_OPERAND, condition, elseLabel);
+            generateStatementCode(generator, thenNode);
+            if (elseNode != NO_NODE) {
+                Operand endLabel = createLabel(ir);
+                emitInstruction(ir, OP_GOTO, NO_OPERAND, endLabel, NO_OPERAND);
+                emitInstruction(ir, OP_LABEL, NO_OPERAND, elseLabel, NO_OPERAND);
+                generateStatementCode(generator, elseNode);
+                emitInstruction(ir, OP_LABEL, NO_OPERAND, endLabel, NO_OPERAND);
+            } else {
+                emitInstruction(ir, OP_LABEL, NO_OPERAND, elseLabel, NO_OPERAND);
+            }
+            break;
+        }
+
+        case AST_WHILE: {
+            // top: ifFalse condition goto end; body; goto top; end:
+            int bodyNode = ast->nodes[node->firstChild].nextSibling;
+            Operand topLabel = createLabel(ir);
+            Operand endLabel = createLabel(ir);
+
+            emitInstruction(ir, OP_LABEL, NO_OPERAND, topLabel, NO_OPERAND);
+            Operand condition = generateExpressionCode(generator, node->firstChild);
+            emitInstruction(ir, OP_IF_FALSE, NO_OPERAND, condition, endLabel);
+            generateLoopBodyCode(generator, bodyNode, endLabel, topLabel);
+            emitInstruction(ir, OP_GOTO, NO_OPERAND, topLabel, NO_OPERAND);
+            emitInstruction(ir, OP_LABEL, NO_OPERAND, endLabel, NO_OPERAND);
+            break;
+        }
+
+        case AST_FOR: {
+            // init; top: ifFalse condition goto end; body; step: step; goto top; end:
+            int initNode = node->firstChild;
+            int conditionNode = ast->nodes[initNode].nextSibling;
+            int stepNode = ast->nodes[conditionNode].nextSibling;
+            int bodyNode = ast->nodes[stepNode].nextSibling;
+            Operand topLabel = createLabel(ir);
+            Operand stepLabel = createLabel(ir);
+            Operand endLabel = createLabel(ir);
+
+            generateStatementCode(generator, initNode);
+            emitInstruction(ir, OP_LABEL, NO_OPERAND, topLabel, NO_OPERAND);
+            if (ast->nodes[conditionNode].nodeType != AST_EMPTY) {
+                Operand condition = generateExpressionCode(generator, conditionNode);
+                emitInstruction(ir, OP_IF_FALSE, NO_OPERAND, condition, endLabel);
+            }
+            generateLoopBodyCode(generator, bodyNode, endLabel, stepLabel);
+            emitInstruction(ir, OP_LABEL, NO_OPERAND, stepLabel, NO_OPERAND);
+            generateStatementCode(generator, stepNode);
+            emitInstruction(ir, OP_GOTO, NO_OPERAND, topLabel, NO_OPERAND);
+            emitInstruction(ir, OP_LABEL, NO_OPERAND, endLabel, NO_OPERAND);
+            break;
+        }
+
+        case AST_BREAK:
+            emitInstruction(ir, OP_GOTO, NO_OPERAND, generator->breakLabel, NO_OPERAND);
+            break;
+
+        case AST_CONTINUE:
+            emitInstruction(ir, OP_GOTO, NO_OPERAND, generator->continueLabel, NO_OPERAND);
+            break;
+
+        case AST_RETURN: {
+            Operand value = node->firstChild != NO_NODE ? generateExpressionCode(generator, node->firstChild)
+                                                        : constantOperand(ir, 0);
+            emitInstruction(ir, OP_RETURN, NO_OPERAND, value, NO_OPERAND);
+            break;
+        }
+
+        case AST_EMPTY:
+            break;
+
+        default:
+            // An expression statement is evaluated for its calls
+            generateExpressionCode(generator, statementNode);
+            break;
+    }
+}
+
+void generateAssignmentCode(CodeGenerator* generator, int assignmentNode) {
+    const AST* ast = generator->ast;
+
+    // The assignment node has two children: variable and expression
+    int variableNode = ast->nodes[assignmentNode].firstChild;
+    int expressionNode = ast->nodes[variableNode].nextSibling;
+
+    // Generate intermediate code for the expression and move its value into the variable
+    Operand value = generateExpressionCode(generator, expressionNode);
+    emitInstruction(generator->ir, OP_ASSIGN, variableOperand(generator, ast->nodes[variableNode].symbolId), value,
+                    NO_OPERAND);
+}
+
+// Intermediate code operation of each binary AST operator, indexed by node type - AST_ADD
+const int binaryOperations[] = {
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_LT, OP_GT, OP_LE, OP_GE, OP_EQ, OP_NE
+};
+
+// Function to check whether an AST node type is a binary operator
+int isBinaryNode(int nodeType) {
+    return nodeType >= AST_ADD && nodeType <= AST_NE;
+}
+
+Operand generateExpressionCode(CodeGenerator* generator, int expressionNode) {
+    const AST* ast = generator->ast;
+    IRFunction* ir = generator->ir;
+    const TreeNode* node = &ast->nodes[expressionNode];
+
+    switch (node->nodeType) {
+        case AST_NUMBER:
+            return constantOperand(ir, strtol(symbolName(node->symbolId), NULL, 10));
+
+        case AST_VARIABLE:
+            // If the expression is a variable, use it directly as the argument
+            return variableOperand(generator, node->symbolId);
+
+        case AST_CALL: {
+            Operand result = createTempVar(ir);
+            emitInstruction(ir, OP_CALL, result, symbolOperand(node->symbolId), NO_OPERAND);
+            return result;
+        }
+
+        case AST_NEGATE: {
+            Operand value = generateExpressionCode(generator, node->firstChild);
+            Operand result = createTempVar(ir);
+            emitInstruction(ir, OP_NEG, result, value, NO_OPERAND);
+            return result;
+        }
+
+        case AST_ADD: case AST_SUB: case AST_MUL: case AST_DIV:
+        case AST_LT: case AST_GT: case AST_LE: case AST_GE: case AST_EQ: case AST_NE: {
+            // A chain like 1+1+...+1 is one left-leaning tree: walk down its left
+            // spine with an explicit stack, then lower the operators bottom-up.
+            // Right operands recurse only as deep as the source nests parentheses.
+            NodeStack* operators = &generator->operators;
+            int base = operators->count;
+            int leftNode = expressionNode;
+            while (isBinaryNode(ast->nodes[leftNode].nodeType)) {
+                pushNode(operators, leftNode);
+                leftNode = ast->nodes[leftNode].firstChild;
+            }
+            Operand result = generateExpressionCode(generator, leftNode);
+            while (operators->count > base) {
+                const TreeNode* operatorNode = &ast->nodes[operators->items[--operators->count]];
+                Operand left = result;
+                Operand right = generateExpressionCode(generator, operatorNode->lastChild);
+                result = createTempVar(ir);
+                emitInstruction(ir, binaryOperations[operatorNode->nodeType - AST_ADD], result, left, right);
+            }
+            return result;
+        }
+
+        default:
+            fprintf(stderr, "Error: Unsupported expression node type\n");
+            return constantOperand(ir, 0);
+    }
+}
+
+// Function to allocate zeroed memory for the optimizer, exiting when out of memory
+void* optimizerAlloc(size_t count, size_t size) {
+    void* memory = calloc(count == 0 ? 1 : count, size);
+    if (memory == NULL) {
+        fprintf(stderr, "Error: Out of memory in optimizer\n");
+        exit(1);
+    }
+    return memory;
+}
+
+// Function to check whether an operation ends a basic block by branching
+int isBranchOperation(int op) {
+    return op == OP_GOTO || op == OP_IF || op == OP_IF_FALSE;
+}
+
+// Function to check whether an operation only computes its result from its arguments
+int isPureOperation(int op) {
+    return (op >= OP_ADD && op <= OP_DIV) || (op >= OP_LT && op <= OP_NEG);
+}
+
+// Function to check whether an operand is a temporary
+int isTempOperand(Operand operand) {
+    return operand != NO_OPERAND && OPERAND_TAG(operand) == OPERAND_TEMP;
+}
+
+// Function to count the instructions of a function that are not NOPs
+int countInstructions(const IRFunction* ir) {
+    int count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        count += ir->code[i].op != OP_NOP;
+    }
+    return count;
+}
+
+// Function to evaluate an operation on constants; returns 0 when it must not be folded
+int foldOperation(int op, long a, long b, long* result) {
+    switch (op) {
+        case OP_ADD: *result = (long)((unsigned long)a + (unsigned long)b); return 1;
+        case OP_SUB: *result = (long)((unsigned long)a - (unsigned long)b); return 1;
+        case OP_MUL: *result = (long)((unsigned long)a * (unsigned long)b); return 1;
+        case OP_DIV:
+            if (b == 0 || (b == -1 && a == LONG_MIN)) {
+                return 0;  // Left for run time
+            }
+            *result = a / b;
+            return 1;
+        case OP_NEG: *result = (long)(0UL - (unsigned long)a); return 1;
+        case OP_LT: *result = a < b; return 1;
+        case OP_GT: *result = a > b; return 1;
+        case OP_LE: *result = a <= b; return 1;
+        case OP_GE: *result = a >= b; return 1;
+        case OP_EQ: *result = a == b; return 1;
+        case OP_NE: *result = a != b; return 1;
+        default: return 0;
+    }
+}
+
+// Function to evaluate a constant expression (numbers, negation and binary
+// operators) as the program would; returns 0 if it uses a variable or a call
+// or would trap at run time. Like the lowering, it walks down the left spine
+// of an operator chain with an explicit stack rather than recursing.
+int evaluateConstant(const AST* ast, int expressionNode, long* value) {
+    NodeStack operators = { NULL, 0, 0 };
+    int leftNode = expressionNode;
+    int constant = 0;
+    long operand;
+
+    while (isBinaryNode(ast->nodes[leftNode].nodeType)) {
+        pushNode(&operators, leftNode);
+        leftNode = ast->nodes[leftNode].firstChild;
+    }
+
+    const TreeNode* node = &ast->nodes[leftNode];
+    if (node->nodeType == AST_NUMBER) {
+        *value = strtol(symbolName(node->symbolId), NULL, 10);
+        constant = 1;
+    } else if (node->nodeType == AST_NEGATE) {
+        constant = evaluateConstant(ast, node->firstChild, &operand) && foldOperation(OP_NEG, operand, 0, value);
+    }
+    while (constant && operators.count > 0) {
+        const TreeNode* operatorNode = &ast->nodes[operators.items[--operators.count]];
+        constant = evaluateConstant(ast, operatorNode->lastChild, &operand) &&
+                   foldOperation(binaryOperations[operatorNode->nodeType - AST_ADD], *value, operand, value);
+    }
+
+    free(operators.items);
+    return constant;
+}
+
+// Basic block: a run of instructions that is only entered at its top
+typedef struct {
+    int start;             // First instruction
+    int end;               // One past the last instruction
+    int successors[2];
+    int successorCount;
+    int firstPredecessor;  // Range of this block in the graph's predecessor list
+    int predecessorCount;
+    int idom;              // Immediate dominator; the entry is its own
+    int order;             // Position in reverse postorder, -1 if unreachable
+} BasicBlock;
+
+// Control flow graph of one function
+typedef struct {
+    BasicBlock *blocks;
+    int count;
+    int *predecessors;       // Predecessor lists of all blocks, back to back in block order
+    int *reversePostorder;   // Reachable blocks only
+    int reachableCount;
+    int *domChildren;        // Dominator tree children, back to back
+    int *firstDomChild;      // Start of each block's children in domChildren (count + 1 entries)
+} ControlFlowGraph;
+
+// Function to free a control flow graph
+void freeControlFlowGraph(ControlFlowGraph* cfg) {
+    free(cfg->blocks);
+    free(cfg->predecessors);
+    free(cfg->reversePostorder);
+    free(cfg->domChildren);
+    free(cfg->firstDomChild);
+    memset(cfg, 0, sizeof(ControlFlowGraph));
+}
+
+// Function to find the dominator of two blocks (Cooper, Harvey and Kennedy)
+int intersectDominators(const BasicBlock* blocks, int a, int b) {
+    while (a != b) {
+        while (blocks[a].order > blocks[b].order) {
+            a = blocks[a].idom;
+        }
+        while (blocks[b].order > blocks[a].order) {
+            b = blocks[b].idom;
+        }
+    }
+    return a;
+}
+
+// Function to split a function into basic blocks and compute edges, reverse
+// postorder and dominators
+void buildControlFlowGraph(ControlFlowGraph* cfg, const IRFunction* ir) {
+    int count = ir->count;
+    char* leader = (char*)optimizerAlloc((size_t)count + 1, 1);
+    int* labelBlock = (int*)optimizerAlloc((size_t)ir->labelCount, sizeof(int));
+
+    memset(cfg, 0, sizeof(ControlFlowGraph));
+    leader[0] = 1;
+    for (int i = 0; i < count; i++) {
+        int op = ir->code[i].op;
+        if (op == OP_LABEL) {
+            leader[i] = 1;
+        }
+        if (isBranchOperation(op) || op == OP_RETURN) {
+            leader[i + 1] = 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        cfg->count += leader[i];
+    }
+
+    cfg->blocks = (BasicBlock*)optimizerAlloc((size_t)cfg->count, sizeof(BasicBlock));
+    for (int i = 0, b = -1; i < count; i++) {
+        if (leader[i]) {
+            b++;
+            cfg->blocks[b].start = i;
+            if (ir->code[i].op == OP_LABEL) {
+                labelBlock[OPERAND_PAYLOAD(ir->code[i].arg1)] = b;
+            }
+        }
+        cfg->blocks[b].end = i + 1;
+    }
+
+    // Successors; a conditional branch whose target is also the next block has one
+    int edgeCount = 0;
+    for (int b = 0; b < cfg->count; b++) {
+        BasicBlock* block = &cfg->blocks[b];
+        const IntermediateCode* last = &ir->code[block->end - 1];
+        int fallthrough = b + 1 < cfg->count ? b + 1 : -1;
+
+        block->successorCount = 0;
+        if (last->op == OP_GOTO) {
+            block->successors[block->successorCount++] = labelBlock[OPERAND_PAYLOAD(last->arg1)];
+        } else if (last->op == OP_IF || last->op == OP_IF_FALSE) {
+            block->successors[block->successorCount++] = labelBlock[OPERAND_PAYLOAD(last->arg2)];
+            if (fallthrough >= 0 && fallthrough != block->successors[0]) {
+                block->successors[block->successorCount++] = fallthrough;
+            }
+        } else if (last->op != OP_RETURN && fallthrough >= 0) {
+            block->successors[block->successorCount++] = fallthrough;
+        }
+        edgeCount += block->successorCount;
+        for (int s = 0; s < block->successorCount; s++) {
+            cfg->blocks[block->successors[s]].predecessorCount++;
+        }
+    }
+
+    cfg->predecessors = (int*)optimizerAlloc((size_t)edgeCount, sizeof(int));
+    for (int b = 0, offset = 0; b < cfg->count; b++) {
+        cfg->blocks[b].firstPredecessor = offset;
+        offset += cfg->blocks[b].predecessorCount;
+        cfg->blocks[b].predecessorCount = 0;
+    }
+    for (int b = 0; b < cfg->count; b++) {
+        for (int s = 0; s < cfg->blocks[b].successorCount; s++) {
+            BasicBlock* successor = &cfg->blocks[cfg->blocks[b].successors[s]];
+            cfg->predecessors[successor->firstPredecessor + successor->predecessorCount++] = b;
+        }
+    }
+
+    // Reverse postorder by an iterative depth-first search from the entry
+    int* stack = (int*)optimizerAlloc((size_t)cfg->count * 2, sizeof(int));
+    int* postorder = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    int depth = 0, visited = 0;
+    for (int b = 0; b < cfg->count; b++) {
+        cfg->blocks[b].order = -1;
+        cfg->blocks[b].idom = -1;
+    }
+    cfg->blocks[0].order = 0;  // Marks the entry as seen
+    stack[depth++] = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        int next = stack[depth - 1];
+        int b = stack[depth - 2];
+        if (next < cfg->blocks[b].successorCount) {
+            int successor = cfg->blocks[b].successors[next];
+            stack[depth - 1]++;
+            if (cfg->blocks[successor].order < 0) {
+                cfg->blocks[successor].order = 0;
+                stack[depth++] = successor;
+                stack[depth++] = 0;
+            }
+        } else {
+            postorder[visited++] = b;
+            depth -= 2;
+        }
+    }
+    cfg->reachableCount = visited;
+    cfg->reversePostorder = (int*)optimizerAlloc((size_t)visited, sizeof(int));
+    for (int i = 0; i < visited; i++) {
+        cfg->reversePostorder[i] = postorder[visited - 1 - i];
+        cfg->blocks[cfg->reversePostorder[i]].order = i;
+    }
+
+    // Dominators: iterate to a fixed point over reverse postorder
+    int changed = 1;
+    cfg->blocks[0].idom = 0;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < visited; i++) {
+            int b = cfg->reversePostorder[i];
+            const BasicBlock* block = &cfg->blocks[b];
+            int newIdom = -1;
+            for (int p = 0; p < block->predecessorCount; p++) {
+                int predecessor = cfg->predecessors[block->firstPredecessor + p];
+                if (cfg->blocks[predecessor].idom < 0) {
+                    continue;  // Unreachable or not processed yet
+                }
+                newIdom = newIdom < 0 ? predecessor : intersectDominators(cfg->blocks, predecessor, newIdom);
+            }
+            if (newIdom != block->idom) {
+                cfg->blocks[b].idom = newIdom;
+                changed = 1;
+            }
+        }
+    }
+
+    // Dominator tree as child lists
+    cfg->firstDomChild = (int*)optimizerAlloc((size_t)cfg->count + 1, sizeof(int));
+    cfg->domChildren = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    for (int b = 1; b < cfg->count; b++) {
+        if (cfg->blocks[b].idom >= 0) {
+            cfg->firstDomChild[cfg->blocks[b].idom + 1]++;
+        }
+    }
+    for (int b = 0; b < cfg->count; b++) {
+        cfg->firstDomChild[b + 1] += cfg->firstDomChild[b];
+    }
+    int* fill = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    for (int b = 1; b < cfg->count; b++) {
+        int idom = cfg->blocks[b].idom;
+        if (idom >= 0) {
+            cfg->domChildren[cfg->firstDomChild[idom] + fill[idom]++] = b;
+        }
+    }
+
+    free(fill);
+    free(stack);
+    free(postorder);
+    free(leader);
+    free(labelBlock);
+}
+
+// Phi function: result = phi(args), one argument per predecessor of its block
+typedef struct {
+    int block;
+    int variable;  // Temporary it merges before renaming
+    Operand result;
+    int firstArgument;  // Arguments live in the optimization state's phiArguments
+} PhiFunction;
+
+// State shared by the passes while one function is optimized
+typedef struct {
+    IRFunction *ir;
+    ControlFlowGraph cfg;
+    PhiFunction *phis;     // OP_PHI instructions refer to these by index in arg1
+    int phiCount;
+    Operand *phiArguments;
+    int phiArgumentCount;
+} OptimizationState;
+
+// Function to append a phi for a variable at the top of a block
+void addPhi(OptimizationState* state, int block, int variable, int* phiCapacity, int* argumentCapacity) {
+    int arguments = state->cfg.blocks[block].predecessorCount;
+
+    if (state->phiCount == *phiCapacity) {
+        *phiCapacity = *phiCapacity == 0 ? 64 : *phiCapacity * 2;
+        state->phis = (PhiFunction*)realloc(state->phis, (size_t)*phiCapacity * sizeof(PhiFunction));
+    }
+    while (state->phiArgumentCount + arguments > *argumentCapacity) {
+        *argumentCapacity = *argumentCapacity == 0 ? 256 : *argumentCapacity * 2;
+        state->phiArguments = (Operand*)realloc(state->phiArguments, (size_t)*argumentCapacity * sizeof(Operand));
+    }
+    if (state->phis == NULL || state->phiArguments == NULL) {
+        fprintf(stderr, "Error: Out of memory in optimizer\n");
+        exit(1);
+    }
+
+    PhiFunction* phi = &state->phis[state->phiCount++];
+    phi->block = block;
+    phi->variable = variable;
+    phi->result = NO_OPERAND;
+    phi->firstArgument = state->phiArgumentCount;
+    for (int i = 0; i < arguments; i++) {
+        state->phiArguments[state->phiArgumentCount++] = NO_OPERAND;
+    }
+}
+
+// Function to drop unreachable blocks so every remaining block has a dominator
+void removeUnreachableCode(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    int kept = 0;
+
+    for (int b = 0; b < state->cfg.count; b++) {
+        const BasicBlock* block = &state->cfg.blocks[b];
+        if (block->order < 0) {
+            continue;
+        }
+        for (int i = block->start; i < block->end; i++) {
+            ir->code[kept++] = ir->code[i];
+        }
+    }
+    ir->count = kept;
+    freeControlFlowGraph(&state->cfg);
+    buildControlFlowGraph(&state->cfg, ir);
+}
+
+// Function to give a new SSA version of a variable its own temporary
+Operand newVersion(IRFunction* ir, int variable) {
+    Operand version = createTempVar(ir);
+    ir->tempNames[OPERAND_PAYLOAD(version)] = ir->tempNames[variable];
+    return version;
+}
+
+// Function to compute the dominance frontier of every block; the frontier of
+// block b is frontiers[firstFrontier[b]] up to frontiers[firstFrontier[b + 1]]
+int* computeDominanceFrontiers(const ControlFlowGraph* cfg, int** firstFrontier) {
+    int* first = (int*)optimizerAlloc((size_t)cfg->count + 1, sizeof(int));
+    int* stamp = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    int* fill = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    int* frontiers = NULL;
+
+    // The first pass counts frontier entries, the second stores them
+    for (int pass = 0; pass < 2; pass++) {
+        for (int b = 0; b < cfg->count; b++) {
+            stamp[b] = -1;
+        }
+        for (int b = 0; b < cfg->count; b++) {
+            const BasicBlock* block = &cfg->blocks[b];
+            if (block->predecessorCount < 2) {
+                continue;
+            }
+            for (int p = 0; p < block->predecessorCount; p++) {
+                int runner = cfg->predecessors[block->firstPredecessor + p];
+                while (runner != block->idom) {
+                    // The stamp keeps b from being listed twice in one frontier
+                    if (stamp[runner] != b) {
+                        stamp[runner] = b;
+                        if (pass == 0) {
+                            first[runner + 1]++;
+                        } else {
+                            frontiers[first[runner] + fill[runner]++] = b;
+                        }
+                    }
+                    runner = cfg->blocks[runner].idom;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int b = 0; b < cfg->count; b++) {
+                first[b + 1] += first[b];
+            }
+            frontiers = (int*)optimizerAlloc((size_t)first[cfg->count], sizeof(int));
+        }
+    }
+
+    free(stamp);
+    free(fill);
+    *firstFrontier = first;
+    return frontiers;
+}
+
+// Function to place phis for the renamed variables on the iterated dominance
+// frontiers of the blocks that assign them
+void placePhis(OptimizationState* state, const char* renamed) {
+    IRFunction* ir = state->ir;
+    ControlFlowGraph* cfg = &state->cfg;
+    int blockCount = cfg->count, variableCount = ir->tempCount;
+    int phiCapacity = 0, argumentCapacity = 0;
+    int* firstFrontier;
+    int* frontiers = computeDominanceFrontiers(cfg, &firstFrontier);
+    int* hasPhi = (int*)optimizerAlloc((size_t)blockCount, sizeof(int));
+    int* queued = (int*)optimizerAlloc((size_t)blockCount, sizeof(int));
+    int* worklist = (int*)optimizerAlloc((size_t)blockCount, sizeof(int));
+    int* defBlocks = (int*)optimizerAlloc((size_t)ir->count, sizeof(int));
+    int* firstDef = (int*)optimizerAlloc((size_t)variableCount + 1, sizeof(int));
+    int* defFill = (int*)optimizerAlloc((size_t)variableCount, sizeof(int));
+
+    // Blocks assigning each variable, grouped by variable
+    for (int pass = 0; pass < 2; pass++) {
+        for (int b = 0; b < blockCount; b++) {
+            for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; i++) {
+                Operand result = ir->code[i].result;
+                if (!isTempOperand(result) || !renamed[OPERAND_PAYLOAD(result)]) {
+                    continue;
+                }
+                if (pass == 0) {
+                    firstDef[OPERAND_PAYLOAD(result) + 1]++;
+                } else {
+                    defBlocks[firstDef[OPERAND_PAYLOAD(result)] + defFill[OPERAND_PAYLOAD(result)]++] = b;
+                }
+            }
+        }
+        for (int v = 0; pass == 0 && v < variableCount; v++) {
+            firstDef[v + 1] += firstDef[v];
+        }
+    }
+
+    for (int b = 0; b < blockCount; b++) {
+        hasPhi[b] = queued[b] = -1;
+    }
+    for (int v = 0; v < variableCount; v++) {
+        int pending = 0;
+        for (int d = firstDef[v]; d < firstDef[v + 1]; d++) {
+            if (queued[defBlocks[d]] != v) {
+                queued[defBlocks[d]] = v;
+                worklist[pending++] = defBlocks[d];
+            }
+        }
+        while (pending > 0) {
+            int b = worklist[--pending];
+            for (int f = firstFrontier[b]; f < firstFrontier[b + 1]; f++) {
+                int target = frontiers[f];
+                if (hasPhi[target] == v) {
+                    continue;
+                }
+                hasPhi[target] = v;
+                addPhi(state, target, v, &phiCapacity, &argumentCapacity);
+                if (queued[target] != v) {
+                    queued[target] = v;
+                    worklist[pending++] = target;
+                }
+            }
+        }
+    }
+
+    free(firstFrontier);
+    free(frontiers);
+    free(hasPhi);
+    free(queued);
+    free(worklist);
+    free(defBlocks);
+    free(firstDef);
+    free(defFill);
+}
+
+// Function to convert a function to SSA form: phis are placed on the iterated
+// dominance frontiers of variables assigned more than once, then all
+// definitions are renamed in a dominator tree walk
+void buildSSA(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    ControlFlowGraph* cfg = &state->cfg;
+
+    buildControlFlowGraph(cfg, ir);
+    if (cfg->reachableCount != cfg->count) {
+        removeUnreachableCode(state);
+    }
+
+    // Locals and temporaries assigned more than once are renamed; a read of a
+    // local before any assignment becomes 0
+    int variableCount = ir->tempCount;
+    int* definitions = (int*)optimizerAlloc((size_t)variableCount, sizeof(int));
+    char* renamed = (char*)optimizerAlloc((size_t)variableCount, 1);
+    for (int i = 0; i < ir->count; i++) {
+        if (isTempOperand(ir->code[i].result)) {
+            definitions[OPERAND_PAYLOAD(ir->code[i].result)]++;
+        }
+    }
+    for (int v = 0; v < variableCount; v++) {
+        renamed[v] = definitions[v] > 1 || ir->tempNames[v] != NO_SYMBOL;
+    }
+
+    ir->firstVersion = ir->tempCount;
+    placePhis(state, renamed);
+    int blockCount = cfg->count;
+
+    // Phis grouped by block
+    int* firstPhi = (int*)optimizerAlloc((size_t)blockCount + 1, sizeof(int));
+    int* phiOrder = (int*)optimizerAlloc((size_t)state->phiCount, sizeof(int));
+    int* phiFill = (int*)optimizerAlloc((size_t)blockCount, sizeof(int));
+    for (int p = 0; p < state->phiCount; p++) {
+        firstPhi[state->phis[p].block + 1]++;
+    }
+    for (int b = 0; b < blockCount; b++) {
+        firstPhi[b + 1] += firstPhi[b];
+    }
+    for (int p = 0; p < state->phiCount; p++) {
+        int b = state->phis[p].block;
+        phiOrder[firstPhi[b] + phiFill[b]++] = p;
+    }
+
+    // Renaming: a pre-order walk of the dominator tree; current names are
+    // restored from an undo log when a subtree is left
+    Operand* current = (Operand*)optimizerAlloc((size_t)variableCount, sizeof(Operand));
+    int* undoVariable = (int*)optimizerAlloc((size_t)ir->count + (size_t)state->phiCount + 1, sizeof(int));
+    Operand* undoValue = (Operand*)optimizerAlloc((size_t)ir->count + (size_t)state->phiCount + 1, sizeof(Operand));
+    int* walk = (int*)optimizerAlloc((size_t)blockCount * 4, sizeof(int));
+    int undoCount = 0, depth = 0;
+    Operand zero = constantOperand(ir, 0);  // Value of a variable read before any assignment
+
+    for (int v = 0; v < variableCount; v++) {
+        current[v] = NO_OPERAND;
+    }
+    walk[depth++] = 0;
+    walk[depth++] = 0;
+    while (depth > 0) {
+        int mark = walk[--depth];
+        int b = walk[--depth];
+
+        if (b < 0) {
+            // Leaving a subtree
+            while (undoCount > mark) {
+                undoCount--;
+                current[undoVariable[undoCount]] = undoValue[undoCount];
+            }
+            continue;
+        }
+
+        const BasicBlock* block = &cfg->blocks[b];
+        mark = undoCount;
+        for (int p = firstPhi[b]; p < firstPhi[b + 1]; p++) {
+            PhiFunction* phi = &state->phis[phiOrder[p]];
+            phi->result = newVersion(ir, phi->variable);
+            undoVariable[undoCount] = phi->variable;
+            undoValue[undoCount++] = current[phi->variable];
+            current[phi->variable] = phi->result;
+        }
+        for (int i = block->start; i < block->end; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            Operand* uses[2] = { &instruction->arg1, &instruction->arg2 };
+            for (int u = 0; u < 2; u++) {
+                if (isTempOperand(*uses[u]) && renamed[OPERAND_PAYLOAD(*uses[u])]) {
+                    Operand name = current[OPERAND_PAYLOAD(*uses[u])];
+                    *uses[u] = name != NO_OPERAND ? name : zero;
+                }
+            }
+            if (isTempOperand(instruction->result) && renamed[OPERAND_PAYLOAD(instruction->result)]) {
+                int v = OPERAND_PAYLOAD(instruction->result);
+                instruction->result = newVersion(ir, v);
+                undoVariable[undoCount] = v;
+                undoValue[undoCount++] = current[v];
+                current[v] = instruction->result;
+            }
+        }
+        for (int s = 0; s < block->successorCount; s++) {
+            int successor = block->successors[s];
+            const BasicBlock* target = &cfg->blocks[successor];
+            int position = 0;
+            while (cfg->predecessors[target->firstPredecessor + position] != b) {
+                position++;
+            }
+            for (int p = firstPhi[successor]; p < firstPhi[successor + 1]; p++) {
+                PhiFunction* phi = &state->phis[phiOrder[p]];
+                Operand name = current[phi->variable];
+                state->phiArguments[phi->firstArgument + position] = name != NO_OPERAND ? name : zero;
+            }
+        }
+
+        walk[depth++] = -1;
+        walk[depth++] = mark;
+        for (int c = cfg->firstDomChild[b]; c < cfg->firstDomChild[b + 1]; c++) {
+            walk[depth++] = cfg->domChildren[c];
+            walk[depth++] = 0;
+        }
+    }
+
+    // Materialize the phis at the top of their blocks, after the block's label
+    IntermediateCode* code = (IntermediateCode*)optimizerAlloc((size_t)ir->count + (size_t)state->phiCount,
+                                                               sizeof(IntermediateCode));
+    int count = 0;
+    for (int b = 0; b < blockCount; b++) {
+        BasicBlock* block = &cfg->blocks[b];
+        int i = block->start;
+        int start = count;
+        if (ir->code[i].op == OP_LABEL) {
+            code[count++] = ir->code[i++];
+        }
+        for (int p = firstPhi[b]; p < firstPhi[b + 1]; p++) {
+            IntermediateCode* instruction = &code[count++];
+            instruction->op = OP_PHI;
+            instruction->result = state->phis[phiOrder[p]].result;
+            instruction->arg1 = (Operand)phiOrder[p];  // Index into state->phis, not a tagged operand
+            instruction->arg2 = NO_OPERAND;
+        }
+        while (i < block->end) {
+            code[count++] = ir->code[i++];
+        }
+        block->start = start;
+        block->end = count;
+    }
+    releaseIRCode(ir);
+    ir->code = code;
+    ir->count = count;
+    ir->capacity = count;
+
+    free(definitions);
+    free(renamed);
+    free(firstPhi);
+    free(phiOrder);
+    free(phiFill);
+    free(current);
+    free(undoVariable);
+    free(undoValue);
+    free(walk);
+}
+
+// Function to get the argument list of a phi instruction
+Operand* phiArgumentsOf(OptimizationState* state, const IntermediateCode* instruction, int* count) {
+    const PhiFunction* phi = &state->phis[instruction->arg1];
+    *count = state->cfg.blocks[phi->block].predecessorCount;
+    return &state->phiArguments[phi->firstArgument];
+}
+
+// Function to replace temporaries known to be constant and fold operations
+// whose arguments are all constant; repeats until loops settle
+void propagateConstants(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    char* known = (char*)optimizerAlloc((size_t)ir->tempCount, 1);
+    long* values = (long*)optimizerAlloc((size_t)ir->tempCount, sizeof(long));
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (int r = 0; r < state->cfg.reachableCount; r++) {
+            const BasicBlock* block = &state->cfg.blocks[state->cfg.reversePostorder[r]];
+            for (int i = block->start; i < block->end; i++) {
+                IntermediateCode* instruction = &ir->code[i];
+                long a, b, result;
+
+                if (instruction->op == OP_PHI) {
+                    int count, same = 1;
+                    Operand* arguments = phiArgumentsOf(state, instruction, &count);
+                    for (int k = 0; k < count; k++) {
+                        if (isTempOperand(arguments[k]) && known[OPERAND_PAYLOAD(arguments[k])]) {
+                            arguments[k] = constantOperand(ir, values[OPERAND_PAYLOAD(arguments[k])]);
+                        }
+                        same &= OPERAND_TAG(arguments[k]) == OPERAND_CONST && arguments[k] == arguments[0];
+                    }
+                    if (same && !known[OPERAND_PAYLOAD(instruction->result)]) {
+                        known[OPERAND_PAYLOAD(instruction->result)] = 1;
+                        values[OPERAND_PAYLOAD(instruction->result)] = ir->constants[OPERAND_PAYLOAD(arguments[0])];
+                        changed = 1;
+                    }
+                    continue;
+                }
+
+                if (isTempOperand(instruction->arg1) && known[OPERAND_PAYLOAD(instruction->arg1)]) {
+                    instruction->arg1 = constantOperand(ir, values[OPERAND_PAYLOAD(instruction->arg1)]);
+                }
+                if (isTempOperand(instruction->arg2) && known[OPERAND_PAYLOAD(instruction->arg2)]) {
+                    instruction->arg2 = constantOperand(ir, values[OPERAND_PAYLOAD(instruction->arg2)]);
+                }
+                if (!isTempOperand(instruction->result) || known[OPERAND_PAYLOAD(instruction->result)]) {
+                    continue;
+                }
+
+                if (instruction->op == OP_ASSIGN && OPERAND_TAG(instruction->arg1) == OPERAND_CONST) {
+                    result = ir->constants[OPERAND_PAYLOAD(instruction->arg1)];
+                } else if (isPureOperation(instruction->op) && OPERAND_TAG(instruction->arg1) == OPERAND_CONST &&
+                           (instruction->op == OP_NEG || OPERAND_TAG(instruction->arg2) == OPERAND_CONST)) {
+                    a = ir->constants[OPERAND_PAYLOAD(instruction->arg1)];
+                    b = instruction->op == OP_NEG ? 0 : ir->constants[OPERAND_PAYLOAD(instruction->arg2)];
+                    if (!foldOperation(instruction->op, a, b, &result)) {
+                        continue;
+                    }
+                    instruction->op = OP_ASSIGN;
+                    instruction->arg1 = constantOperand(ir, result);
+                    instruction->arg2 = NO_OPERAND;
+                } else {
+                    continue;
+                }
+                known[OPERAND_PAYLOAD(instruction->result)] = 1;
+                values[OPERAND_PAYLOAD(instruction->result)] = result;
+                changed = 1;
+            }
+        }
+    }
+
+    // Phis with a constant value become plain assignments
+    for (int i = 0; i < ir->count; i++) {
+        IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_PHI && known[OPERAND_PAYLOAD(instruction->result)]) {
+            instruction->op = OP_ASSIGN;
+            instruction->arg1 = constantOperand(ir, values[OPERAND_PAYLOAD(instruction->result)]);
+            instruction->arg2 = NO_OPERAND;
+        }
+    }
+
+    free(known);
+    free(values);
+}
+
+// Function to follow a chain of copies to the operand it started from
+Operand resolveCopy(const Operand* copyOf, Operand operand) {
+    while (isTempOperand(operand) && copyOf[OPERAND_PAYLOAD(operand)] != NO_OPERAND) {
+        operand = copyOf[OPERAND_PAYLOAD(operand)];
+    }
+    return operand;
+}
+
+// Function to replace uses of temporaries that are copies of another temporary
+// or a constant; phis whose arguments are all the same value count as copies.
+// Globals are memory and are not propagated.
+void propagateCopies(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    Operand* copyOf = (Operand*)optimizerAlloc((size_t)ir->tempCount, sizeof(Operand));
+    int changed = 1;
+
+    for (int t = 0; t < ir->tempCount; t++) {
+        copyOf[t] = NO_OPERAND;
+    }
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < ir->count; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            Operand source = NO_OPERAND;
+
+            if (!isTempOperand(instruction->result) || copyOf[OPERAND_PAYLOAD(instruction->result)] != NO_OPERAND) {
+                continue;
+            }
+            if (instruction->op == OP_ASSIGN && OPERAND_TAG(instruction->arg1) != OPERAND_SYMBOL) {
+                source = resolveCopy(copyOf, instruction->arg1);
+            } else if (instruction->op == OP_PHI) {
+                int count;
+                Operand* arguments = phiArgumentsOf(state, instruction, &count);
+                for (int k = 0; k < count; k++) {
+                    Operand argument = resolveCopy(copyOf, arguments[k]);
+                    if (argument == instruction->result || argument == source) {
+                        continue;  // A phi may merge itself around a loop
+                    }
+                    if (source != NO_OPERAND) {
+                        source = NO_OPERAND;
+                        break;
+                    }
+                    source = argument;
+                }
+            }
+            if (source != NO_OPERAND && source != instruction->result) {
+                copyOf[OPERAND_PAYLOAD(instruction->result)] = source;
+                changed = 1;
+            }
+        }
+    }
+
+    // Rewrite every use
+    for (int i = 0; i < ir->count; i++) {
+        IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_PHI) {
+            int count;
+            Operand* arguments = phiArgumentsOf(state, instruction, &count);
+            for (int k = 0; k < count; k++) {
+                arguments[k] = resolveCopy(copyOf, arguments[k]);
+            }
+            continue;
+        }
+        if (instruction->op != OP_LABEL && instruction->op != OP_GOTO) {
+            instruction->arg1 = resolveCopy(copyOf, instruction->arg1);
+            instruction->arg2 = resolveCopy(copyOf, instruction->arg2);
+        }
+    }
+
+    free(copyOf);
+}
+
+// Function to hash the expression an instruction computes
+unsigned int hashExpression(int op, Operand a, Operand b) {
+    unsigned int hash = (unsigned int)op * 0x9E3779B1u;
+    hash = (hash ^ a) * 0x85EBCA6Bu;
+    hash = (hash ^ b) * 0xC2B2AE35u;
+    return hash ^ (hash >> 15);
+}
+
+// Function to replace recomputations of an expression available from a
+// dominating instruction with copies (dominator-scoped value numbering)
+void eliminateCommonSubexpressions(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    ControlFlowGraph* cfg = &state->cfg;
+    unsigned int mask = 16;
+    while (mask < (unsigned int)ir->count * 2) {
+        mask *= 2;
+    }
+    int* table = (int*)optimizerAlloc(mask, sizeof(int));
+    int* inserted = (int*)optimizerAlloc((size_t)ir->count + 1, sizeof(int));
+    int* walk = (int*)optimizerAlloc((size_t)cfg->count * 4, sizeof(int));
+    int insertedCount = 0, depth = 0;
+
+    mask--;
+    for (unsigned int s = 0; s <= mask; s++) {
+        table[s] = -1;
+    }
+    walk[depth++] = 0;
+    walk[depth++] = 0;
+    while (depth > 0) {
+        int mark = walk[--depth];
+        int b = walk[--depth];
+
+        if (b < 0) {
+            // Expressions of a subtree stop being available outside it; they were
+            // inserted last, so removing them in reverse keeps probe chains intact
+            while (insertedCount > mark) {
+                table[inserted[--insertedCount]] = -1;
+            }
+            continue;
+        }
+
+        mark = insertedCount;
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            Operand a = instruction->arg1, c = instruction->arg2;
+
+            if (!isPureOperation(instruction->op) || !isTempOperand(instruction->result) ||
+                OPERAND_TAG(a) == OPERAND_SYMBOL || (c != NO_OPERAND && OPERAND_TAG(c) == OPERAND_SYMBOL)) {
+                continue;
+            }
+            if ((instruction->op == OP_ADD || instruction->op == OP_MUL || instruction->op == OP_EQ ||
+                 instruction->op == OP_NE) && a > c) {
+                Operand swap = a;
+                a = c;
+                c = swap;
+            }
+
+            unsigned int slot = hashExpression(instruction->op, a, c) & mask;
+            while (table[slot] >= 0) {
+                IntermediateCode* previous = &ir->code[table[slot]];
+                Operand pa = previous->arg1, pc = previous->arg2;
+                if (previous->op == OP_ADD || previous->op == OP_MUL || previous->op == OP_EQ || previous->op == OP_NE) {
+                    if (pa > pc) {
+                        Operand swap = pa;
+                        pa = pc;
+                        pc = swap;
+                    }
+                }
+                if (previous->op == instruction->op && pa == a && pc == c) {
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            if (table[slot] >= 0) {
+                instruction->op = OP_ASSIGN;
+                instruction->arg1 = ir->code[table[slot]].result;
+                instruction->arg2 = NO_OPERAND;
+            } else {
+                table[slot] = i;
+                inserted[insertedCount++] = (int)slot;
+            }
+        }
+
+        walk[depth++] = -1;
+        walk[depth++] = mark;
+        for (int k = cfg->firstDomChild[b]; k < cfg->firstDomChild[b + 1]; k++) {
+            walk[depth++] = cfg->domChildren[k];
+            walk[depth++] = 0;
+        }
+    }
+
+    free(table);
+    free(inserted);
+    free(walk);
+}
+
+// Function to turn instructions whose results are never used into NOPs.
+// Stores to globals, calls, branches, labels and returns are always kept.
+void eliminateDeadCode(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    int* definition = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    char* live = (char*)optimizerAlloc((size_t)ir->count, 1);
+    int* worklist = (int*)optimizerAlloc((size_t)ir->count + 1, sizeof(int));
+    int pending = 0;
+
+    for (int t = 0; t < ir->tempCount; t++) {
+        definition[t] = -1;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (isTempOperand(instruction->result)) {
+            definition[OPERAND_PAYLOAD(instruction->result)] = i;
+        }
+        int pure = instruction->op == OP_NOP || instruction->op == OP_PHI || isPureOperation(instruction->op) ||
+                   (instruction->op == OP_ASSIGN && isTempOperand(instruction->result));
+        if (!pure) {
+            live[i] = 1;
+            worklist[pending++] = i;
+        }
+    }
+
+    while (pending > 0) {
+        const IntermediateCode* instruction = &ir->code[worklist[--pending]];
+        Operand direct[2] = { instruction->arg1, instruction->arg2 };
+        Operand* uses = direct;
+        int count = 2;
+
+        if (instruction->op == OP_PHI) {
+            uses = phiArgumentsOf(state, instruction, &count);
+        } else if (instruction->op == OP_LABEL || instruction->op == OP_GOTO) {
+            count = 0;
+        }
+        for (int k = 0; k < count; k++) {
+            if (isTempOperand(uses[k])) {
+                int d = definition[OPERAND_PAYLOAD(uses[k])];
+                if (d >= 0 && !live[d]) {
+                    live[d] = 1;
+                    worklist[pending++] = d;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < ir->count; i++) {
+        if (!live[i]) {
+            ir->code[i].op = OP_NOP;
+        }
+    }
+
+    free(definition);
+    free(live);
+    free(worklist);
+}
+
+// Function to coalesce the copies at the end of each block with one successor
+// with the temporaries they read: a temporary defined once in the block, or in the straight line of
+// blocks leading only into it, and read only there and by one copy is renamed
+// to the copy's destination, when nothing after its definition reads the
+// destination. The definition then computes the value
+// straight into the destination and the copy disappears, which keeps the
+// versions of a loop variable in one temporary.
+void coalescePhiCopies(OptimizationState* state, IntermediateCode* copies, const int* firstCopy, Operand* rename) {
+    IRFunction* ir = state->ir;
+    ControlFlowGraph* cfg = &state->cfg;
+    int* definitions = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* uses = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* copyUses = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* usesBelow = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* seen = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* copyOf = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_NOP) {
+            continue;
+        }
+        if (isTempOperand(instruction->result)) {
+            definitions[OPERAND_PAYLOAD(instruction->result)]++;
+        }
+        if (isTempOperand(instruction->arg1)) {
+            uses[OPERAND_PAYLOAD(instruction->arg1)]++;
+        }
+        if (isTempOperand(instruction->arg2)) {
+            uses[OPERAND_PAYLOAD(instruction->arg2)]++;
+        }
+    }
+    for (int k = 0; k < firstCopy[2 * cfg->count]; k++) {
+        if (copies[k].op != OP_NOP) {
+            definitions[OPERAND_PAYLOAD(copies[k].result)]++;
+            if (isTempOperand(copies[k].arg1)) {
+                copyUses[OPERAND_PAYLOAD(copies[k].arg1)]++;
+            }
+        }
+    }
+
+    // Each block with one successor and the blocks that only lead into it are
+    // walked backwards, counting the reads below the current instruction; the
+    // copies at its end come last, so they are counted first
+    for (int b = 0; b < cfg->count; b++) {
+        if (cfg->blocks[b].successorCount != 1 || firstCopy[2 * b] == firstCopy[2 * b + 1]) {
+            continue;
+        }
+        for (int k = firstCopy[2 * b]; k < firstCopy[2 * b + 1]; k++) {
+            if (copies[k].op != OP_NOP && isTempOperand(copies[k].arg1)) {
+                int t = OPERAND_PAYLOAD(copies[k].arg1);
+                if (seen[t] != b + 1) {
+                    seen[t] = b + 1;
+                    usesBelow[t] = 0;
+                }
+                usesBelow[t]++;
+                copyOf[t] = k;
+            }
+        }
+        for (int block = b; block >= 0;) {
+            for (int i = cfg->blocks[block].end - 1; i >= cfg->blocks[block].start; i--) {
+                IntermediateCode* instruction = &ir->code[i];
+                if (instruction->op == OP_NOP) {
+                    continue;
+                }
+                if (isTempOperand(instruction->result)) {
+                    int t = OPERAND_PAYLOAD(instruction->result);
+                    if (seen[t] == b + 1 && copyUses[t] == 1 && definitions[t] == 1 && usesBelow[t] == uses[t] + 1) {
+                        IntermediateCode* copy = &copies[copyOf[t]];
+                        int destination = OPERAND_PAYLOAD(copy->result);
+                        if (seen[destination] != b + 1 || usesBelow[destination] == 0) {
+                            rename[t] = copy->result;
+                            instruction->result = copy->result;
+                            copy->op = OP_NOP;
+                        }
+                    }
+                }
+                Operand reads[2] = { instruction->arg1, instruction->arg2 };
+                for (int k = 0; k < 2; k++) {
+                    if (isTempOperand(reads[k])) {
+                        int t = OPERAND_PAYLOAD(reads[k]);
+                        if (seen[t] != b + 1) {
+                            seen[t] = b + 1;
+                            usesBelow[t] = 0;
+                        }
+                        usesBelow[t]++;
+                    }
+                }
+            }
+            const BasicBlock* current = &cfg->blocks[block];
+            int predecessor = current->predecessorCount == 1 ? cfg->predecessors[current->firstPredecessor] : b;
+            block = predecessor != b && cfg->blocks[predecessor].successorCount == 1 ? predecessor : -1;
+        }
+    }
+
+    free(definitions);
+    free(uses);
+    free(copyUses);
+    free(usesBelow);
+    free(seen);
+    free(copyOf);
+}
+
+// Function to drop NOPs from a function's instruction stream
+void compactInstructions(IRFunction* ir) {
+    int kept = 0;
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->code[i].op != OP_NOP) {
+            ir->code[kept++] = ir->code[i];
+        }
+    }
+    ir->count = kept;
+}
+
+// Function to find the web a temporary belongs to, halving the path on the way
+int findWeb(int* web, int t) {
+    while (web[t] != t) {
+        web[t] = web[web[t]];
+        t = web[t];
+    }
+    return t;
+}
+
+// Function to give each web of versions of one local one temporary when that
+// changes no value: a web is the versions that copies connect, and merging it
+// is safe when no point of the code needs two of them at once, except right at
+// a copy between them. Copies inside a merged web disappear when NOPs are
+// dropped. Liveness is walked per web from the blocks that read it first, so
+// the cost follows the size of the webs' live ranges.
+void coalesceVersions(IRFunction* ir) {
+    ControlFlowGraph cfg;
+    int tempCount = ir->tempCount;
+    int* web = NULL;
+    int* copies = NULL;
+
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_ASSIGN && isTempOperand(instruction->result) && isTempOperand(instruction->arg1)) {
+            int x = OPERAND_PAYLOAD(instruction->result), y = OPERAND_PAYLOAD(instruction->arg1);
+            if (x != y && ir->tempNames[x] != NO_SYMBOL && ir->tempNames[x] == ir->tempNames[y]) {
+                if (web == NULL) {
+                    web = (int*)optimizerAlloc((size_t)tempCount, sizeof(int));
+                    copies = (int*)optimizerAlloc((size_t)tempCount, sizeof(int));
+                    for (int t = 0; t < tempCount; t++) {
+                        web[t] = t;
+                    }
+                }
+                x = findWeb(web, x);
+                y = findWeb(web, y);
+                if (x != y) {
+                    web[y] = x;
+                    copies[x] += copies[y];
+                }
+                copies[x]++;
+            }
+        }
+    }
+
+    if (web == NULL) {
+        return;
+    }
+    for (int t = 0; t < tempCount; t++) {
+        web[t] = findWeb(web, t);
+    }
+
+    // Instructions touching each web, in code order
+    int* firstTouch = (int*)optimizerAlloc((size_t)tempCount + 1, sizeof(int));
+    int* touches = (int*)optimizerAlloc((size_t)ir->count * 3 + 1, sizeof(int));
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < ir->count; i++) {
+            const IntermediateCode* instruction = &ir->code[i];
+            int webs[3];
+            Operand operands[3] = { instruction->result, instruction->arg1, instruction->arg2 };
+            for (int k = 0; k < 3; k++) {
+                webs[k] = isTempOperand(operands[k]) ? web[OPERAND_PAYLOAD(operands[k])] : -1;
+                // An instruction can touch a web through several operands; list it once
+                if (webs[k] < 0 || copies[webs[k]] == 0 || (k > 0 && webs[k - 1] == webs[k]) ||
+                    (k == 2 && webs[0] == webs[2])) {
+                    continue;
+                }
+                int w = webs[k];
+                if (pass == 0) {
+                    firstTouch[w + 1]++;
+                } else {
+                    touches[firstTouch[w]++] = i;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int t = 0; t < tempCount; t++) {
+                firstTouch[t + 1] += firstTouch[t];
+            }
+        } else {
+            for (int t = tempCount; t > 0; t--) {
+                firstTouch[t] = firstTouch[t - 1];
+            }
+            firstTouch[0] = 0;
+        }
+    }
+
+    buildControlFlowGraph(&cfg, ir);
+    int* blockOf = (int*)optimizerAlloc((size_t)ir->count + 1, sizeof(int));
+    for (int b = 0; b < cfg.count; b++) {
+        for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++) {
+            blockOf[i] = b;
+        }
+    }
+
+    // Per block and stamped with the web: the version live on entry, the
+    // version live on exit of a block that writes the web, and whether it does
+    int* liveInMark = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* liveIn = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* liveOutMark = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* liveOut = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* writeMark = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* worklist = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* writingBlocks = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* touchEnd = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));  // Past a writing block's last touch
+    for (int b = 0; b < cfg.count; b++) {
+        liveInMark[b] = liveOutMark[b] = writeMark[b] = -1;
+    }
+
+    for (int w = 0; w < tempCount; w++) {
+        if (web[w] != w || copies[w] == 0) {
+            continue;
+        }
+        int conflict = 0, pending = 0, writing = 0;
+
+        // The version each block reads before writing the web; two different
+        // ones read before a write are live together
+        for (int n = firstTouch[w]; n < firstTouch[w + 1] && !conflict;) {
+            int b = blockOf[touches[n]];
+            int exposed = -1;
+            for (; n < firstTouch[w + 1] && blockOf[touches[n]] == b; n++) {
+                const IntermediateCode* instruction = &ir->code[touches[n]];
+                Operand reads[2] = { instruction->arg1, instruction->arg2 };
+                for (int k = 0; k < 2 && writeMark[b] != w; k++) {
+                    if (isTempOperand(reads[k]) && web[OPERAND_PAYLOAD(reads[k])] == w) {
+                        conflict |= exposed >= 0 && exposed != (int)OPERAND_PAYLOAD(reads[k]);
+                        exposed = OPERAND_PAYLOAD(reads[k]);
+                    }
+                }
+                if (isTempOperand(instruction->result) && web[OPERAND_PAYLOAD(instruction->result)] == w &&
+                    writeMark[b] != w) {
+                    writeMark[b] = w;
+                    writingBlocks[writing++] = b;
+                }
+            }
+            touchEnd[b] = n;
+            if (exposed >= 0) {
+                liveInMark[b] = w;
+                liveIn[b] = exposed;
+                worklist[pending++] = b;
+            }
+        }
+
+        // Carry each version back to the blocks it is live out of
+        while (pending > 0 && !conflict) {
+            const BasicBlock* block = &cfg.blocks[worklist[--pending]];
+            int version = liveIn[worklist[pending]];
+            for (int p = 0; p < block->predecessorCount && !conflict; p++) {
+                int predecessor = cfg.predecessors[block->firstPredecessor + p];
+                if (writeMark[predecessor] == w) {
+                    conflict = liveOutMark[predecessor] == w && liveOut[predecessor] != version;
+                    liveOutMark[predecessor] = w;
+                    liveOut[predecessor] = version;
+                } else if (liveInMark[predecessor] != w) {
+                    liveInMark[predecessor] = w;
+                    liveIn[predecessor] = version;
+                    worklist[pending++] = predecessor;
+                } else {
+                    conflict = liveIn[predecessor] != version;
+                }
+            }
+        }
+
+        // Walk the blocks that write the web backwards: a write of one version
+        // while another is live loses it, unless it copies that version
+        for (int k = 0; k < writing && !conflict; k++) {
+            int b = writingBlocks[k];
+            int live = liveOutMark[b] == w ? liveOut[b] : -1;
+            for (int n = touchEnd[b] - 1; n >= firstTouch[w] && blockOf[touches[n]] == b && !conflict; n--) {
+                const IntermediateCode* instruction = &ir->code[touches[n]];
+                if (isTempOperand(instruction->result) && web[OPERAND_PAYLOAD(instruction->result)] == w) {
+                    int version = OPERAND_PAYLOAD(instruction->result);
+                    int copiesLive = instruction->op == OP_ASSIGN && instruction->arg1 == MAKE_OPERAND(OPERAND_TEMP, live);
+                    conflict = live >= 0 && live != version && !copiesLive;
+                    if (live == version) {
+                        live = -1;
+                    }
+                }
+                Operand reads[2] = { instruction->arg1, instruction->arg2 };
+                for (int r = 0; r < 2; r++) {
+                    if (isTempOperand(reads[r]) && web[OPERAND_PAYLOAD(reads[r])] == w) {
+                        conflict |= live >= 0 && live != (int)OPERAND_PAYLOAD(reads[r]);
+                        live = OPERAND_PAYLOAD(reads[r]);
+                    }
+                }
+            }
+        }
+        if (conflict) {
+            copies[w] = 0;
+        }
+    }
+
+    // Every version of a merged web becomes its root
+    for (int i = 0; i < ir->count; i++) {
+        IntermediateCode* instruction = &ir->code[i];
+        Operand* operands[3] = { &instruction->result, &instruction->arg1, &instruction->arg2 };
+        for (int k = 0; k < 3; k++) {
+            if (isTempOperand(*operands[k])) {
+                int w = web[OPERAND_PAYLOAD(*operands[k])];
+                if (copies[w] > 0) {
+                    *operands[k] = MAKE_OPERAND(OPERAND_TEMP, w);
+                }
+            }
+        }
+        if (instruction->op == OP_ASSIGN && instruction->arg1 == instruction->result) {
+            instruction->op = OP_NOP;
+        }
+    }
+    compactInstructions(ir);
+
+    freeControlFlowGraph(&cfg);
+    free(web);
+    free(copies);
+    free(firstTouch);
+    free(touches);
+    free(blockOf);
+    free(liveInMark);
+    free(liveIn);
+    free(liveOutMark);
+    free(liveOut);
+    free(writeMark);
+    free(worklist);
+    free(writingBlocks);
+    free(touchEnd);
+}
+
+// Function to get the edge a phi copy goes on: a block's first edge is its
+// jump target or its only successor, its second the fall-through of a
+// conditional branch whose targets differ
+int copyEdge(const ControlFlowGraph* cfg, int predecessor, int block) {
+    const BasicBlock* source = &cfg->blocks[predecessor];
+    int split = source->successorCount == 2 && source->successors[0] != source->successors[1];
+    return 2 * predecessor + (split && source->successors[1] == block);
+}
+
+// Function to leave SSA form by turning phis into copies on the edges into
+// their block: at the end of a predecessor with one successor, after the
+// branch for a fall-through edge, and in a stub the branch is redirected to
+// for a taken one, so a copy only runs on its own edge. When no other phi in
+// the block reads the result and no predecessor branches to the block both
+// ways, the copies assign the result directly. Otherwise they assign a fresh
+// temporary that the phi becomes a copy of, which avoids the lost-copy and
+// swap problems. Copies are then coalesced with the temporaries they read and
+// versions of a local with each other where that is safe, and NOPs are dropped.
+void destroySSA(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    ControlFlowGraph* cfg = &state->cfg;
+    int* phiBlock = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    char* readByPhi = (char*)optimizerAlloc((size_t)ir->tempCount, 1);
+    int* firstCopy = (int*)optimizerAlloc((size_t)cfg->count * 2 + 1, sizeof(int));
+    int* copyFill = (int*)optimizerAlloc((size_t)cfg->count * 2, sizeof(int));
+    IntermediateCode* copies = (IntermediateCode*)optimizerAlloc((size_t)state->phiArgumentCount,
+                                                                 sizeof(IntermediateCode));
+
+    for (int t = 0; t < ir->tempCount; t++) {
+        phiBlock[t] = -1;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->code[i].op == OP_PHI) {
+            phiBlock[OPERAND_PAYLOAD(ir->code[i].result)] = state->phis[ir->code[i].arg1].block;
+        }
+    }
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->code[i].op == OP_PHI) {
+            int count;
+            const Operand* arguments = phiArgumentsOf(state, &ir->code[i], &count);
+            for (int k = 0; k < count; k++) {
+                if (isTempOperand(arguments[k]) &&
+                    phiBlock[OPERAND_PAYLOAD(arguments[k])] == state->phis[ir->code[i].arg1].block) {
+                    readByPhi[OPERAND_PAYLOAD(arguments[k])] = 1;
+                }
+            }
+        }
+    }
+
+    // Count the copies each edge receives, then fill them in
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < ir->count; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            if (instruction->op != OP_PHI) {
+                continue;
+            }
+            const PhiFunction* phi = &state->phis[instruction->arg1];
+            const BasicBlock* block = &cfg->blocks[phi->block];
+            Operand merged = pass == 1 ? instruction->arg2 : NO_OPERAND;
+            if (pass == 1) {
+                instruction->op = merged == instruction->result ? OP_NOP : OP_ASSIGN;
+                instruction->arg1 = merged;
+                instruction->arg2 = NO_OPERAND;
+            }
+            int direct = !readByPhi[OPERAND_PAYLOAD(instruction->result)];
+            for (int p = 0; p < block->predecessorCount; p++) {
+                int predecessor = cfg->predecessors[block->firstPredecessor + p];
+                int edge = copyEdge(cfg, predecessor, phi->block);
+                const BasicBlock* source = &cfg->blocks[predecessor];
+                direct &= source->successorCount == 1 || source->successors[0] != source->successors[1];
+                if (pass == 0) {
+                    firstCopy[edge + 1]++;
+                } else {
+                    IntermediateCode* copy = &copies[firstCopy[edge] + copyFill[edge]++];
+                    copy->result = merged;
+                    copy->arg1 = state->phiArguments[phi->firstArgument + p];
+                    copy->op = copy->arg1 == merged ? OP_NOP : OP_ASSIGN;
+                    copy->arg2 = NO_OPERAND;
+                }
+            }
+            if (pass == 0) {
+                instruction->arg2 = direct ? instruction->result : newVersion(ir, OPERAND_PAYLOAD(instruction->result));
+            }
+        }
+        if (pass == 0) {
+            for (int e = 0; e < 2 * cfg->count; e++) {
+                firstCopy[e + 1] += firstCopy[e];
+            }
+        }
+    }
+
+    Operand* rename = (Operand*)optimizerAlloc((size_t)ir->tempCount, sizeof(Operand));
+    for (int t = 0; t < ir->tempCount; t++) {
+        rename[t] = NO_OPERAND;
+    }
+    if (state->phiArgumentCount > 0) {
+        coalescePhiCopies(state, copies, firstCopy, rename);
+    }
+    for (int i = 0; i < ir->count; i++) {
+        IntermediateCode* instruction = &ir->code[i];
+        if (isTempOperand(instruction->arg1) && rename[OPERAND_PAYLOAD(instruction->arg1)] != NO_OPERAND) {
+            instruction->arg1 = rename[OPERAND_PAYLOAD(instruction->arg1)];
+        }
+        if (isTempOperand(instruction->arg2) && rename[OPERAND_PAYLOAD(instruction->arg2)] != NO_OPERAND) {
+            instruction->arg2 = rename[OPERAND_PAYLOAD(instruction->arg2)];
+        }
+    }
+
+    // Stubs of taken edges go after the last block, which ends in a jump or a return
+    IntermediateCode* code = (IntermediateCode*)optimizerAlloc((size_t)ir->count + (size_t)firstCopy[2 * cfg->count] +
+                                                               (size_t)cfg->count * 2, sizeof(IntermediateCode));
+    int* stubs = (int*)optimizerAlloc((size_t)cfg->count, sizeof(int));
+    Operand* stubLabels = (Operand*)optimizerAlloc((size_t)cfg->count, sizeof(Operand));
+    Operand* stubTargets = (Operand*)optimizerAlloc((size_t)cfg->count, sizeof(Operand));
+    int count = 0, stubCount = 0;
+    for (int b = 0; b < cfg->count; b++) {
+        const BasicBlock* block = &cfg->blocks[b];
+        int last = block->end - 1;
+        while (last >= block->start && ir->code[last].op == OP_NOP) {
+            last--;
+        }
+        int branches = last >= block->start && (isBranchOperation(ir->code[last].op) || ir->code[last].op == OP_RETURN);
+        int split = block->successorCount == 2 && block->successors[0] != block->successors[1];
+        int copyPoint = split ? -1 : branches ? last : block->end;
+
+        for (int i = block->start; i < block->end; i++) {
+            if (i == copyPoint) {
+                for (int k = firstCopy[2 * b]; k < firstCopy[2 * b + 1]; k++) {
+                    if (copies[k].op != OP_NOP) {
+                        code[count++] = copies[k];
+                    }
+                }
+            }
+            if (ir->code[i].op != OP_NOP) {
+                code[count++] = ir->code[i];
+            }
+        }
+        if (copyPoint == block->end) {
+            for (int k = firstCopy[2 * b]; k < firstCopy[2 * b + 1]; k++) {
+                if (copies[k].op != OP_NOP) {
+                    code[count++] = copies[k];
+                }
+            }
+        }
+        if (split) {
+            IntermediateCode* branch = &code[count - 1];
+            for (int k = firstCopy[2 * b + 1]; k < firstCopy[2 * b + 2]; k++) {
+                if (copies[k].op != OP_NOP) {
+                    code[count++] = copies[k];
+                }
+            }
+            for (int k = firstCopy[2 * b]; k < firstCopy[2 * b + 1]; k++) {
+                if (copies[k].op != OP_NOP) {
+                    stubs[stubCount] = b;
+                    stubTargets[stubCount] = branch->arg2;
+                    stubLabels[stubCount] = createLabel(ir);
+                    branch->arg2 = stubLabels[stubCount++];
+                    break;
+                }
+            }
+        }
+    }
+    for (int n = 0; n < stubCount; n++) {
+        int b = stubs[n];
+        IntermediateCode* label = &code[count++];
+        label->op = OP_LABEL;
+        label->result = label->arg2 = NO_OPERAND;
+        label->arg1 = stubLabels[n];
+        for (int k = firstCopy[2 * b]; k < firstCopy[2 * b + 1]; k++) {
+            if (copies[k].op != OP_NOP) {
+                code[count++] = copies[k];
+            }
+        }
+        IntermediateCode* jump = &code[count++];
+        jump->op = OP_GOTO;
+        jump->result = jump->arg2 = NO_OPERAND;
+        jump->arg1 = stubTargets[n];
+    }
+    releaseIRCode(ir);
+    ir->code = code;
+    ir->count = count;
+    ir->capacity = count;
+    coalesceVersions(ir);
+
+    free(phiBlock);
+    free(readByPhi);
+    free(rename);
+    free(stubs);
+    free(stubLabels);
+    free(stubTargets);
+    free(firstCopy);
+    free(copyFill);
+    free(copies);
+}
+
+// Function to send branches to a label that is followed by a jump straight to
+// the jump's final target; labels on or leading into a cycle of jumps keep
+// their branches. Returns whether a branch changed.
+int threadJumps(IRFunction* ir, int* forward, int* final) {
+    for (int l = 0; l < ir->labelCount; l++) {
+        forward[l] = final[l] = -1;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->code[i].op == OP_LABEL) {
+            int j = i;
+            while (j < ir->count && ir->code[j].op == OP_LABEL) {
+                j++;
+            }
+            if (j < ir->count && ir->code[j].op == OP_GOTO) {
+                forward[OPERAND_PAYLOAD(ir->code[i].arg1)] = OPERAND_PAYLOAD(ir->code[j].arg1);
+            }
+        }
+    }
+
+    // Each path of forwards is followed once, marking its labels -2 on the way
+    for (int l = 0; l < ir->labelCount; l++) {
+        int end = l;
+        while (final[end] == -1 && forward[end] >= 0) {
+            final[end] = -2;
+            end = forward[end];
+        }
+        int target = final[end] == -2 ? -1 : final[end] >= 0 ? final[end] : end;
+        final[end] = final[end] == -1 ? end : final[end];
+        for (int k = l; final[k] == -2; k = forward[k]) {
+            final[k] = target >= 0 ? target : k;
+        }
+    }
+
+    int changed = 0;
+    for (int i = 0; i < ir->count; i++) {
+        IntermediateCode* instruction = &ir->code[i];
+        Operand* target = instruction->op == OP_GOTO ? &instruction->arg1 :
+                          instruction->op == OP_IF || instruction->op == OP_IF_FALSE ? &instruction->arg2 : NULL;
+        if (target != NULL && final[OPERAND_PAYLOAD(*target)] != OPERAND_PAYLOAD(*target)) {
+            *target = MAKE_OPERAND(OPERAND_LABEL, final[OPERAND_PAYLOAD(*target)]);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// Function to resolve branches on constants, then thread jumps to jumps and
+// remove jumps to the next instruction, code after unconditional jumps and
+// labels nothing jumps to
+void foldBranches(OptimizationState* state) {
+    IRFunction* ir = state->ir;
+    int* references = (int*)optimizerAlloc((size_t)ir->labelCount, sizeof(int));
+    int* forward = (int*)optimizerAlloc((size_t)ir->labelCount, sizeof(int));
+    int* final = (int*)optimizerAlloc((size_t)ir->labelCount, sizeof(int));
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < ir->count; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            if ((instruction->op == OP_IF || instruction->op == OP_IF_FALSE) &&
+                OPERAND_TAG(instruction->arg1) == OPERAND_CONST) {
+                int taken = (ir->constants[OPERAND_PAYLOAD(instruction->arg1)] != 0) == (instruction->op == OP_IF);
+                if (taken) {
+                    instruction->op = OP_GOTO;
+                    instruction->arg1 = instruction->arg2;
+                    instruction->arg2 = NO_OPERAND;
+                } else {
+                    instruction->op = OP_NOP;
+                }
+                changed = 1;
+            }
+        }
+        compactInstructions(ir);
+        changed |= threadJumps(ir, forward, final);
+
+        for (int i = 0; i < ir->count; i++) {
+            IntermediateCode* instruction = &ir->code[i];
+            if (instruction->op == OP_GOTO) {
+                for (int j = i + 1; j < ir->count && ir->code[j].op == OP_LABEL; j++) {
+                    if (ir->code[j].arg1 == instruction->arg1) {
+                        instruction->op = OP_NOP;
+                        changed = 1;
+                        break;
+                    }
+                }
+            }
+            if (instruction->op == OP_GOTO || instruction->op == OP_RETURN) {
+                for (int j = i + 1; j < ir->count && ir->code[j].op != OP_LABEL; j++) {
+                    if (ir->code[j].op != OP_NOP) {
+                        ir->code[j].op = OP_NOP;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+
+        memset(references, 0, (size_t)ir->labelCount * sizeof(int));
+        for (int i = 0; i < ir->count; i++) {
+            const IntermediateCode* instruction = &ir->code[i];
+            if (instruction->op == OP_GOTO) {
+                references[OPERAND_PAYLOAD(instruction->arg1)]++;
+            } else if (instruction->op == OP_IF || instruction->op == OP_IF_FALSE) {
+                references[OPERAND_PAYLOAD(instruction->arg2)]++;
+            }
+        }
+        for (int i = 0; i < ir->count; i++) {
+            if (ir->code[i].op == OP_LABEL && references[OPERAND_PAYLOAD(ir->code[i].arg1)] == 0) {
+                ir->code[i].op = OP_NOP;
+                changed = 1;
+            }
+        }
+        compactInstructions(ir);
+    }
+
+    free(references);
+    free(forward);
+    free(final);
+}
+
+// Optimization pass of the pipeline
+typedef struct {
+    const char *name;
+    void (*run)(OptimizationState* state);
+} OptimizationPass;
+
+// Passes in the order they run on every function
+const OptimizationPass optimizationPipeline[] = {
+    { "ssa", buildSSA },
+    { "constprop", propagateConstants },
+    { "copyprop", propagateCopies },
+    { "cse", eliminateCommonSubexpressions },
+    { "copyprop", propagateCopies },
+    { "dce", eliminateDeadCode },
+    { "out-of-ssa", destroySSA },
+    { "branches", foldBranches }
+};
+
+#define PASS_COUNT ((int)(sizeof(optimizationPipeline) / sizeof(optimizationPipeline[0])))
+
+// Instruction counts and time of every pass, summed over the functions it ran on
+typedef struct {
+    long before[PASS_COUNT];
+    long after[PASS_COUNT];
+    double seconds[PASS_COUNT];
+    int functions;
+} PassStats;
+
+// Function to clear pass statistics
+void initPassStats(PassStats* stats) {
+    memset(stats, 0, sizeof(PassStats));
+}
+
+// Function to run the optimization pipeline on one function
+void optimizeFunction(IRFunction* ir, PassStats* stats) {
+    OptimizationState state;
+
+    memset(&state, 0, sizeof(OptimizationState));
+    state.ir = ir;
+    for (int p = 0; p < PASS_COUNT; p++) {
+        double start = nowSeconds();
+        stats->before[p] += countInstructions(ir);
+        optimizationPipeline[p].run(&state);
+        stats->after[p] += countInstructions(ir);
+        stats->seconds[p] += nowSeconds() - start;
+    }
+    stats->functions++;
+
+    freeControlFlowGraph(&state.cfg);
+    free(state.phis);
+    free(state.phiArguments);
+}
+
+// Function to optimize every function of a program
+void optimizeProgram(IRProgram* program, PassStats* stats) {
+    for (int i = 0; i < program->count; i++) {
+        optimizeFunction(&program->functions[i], stats);
+    }
+}
+
+// Function to display the instruction count change and time of each pass
+void displayPassStats(const PassStats* stats) {
+    printf("\nOptimization passes (%d functions):\n", stats->functions);
+    printf("%-12s %10s %10s %10s %10s\n", "pass", "before", "after", "delta", "time(ms)");
+    for (int p = 0; p < PASS_COUNT; p++) {
+        printf("%-12s %10ld %10ld %+10ld %10.3f\n", optimizationPipeline[p].name, stats->before[p], stats->after[p],
+               stats->after[p] - stats->before[p], stats->seconds[p] * 1e3);
+    }
+}
+
+// Function to dump the pass statistics as a JSON array
+void jsonPassStats(OutputBuffer* json, const PassStats* stats) {
+    bufferPuts(json, "[");
+    for (int p = 0; p < PASS_COUNT; p++) {
+        bufferPrintf(json, "%s{\"pass\":\"%s\",\"before\":%ld,\"after\":%ld,\"seconds\":%.9f}", p == 0 ? "" : ",",
+                     optimizationPipeline[p].name, stats->before[p], stats->after[p], stats->seconds[p]);
+    }
+    bufferPuts(json, "]");
+}
+
+// Machine registers the allocator hands out. The first CALLEE_SAVED_COUNT keep
+// their value across calls; the others are cheaper but clobbered by a call
+const char *registerNames[] = { "rbx", "r12", "r13", "r14", "r15", "rsi", "rdi", "r8", "r9" };
+#define REGISTER_COUNT 9
+#define CALLEE_SAVED_COUNT 5
+#define CALLEE_SAVED_MASK ((1u << CALLEE_SAVED_COUNT) - 1)
+#define ALL_REGISTERS_MASK ((1u << REGISTER_COUNT) - 1)
+
+// Registers kept out of allocation to reload spilled arguments and hold spilled results
+const char *scratchRegisterNames[] = { "r10", "r11" };
+
+// Live range of a temporary as one interval over instruction positions:
+// instruction i reads its arguments at 2 * i and writes its result at 2 * i + 1
+typedef struct {
+    int temp;
+    int start;
+    int end;
+    int crossesCall;  // Live while a call clobbers the caller-saved registers
+} LiveInterval;
+
+// Allocator figures of one function
+typedef struct {
+    int name;
+    int instructions;
+    int intervals;
+    int spilled;      // Temporaries that live in a stack slot
+    int coalesced;    // Copies whose source and destination share a register
+    double seconds;
+} AllocationStats;
+
+// Location of every temporary of one function
+typedef struct {
+    int *location;               // Register index, or -(slot + 1) for a stack slot
+    int capacity;
+    int spillSlots;
+    unsigned int usedRegisters;  // Bit per entry of registerNames
+    AllocationStats stats;
+} RegisterAllocation;
+
+// Allocator figures of every function of a program
+typedef struct {
+    AllocationStats *functions;
+    int count;
+    int capacity;
+} AllocationReport;
+
+// Function to create an empty register allocation
+void initRegisterAllocation(RegisterAllocation* allocation) {
+    memset(allocation, 0, sizeof(RegisterAllocation));
+}
+
+// Function to free a register allocation
+void freeRegisterAllocation(RegisterAllocation* allocation) {
+    free(allocation->location);
+    initRegisterAllocation(allocation);
+}
+
+// Function to create an empty allocation report
+void initAllocationReport(AllocationReport* report) {
+    report->functions = NULL;
+    report->count = 0;
+    report->capacity = 0;
+}
+
+// Function to append the figures of one function to a report
+void addAllocationStats(AllocationReport* report, const AllocationStats* stats) {
+    if (report->count == report->capacity) {
+        report->capacity = report->capacity == 0 ? 16 : report->capacity * 2;
+        report->functions = (AllocationStats*)realloc(report->functions,
+                                                      (size_t)report->capacity * sizeof(AllocationStats));
+        if (report->functions == NULL) {
+            fprintf(stderr, "Error: Out of memory for allocation report\n");
+            exit(1);
+        }
+    }
+    report->functions[report->count++] = *stats;
+}
+
+// Function to free an allocation report
+void freeAllocationReport(AllocationReport* report) {
+    free(report->functions);
+    initAllocationReport(report);
+}
+
+// Function to widen a temporary's interval to cover a position
+void extendInterval(LiveInterval* intervals, int temp, int position) {
+    if (position < intervals[temp].start) {
+        intervals[temp].start = position;
+    }
+    if (position > intervals[temp].end) {
+        intervals[temp].end = position;
+    }
+}
+
+// Function to order intervals by start position for the linear scan
+int compareIntervalStarts(const void* a, const void* b) {
+    const LiveInterval* left = (const LiveInterval*)a;
+    const LiveInterval* right = (const LiveInterval*)b;
+    if (left->start != right->start) {
+        return left->start < right->start ? -1 : 1;
+    }
+    return left->temp - right->temp;
+}
+
+// Function to coalesce copies out of the way: when a temporary is used only by
+// a copy right after its single definition, the definition can write the
+// copy's destination directly, so both share one representative temporary
+void coalesceCopies(const IRFunction* ir, int* representative) {
+    int* definitions = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* uses = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+
+    for (int t = 0; t < ir->tempCount; t++) {
+        representative[t] = t;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (isTempOperand(instruction->result)) {
+            definitions[OPERAND_PAYLOAD(instruction->result)]++;
+        }
+        if (isTempOperand(instruction->arg1)) {
+            uses[OPERAND_PAYLOAD(instruction->arg1)]++;
+        }
+        if (isTempOperand(instruction->arg2)) {
+            uses[OPERAND_PAYLOAD(instruction->arg2)]++;
+        }
+    }
+
+    // Walking backwards lets a chain of copies collapse onto its last destination
+    for (int i = ir->count - 2; i >= 0; i--) {
+        const IntermediateCode* definition = &ir->code[i];
+        const IntermediateCode* copy = &ir->code[i + 1];
+        if (copy->op == OP_ASSIGN && isTempOperand(copy->result) && copy->arg1 == definition->result &&
+            isTempOperand(definition->result) && copy->result != definition->result) {
+            int t = OPERAND_PAYLOAD(definition->result);
+            if (definitions[t] == 1 && uses[t] == 1) {
+                representative[t] = representative[OPERAND_PAYLOAD(copy->result)];
+            }
+        }
+    }
+
+    free(definitions);
+    free(uses);
+}
+
+// Function to get the temporary an operand is allocated as, -1 if it is not a temporary
+int allocatedTemp(const int* representative, Operand operand) {
+    return isTempOperand(operand) ? representative[OPERAND_PAYLOAD(operand)] : -1;
+}
+
+// Function to widen the intervals of the temporaries one instruction reads and writes
+void extendIntervalsOfInstruction(LiveInterval* intervals, const int* representative,
+                                  const IntermediateCode* instruction, int position) {
+    if (isTempOperand(instruction->arg1)) {
+        extendInterval(intervals, allocatedTemp(representative, instruction->arg1), 2 * position);
+    }
+    if (isTempOperand(instruction->arg2)) {
+        extendInterval(intervals, allocatedTemp(representative, instruction->arg2), 2 * position);
+    }
+    if (isTempOperand(instruction->result)) {
+        extendInterval(intervals, allocatedTemp(representative, instruction->result), 2 * position + 1);
+    }
+}
+
+// Function to compute the live interval of every representative temporary.
+// Liveness is solved per temporary by walking backwards from the blocks that
+// read it before writing it until its definitions are reached, so the cost
+// follows the size of the live ranges instead of blocks times temporaries.
+// Returns the number of temporaries that occur in the code, sorted by start.
+int buildLiveIntervals(const IRFunction* ir, const int* representative, LiveInterval* intervals) {
+    ControlFlowGraph cfg;
+    int tempCount = ir->tempCount;
+
+    buildControlFlowGraph(&cfg, ir);
+    int* firstUse = (int*)optimizerAlloc((size_t)tempCount + 1, sizeof(int));
+    int* firstDef = (int*)optimizerAlloc((size_t)tempCount + 1, sizeof(int));
+    int* useBlocks = (int*)optimizerAlloc((size_t)ir->count * 2, sizeof(int));
+    int* defBlocks = (int*)optimizerAlloc((size_t)ir->count, sizeof(int));
+    int* useStamp = (int*)optimizerAlloc((size_t)tempCount, sizeof(int));
+    int* defStamp = (int*)optimizerAlloc((size_t)tempCount, sizeof(int));
+    int* liveInMark = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* defMark = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+    int* worklist = (int*)optimizerAlloc((size_t)cfg.count, sizeof(int));
+
+    for (int t = 0; t < tempCount; t++) {
+        intervals[t].temp = t;
+        intervals[t].start = INT_MAX;
+        intervals[t].end = -1;
+        intervals[t].crossesCall = 0;
+    }
+
+    // Blocks with an upward-exposed read and blocks with a definition of each
+    // temporary; the first pass counts them, the second stores them by temporary
+    for (int pass = 0; pass < 2; pass++) {
+        for (int t = 0; t < tempCount; t++) {
+            useStamp[t] = defStamp[t] = -1;
+        }
+        for (int b = 0; b < cfg.count; b++) {
+            for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++) {
+                const IntermediateCode* instruction = &ir->code[i];
+                int arguments[2] = { allocatedTemp(representative, instruction->arg1),
+                                     allocatedTemp(representative, instruction->arg2) };
+                int t = allocatedTemp(representative, instruction->result);
+                for (int k = 0; k < 2; k++) {
+                    int u = arguments[k];
+                    // Stamps hold the last block that recorded the temporary
+                    if (u >= 0 && useStamp[u] != b && defStamp[u] != b) {
+                        useStamp[u] = b;
+                        if (pass == 0) {
+                            firstUse[u + 1]++;
+                        } else {
+                            useBlocks[firstUse[u]++] = b;
+                        }
+                    }
+                }
+                if (t >= 0 && defStamp[t] != b) {
+                    defStamp[t] = b;
+                    if (pass == 0) {
+                        firstDef[t + 1]++;
+                    } else {
+                        defBlocks[firstDef[t]++] = b;
+                    }
+                }
+                if (pass == 1) {
+                    extendIntervalsOfInstruction(intervals, representative, instruction, i);
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int t = 0; t < tempCount; t++) {
+                firstUse[t + 1] += firstUse[t];
+                firstDef[t + 1] += firstDef[t];
+            }
+        } else {
+            // The fill advanced each start to the next temporary's; shift them back
+            for (int t = tempCount; t > 0; t--) {
+                firstUse[t] = firstUse[t - 1];
+                firstDef[t] = firstDef[t - 1];
+            }
+            firstUse[0] = firstDef[0] = 0;
+        }
+    }
+
+    for (int b = 0; b < cfg.count; b++) {
+        liveInMark[b] = defMark[b] = -1;
+    }
+    for (int t = 0; t < tempCount; t++) {
+        int pending = 0;
+        for (int d = firstDef[t]; d < firstDef[t + 1]; d++) {
+            defMark[defBlocks[d]] = t;
+        }
+        for (int u = firstUse[t]; u < firstUse[t + 1]; u++) {
+            int b = useBlocks[u];
+            if (liveInMark[b] != t) {
+                liveInMark[b] = t;
+                extendInterval(intervals, t, 2 * cfg.blocks[b].start);
+                worklist[pending++] = b;
+            }
+        }
+        while (pending > 0) {
+            const BasicBlock* block = &cfg.blocks[worklist[--pending]];
+            for (int p = 0; p < block->predecessorCount; p++) {
+                int predecessor = cfg.predecessors[block->firstPredecessor + p];
+                // Live-out values stay live up to the first read of the next block
+                extendInterval(intervals, t, 2 * cfg.blocks[predecessor].end);
+                if (defMark[predecessor] != t && liveInMark[predecessor] != t) {
+                    liveInMark[predecessor] = t;
+                    extendInterval(intervals, t, 2 * cfg.blocks[predecessor].start);
+                    worklist[pending++] = predecessor;
+                }
+            }
+        }
+    }
+
+    // An interval crosses a call when it is live both before and after it
+    int* callsBefore = (int*)optimizerAlloc((size_t)ir->count + 1, sizeof(int));
+    for (int i = 0; i < ir->count; i++) {
+        callsBefore[i + 1] = callsBefore[i] + (ir->code[i].op == OP_CALL);
+    }
+    int count = 0;
+    for (int t = 0; t < ir->tempCount; t++) {
+        if (intervals[t].end < 0) {
+            continue;
+        }
+        int first = (intervals[t].start + 1) / 2;
+        int last = intervals[t].end / 2 - 1;
+        intervals[t].crossesCall = last >= first && callsBefore[last + 1] > callsBefore[first];
+        intervals[count++] = intervals[t];
+    }
+    qsort(intervals, (size_t)count, sizeof(LiveInterval), compareIntervalStarts);
+
+    free(callsBefore);
+    free(firstUse);
+    free(firstDef);
+    free(useBlocks);
+    free(defBlocks);
+    free(useStamp);
+    free(defStamp);
+    free(liveInMark);
+    free(defMark);
+    free(worklist);
+    freeControlFlowGraph(&cfg);
+    return count;
+}
+
+// Function to assign registers to the temporaries of a function by linear scan
+// (Poletto and Sarkar) after coalescing copies. A copy's destination also prefers
+// its source's register so the move disappears; when registers run out, the
+// interval ending last is spilled.
+void allocateRegisters(const IRFunction* ir, RegisterAllocation* allocation) {
+    double start = nowSeconds();
+    LiveInterval* intervals = (LiveInterval*)optimizerAlloc((size_t)ir->tempCount, sizeof(LiveInterval));
+    int* hint = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int* representative = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int active[REGISTER_COUNT];  // Intervals holding a register, by index into intervals
+    int activeCount = 0;
+    unsigned int freeRegisters = ALL_REGISTERS_MASK;
+
+    if (allocation->capacity < ir->tempCount) {
+        free(allocation->location);
+        allocation->capacity = ir->tempCount;
+        allocation->location = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    }
+    if (ir->tempCount > 0) {
+        memset(allocation->location, 0, (size_t)ir->tempCount * sizeof(int));
+    }
+    allocation->spillSlots = 0;
+    allocation->usedRegisters = 0;
+    memset(&allocation->stats, 0, sizeof(AllocationStats));
+    allocation->stats.name = ir->name;
+    allocation->stats.instructions = ir->count;
+
+    coalesceCopies(ir, representative);
+    for (int t = 0; t < ir->tempCount; t++) {
+        hint[t] = -1;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_ASSIGN && isTempOperand(instruction->result) && isTempOperand(instruction->arg1)) {
+            hint[allocatedTemp(representative, instruction->result)] = allocatedTemp(representative, instruction->arg1);
+        }
+    }
+
+    int count = ir->count > 0 ? buildLiveIntervals(ir, representative, intervals) : 0;
+    for (int n = 0; n < count; n++) {
+        const LiveInterval* current = &intervals[n];
+        unsigned int allowed = current->crossesCall ? CALLEE_SAVED_MASK : ALL_REGISTERS_MASK;
+        int chosen = -1;
+
+        // Intervals that ended before this one starts give their registers back
+        for (int a = 0; a < activeCount; a++) {
+            if (intervals[active[a]].end < current->start) {
+                freeRegisters |= 1u << allocation->location[intervals[active[a]].temp];
+                active[a--] = active[--activeCount];
+            }
+        }
+
+        if (hint[current->temp] >= 0 && allocation->location[hint[current->temp]] >= 0) {
+            int preferred = allocation->location[hint[current->temp]];
+            if (freeRegisters & allowed & (1u << preferred)) {
+                chosen = preferred;
+            }
+        }
+        if (chosen < 0 && (freeRegisters & allowed) != 0) {
+            // Caller-saved registers first so the callee-saved ones stay for values live across calls
+            for (int r = REGISTER_COUNT - 1; r >= 0 && chosen < 0; r--) {
+                if (freeRegisters & allowed & (1u << r)) {
+                    chosen = r;
+                }
+            }
+        }
+        if (chosen < 0) {
+            // Spill whichever usable interval ends last: the current one or an active one
+            int victim = -1;
+            for (int a = 0; a < activeCount; a++) {
+                const LiveInterval* candidate = &intervals[active[a]];
+                if ((allowed & (1u << allocation->location[candidate->temp])) &&
+                    (victim < 0 || candidate->end > intervals[active[victim]].end)) {
+                    victim = a;
+                }
+            }
+            if (victim >= 0 && intervals[active[victim]].end > current->end) {
+                int spilledTemp = intervals[active[victim]].temp;
+                chosen = allocation->location[spilledTemp];
+                allocation->location[spilledTemp] = -(++allocation->spillSlots);
+                active[victim] = active[--activeCount];
+                freeRegisters |= 1u << chosen;
+            } else {
+                allocation->location[current->temp] = -(++allocation->spillSlots);
+                continue;
+            }
+        }
+
+        allocation->location[current->temp] = chosen;
+        allocation->usedRegisters |= 1u << chosen;
+        freeRegisters &= ~(1u << chosen);
+        active[activeCount++] = n;
+    }
+
+    for (int t = 0; t < ir->tempCount; t++) {
+        allocation->location[t] = allocation->location[representative[t]];
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        if (instruction->op == OP_ASSIGN && isTempOperand(instruction->result) && isTempOperand(instruction->arg1) &&
+            allocation->location[OPERAND_PAYLOAD(instruction->result)] >= 0 &&
+            allocation->location[OPERAND_PAYLOAD(instruction->result)] ==
+                allocation->location[OPERAND_PAYLOAD(instruction->arg1)]) {
+            allocation->stats.coalesced++;
+        }
+    }
+    allocation->stats.intervals = count;
+    allocation->stats.spilled = allocation->spillSlots;
+    allocation->stats.seconds = nowSeconds() - start;
+
+    free(intervals);
+    free(hint);
+    free(representative);
+}
+
+// Function to display the allocator figures of every function
+void displayAllocationReport(const AllocationReport* report) {
+    printf("\nRegister allocation (%d registers):\n", REGISTER_COUNT);
+    printf("%-16s %10s %10s %10s %10s %10s\n", "function", "instrs", "intervals", "spilled", "coalesced", "time(ms)");
+    for (int i = 0; i < report->count; i++) {
+        const AllocationStats* stats = &report->functions[i];
+        printf("%-16s %10d %10d %10d %10d %10.3f\n", symbolName(stats->name), stats->instructions, stats->intervals,
+               stats->spilled, stats->coalesced, stats->seconds * 1e3);
+    }
+}
+
+// Function to dump the allocator figures as a JSON array
+void jsonAllocationReport(OutputBuffer* json, const AllocationReport* report) {
+    bufferPuts(json, "[");
+    for (int i = 0; i < report->count; i++) {
+        const AllocationStats* stats = &report->functions[i];
+        bufferPrintf(json, "%s{\"function\":", i == 0 ? "" : ",");
+        bufferAppendJsonString(json, symbolName(stats->name), strlen(symbolName(stats->name)));
+        bufferPrintf(json, ",\"instructions\":%d,\"intervals\":%d,\"spilled\":%d,\"coalesced\":%d,\"seconds\":%.9f}",
+                     stats->instructions, stats->intervals, stats->spilled, stats->coalesced, stats->seconds);
+    }
+    bufferPuts(json, "]");
+}
+
+// Function to generate assembly code into an output buffer; allocator figures
+// are added to report when it is not NULL
+void generateAssemblyCode(OutputBuffer* out, const IRProgram* program, AllocationReport* report);
+
+// Function to generate the assembly of one function (or of the global
+// initializers, which have no allocation and address variables by name)
+void generateFunctionAssembly(OutputBuffer* out, const IRFunction* ir, const RegisterAllocation* allocation);
+
+// Assembly mnemonics of the comparison operations, indexed by op - OP_LT
+const char *compareMnemonics[] = { "CMPLT", "CMPGT", "CMPLE", "CMPGE", "CMPEQ", "CMPNE" };
+
+void generateAssemblyCode(OutputBuffer* out, const IRProgram* program, AllocationReport* report) {
+    RegisterAllocation allocation;
+
+    initRegisterAllocation(&allocation);
+    generateFunctionAssembly(out, &program->globals, NULL);
+    for (int i = 0; i < program->count; i++) {
+        allocateRegisters(&program->functions[i], &allocation);
+        generateFunctionAssembly(out, &program->functions[i], &allocation);
+        if (report != NULL) {
+            addAllocationStats(report, &allocation.stats);
+        }
+    }
+    freeRegisterAllocation(&allocation);
+}
+
+// Function to format a spill slot of the stack frame
+const char* spillSlotText(int location, char buffer[OPERAND_TEXT_SIZE]) {
+    snprintf(buffer, OPERAND_TEXT_SIZE, "[sp+%d]", (-location - 1) * 8);
+    return buffer;
+}
+
+// Function to format an argument for the assembly; a spilled temporary is
+// first reloaded into the given scratch register
+const char* argumentText(OutputBuffer* out, const IRFunction* ir, const RegisterAllocation* allocation,
+                         Operand operand, int scratch, char buffer[OPERAND_TEXT_SIZE]) {
+    if (allocation == NULL || !isTempOperand(operand)) {
+        return operandText(ir, operand, buffer);
+    }
+    int location = allocation->location[OPERAND_PAYLOAD(operand)];
+    if (location >= 0) {
+        return registerNames[location];
+    }
+    bufferPrintf(out, "LOAD %s, %s\n", scratchRegisterNames[scratch], spillSlotText(location, buffer));
+    return scratchRegisterNames[scratch];
+}
+
+// Function to emit the register restores and frame release in front of a return
+void emitFunctionEpilogue(OutputBuffer* out, const RegisterAllocation* allocation) {
+    if (allocation->spillSlots > 0) {
+        bufferPrintf(out, "ADD sp, sp, %d\n", allocation->spillSlots * 8);
+    }
+    for (int r = CALLEE_SAVED_COUNT - 1; r >= 0; r--) {
+        if (allocation->usedRegisters & (1u << r)) {
+            bufferPrintf(out, "POP %s\n", registerNames[r]);
+        }
+    }
+}
+
+void generateFunctionAssembly(OutputBuffer* out, const IRFunction* ir, const RegisterAllocation* allocation) {
+    char result[OPERAND_TEXT_SIZE], arg1[OPERAND_TEXT_SIZE], arg2[OPERAND_TEXT_SIZE];
+
+    if (ir->name != NO_SYMBOL) {
+        bufferPrintf(out, "%s:\n", symbolName(ir->name));
+    }
+    if (allocation != NULL) {
+        // Callee-saved registers in use are preserved, then the spill slots are reserved
+        for (int r = 0; r < CALLEE_SAVED_COUNT; r++) {
+            if (allocation->usedRegisters & (1u << r)) {
+                bufferPrintf(out, "PUSH %s\n", registerNames[r]);
+            }
+        }
+        if (allocation->spillSlots > 0) {
+            bufferPrintf(out, "SUB sp, sp, %d\n", allocation->spillSlots * 8);
+        }
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        const char* arg1Text = argumentText(out, ir, allocation, instruction->arg1, 0, arg1);
+        const char* arg2Text = argumentText(out, ir, allocation, instruction->arg2, 1, arg2);
+        const char* resultText;
+        int resultLocation = 0;
+
+        // A spilled result is computed into a scratch register and stored afterwards
+        if (allocation != NULL && isTempOperand(instruction->result)) {
+            resultLocation = allocation->location[OPERAND_PAYLOAD(instruction->result)];
+            resultText = resultLocation >= 0 ? registerNames[resultLocation] : scratchRegisterNames[0];
+            if (instruction->op == OP_ASSIGN && resultLocation >= 0 && resultText == arg1Text) {
+                continue;  // Coalesced copy
+            }
+        } else {
+            resultText = operandText(ir, instruction->result, result);
+        }
+        if (allocation != NULL && instruction->op == OP_RETURN) {
+            // The value moves out of a callee-saved register before the epilogue restores it
+            int location = isTempOperand(instruction->arg1) ? allocation->location[OPERAND_PAYLOAD(instruction->arg1)] : -1;
+            if (location >= 0 && location < CALLEE_SAVED_COUNT) {
+                bufferPrintf(out, "MOV %s, %s\n", scratchRegisterNames[0], arg1Text);
+                arg1Text = scratchRegisterNames[0];
+            }
+            emitFunctionEpilogue(out, allocation);
+        }
+
+        switch (instruction->op) {
+            case OP_ASSIGN:
+                bufferPrintf(out, "MOV %s, %s\n", resultText, arg1Text);
+                break;
+            case OP_ADD:
+                bufferPrintf(out, "ADD %s, %s, %s\n", resultText, arg1Text, arg2Text);
+                break;
+            case OP_SUB:
+                bufferPrintf(out, "SUB %s, %s, %s\n", resultText, arg1Text, arg2Text);
+                break;
+            case OP_MUL:
+                bufferPrintf(out, "MUL %s, %s, %s\n", resultText, arg1Text, arg2Text);
+                break;
+            case OP_DIV:
+                bufferPrintf(out, "DIV %s, %s, %s\n", resultText, arg1Text, arg2Text);
+                break;
+            case OP_NEG:
+                bufferPrintf(out, "NEG %s, %s\n", resultText, arg1Text);
+                break;
+            case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+                bufferPrintf(out, "%s %s, %s, %s\n", compareMnemonics[instruction->op - OP_LT], resultText, arg1Text,
+                             arg2Text);
+                break;
+            case OP_LABEL:
+                bufferPrintf(out, "%s:\n", arg1Text);
+                break;
+            case OP_GOTO:
+                bufferPrintf(out, "JMP %s\n", arg1Text);
+                break;
+            case OP_IF:
+                bufferPrintf(out, "JNZ %s, %s\n", arg1Text, arg2Text);
+                break;
+            case OP_IF_FALSE:
+                bufferPrintf(out, "JZ %s, %s\n", arg1Text, arg2Text);
+                break;
+            case OP_CALL:
+                bufferPrintf(out, "CALL %s, %s\n", resultText, arg1Text);
+                break;
+            case OP_RETURN:
+                bufferPrintf(out, "RET %s\n", arg1Text);
+                break;
+            // Add more cases for other operations as needed
+            default:
+                bufferPrintf(out, "Unknown operation\n");
+                break;
+        }
+        if (resultLocation < 0) {
+            bufferPrintf(out, "STORE %s, %s\n", spillSlotText(resultLocation, result), resultText);
+        }
+    }
+}
+
+// Hardware numbers of the x86-64 registers the backend names directly
+enum {
+    X86_RAX = 0,
+    X86_RCX = 1,
+    X86_RDX = 2,
+    X86_RSP = 4
+};
+
+// Register names by hardware number, in 64-, 32- and 8-bit width
+const char *x86RegisterNames[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+const char *x86RegisterNames32[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+const char *x86RegisterNames8[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+
+// Hardware numbers of the allocatable registers (see registerNames) and of the scratch registers
+const int registerNumbers[] = { 3, 12, 13, 14, 15, 6, 7, 8, 9 };
+const int scratchRegisterNumbers[] = { 10, 11 };
+
+// Condition codes as encoded in jcc and setcc; a code with its low bit flipped is its negation
+const char *conditionSuffixes[] = { "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g" };
+
+// Condition codes of the comparisons, indexed by op - OP_LT
+const int comparisonConditions[] = { 0xC, 0xF, 0xE, 0xD, 0x4, 0x5 };
+
+// Kinds of x86-64 operands
+enum {
+    X86_NONE,
+    X86_REGISTER,   // value is the hardware register number
+    X86_STACK,      // value is the offset from %rsp
+    X86_GLOBAL,     // value is the symbol id of a global variable, addressed relative to %rip
+    X86_IMMEDIATE,
+    X86_LABEL,      // value is the label number within the function
+    X86_FUNCTION    // value is the symbol id of a call target
+};
+
+// Operand of an x86-64 instruction
+typedef struct {
+    int kind;
+    long value;
+} X86Operand;
+
+// x86-64 instructions the backend selects
+enum {
+    X86_MOVQ,
+    X86_MOVABSQ,
+    X86_ADDQ,
+    X86_SUBQ,
+    X86_IMULQ,
+    X86_CQTO,
+    X86_IDIVQ,
+    X86_NEGQ,
+    X86_CMPQ,
+    X86_JMP,
+    X86_JCC,
+    X86_SETCC,
+    X86_MOVZBQ,
+    X86_XORL,
+    X86_CALL,
+    X86_RET,
+    X86_PUSHQ,
+    X86_POPQ,
+    X86_PLACE_LABEL  // Not an instruction: defines the label in destination
+};
+
+// Mnemonics of the instructions, indexed by op; jcc and setcc take the condition as suffix
+const char *x86Mnemonics[] = {
+    "movq", "movabsq", "addq", "subq", "imulq", "cqto", "idivq", "negq", "cmpq", "jmp", "j", "set", "movzbq",
+    "xorl", "call", "ret", "pushq", "popq", NULL
+};
+
+// One x86-64 instruction, kept until the peephole pass has run; the text
+// writer and the machine code encoder both start from this form
+typedef struct {
+    int op;
+    int condition;  // Condition code of jcc and setcc
+    X86Operand source;
+    X86Operand destination;
+} X86Instruction;
+
+// Selected instructions of one function
+typedef struct {
+    X86Instruction *code;
+    int count;
+    int capacity;
+    const IRFunction *ir;
+    const RegisterAllocation *allocation;
+    int frameSize;    // Bytes reserved below the saved registers
+} X86Function;
+
+const X86Operand noX86Operand = { X86_NONE, 0 };
+
+// Function to make an operand of the given kind
+X86Operand x86Operand(int kind, long value) {
+    X86Operand operand = { kind, value };
+    return operand;
+}
+
+// Function to check whether two operands are the same
+int sameX86Operand(X86Operand a, X86Operand b) {
+    return a.kind == b.kind && a.value == b.value;
+}
+
+// Function to check whether an operand addresses memory
+int isX86Memory(X86Operand operand) {
+    return operand.kind == X86_STACK || operand.kind == X86_GLOBAL;
+}
+
+// Function to append an instruction
+void emitX86(X86Function* function, int op, X86Operand source, X86Operand destination) {
+    if (function->count == function->capacity) {
+        function->capacity = function->capacity == 0 ? INITIAL_IR_CAPACITY : function->capacity * 2;
+        function->code = (X86Instruction*)realloc(function->code, (size_t)function->capacity * sizeof(X86Instruction));
+        if (function->code == NULL) {
+            fprintf(stderr, "Error: Out of memory for assembly\n");
+            exit(1);
+        }
+    }
+
+    X86Instruction* instruction = &function->code[function->count++];
+    instruction->op = op;
+    instruction->condition = 0;
+    instruction->source = source;
+    instruction->destination = destination;
+}
+
+// Function to append a conditional jump or set
+void emitX86Conditional(X86Function* function, int op, int condition, X86Operand destination) {
+    emitX86(function, op, noX86Operand, destination);
+    function->code[function->count - 1].condition = condition;
+}
+
+// Function to translate an IR operand. Constants that do not fit an immediate
+// are first loaded into the given scratch register.
+X86Operand x86IROperand(X86Function* function, Operand operand, int scratch) {
+    const IRFunction* ir = function->ir;
+
+    switch (OPERAND_TAG(operand)) {
+        case OPERAND_SYMBOL:
+            return x86Operand(X86_GLOBAL, OPERAND_PAYLOAD(operand));
+        case OPERAND_TEMP: {
+            int location = function->allocation->location[OPERAND_PAYLOAD(operand)];
+            if (location >= 0) {
+                return x86Operand(X86_REGISTER, registerNumbers[location]);
+            }
+            return x86Operand(X86_STACK, (-location - 1) * 8);
+        }
+        case OPERAND_CONST: {
+            long value = ir->constants[OPERAND_PAYLOAD(operand)];
+            if (value < INT_MIN || value > INT_MAX) {
+                // movabsq is the only instruction that takes a 64-bit immediate
+                X86Operand scratchRegister = x86Operand(X86_REGISTER, scratchRegisterNumbers[scratch]);
+                emitX86(function, X86_MOVABSQ, x86Operand(X86_IMMEDIATE, value), scratchRegister);
+                return scratchRegister;
+            }
+            return x86Operand(X86_IMMEDIATE, value);
+        }
+        default:
+            return x86Operand(X86_LABEL, OPERAND_PAYLOAD(operand));
+    }
+}
+
+// Function to emit a move, going through %rax when both operands are in memory
+void emitX86Move(X86Function* function, X86Operand source, X86Operand destination) {
+    if (sameX86Operand(source, destination)) {
+        return;
+    }
+    if (isX86Memory(source) && isX86Memory(destination)) {
+        emitX86(function, X86_MOVQ, source, x86Operand(X86_REGISTER, X86_RAX));
+        source = x86Operand(X86_REGISTER, X86_RAX);
+    }
+    emitX86(function, X86_MOVQ, source, destination);
+}
+
+// Function to emit the register restores, frame release and return
+void emitX86Epilogue(X86Function* function) {
+    if (function->frameSize > 0) {
+        emitX86(function, X86_ADDQ, x86Operand(X86_IMMEDIATE, function->frameSize), x86Operand(X86_REGISTER, X86_RSP));
+    }
+    for (int r = CALLEE_SAVED_COUNT - 1; r >= 0; r--) {
+        if (function->allocation->usedRegisters & (1u << r)) {
+            emitX86(function, X86_POPQ, noX86Operand, x86Operand(X86_REGISTER, registerNumbers[r]));
+        }
+    }
+    emitX86(function, X86_RET, noX86Operand, noX86Operand);
+}
+
+// Instructions of the two-operand arithmetic operations, indexed by op
+const int x86ArithmeticOps[] = { 0, X86_ADDQ, X86_SUBQ, X86_IMULQ };
+
+// Function to select x86-64 instructions for one IR instruction; returns the
+// number of IR instructions consumed (a comparison feeding the branch right
+// after it is fused into a compare and conditional jump)
+int selectX86Instruction(X86Function* function, int index, const int* uses) {
+    const IRFunction* ir = function->ir;
+    const IntermediateCode* instruction = &ir->code[index];
+    const X86Operand rax = x86Operand(X86_REGISTER, X86_RAX);
+    X86Operand result = noX86Operand, arg1 = noX86Operand, arg2 = noX86Operand;
+
+    if (instruction->op != OP_LABEL && instruction->op != OP_GOTO) {
+        if (instruction->arg1 != NO_OPERAND) {
+            arg1 = x86IROperand(function, instruction->arg1, 0);
+        }
+        if (instruction->arg2 != NO_OPERAND) {
+            arg2 = x86IROperand(function, instruction->arg2, 1);
+        }
+        if (instruction->result != NO_OPERAND) {
+            result = x86IROperand(function, instruction->result, 0);
+        }
+    }
+
+    switch (instruction->op) {
+        case OP_ASSIGN:
+            emitX86Move(function, arg1, result);
+            return 1;
+
+        case OP_ADD: case OP_SUB: case OP_MUL: {
+            int op = x86ArithmeticOps[instruction->op];
+            // Work in the destination register unless the second argument lives there
+            X86Operand work = result.kind == X86_REGISTER && !sameX86Operand(result, arg2) ? result : rax;
+            if (instruction->op != OP_SUB && sameX86Operand(result, arg2) && result.kind == X86_REGISTER) {
+                emitX86(function, op, arg1, result);
+                return 1;
+            }
+            emitX86Move(function, arg1, work);
+            emitX86(function, op, arg2, work);
+            emitX86Move(function, work, result);
+            return 1;
+        }
+
+        case OP_DIV:
+            emitX86Move(function, arg1, rax);
+            emitX86(function, X86_CQTO, noX86Operand, noX86Operand);
+            if (arg2.kind == X86_IMMEDIATE) {
+                emitX86(function, X86_MOVQ, arg2, x86Operand(X86_REGISTER, X86_RCX));
+                arg2 = x86Operand(X86_REGISTER, X86_RCX);
+            }
+            emitX86(function, X86_IDIVQ, noX86Operand, arg2);
+            emitX86Move(function, rax, result);
+            return 1;
+
+        case OP_NEG: {
+            X86Operand work = result.kind == X86_REGISTER ? result : rax;
+            emitX86Move(function, arg1, work);
+            emitX86(function, X86_NEGQ, noX86Operand, work);
+            emitX86Move(function, work, result);
+            return 1;
+        }
+
+        case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE: {
+            const IntermediateCode* next = index + 1 < ir->count ? &ir->code[index + 1] : NULL;
+            int condition = comparisonConditions[instruction->op - OP_LT];
+            // cmpq cannot take an immediate first argument or two memory operands
+            if (arg1.kind != X86_REGISTER && (!isX86Memory(arg1) || isX86Memory(arg2))) {
+                emitX86(function, X86_MOVQ, arg1, rax);
+                arg1 = rax;
+            }
+            emitX86(function, X86_CMPQ, arg2, arg1);
+
+            if (next != NULL && (next->op == OP_IF || next->op == OP_IF_FALSE) && next->arg1 == instruction->result &&
+                uses[OPERAND_PAYLOAD(instruction->result)] == 1) {
+                emitX86Conditional(function, X86_JCC, next->op == OP_IF ? condition : condition ^ 1,
+                                   x86Operand(X86_LABEL, OPERAND_PAYLOAD(next->arg2)));
+                return 2;
+            }
+
+            emitX86Conditional(function, X86_SETCC, condition, rax);
+            emitX86(function, X86_MOVZBQ, rax, result.kind == X86_REGISTER ? result : rax);
+            if (result.kind != X86_REGISTER) {
+                emitX86(function, X86_MOVQ, rax, result);
+            }
+            return 1;
+        }
+
+        case OP_LABEL:
+            emitX86(function, X86_PLACE_LABEL, noX86Operand, x86Operand(X86_LABEL, OPERAND_PAYLOAD(instruction->arg1)));
+            return 1;
+
+        case OP_GOTO:
+            emitX86(function, X86_JMP, noX86Operand, x86Operand(X86_LABEL, OPERAND_PAYLOAD(instruction->arg1)));
+            return 1;
+
+        case OP_IF: case OP_IF_FALSE: {
+            int jumpWhenNonzero = instruction->op == OP_IF;
+            if (OPERAND_TAG(instruction->arg1) == OPERAND_CONST) {
+                // Unoptimized code can branch on a constant
+                if ((ir->constants[OPERAND_PAYLOAD(instruction->arg1)] != 0) == jumpWhenNonzero) {
+                    emitX86(function, X86_JMP, noX86Operand, arg2);
+                }
+                return 1;
+            }
+            emitX86(function, X86_CMPQ, x86Operand(X86_IMMEDIATE, 0), arg1);
+            emitX86Conditional(function, X86_JCC, jumpWhenNonzero ? 0x5 : 0x4, arg2);
+            return 1;
+        }
+
+        case OP_CALL:
+            emitX86(function, X86_CALL, noX86Operand, x86Operand(X86_FUNCTION, OPERAND_PAYLOAD(instruction->arg1)));
+            emitX86Move(function, rax, result);
+            return 1;
+
+        case OP_RETURN:
+            emitX86Move(function, arg1, rax);
+            emitX86Epilogue(function);
+            return 1;
+
+        default:
+            fprintf(stderr, "Error: Unsupported intermediate code operation\n");
+            return 1;
+    }
+}
+
+// Function to clean up the selected instructions until nothing changes: drop
+// self-moves, reloads of a value just stored, jumps to the next instruction,
+// and zero registers with the shorter xor idiom
+void peepholeX86(X86Function* function) {
+    int changed = 1;
+
+    while (changed) {
+        int kept = 0;
+        changed = 0;
+        for (int i = 0; i < function->count; i++) {
+            X86Instruction* instruction = &function->code[i];
+            const X86Instruction* previous = kept > 0 ? &function->code[kept - 1] : NULL;
+            int remove = 0;
+
+            if (instruction->op == X86_MOVQ) {
+                remove = sameX86Operand(instruction->source, instruction->destination) ||
+                         (previous != NULL && previous->op == X86_MOVQ &&
+                          sameX86Operand(previous->source, instruction->destination) &&
+                          sameX86Operand(previous->destination, instruction->source));
+            } else if (instruction->op == X86_JMP) {
+                for (int j = i + 1; j < function->count && function->code[j].op == X86_PLACE_LABEL; j++) {
+                    if (sameX86Operand(function->code[j].destination, instruction->destination)) {
+                        remove = 1;
+                        break;
+                    }
+                }
+            }
+            if (remove) {
+                changed = 1;
+                continue;
+            }
+            function->code[kept++] = *instruction;
+        }
+        function->count = kept;
+    }
+
+    // mov $0 never sits between a compare and its jump or set, so clobbering the flags is safe
+    for (int i = 0; i < function->count; i++) {
+        X86Instruction* instruction = &function->code[i];
+        if (instruction->op == X86_MOVQ && sameX86Operand(instruction->source, x86Operand(X86_IMMEDIATE, 0)) &&
+            instruction->destination.kind == X86_REGISTER) {
+            instruction->op = X86_XORL;
+            instruction->source = instruction->destination;
+        }
+    }
+}
+
+// Function to format an operand in AT&T syntax; registers are named in the
+// given width in bytes
+const char* x86OperandText(const X86Function* function, X86Operand operand, int width, char buffer[OPERAND_TEXT_SIZE]) {
+    switch (operand.kind) {
+        case X86_REGISTER:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "%%%s", width == 8 ? x86RegisterNames[operand.value] :
+                     width == 4 ? x86RegisterNames32[operand.value] : x86RegisterNames8[operand.value]);
+            break;
+        case X86_STACK:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "%ld(%%rsp)", operand.value);
+            break;
+        case X86_GLOBAL:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "%s(%%rip)", symbolName((int)operand.value));
+            break;
+        case X86_IMMEDIATE:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "$%ld", operand.value);
+            break;
+        case X86_LABEL:
+            // Labels are local to the assembly file, so they carry the function name
+            snprintf(buffer, OPERAND_TEXT_SIZE, ".L%s_%ld", symbolName(function->ir->name), operand.value);
+            break;
+        case X86_FUNCTION:
+            snprintf(buffer, OPERAND_TEXT_SIZE, "%s", symbolName((int)operand.value));
+            break;
+        default:
+            buffer[0] = '\0';
+            break;
+    }
+    return buffer;
+}
+
+// Function to print the instructions of a function
+void writeX86Function(OutputBuffer* out, const X86Function* function) {
+    char source[OPERAND_TEXT_SIZE], destination[OPERAND_TEXT_SIZE];
+
+    for (int i = 0; i < function->count; i++) {
+        const X86Instruction* instruction = &function->code[i];
+        int sourceWidth = instruction->op == X86_XORL ? 4 : instruction->op == X86_MOVZBQ ? 1 : 8;
+        int destinationWidth = instruction->op == X86_XORL ? 4 : instruction->op == X86_SETCC ? 1 : 8;
+        const char* suffix = instruction->op == X86_JCC || instruction->op == X86_SETCC ?
+                             conditionSuffixes[instruction->condition] : "";
+
+        x86OperandText(function, instruction->source, sourceWidth, source);
+        x86OperandText(function, instruction->destination, destinationWidth, destination);
+        if (instruction->op == X86_PLACE_LABEL) {
+            bufferPrintf(out, "%s:\n", destination);
+        } else if (source[0] != '\0') {
+            bufferPrintf(out, "\t%s%s\t%s, %s\n", x86Mnemonics[instruction->op], suffix, source, destination);
+        } else if (destination[0] != '\0') {
+            bufferPrintf(out, "\t%s%s\t%s\n", x86Mnemonics[instruction->op], suffix, destination);
+        } else {
+            bufferPrintf(out, "\t%s\n", x86Mnemonics[instruction->op]);
+        }
+    }
+}
+
+// Function to select and clean up the x86-64 instructions of one allocated function
+void selectX86Function(X86Function* function, const IRFunction* ir, const RegisterAllocation* allocation) {
+    int* uses = (int*)optimizerAlloc((size_t)ir->tempCount, sizeof(int));
+    int pushes = 0;
+
+    function->code = NULL;
+    function->count = 0;
+    function->capacity = 0;
+    function->ir = ir;
+    function->allocation = allocation;
+    for (int i = 0; i < ir->count; i++) {
+        if (isTempOperand(ir->code[i].arg1)) {
+            uses[OPERAND_PAYLOAD(ir->code[i].arg1)]++;
+        }
+        if (isTempOperand(ir->code[i].arg2)) {
+            uses[OPERAND_PAYLOAD(ir->code[i].arg2)]++;
+        }
+    }
+
+    // Saved registers and spill slots keep %rsp 16-byte aligned at calls
+    int hasCall = 0;
+    for (int i = 0; i < ir->count; i++) {
+        hasCall |= ir->code[i].op == OP_CALL;
+    }
+    for (int r = 0; r < CALLEE_SAVED_COUNT; r++) {
+        if (allocation->usedRegisters & (1u << r)) {
+            emitX86(function, X86_PUSHQ, noX86Operand, x86Operand(X86_REGISTER, registerNumbers[r]));
+            pushes++;
+        }
+    }
+    function->frameSize = (allocation->spillSlots + (hasCall && (pushes + allocation->spillSlots) % 2 == 0)) * 8;
+    if (function->frameSize > 0) {
+        emitX86(function, X86_SUBQ, x86Operand(X86_IMMEDIATE, function->frameSize), x86Operand(X86_REGISTER, X86_RSP));
+    }
+
+    for (int i = 0; i < ir->count;) {
+        i += selectX86Instruction(function, i, uses);
+    }
+    peepholeX86(function);
+    free(uses);
+}
+
+// Function to generate the x86-64 code of one allocated function
+void generateX86Function(OutputBuffer* out, const IRFunction* ir, const RegisterAllocation* allocation) {
+    X86Function function;
+    const char* name = symbolName(ir->name);
+
+    selectX86Function(&function, ir, allocation);
+    bufferPrintf(out, "\t.text\n\t.globl\t%s\n\t.type\t%s, @function\n%s:\n", name, name, name);
+    writeX86Function(out, &function);
+    bufferPrintf(out, "\t.size\t%s, .-%s\n", name, name);
+    free(function.code);
+}
+
+// Function to define the global variables from the global initializers, which
+// hold one assignment per declaration: zero-initialized ones go to .bss, the
+// others to .data
+void generateX86Data(OutputBuffer* out, const IRFunction* globals) {
+    for (int i = 0; i < globals->count; i++) {
+        const IntermediateCode* instruction = &globals->code[i];
+        if (instruction->op != OP_ASSIGN || OPERAND_TAG(instruction->result) != OPERAND_SYMBOL ||
+            OPERAND_TAG(instruction->arg1) != OPERAND_CONST) {
+            continue;
+        }
+        const char* name = symbolName(OPERAND_PAYLOAD(instruction->result));
+        long value = globals->constants[OPERAND_PAYLOAD(instruction->arg1)];
+        bufferPrintf(out, "\t%s\n\t.globl\t%s\n\t.align\t8\n\t.type\t%s, @object\n\t.size\t%s, 8\n%s:\n",
+                     value == 0 ? ".bss" : ".data", name, name, name, name);
+        if (value == 0) {
+            bufferPuts(out, "\t.zero\t8\n");
+        } else {
+            bufferPrintf(out, "\t.quad\t%ld\n", value);
+        }
+    }
+}
+
+// Function to generate an x86-64 System V assembly file for GNU as
+void generateX86Assembly(OutputBuffer* out, const IRProgram* program, AllocationReport* report) {
+    RegisterAllocation allocation;
+
+    initRegisterAllocation(&allocation);
+    generateX86Data(out, &program->globals);
+    for (int i = 0; i < program->count; i++) {
+        allocateRegisters(&program->functions[i], &allocation);
+        generateX86Function(out, &program->functions[i], &allocation);
+        if (report != NULL) {
+            addAllocationStats(report, &allocation.stats);
+        }
+    }
+    bufferPuts(out, "\t.section\t.note.GNU-stack,\"\",@progbits\n");
+    freeRegisterAllocation(&allocation);
+}
+
+// Kinds of 32-bit displacements patched once their target is placed
+enum {
+    FIXUP_LABEL,     // Jump to a label of the current function
+    FIXUP_FUNCTION,  // Call of a function by symbol id
+    FIXUP_GLOBAL     // %rip-relative access to a global variable by symbol id
+};
+
+// Displacement to patch: target - end is stored at position
+typedef struct {
+    int kind;
+    int target;
+    size_t position;
+    size_t end;
+} JitFixup;
+
+// Machine code of a program being compiled in memory. Code and data share
+// one mapping so every global is in reach of a 32-bit %rip displacement.
+typedef struct {
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+    JitFixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    int firstLabelFixup;    // Label fixups of the current function start here
+    long *labelOffsets;     // Offsets of the current function's labels, -1 until placed
+    int labelCapacity;
+    long *functionOffsets;  // Entry offsets by symbol id, -1 for symbols that are not functions
+    long *globalSlots;      // Data slots by symbol id, -1 for symbols that are not globals
+    long *globalValues;     // Initial values by data slot
+    int globalCount;
+    unsigned char *memory;  // Executable mapping once linked
+    size_t mappedSize;
+    size_t dataOffset;
+} JitProgram;
+
+// Function to grow an array to hold at least the given number of elements
+void* reserveArray(void* data, int* capacity, int needed, size_t elementSize) {
+    if (needed <= *capacity) {
+        return data;
+    }
+    int grown = *capacity == 0 ? 64 : *capacity;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    data = realloc(data, (size_t)grown * elementSize);
+    if (data == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    *capacity = grown;
+    return data;
+}
+
+// Function to initialize an empty program
+void initJitProgram(JitProgram* jit) {
+    memset(jit, 0, sizeof(JitProgram));
+    jit->functionOffsets = (long*)malloc((size_t)symbolTable->count * sizeof(long));
+    jit->globalSlots = (long*)malloc((size_t)symbolTable->count * sizeof(long));
+    if (jit->functionOffsets == NULL || jit->globalSlots == NULL) {
+        fprintf(stderr, "Error: Out of memory for machine code\n");
+        exit(1);
+    }
+    for (int i = 0; i < symbolTable->count; i++) {
+        jit->functionOffsets[i] = -1;
+        jit->globalSlots[i] = -1;
+    }
+}
+
+// Function to free the program and unmap its code
+void freeJitProgram(JitProgram* jit) {
+    if (jit->memory != NULL) {
+        munmap(jit->memory, jit->mappedSize);
+    }
+    free(jit->code);
+    free(jit->fixups);
+    free(jit->labelOffsets);
+    free(jit->functionOffsets);
+    free(jit->globalSlots);
+    free(jit->globalValues);
+    memset(jit, 0, sizeof(JitProgram));
+}
+
+// Function to append bytes of machine code
+void jitBytes(JitProgram* jit, const void* bytes, size_t count) {
+    if (jit->length + count > jit->capacity) {
+        jit->capacity = jit->capacity == 0 ? 4096 : jit->capacity * 2;
+        jit->code = (unsigned char*)realloc(jit->code, jit->capacity);
+        if (jit->code == NULL) {
+            fprintf(stderr, "Error: Out of memory for machine code\n");
+            exit(1);
+        }
+    }
+    memcpy(jit->code + jit->length, bytes, count);
+    jit->length += count;
+}
+
+// Function to append one byte of machine code
+void jitByte(JitProgram* jit, unsigned char byte) {
+    jitBytes(jit, &byte, 1);
+}
+
+// Function to append a little-endian 32-bit value
+void jitInt32(JitProgram* jit, long value) {
+    int word = (int)value;
+    jitBytes(jit, &word, 4);
+}
+
+// Function to append a 32-bit displacement to be patched later; the end of
+// the instruction is filled in by encodeX86Instruction
+void jitFixup(JitProgram* jit, int kind, long target) {
+    jit->fixups = (JitFixup*)reserveArray(jit->fixups, &jit->fixupCapacity, jit->fixupCount + 1, sizeof(JitFixup));
+    JitFixup* fixup = &jit->fixups[jit->fixupCount++];
+    fixup->kind = kind;
+    fixup->target = (int)target;
+    fixup->position = jit->length;
+    fixup->end = 0;
+    jitInt32(jit, 0);
+}
+
+// Function to encode an instruction with a ModRM operand: optional REX prefix,
+// one- or two-byte opcode, ModRM with the given reg field, then SIB and displacement
+void encodeModRM(JitProgram* jit, int wide, unsigned int opcode, int reg, X86Operand rm) {
+    int base = rm.kind == X86_REGISTER ? (int)rm.value : 0;
+    unsigned char rex = (unsigned char)(0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3));
+
+    if (rex != 0x40) {
+        jitByte(jit, rex);
+    }
+    if (opcode > 0xFF) {
+        jitByte(jit, (unsigned char)(opcode >> 8));
+    }
+    jitByte(jit, (unsigned char)opcode);
+
+    switch (rm.kind) {
+        case X86_REGISTER:
+            jitByte(jit, (unsigned char)(0xC0 | ((reg & 7) << 3) | (base & 7)));
+            break;
+        case X86_STACK:
+            // %rsp as base always needs a SIB byte
+            if (rm.value == 0) {
+                jitByte(jit, (unsigned char)(0x04 | ((reg & 7) << 3)));
+                jitByte(jit, 0x24);
+            } else if (rm.value >= -128 && rm.value <= 127) {
+                jitByte(jit, (unsigned char)(0x44 | ((reg & 7) << 3)));
+                jitByte(jit, 0x24);
+                jitByte(jit, (unsigned char)rm.value);
+            } else {
+                jitByte(jit, (unsigned char)(0x84 | ((reg & 7) << 3)));
+                jitByte(jit, 0x24);
+                jitInt32(jit, rm.value);
+            }
+            break;
+        case X86_GLOBAL:
+            jitByte(jit, (unsigned char)(0x05 | ((reg & 7) << 3)));
+            jitFixup(jit, FIXUP_GLOBAL, rm.value);
+            break;
+        default:
+            fprintf(stderr, "Error: Operand cannot be encoded\n");
+            exit(1);
+    }
+}
+
+// Function to encode a two-operand ALU instruction (add, sub, cmp) from its
+// r/m-destination opcode, r-destination opcode and immediate extension
+void encodeX86Arithmetic(JitProgram* jit, const X86Instruction* instruction, unsigned int toMemory,
+                         unsigned int toRegister, int extension) {
+    X86Operand source = instruction->source;
+    X86Operand destination = instruction->destination;
+
+    if (source.kind == X86_IMMEDIATE) {
+        int small = source.value >= -128 && source.value <= 127;
+        encodeModRM(jit, 1, small ? 0x83 : 0x81, extension, destination);
+        if (small) {
+            jitByte(jit, (unsigned char)source.value);
+        } else {
+            jitInt32(jit, source.value);
+        }
+    } else if (source.kind == X86_REGISTER) {
+        encodeModRM(jit, 1, toMemory, (int)source.value, destination);
+    } else {
+        encodeModRM(jit, 1, toRegister, (int)destination.value, source);
+    }
+}
+
+// Function to encode a push or pop of a register
+void encodeX86Stack(JitProgram* jit, unsigned char opcode, int reg) {
+    if (reg >= 8) {
+        jitByte(jit, 0x41);
+    }
+    jitByte(jit, (unsigned char)(opcode + (reg & 7)));
+}
+
+// Function to encode one selected instruction. Jumps always take a 32-bit
+// displacement, so no relaxation pass is needed.
+void encodeX86Instruction(JitProgram* jit, const X86Instruction* instruction) {
+    X86Operand source = instruction->source;
+    X86Operand destination = instruction->destination;
+    int firstFixup = jit->fixupCount;
+
+    switch (instruction->op) {
+        case X86_MOVQ:
+            if (source.kind == X86_IMMEDIATE) {
+                encodeModRM(jit, 1, 0xC7, 0, destination);
+                jitInt32(jit, source.value);
+            } else if (source.kind == X86_REGISTER) {
+                encodeModRM(jit, 1, 0x89, (int)source.value, destination);
+            } else {
+                encodeModRM(jit, 1, 0x8B, (int)destination.value, source);
+            }
+            break;
+        case X86_MOVABSQ:
+            jitByte(jit, (unsigned char)(0x48 | (destination.value >> 3)));
+            jitByte(jit, (unsigned char)(0xB8 + (destination.value & 7)));
+            jitBytes(jit, &source.value, 8);
+            break;
+        case X86_ADDQ:
+            encodeX86Arithmetic(jit, instruction, 0x01, 0x03, 0);
+            break;
+        case X86_SUBQ:
+            encodeX86Arithmetic(jit, instruction, 0x29, 0x2B, 5);
+            break;
+        case X86_CMPQ:
+            encodeX86Arithmetic(jit, instruction, 0x39, 0x3B, 7);
+            break;
+        case X86_IMULQ:
+            // The destination of imul is always a register
+            if (source.kind == X86_IMMEDIATE) {
+                int small = source.value >= -128 && source.value <= 127;
+                encodeModRM(jit, 1, small ? 0x6B : 0x69, (int)destination.value, destination);
+                if (small) {
+                    jitByte(jit, (unsigned char)source.value);
+                } else {
+                    jitInt32(jit, source.value);
+                }
+            } else {
+                encodeModRM(jit, 1, 0x0FAF, (int)destination.value, source);
+            }
+            break;
+        case X86_CQTO:
+            jitByte(jit, 0x48);
+            jitByte(jit, 0x99);
+            break;
+        case X86_IDIVQ:
+            encodeModRM(jit, 1, 0xF7, 7, destination);
+            break;
+        case X86_NEGQ:
+            encodeModRM(jit, 1, 0xF7, 3, destination);
+            break;
+        case X86_JMP:
+            jitByte(jit, 0xE9);
+            jitFixup(jit, FIXUP_LABEL, destination.value);
+            break;
+        case X86_JCC:
+            jitByte(jit, 0x0F);
+            jitByte(jit, (unsigned char)(0x80 + instruction->condition));
+            jitFixup(jit, FIXUP_LABEL, destination.value);
+            break;
+        case X86_SETCC:
+            // Only %al is set, which needs no REX prefix
+            encodeModRM(jit, 0, 0x0F90 + (unsigned int)instruction->condition, 0, destination);
+            break;
+        case X86_MOVZBQ:
+            encodeModRM(jit, 1, 0x0FB6, (int)destination.value, source);
+            break;
+        case X86_XORL:
+            encodeModRM(jit, 0, 0x31, (int)source.value, destination);
+            break;
+        case X86_CALL:
+            jitByte(jit, 0xE8);
+            jitFixup(jit, FIXUP_FUNCTION, destination.value);
+            break;
+        case X86_RET:
+            jitByte(jit, 0xC3);
+            break;
+        case X86_PUSHQ:
+            encodeX86Stack(jit, 0x50, (int)destination.value);
+            break;
+        case X86_POPQ:
+            encodeX86Stack(jit, 0x58, (int)destination.value);
+            break;
+        case X86_PLACE_LABEL:
+            jit->labelOffsets = (long*)reserveArray(jit->labelOffsets, &jit->labelCapacity, (int)destination.value + 1,
+                                                  sizeof(long));
+            jit->labelOffsets[destination.value] = (long)jit->length;
+            break;
+    }
+
+    // Displacements count from the end of the instruction, after any immediate
+    for (int i = firstFixup; i < jit->fixupCount; i++) {
+        jit->fixups[i].end = jit->length;
+    }
+}
+
+// Function to encode the instructions of one function and resolve its jumps;
+// returns 0 if a function of the same name was encoded already
+int encodeX86Function(JitProgram* jit, const X86Function* function) {
+    int symbolId = function->ir->name;
+
+    if (jit->functionOffsets[symbolId] >= 0) {
+        fprintf(diagnosticOutput, "Error: Function '%s' is defined twice\n", symbolName(symbolId));
+        return 0;
+    }
+    jit->functionOffsets[symbolId] = (long)jit->length;
+
+    for (int i = 0; i < jit->labelCapacity; i++) {
+        jit->labelOffsets[i] = -1;
+    }
+    jit->firstLabelFixup = jit->fixupCount;
+    for (int i = 0; i < function->count; i++) {
+        encodeX86Instruction(jit, &function->code[i]);
+    }
+
+    // Label fixups are patched now and dropped; the others wait for linking
+    int kept = jit->firstLabelFixup;
+    for (int i = jit->firstLabelFixup; i < jit->fixupCount; i++) {
+        JitFixup* fixup = &jit->fixups[i];
+        if (fixup->kind != FIXUP_LABEL) {
+            jit->fixups[kept++] = *fixup;
+            continue;
+        }
+        if (fixup->target >= jit->labelCapacity || jit->labelOffsets[fixup->target] < 0) {
+            fprintf(diagnosticOutput, "Error: Branch to a label that function '%s' never places\n",
+                    symbolName(symbolId));
+            return 0;
+        }
+        int displacement = (int)(jit->labelOffsets[fixup->target] - (long)fixup->end);
+        memcpy(jit->code + fixup->position, &displacement, 4);
+    }
+    jit->fixupCount = kept;
+    return 1;
+}
+
+// Function to give every zero- or constant-initialized global a data slot;
+// a variable declared twice keeps one slot. slots is indexed by symbol id and
+// holds -1 for symbols without one; values receives the initial value of each slot.
+void allocateGlobalSlots(const IRFunction* globals, long* slots, long** values, int* count) {
+    int capacity = 0;
+
+    for (int i = 0; i < globals->count; i++) {
+        const IntermediateCode* instruction = &globals->code[i];
+        if (instruction->op != OP_ASSIGN || OPERAND_TAG(instruction->result) != OPERAND_SYMBOL ||
+            OPERAND_TAG(instruction->arg1) != OPERAND_CONST || slots[OPERAND_PAYLOAD(instruction->result)] >= 0) {
+            continue;
+        }
+        *values = (long*)reserveArray(*values, &capacity, *count + 1, sizeof(long));
+        slots[OPERAND_PAYLOAD(instruction->result)] = *count;
+        (*values)[(*count)++] = globals->constants[OPERAND_PAYLOAD(instruction->arg1)];
+    }
+}
+
+// Function to map the code and data, patch calls and global accesses, and
+// make the code executable; returns 0 on an unresolved symbol
+int linkJitProgram(JitProgram* jit) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    jit->dataOffset = (jit->length + page - 1) & ~(page - 1);
+    jit->mappedSize = (jit->dataOffset + (size_t)jit->globalCount * sizeof(long) + page - 1) & ~(page - 1);
+    if (jit->mappedSize == 0) {
+        jit->mappedSize = page;
+    }
+    jit->memory = (unsigned char*)mmap(NULL, jit->mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->memory == MAP_FAILED) {
+        jit->memory = NULL;
+        fprintf(stderr, "Error: Cannot map memory for machine code\n");
+        return 0;
+    }
+    if (jit->length > 0) {
+        memcpy(jit->memory, jit->code, jit->length);
+    }
+    if (jit->globalCount > 0) {
+        memcpy(jit->memory + jit->dataOffset, jit->globalValues, (size_t)jit->globalCount * sizeof(long));
+    }
+
+    for (int i = 0; i < jit->fixupCount; i++) {
+        const JitFixup* fixup = &jit->fixups[i];
+        long target = fixup->kind == FIXUP_FUNCTION ? jit->functionOffsets[fixup->target] :
+                      jit->globalSlots[fixup->target] < 0 ? -1 :
+                      (long)jit->dataOffset + jit->globalSlots[fixup->target] * (long)sizeof(long);
+        if (target < 0) {
+            fprintf(diagnosticOutput, "Error: Undefined %s '%s'\n",
+                    fixup->kind == FIXUP_FUNCTION ? "function" : "variable", symbolName(fixup->target));
+            return 0;
+        }
+        int displacement = (int)(target - (long)fixup->end);
+        memcpy(jit->memory + fixup->position, &displacement, 4);
+    }
+
+    // The code pages become read-only and executable; the data pages stay writable
+    if (jit->dataOffset > 0 && mprotect(jit->memory, jit->dataOffset, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Error: Cannot make machine code executable\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Result of compiling and running a program in memory
+typedef struct {
+    int succeeded;
+    long result;         // Value returned by main
+    size_t codeBytes;
+    int globals;
+    double encodeSeconds;  // Register allocation, instruction selection, encoding and linking
+    double runSeconds;
+} JitReport;
+
+// Function to write the JIT result as a JSON object
+void jsonJitReport(OutputBuffer* json, const JitReport* report) {
+    bufferPrintf(json, "{\"succeeded\":%s,\"result\":%ld,\"codeBytes\":%zu,\"globals\":%d,"
+                 "\"encodeSeconds\":%.9f,\"runSeconds\":%.9f}", report->succeeded ? "true" : "false", report->result,
+                 report->codeBytes, report->globals, report->encodeSeconds, report->runSeconds);
+}
+
+// Where JIT-compiled code that traps resumes, the instruction that trapped and the signal
+_Thread_local sigjmp_buf jitTrapTarget;
+_Thread_local void *jitTrapAddress;
+_Thread_local int jitTrapSignal;
+
+// Function to leave JIT-compiled code on SIGFPE, which idivq raises on a zero
+// divisor and on LONG_MIN / -1, or on SIGSEGV, which unbounded recursion
+// raises once it runs into the stack guard; the handler runs on an alternate
+// stack, since the thread's own stack is used up in that case
+void handleJitTrap(int signalNumber, siginfo_t *info, void *context) {
+#if defined(__x86_64__)
+    (void)info;
+    jitTrapAddress = (void*)((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+#else
+    (void)context;
+    jitTrapAddress = info->si_addr;
+#endif
+    jitTrapSignal = signalNumber;
+    siglongjmp(jitTrapTarget, 1);
+}
+
+// Function to call JIT-compiled code with its traps caught; returns 0 if it
+// trapped. Kept apart so no local of the caller lives across the jump.
+int callJitEntry(long (*entry)(void), long *result) {
+    if (sigsetjmp(jitTrapTarget, 1) != 0) {
+        return 0;
+    }
+    *result = entry();
+    return 1;
+}
+
+// Function to find the function whose machine code holds the given offset,
+// or NO_SYMBOL
+int jitFunctionAt(const JitProgram* jit, long offset) {
+    int found = NO_SYMBOL;
+
+    for (int i = 0; i < symbolTable->count; i++) {
+        if (jit->functionOffsets[i] >= 0 && jit->functionOffsets[i] <= offset &&
+            (found == NO_SYMBOL || jit->functionOffsets[i] > jit->functionOffsets[found])) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+// Function to compile the program to machine code in memory and run its main function
+void runJitProgram(const IRProgram* program, AllocationReport* allocationReport, JitReport* report) {
+    JitProgram jit;
+    RegisterAllocation allocation;
+    X86Function function;
+    int encoded = 1;
+    double start = nowSeconds();
+
+    // Looked up without interning: running a program leaves the symbol table as it was
+    int mainId = findSymbol(symbolTable, "main", 4);
+
+    memset(report, 0, sizeof(JitReport));
+    initJitProgram(&jit);
+    initRegisterAllocation(&allocation);
+    allocateGlobalSlots(&program->globals, jit.globalSlots, &jit.globalValues, &jit.globalCount);
+    for (int i = 0; i < program->count && encoded; i++) {
+        allocateRegisters(&program->functions[i], &allocation);
+        selectX86Function(&function, &program->functions[i], &allocation);
+        encoded = encodeX86Function(&jit, &function);
+        free(function.code);
+        if (allocationReport != NULL) {
+            addAllocationStats(allocationReport, &allocation.stats);
+        }
+    }
+    freeRegisterAllocation(&allocation);
+
+    if (encoded && linkJitProgram(&jit)) {
+        report->codeBytes = jit.length;
+        report->globals = jit.globalCount;
+        report->encodeSeconds = nowSeconds() - start;
+        if (mainId == NO_SYMBOL || jit.functionOffsets[mainId] < 0) {
+            fprintf(diagnosticOutput, "Error: No main function to run\n");
+        } else {
+            long (*entry)(void) = (long (*)(void))(void*)(jit.memory + jit.functionOffsets[mainId]);
+            struct sigaction action, previousFpe, previousSegv;
+            stack_t signalStack, previousStack;
+
+            // Division traps and stack overflows end the run with a diagnostic, as in the VM,
+            // instead of killing the compiler
+            signalStack.ss_sp = malloc(JIT_SIGNAL_STACK_SIZE);
+            signalStack.ss_size = JIT_SIGNAL_STACK_SIZE;
+            signalStack.ss_flags = 0;
+            if (signalStack.ss_sp == NULL) {
+                fprintf(stderr, "Error: Out of memory for the signal stack\n");
+                exit(1);
+            }
+            sigaltstack(&signalStack, &previousStack);
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = handleJitTrap;
+            action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGFPE, &action, &previousFpe);
+            sigaction(SIGSEGV, &action, &previousSegv);
+            start = nowSeconds();
+            report->succeeded = callJitEntry(entry, &report->result);
+            if (!report->succeeded) {
+                int trapped = jitFunctionAt(&jit, (long)((unsigned char*)jitTrapAddress - jit.memory));
+                fprintf(diagnosticOutput, "Error: %s in function '%s'\n",
+                        jitTrapSignal == SIGSEGV ? "Stack overflow" : "Division trap",
+                        trapped == NO_SYMBOL ? "?" : symbolName(trapped));
+            }
+            report->runSeconds = nowSeconds() - start;
+            sigaction(SIGFPE, &previousFpe, NULL);
+            sigaction(SIGSEGV, &previousSegv, NULL);
+            sigaltstack(&previousStack, NULL);
+            free(signalStack.ss_sp);
+        }
+    }
+    freeJitProgram(&jit);
+}
+
+// Bytecode operations of the VM. Instructions are 32-bit words: the first one
+// holds the operation in its low byte and operand a above it, operands b and c
+// follow as whole words. Operands are registers of the current frame unless
+// noted; the constants of a function live in registers loaded at entry.
+enum {
+    VM_MOVE,          // r[a] = r[b]
+    VM_LOAD_GLOBAL,   // r[a] = globals[b]
+    VM_STORE_GLOBAL,  // globals[b] = r[a]
+    VM_ADD,           // r[a] = r[b] + r[c], and so on up to VM_NE
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_LT,
+    VM_GT,
+    VM_LE,
+    VM_GE,
+    VM_EQ,
+    VM_NE,
+    VM_NEG,           // r[a] = -r[b]
+    VM_JUMP,          // Continue at word a
+    VM_JUMP_IF,       // Continue at word a if r[b] is nonzero
+    VM_JUMP_IF_FALSE, // Continue at word a if r[b] is zero
+    VM_JUMP_LT,       // Continue at word a if r[b] < r[c], and so on up to VM_JUMP_NE
+    VM_JUMP_GT,
+    VM_JUMP_LE,
+    VM_JUMP_GE,
+    VM_JUMP_EQ,
+    VM_JUMP_NE,
+    VM_CALL,          // r[a] = value returned by function b
+    VM_RETURN,        // Return r[a]
+    VM_OP_COUNT
+};
+
+// Words taken by each operation, indexed by operation
+const unsigned char vmInstructionWords[] = {
+    2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 1, 2, 2, 3, 3, 3, 3, 3, 3, 2, 1
+};
+
+// Names of the operations for the bytecode listing, indexed by operation
+const char *vmOpNames[] = {
+    "move", "loadg", "storeg", "add", "sub", "mul", "div", "lt", "gt", "le", "ge", "eq", "ne", "neg",
+    "jump", "jumpif", "jumpiffalse", "jumplt", "jumpgt", "jumple", "jumpge", "jumpeq", "jumpne", "call", "ret"
+};
+
+#define VM_OPERAND_LIMIT (1 << 24)  // Operand a shares its word with the operation
+#define VM_STACK_SIZE (1 << 20)     // Registers of all active frames
+#define VM_MAX_DEPTH 100000         // Active calls
+
+// Threaded dispatch jumps from each handler straight to the next one through
+// a table of label addresses; build with -DVM_SWITCH_DISPATCH (or a compiler
+// without computed goto) to go through a switch instead
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+// Bytecode of one function
+typedef struct {
+    int name;              // Symbol id
+    unsigned int *code;
+    int length;
+    int capacity;
+    int tempCount;         // Registers zeroed at entry
+    long *constants;       // Loaded into the registers after the temporaries at entry
+    int constantCount;
+    int registerCount;     // Temporaries, constants and two scratch registers for globals
+} VMFunction;
+
+// Bytecode of a whole program
+typedef struct {
+    VMFunction *functions;
+    int count;
+    long *functionIndex;   // Function by symbol id, -1 for symbols that are not functions
+    long *globalSlots;     // Global slot by symbol id, -1 for symbols that are not globals
+    long *globals;         // Values by slot
+    int globalCount;
+} VMProgram;
+
+// Counters of one run
+typedef struct {
+    int succeeded;
+    long result;
+    long executed;         // Instructions dispatched
+    int codeWords;
+    double compileSeconds;
+    double runSeconds;
+} VMReport;
+
+// Function to append words to a function's bytecode
+void emitVM(VMFunction* function, int op, unsigned int a, unsigned int b, unsigned int c) {
+    function->code = (unsigned int*)reserveArray(function->code, &function->capacity, function->length + 3,
+                                                 sizeof(unsigned int));
+    function->code[function->length++] = (unsigned int)op | (a << 8);
+    if (vmInstructionWords[op] > 1) {
+        function->code[function->length++] = b;
+    }
+    if (vmInstructionWords[op] > 2) {
+        function->code[function->length++] = c;
+    }
+}
+
+// Function to get the register of an argument; a global is first loaded into the given scratch register
+unsigned int vmArgument(const VMProgram* program, VMFunction* function, Operand operand, int scratch) {
+    switch (OPERAND_TAG(operand)) {
+        case OPERAND_TEMP:
+            return (unsigned int)OPERAND_PAYLOAD(operand);
+        case OPERAND_CONST:
+            return (unsigned int)(function->tempCount + OPERAND_PAYLOAD(operand));
+        default: {
+            unsigned int reg = (unsigned int)(function->tempCount + function->constantCount + scratch);
+            emitVM(function, VM_LOAD_GLOBAL, reg, (unsigned int)program->globalSlots[OPERAND_PAYLOAD(operand)], 0);
+            return reg;
+        }
+    }
+}
+
+// Function to translate one function to bytecode; returns 0 when it refers to
+// an undefined symbol or does not fit the encoding
+int compileVMFunction(const VMProgram* program, const IRFunction* ir, VMFunction* function) {
+    int* labelOffsets = (int*)optimizerAlloc((size_t)ir->labelCount + 1, sizeof(int));
+    int* uses = (int*)optimizerAlloc((size_t)ir->tempCount + 1, sizeof(int));
+    int* definitions = (int*)optimizerAlloc((size_t)ir->tempCount + 1, sizeof(int));
+    int* jumps = (int*)optimizerAlloc((size_t)ir->count + 1, sizeof(int));  // Words holding a label number
+    int jumpCount = 0;
+
+    memset(function, 0, sizeof(VMFunction));
+    function->name = ir->name;
+    function->tempCount = ir->tempCount;
+    function->constantCount = ir->constantCount;
+    function->registerCount = ir->tempCount + ir->constantCount + 2;
+    function->constants = (long*)malloc(((size_t)ir->constantCount + 1) * sizeof(long));
+    if (function->constants == NULL) {
+        fprintf(stderr, "Error: Out of memory for bytecode\n");
+        exit(1);
+    }
+    if (ir->constantCount > 0) {
+        memcpy(function->constants, ir->constants, (size_t)ir->constantCount * sizeof(long));
+    }
+    if (function->registerCount >= VM_OPERAND_LIMIT) {
+        fprintf(diagnosticOutput, "Error: Function '%s' is too large for the VM\n", symbolName(ir->name));
+        return 0;
+    }
+
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        Operand operands[3] = { instruction->result, instruction->arg1, instruction->arg2 };
+        for (int k = 0; k < 3; k++) {
+            // The first argument of a call is the callee
+            if (OPERAND_TAG(operands[k]) == OPERAND_SYMBOL && !(instruction->op == OP_CALL && k == 1) &&
+                program->globalSlots[OPERAND_PAYLOAD(operands[k])] < 0) {
+                fprintf(diagnosticOutput, "Error: Undefined variable '%s'\n", symbolName(OPERAND_PAYLOAD(operands[k])));
+                return 0;
+            }
+        }
+        if (instruction->op == OP_CALL && program->functionIndex[OPERAND_PAYLOAD(instruction->arg1)] < 0) {
+            fprintf(diagnosticOutput, "Error: Undefined function '%s'\n", symbolName(OPERAND_PAYLOAD(instruction->arg1)));
+            return 0;
+        }
+        if (isTempOperand(instruction->arg1)) {
+            uses[OPERAND_PAYLOAD(instruction->arg1)]++;
+        }
+        if (isTempOperand(instruction->arg2)) {
+            uses[OPERAND_PAYLOAD(instruction->arg2)]++;
+        }
+        if (isTempOperand(instruction->result)) {
+            definitions[OPERAND_PAYLOAD(instruction->result)]++;
+        }
+    }
+
+    unsigned int scratch = (unsigned int)(function->tempCount + function->constantCount);
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        const IntermediateCode* next = i + 1 < ir->count ? &ir->code[i + 1] : NULL;
+        Operand destination = instruction->result;
+        unsigned int arg1, arg2;
+
+        // A temporary computed only to be copied by the next instruction is
+        // computed straight into the copy's destination, as coalesceCopies does
+        if (instruction->op != OP_ASSIGN && isTempOperand(destination) && next != NULL && next->op == OP_ASSIGN &&
+            next->arg1 == destination && uses[OPERAND_PAYLOAD(destination)] == 1 &&
+            definitions[OPERAND_PAYLOAD(destination)] == 1) {
+            destination = next->result;
+            i++;
+        }
+        int resultIsGlobal = OPERAND_TAG(destination) == OPERAND_SYMBOL;
+        unsigned int result = resultIsGlobal ? scratch : (unsigned int)OPERAND_PAYLOAD(destination);
+
+        switch (instruction->op) {
+            case OP_ASSIGN:
+                if (resultIsGlobal) {
+                    arg1 = vmArgument(program, function, instruction->arg1, 0);
+                    emitVM(function, VM_STORE_GLOBAL, arg1,
+                           (unsigned int)program->globalSlots[OPERAND_PAYLOAD(instruction->result)], 0);
+                    continue;
+                }
+                if (OPERAND_TAG(instruction->arg1) == OPERAND_SYMBOL) {
+                    emitVM(function, VM_LOAD_GLOBAL, result,
+                           (unsigned int)program->globalSlots[OPERAND_PAYLOAD(instruction->arg1)], 0);
+                    continue;
+                }
+                emitVM(function, VM_MOVE, result, vmArgument(program, function, instruction->arg1, 0), 0);
+                break;
+
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE: {
+                arg1 = vmArgument(program, function, instruction->arg1, 0);
+                arg2 = vmArgument(program, function, instruction->arg2, 1);
+
+                // A comparison used only by the branch after it becomes one compare-and-jump
+                if (instruction->op >= OP_LT && next != NULL && (next->op == OP_IF || next->op == OP_IF_FALSE) &&
+                    next->arg1 == instruction->result && isTempOperand(instruction->result) &&
+                    uses[OPERAND_PAYLOAD(instruction->result)] == 1) {
+                    int comparison = instruction->op - OP_LT;
+                    if (next->op == OP_IF_FALSE) {
+                        // Swaps lt/ge, gt/le and eq/ne
+                        comparison = comparison < 4 ? 3 - comparison : 9 - comparison;
+                    }
+                    jumps[jumpCount++] = function->length;
+                    emitVM(function, VM_JUMP_LT + comparison, (unsigned int)OPERAND_PAYLOAD(next->arg2), arg1, arg2);
+                    i++;
+                    continue;
+                }
+                emitVM(function, instruction->op >= OP_LT ? VM_LT + (instruction->op - OP_LT) : VM_ADD + (instruction->op - OP_ADD),
+                       result, arg1, arg2);
+                break;
+            }
+
+            case OP_NEG:
+                emitVM(function, VM_NEG, result, vmArgument(program, function, instruction->arg1, 0), 0);
+                break;
+
+            case OP_LABEL:
+                labelOffsets[OPERAND_PAYLOAD(instruction->arg1)] = function->length;
+                continue;
+
+            case OP_GOTO:
+                jumps[jumpCount++] = function->length;
+                emitVM(function, VM_JUMP, (unsigned int)OPERAND_PAYLOAD(instruction->arg1), 0, 0);
+                continue;
+
+            case OP_IF: case OP_IF_FALSE:
+                if (OPERAND_TAG(instruction->arg1) == OPERAND_CONST) {
+                    // Unoptimized code can branch on a constant
+                    if ((ir->constants[OPERAND_PAYLOAD(instruction->arg1)] != 0) == (instruction->op == OP_IF)) {
+                        jumps[jumpCount++] = function->length;
+                        emitVM(function, VM_JUMP, (unsigned int)OPERAND_PAYLOAD(instruction->arg2), 0, 0);
+                    }
+                    continue;
+                }
+                arg1 = vmArgument(program, function, instruction->arg1, 0);
+                jumps[jumpCount++] = function->length;
+                emitVM(function, instruction->op == OP_IF ? VM_JUMP_IF : VM_JUMP_IF_FALSE,
+                       (unsigned int)OPERAND_PAYLOAD(instruction->arg2), arg1, 0);
+                continue;
+
+            case OP_CALL:
+                emitVM(function, VM_CALL, result,
+                       (unsigned int)program->functionIndex[OPERAND_PAYLOAD(instruction->arg1)], 0);
+                break;
+
+            case OP_RETURN:
+                emitVM(function, VM_RETURN, vmArgument(program, function, instruction->arg1, 0), 0, 0);
+                continue;
+
+            default:
+                continue;
+        }
+        if (resultIsGlobal) {
+            emitVM(function, VM_STORE_GLOBAL, scratch, (unsigned int)program->globalSlots[OPERAND_PAYLOAD(destination)], 0);
+        }
+    }
+
+    // Jump targets are label numbers until every label has its offset
+    for (int j = 0; j < jumpCount; j++) {
+        unsigned int* word = &function->code[jumps[j]];
+        *word = (*word & 0xFF) | ((unsigned int)labelOffsets[*word >> 8] << 8);
+    }
+    free(labelOffsets);
+    free(uses);
+    free(definitions);
+    free(jumps);
+
+    if (function->length >= VM_OPERAND_LIMIT) {
+        fprintf(diagnosticOutput, "Error: Function '%s' is too large for the VM\n", symbolName(ir->name));
+        return 0;
+    }
+    return 1;
+}
+
+// Function to free the bytecode of a program
+void freeVMProgram(VMProgram* program) {
+    for (int i = 0; i < program->count; i++) {
+        free(program->functions[i].code);
+        free(program->functions[i].constants);
+    }
+    free(program->functions);
+    free(program->functionIndex);
+    free(program->globalSlots);
+    free(program->globals);
+    memset(program, 0, sizeof(VMProgram));
+}
+
+// Function to translate a program to bytecode; returns 0 on an undefined symbol
+int compileVMProgram(const IRProgram* ir, VMProgram* program) {
+    memset(program, 0, sizeof(VMProgram));
+    program->functions = (VMFunction*)calloc((size_t)ir->count + 1, sizeof(VMFunction));
+    program->functionIndex = (long*)malloc(((size_t)symbolTable->count + 1) * sizeof(long));
+    program->globalSlots = (long*)malloc(((size_t)symbolTable->count + 1) * sizeof(long));
+    if (program->functions == NULL || program->functionIndex == NULL || program->globalSlots == NULL) {
+        fprintf(stderr, "Error: Out of memory for bytecode\n");
+        exit(1);
+    }
+    for (int i = 0; i < symbolTable->count; i++) {
+        program->functionIndex[i] = -1;
+        program->globalSlots[i] = -1;
+    }
+    allocateGlobalSlots(&ir->globals, program->globalSlots, &program->globals, &program->globalCount);
+
+    // Calls can refer to functions defined further down
+    for (int i = 0; i < ir->count; i++) {
+        if (program->functionIndex[ir->functions[i].name] >= 0) {
+            fprintf(diagnosticOutput, "Error: Function '%s' is defined twice\n", symbolName(ir->functions[i].name));
+            return 0;
+        }
+        program->functionIndex[ir->functions[i].name] = i;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        program->count++;
+        if (!compileVMFunction(program, &ir->functions[i], &program->functions[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to print the bytecode of a program
+void displayVMProgram(const VMProgram* program) {
+    printf("\nBytecode:\n");
+    for (int f = 0; f < program->count; f++) {
+        const VMFunction* function = &program->functions[f];
+        printf("Function %s (%d registers, %d words):\n", symbolName(function->name), function->registerCount,
+               function->length);
+        for (int pc = 0; pc < function->length; pc += vmInstructionWords[function->code[pc] & 0xFF]) {
+            const unsigned int* word = &function->code[pc];
+            int op = (int)(word[0] & 0xFF);
+            printf("%5d: %-12s %u", pc, vmOpNames[op], word[0] >> 8);
+            for (int k = 1; k < vmInstructionWords[op]; k++) {
+                printf(", %u", word[k]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+// Call frame of the VM
+typedef struct {
+    const VMFunction *function;
+    const unsigned int *returnAddress;
+    long *registers;
+    unsigned int destination;  // Register of the caller that receives the result
+} VMFrame;
+
+// Function to set up the registers of a function being entered
+void enterVMFunction(const VMFunction* function, long* registers) {
+    memset(registers, 0, (size_t)function->tempCount * sizeof(long));
+    memcpy(registers + function->tempCount, function->constants, (size_t)function->constantCount * sizeof(long));
+}
+
+#if VM_THREADED_DISPATCH
+#define VM_CASE(op) target_##op:
+#define VM_NEXT() do { executed++; goto *dispatchTable[*ip & 0xFF]; } while (0)
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() do { executed++; goto dispatch; } while (0)
+#endif
+#define VM_A (ip[0] >> 8)
+#define VM_BINARY(op, expression) VM_CASE(op) { long b = registers[ip[1]], c = registers[ip[2]]; \
+    registers[VM_A] = (expression); ip += 3; VM_NEXT(); }
+#define VM_COMPARE_JUMP(op, comparison) VM_CASE(op) { \
+    ip = registers[ip[1]] comparison registers[ip[2]] ? code + VM_A : ip + 3; VM_NEXT(); }
+
+// Function to run a function of the program until it returns. Every handler
+// ends in its own indirect jump, so the branch predictor sees one jump per
+// handler instead of the single shared jump of a switch. Returns 0 on a trap.
+int runVM(const VMProgram* program, int entry, long* stack, VMFrame* frames, VMReport* report) {
+#if VM_THREADED_DISPATCH
+    static const void* dispatchTable[VM_OP_COUNT] = {
+        &&target_VM_MOVE, &&target_VM_LOAD_GLOBAL, &&target_VM_STORE_GLOBAL, &&target_VM_ADD, &&target_VM_SUB,
+        &&target_VM_MUL, &&target_VM_DIV, &&target_VM_LT, &&target_VM_GT, &&target_VM_LE, &&target_VM_GE,
+        &&target_VM_EQ, &&target_VM_NE, &&target_VM_NEG, &&target_VM_JUMP, &&target_VM_JUMP_IF,
+        &&target_VM_JUMP_IF_FALSE, &&target_VM_JUMP_LT, &&target_VM_JUMP_GT, &&target_VM_JUMP_LE,
+        &&target_VM_JUMP_GE, &&target_VM_JUMP_EQ, &&target_VM_JUMP_NE, &&target_VM_CALL, &&target_VM_RETURN
+    };
+#endif
+    const VMFunction* function = &program->functions[entry];
+    const unsigned int* code = function->code;
+    const unsigned int* ip = code;
+    long* registers = stack;
+    long* globals = program->globals;
+    long executed = 0;
+    int depth = 0;
+
+    enterVMFunction(function, registers);
+    executed--;  // The first dispatch is not an instruction
+    VM_NEXT();
+
+#if !VM_THREADED_DISPATCH
+dispatch:
+    switch (*ip & 0xFF) {
+#endif
+    VM_CASE(VM_MOVE) {
+        registers[VM_A] = registers[ip[1]];
+        ip += 2;
+        VM_NEXT();
+    }
+    VM_CASE(VM_LOAD_GLOBAL) {
+        registers[VM_A] = globals[ip[1]];
+        ip += 2;
+        VM_NEXT();
+    }
+    VM_CASE(VM_STORE_GLOBAL) {
+        globals[ip[1]] = registers[VM_A];
+        ip += 2;
+        VM_NEXT();
+    }
+    // Arithmetic wraps around like the machine instructions
+    VM_BINARY(VM_ADD, (long)((unsigned long)b + (unsigned long)c))
+    VM_BINARY(VM_SUB, (long)((unsigned long)b - (unsigned long)c))
+    VM_BINARY(VM_MUL, (long)((unsigned long)b * (unsigned long)c))
+    VM_CASE(VM_DIV) {
+        long b = registers[ip[1]], c = registers[ip[2]];
+        if (c == 0 || (b == LONG_MIN && c == -1)) {
+            fprintf(diagnosticOutput, "Error: Division trap in function '%s'\n", symbolName(function->name));
+            report->executed = executed;
+            return 0;
+        }
+        registers[VM_A] = b / c;
+        ip += 3;
+        VM_NEXT();
+    }
+    VM_BINARY(VM_LT, b < c)
+    VM_BINARY(VM_GT, b > c)
+    VM_BINARY(VM_LE, b <= c)
+    VM_BINARY(VM_GE, b >= c)
+    VM_BINARY(VM_EQ, b == c)
+    VM_BINARY(VM_NE, b != c)
+    VM_CASE(VM_NEG) {
+        registers[VM_A] = (long)(0UL - (unsigned long)registers[ip[1]]);
+        ip += 2;
+        VM_NEXT();
+    }
+    VM_CASE(VM_JUMP) {
+        ip = code + VM_A;
+        VM_NEXT();
+    }
+    VM_CASE(VM_JUMP_IF) {
+        ip = registers[ip[1]] != 0 ? code + VM_A : ip + 2;
+        VM_NEXT();
+    }
+    VM_CASE(VM_JUMP_IF_FALSE) {
+        ip = registers[ip[1]] == 0 ? code + VM_A : ip + 2;
+        VM_NEXT();
+    }
+    VM_COMPARE_JUMP(VM_JUMP_LT, <)
+    VM_COMPARE_JUMP(VM_JUMP_GT, >)
+    VM_COMPARE_JUMP(VM_JUMP_LE, <=)
+    VM_COMPARE_JUMP(VM_JUMP_GE, >=)
+    VM_COMPARE_JUMP(VM_JUMP_EQ, ==)
+    VM_COMPARE_JUMP(VM_JUMP_NE, !=)
+    VM_CASE(VM_CALL) {
+        const VMFunction* callee = &program->functions[ip[1]];
+        long* calleeRegisters = registers + function->registerCount;
+        if (depth == VM_MAX_DEPTH || calleeRegisters + callee->registerCount > stack + VM_STACK_SIZE) {
+            fprintf(diagnosticOutput, "Error: VM stack overflow in function '%s'\n", symbolName(callee->name));
+            report->executed = executed;
+            return 0;
+        }
+        frames[depth].function = function;
+        frames[depth].returnAddress = ip + 2;
+        frames[depth].registers = registers;
+        frames[depth].destination = VM_A;
+        depth++;
+        function = callee;
+        code = ip = callee->code;
+        registers = calleeRegisters;
+        enterVMFunction(callee, registers);
+        VM_NEXT();
+    }
+    VM_CASE(VM_RETURN) {
+        long value = registers[VM_A];
+        if (depth == 0) {
+            report->result = value;
+            report->executed = executed;
+            return 1;
+        }
+        depth--;
+        function = frames[depth].function;
+        code = function->code;
+        ip = frames[depth].returnAddress;
+        registers = frames[depth].registers;
+        registers[frames[depth].destination] = value;
+        VM_NEXT();
+    }
+#if !VM_THREADED_DISPATCH
+    }
+#endif
+    return 0;
+}
+
+// Function to translate the program to bytecode and run its main function in the VM
+void interpretProgram(const IRProgram* ir, VMReport* report, int listing) {
+    VMProgram program;
+    double start = nowSeconds();
+
+    // Looked up without interning, as for the JIT
+    int mainId = findSymbol(symbolTable, "main", 4);
+
+    memset(report, 0, sizeof(VMReport));
+    if (compileVMProgram(ir, &program)) {
+        for (int i = 0; i < program.count; i++) {
+            report->codeWords += program.functions[i].length;
+        }
+        report->compileSeconds = nowSeconds() - start;
+        if (listing) {
+            displayVMProgram(&program);
+        }
+        if (mainId == NO_SYMBOL || program.functionIndex[mainId] < 0) {
+            fprintf(diagnosticOutput, "Error: No main function to run\n");
+        } else {
+            long* stack = (long*)malloc(VM_STACK_SIZE * sizeof(long));
+            VMFrame* frames = (VMFrame*)malloc(VM_MAX_DEPTH * sizeof(VMFrame));
+            int entry = (int)program.functionIndex[mainId];
+            if (stack == NULL || frames == NULL) {
+                fprintf(stderr, "Error: Out of memory for the VM stack\n");
+                exit(1);
+            }
+            if (program.functions[entry].registerCount > VM_STACK_SIZE) {
+                fprintf(diagnosticOutput, "Error: VM stack overflow in function 'main'\n");
+            } else {
+                start = nowSeconds();
+                report->succeeded = runVM(&program, entry, stack, frames, report);
+                report->runSeconds = nowSeconds() - start;
+            }
+            free(stack);
+            free(frames);
+        }
+    }
+    freeVMProgram(&program);
+}
+
+// Function to write the VM run as a JSON object
+void jsonVMReport(OutputBuffer* json, const VMReport* report) {
+    bufferPrintf(json, "{\"succeeded\":%s,\"result\":%ld,\"executed\":%ld,\"codeWords\":%d,"
+                 "\"compileSeconds\":%.9f,\"runSeconds\":%.9f}", report->succeeded ? "true" : "false", report->result,
+                 report->executed, report->codeWords, report->compileSeconds, report->runSeconds);
+}
+
+// Source spelling of the binary operations, indexed by op (empty for the others)
+const char *irOperatorSymbols[] = {
+    "", "+", "-", "*", "/", "", "", "", "", "", "", "", "", "", "<", ">", "<=", ">=", "==", "!=", "", "", ""
+};
+
+// Function to print one instruction of the intermediate code
+void displayInstruction(const IRFunction* ir, const IntermediateCode* instruction) {
+    char result[OPERAND_TEXT_SIZE], arg1[OPERAND_TEXT_SIZE], arg2[OPERAND_TEXT_SIZE];
+    const char* resultText = operandText(ir, instruction->result, result);
+    const char* arg1Text = operandText(ir, instruction->arg1, arg1);
+    const char* arg2Text = operandText(ir, instruction->arg2, arg2);
+
+    switch (instruction->op) {
+        case OP_ASSIGN:
+            printf("%s = %s\n", resultText, arg1Text);
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+            printf("%s = %s %s %s\n", resultText, arg1Text, irOperatorSymbols[instruction->op], arg2Text);
+            break;
+        case OP_NEG:
+            printf("%s = -%s\n", resultText, arg1Text);
+            break;
+        case OP_LABEL:
+            printf("%s:\n", arg1Text);
+            break;
+        case OP_GOTO:
+            printf("goto %s\n", arg1Text);
+            break;
+        case OP_IF:
+            printf("if %s goto %s\n", arg1Text, arg2Text);
+            break;
+        case OP_IF_FALSE:
+            printf("ifFalse %s goto %s\n", arg1Text, arg2Text);
+            break;
+        case OP_CALL:
+            printf("%s = call %s\n", resultText, arg1Text);
+            break;
+        case OP_RETURN:
+            printf("return %s\n", arg1Text);
+            break;
+        // Add cases for other operations as needed
+        default:
+            printf("Unknown operation\n");
+            break;
+    }
+}
+
+// Function to display the intermediate code
+void displayIntermediateCode(const IRProgram* program) {
+    int line = 1;
+
+    printf("\nGenerated Intermediate Code:\n");
+    for (int i = 0; i < program->globals.count; i++) {
+        printf("%d: ", line++);
+        displayInstruction(&program->globals, &program->globals.code[i]);
+    }
+    for (int f = 0; f < program->count; f++) {
+        const IRFunction* ir = &program->functions[f];
+        printf("Function %s:\n", symbolName(ir->name));
+        for (int i = 0; i < ir->count; i++) {
+            printf("%d: ", line++);
+            displayInstruction(ir, &ir->code[i]);
+        }
+    }
+}
+
+// Names of the intermediate code operations, indexed by operation
+const char *irOpNames[] = {
+    "assign", "add", "sub", "mul", "div", "label", "jump", "if", "goto", "read", "write", "return",
+    "ifFalse", "call", "lt", "gt", "le", "ge", "eq", "ne", "neg", "nop", "phi"
+};
+
+// Names of the operand kinds, indexed by tag
+const char *operandKindNames[] = { "symbol", "temp", "const", "label" };
+
+// Function to dump one operand as JSON, null when the slot is unused
+void jsonOperand(OutputBuffer *json, const IRFunction *ir, Operand operand) {
+    char buffer[OPERAND_TEXT_SIZE];
+    const char *text;
+
+    if (operand == NO_OPERAND) {
+        bufferPuts(json, "null");
+        return;
+    }
+    text = operandText(ir, operand, buffer);
+    bufferPrintf(json, "{\"kind\":\"%s\",\"text\":", operandKindNames[OPERAND_TAG(operand)]);
+    bufferAppendJsonString(json, text, strlen(text));
+    bufferPuts(json, "}");
+}
+
+// Function to dump the instructions of one function as a JSON array
+void jsonFunctionCode(OutputBuffer *json, const IRFunction* ir) {
+    bufferPuts(json, "[");
+    for (int i = 0; i < ir->count; i++) {
+        const IntermediateCode* instruction = &ir->code[i];
+        bufferPrintf(json, "%s{\"op\":\"%s\",\"result\":", i == 0 ? "" : ",", irOpNames[instruction->op]);
+        jsonOperand(json, ir, instruction->result);
+        bufferPuts(json, ",\"arg1\":");
+        jsonOperand(json, ir, instruction->arg1);
+        bufferPuts(json, ",\"arg2\":");
+        jsonOperand(json, ir, instruction->arg2);
+        bufferPuts(json, "}");
+    }
+    bufferPuts(json, "]");
+}
+
+// Function to dump the intermediate code of a program as JSON
+void jsonIntermediateCode(OutputBuffer *json, const IRProgram* program) {
+    bufferPuts(json, "{\"globals\":");
+    jsonFunctionCode(json, &program->globals);
+    bufferPuts(json, ",\"functions\":[");
+    for (int i = 0; i < program->count; i++) {
+        const IRFunction* ir = &program->functions[i];
+        bufferPrintf(json, "%s{\"name\":", i == 0 ? "" : ",");
+        bufferAppendJsonString(json, symbolName(ir->name), strlen(symbolName(ir->name)));
+        bufferPrintf(json, ",\"temps\":%d,\"labels\":%d,\"code\":", ir->tempCount, ir->labelCount);
+        jsonFunctionCode(json, ir);
+        bufferPuts(json, "}");
+    }
+    bufferPuts(json, "]}");
+}
+
+// Function to write a whole buffer to a file with a single large write
+int writeOutputFile(const char *path, OutputBuffer *buffer) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int previousFd = buffer->fd;
+    int written;
+
+    if (fd < 0) {
+        return 0;
+    }
+    buffer->fd = fd;
+    written = flushOutputBuffer(buffer);
+    buffer->fd = previousFd;
+    return close(fd) == 0 && written;
+}
+
+// State of a streaming compilation, shared with the per-declaration handler
+typedef struct {
+    SourceBuffer *source;
+    TokenSource *tokens;
+    DiagnosticList *diagnostics;
+    OutputBuffer *assembly;
+    IRFunction ir;  // Reused for every declaration
+    CodeGenerator generator;
+    PassStats passStats;
+    RegisterAllocation allocation;
+    SourceLocator locator;
+    unsigned int releasedUpTo;  // Source bytes before this offset were returned to the OS
+    long declarations;
+    int errors;                 // Parser diagnostics printed so far
+} StreamingState;
+
+// Function to print pending diagnostics and drop source pages the parser is done with
+void flushStreamingState(StreamingState *state) {
+    unsigned int consumed = peekToken(state->tokens, 0)->offset;
+
+    printDiagnostics(state->diagnostics, &state->locator);
+    state->errors += state->diagnostics->count;
+    state->diagnostics->count = 0;
+
+    // Mapped pages behind the parser are released so resident memory stays flat;
+    // line counting has to pass them first because diagnostics need line numbers
+    if (state->source->isMapped && consumed - state->releasedUpTo >= RELEASE_CHUNK_SIZE) {
+        unsigned int end = consumed & ~(unsigned int)(sysconf(_SC_PAGESIZE) - 1);
+        advanceSourceLocator(&state->locator, end);
+        madvise(state->source->data + state->releasedUpTo, end - state->releasedUpTo, MADV_DONTNEED);
+        state->releasedUpTo = end;
+    }
+}
+
+// Function called for every declaration or function as soon as it is parsed:
+// generate its intermediate code and assembly right away
+void compileStreamedDeclaration(void *context, AST *ast, int declarationNode) {
+    StreamingState *state = (StreamingState*)context;
+
+    resetIRFunction(&state->ir);
+    state->generator.ast = ast;
+    if (ast->nodes[declarationNode].nodeType == AST_FUNCTION) {
+        generateFunctionCode(&state->generator, declarationNode, &state->ir);
+        if (options.optimize) {
+            optimizeFunction(&state->ir, &state->passStats);
+        }
+        allocateRegisters(&state->ir, &state->allocation);
+        if (options.target == TARGET_X86_64) {
+            generateX86Function(state->assembly, &state->ir, &state->allocation);
+        } else {
+            generateFunctionAssembly(state->assembly, &state->ir, &state->allocation);
+        }
+    } else {
+        state->generator.ir = &state->ir;
+        generateDeclarationCode(&state->generator, declarationNode);
+        if (options.target == TARGET_X86_64) {
+            generateX86Data(state->assembly, &state->ir);
+        } else {
+            generateFunctionAssembly(state->assembly, &state->ir, NULL);
+        }
+    }
+    state->declarations++;
+    flushStreamingState(state);
+}
+
+// Function to compile a file as a stream: tokens are pulled on demand and each
+// declaration goes straight to code generation, so memory does not grow with the input
+int compileStreaming(CompilationContext *context, const char *path, int lexerThread) {
+    OutputBuffer assembly;
+    int outputFd = STDOUT_FILENO;
+    SourceBuffer source;
+    Lexer lexer;
+    TokenQueue *queue = NULL;
+    TokenSource tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    StreamingState state;
+    Parser parser = { .tokens = &tokens, .ast = &ast, .diagnostics = &diagnostics,
+                      .onDeclaration = compileStreamedDeclaration, .handlerContext = &state };
+    struct rusage usage;
+
+    int loaded = loadSourceFile(path, &source);
+    if (loaded != LOAD_OK) {
+        fprintf(diagnosticOutput, "%s\n", loadErrorText(loaded));
+        return 1;
+    }
+    if (options.outputPath != NULL) {
+        outputFd = open(options.outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) {
+            fprintf(diagnosticOutput, "Error opening output file.\n");
+            releaseSource(&source);
+            return 1;
+        }
+    }
+    initOutputBuffer(&assembly, outputFd, 1);
+
+    beginCompilation(context);
+    initAST(&ast);
+    if (lexerThread) {
+        queue = (TokenQueue*)malloc(sizeof(TokenQueue));
+        if (queue == NULL || !startTokenQueue(queue, &source)) {
+            fprintf(stderr, "Error starting lexer thread.\n");
+            return 1;
+        }
+    } else {
+        initLexer(&lexer, &source);
+    }
+    initLexerTokenSource(&tokens, &lexer, queue, &source);
+
+    state.source = &source;
+    state.tokens = &tokens;
+    state.diagnostics = &diagnostics;
+    state.assembly = &assembly;
+    initIRFunction(&state.ir);
+    initCodeGenerator(&state.generator, &ast);
+    initPassStats(&state.passStats);
+    initRegisterAllocation(&state.allocation);
+    initSourceLocator(&state.locator, source.data);
+    state.releasedUpTo = 0;
+    state.declarations = 0;
+    state.errors = 0;
+
+    parseTokens(&parser);
+    printDiagnostics(&diagnostics, &state.locator);
+    state.errors += diagnostics.count;
+    if (options.target == TARGET_X86_64) {
+        bufferPuts(&assembly, "\t.section\t.note.GNU-stack,\"\",@progbits\n");
+    }
+
+    // Declarations are compiled as they are parsed, so errors only change the exit status here
+    if (queue != NULL) {
+        finishTokenQueue(queue);
+        state.errors += queue->lexer.errors;
+        free(queue);
+    } else {
+        state.errors += lexer.errors;
+    }
+
+    flushOutputBuffer(&assembly);
+    freeOutputBuffer(&assembly);
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
+
+    if (options.outputMode == OUTPUT_VERBOSE) {
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Streamed %ld declarations from %d tokens (%d symbols), peak RSS %ld KB\n",
+               state.declarations, tokens.position, symbolTable->count, usage.ru_maxrss);
+    }
+
+    freeIRFunction(&state.ir);
+    freeCodeGenerator(&state.generator);
+    freeRegisterAllocation(&state.allocation);
+    freeAST(&ast);
+    freeDiagnostics(&diagnostics);
+    releaseSource(&source);
+    return state.errors > 0;
+}
+
+typedef struct ThreadPool ThreadPool;
+
+// Unit of work of the thread pool; run gets the index of the worker executing it
+typedef struct {
+    void (*run)(ThreadPool *pool, int worker, void *argument);
+    void *argument;
+} Task;
+
+// Tasks of one worker. The owner pushes and pops at the bottom, so it keeps
+// working on what it produced last while its data is still in cache; idle
+// workers steal from the top, taking the oldest task.
+typedef struct {
+    Task *tasks;       // Circular, indexed modulo capacity
+    long top;          // Oldest task
+    long bottom;       // One past the newest task
+    int capacity;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+// Work-stealing pool: one deque per worker, workers run until every submitted
+// task (including the ones submitted by tasks) has finished. A worker that
+// finds every deque empty sleeps on idle until a task is queued or none is left.
+struct ThreadPool {
+    TaskDeque *deques;
+    int workerCount;
+    void *shared;              // State the tasks share, such as per-worker contexts
+    atomic_long pending;       // Tasks submitted and not yet finished
+    atomic_long queued;        // Tasks sitting in a deque, not taken by a worker yet
+    atomic_long steals;
+    atomic_int nextDeque;      // Round robin for tasks submitted from outside the pool
+    atomic_int sleepers;       // Workers waiting on idle
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle;
+};
+
+// Function to create a pool of the given number of workers
+void initThreadPool(ThreadPool *pool, int workerCount, void *shared) {
+    pool->workerCount = workerCount < 1 ? 1 : workerCount;
+    pool->deques = (TaskDeque*)calloc((size_t)pool->workerCount, sizeof(TaskDeque));
+    if (pool->deques == NULL) {
+        fprintf(stderr, "Error: Out of memory for the thread pool\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pool->shared = shared;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->steals, 0);
+    atomic_init(&pool->nextDeque, 0);
+    atomic_init(&pool->sleepers, 0);
+    pthread_mutex_init(&pool->idleLock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+}
+
+// Function to free a pool once it has run
+void freeThreadPool(ThreadPool *pool) {
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    free(pool->deques);
+    pool->deques = NULL;
+    pthread_mutex_destroy(&pool->idleLock);
+    pthread_cond_destroy(&pool->idle);
+}
+
+// Function to wake sleeping workers: one for a new task, all once nothing is pending
+void wakeWorkers(ThreadPool *pool, int all) {
+    if (atomic_load(&pool->sleepers) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->idleLock);
+    if (all) {
+        pthread_cond_broadcast(&pool->idle);
+    } else {
+        pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+// Function to queue a task on a worker's deque; worker is -1 outside the pool
+void submitTask(ThreadPool *pool, int worker, void (*run)(ThreadPool*, int, void*), void *argument) {
+    if (worker < 0) {
+        worker = atomic_fetch_add_explicit(&pool->nextDeque, 1, memory_order_relaxed) % pool->workerCount;
+    }
+    TaskDeque *deque = &pool->deques[worker];
+
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        int capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        Task *tasks = (Task*)malloc((size_t)capacity * sizeof(Task));
+        if (tasks == NULL) {
+            fprintf(stderr, "Error: Out of memory for the thread pool\n");
+            exit(1);
+        }
+        for (long i = deque->top; i < deque->bottom; i++) {
+            tasks[i % capacity] = deque->tasks[i % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->bottom % deque->capacity].run = run;
+    deque->tasks[deque->bottom % deque->capacity].argument = argument;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+    atomic_fetch_add(&pool->queued, 1);
+    wakeWorkers(pool, 0);
+}
+
+// Function to take the next task of a worker: its own newest one, otherwise
+// the oldest one of another worker. Returns 0 when every deque is empty.
+int takeTask(ThreadPool *pool, int worker, Task *task) {
+    for (int i = 0; i < pool->workerCount; i++) {
+        int victim = (worker + i) % pool->workerCount;
+        TaskDeque *deque = &pool->deques[victim];
+        int found = 0;
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom > deque->top) {
+            if (victim == worker) {
+                deque->bottom--;
+                *task = deque->tasks[deque->bottom % deque->capacity];
+            } else {
+                *task = deque->tasks[deque->top % deque->capacity];
+                deque->top++;
+            }
+            found = 1;
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (found) {
+            atomic_fetch_sub(&pool->queued, 1);
+            if (victim != worker) {
+                atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Worker of a running pool
+typedef struct {
+    ThreadPool *pool;
+    int worker;
+} PoolWorker;
+
+// Function to run tasks until none is pending
+void* runPoolWorker(void *argument) {
+    PoolWorker *self = (PoolWorker*)argument;
+    ThreadPool *pool = self->pool;
+    Task task;
+
+    while (atomic_load_explicit(&pool->pending, memory_order_acquire) > 0) {
+        if (takeTask(pool, self->worker, &task)) {
+            task.run(pool, self->worker, task.argument);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                wakeWorkers(pool, 1);
+            }
+            continue;
+        }
+        // Other workers still run tasks that may submit more; sleep until they
+        // do or finish. The sleeper count is published before queued is checked
+        // and submitTask publishes queued before reading the count, so one of
+        // the two always sees the other and no wakeup is lost.
+        pthread_mutex_lock(&pool->idleLock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) <= 0 && atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle, &pool->idleLock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+    return NULL;
+}
+
+// Function to run the submitted tasks on the workers, the calling thread being
+// worker 0, and return once all of them (and the tasks they submitted) are done
+void runThreadPool(ThreadPool *pool) {
+    pthread_t *threads = (pthread_t*)malloc((size_t)pool->workerCount * sizeof(pthread_t));
+    PoolWorker *workers = (PoolWorker*)malloc((size_t)pool->workerCount * sizeof(PoolWorker));
+    int started = 1;
+
+    if (threads == NULL || workers == NULL) {
+        fprintf(stderr, "Error: Out of memory for the thread pool\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool->workerCount; i++) {
+        workers[i].pool = pool;
+        workers[i].worker = i;
+    }
+    for (int i = 1; i < pool->workerCount; i++) {
+        if (pthread_create(&threads[i], NULL, runPoolWorker, &workers[i]) != 0) {
+            break;  // Fewer workers only cost time; the others steal the tasks
+        }
+        started++;
+    }
+    runPoolWorker(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(workers);
+}
+
+typedef struct TaskGraph TaskGraph;
+
+// Node of a task graph; it goes to the pool once all of its predecessors finished
+typedef struct {
+    TaskGraph *graph;
+    void (*run)(ThreadPool *pool, int worker, void *argument);
+    void *argument;
+    atomic_int waiting;  // Predecessors that have not finished yet
+    int *successors;     // Indices of the tasks that depend on this one
+    int successorCount;
+    int successorCapacity;
+} GraphTask;
+
+// Tasks and their dependencies, built before the graph runs
+struct TaskGraph {
+    GraphTask *tasks;
+    int count;
+    int capacity;
+};
+
+// Function to create an empty task graph
+void initTaskGraph(TaskGraph *graph) {
+    graph->tasks = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+}
+
+// Function to add a task and return its index
+int addGraphTask(TaskGraph *graph, void (*run)(ThreadPool*, int, void*), void *argument) {
+    graph->tasks = (GraphTask*)reserveArray(graph->tasks, &graph->capacity, graph->count + 1, sizeof(GraphTask));
+    GraphTask *task = &graph->tasks[graph->count];
+    task->run = run;
+    task->argument = argument;
+    atomic_init(&task->waiting, 0);
+    task->successors = NULL;
+    task->successorCount = 0;
+    task->successorCapacity = 0;
+    return graph->count++;
+}
+
+// Function to make one task wait for another
+void addTaskDependency(TaskGraph *graph, int before, int after) {
+    GraphTask *task = &graph->tasks[before];
+    task->successors = (int*)reserveArray(task->successors, &task->successorCapacity, task->successorCount + 1,
+                                          sizeof(int));
+    task->successors[task->successorCount++] = after;
+    atomic_fetch_add_explicit(&graph->tasks[after].waiting, 1, memory_order_relaxed);
+}
+
+// Function run by the pool for a graph task; successors that become ready
+// go to the same worker, which finds the data they need still in its cache
+void runGraphTask(ThreadPool *pool, int worker, void *argument) {
+    GraphTask *task = (GraphTask*)argument;
+
+    task->run(pool, worker, task->argument);
+    for (int i = 0; i < task->successorCount; i++) {
+        GraphTask *successor = &task->graph->tasks[task->successors[i]];
+        if (atomic_fetch_sub_explicit(&successor->waiting, 1, memory_order_acq_rel) == 1) {
+            submitTask(pool, worker, runGraphTask, successor);
+        }
+    }
+}
+
+// Function to run every task of a graph on a pool, respecting the dependencies
+void runTaskGraph(TaskGraph *graph, ThreadPool *pool) {
+    for (int i = 0; i < graph->count; i++) {
+        graph->tasks[i].graph = graph;
+    }
+    for (int i = 0; i < graph->count; i++) {
+        if (atomic_load_explicit(&graph->tasks[i].waiting, memory_order_relaxed) == 0) {
+            submitTask(pool, -1, runGraphTask, &graph->tasks[i]);
+        }
+    }
+    runThreadPool(pool);
+}
+
+// Function to free a task graph
+void freeTaskGraph(TaskGraph *graph) {
+    for (int i = 0; i < graph->count; i++) {
+        free(graph->tasks[i].successors);
+    }
+    free(graph->tasks);
+    initTaskGraph(graph);
+}
+
+// State of one worker of the function pipeline, reused for every function it handles
+typedef struct {
+    CodeGenerator generator;
+    RegisterAllocation allocation;
+    PassStats passStats;
+} FunctionWorker;
+
+// One function of the unit and the assembly produced for it
+typedef struct {
+    int node;
+    OutputBuffer output;
+    AllocationStats stats;
+} FunctionJob;
+
+// Shared state of the function pipeline. The symbol table and the AST are
+// complete before the pool starts and only read by the tasks.
+typedef struct {
+    const AST *ast;
+    SymbolTable *symbols;
+    IRProgram *program;
+    FunctionJob *jobs;
+    FunctionWorker *workers;
+} FunctionPipeline;
+
+// Function to get the pipeline of a pool and bind its symbols to the calling thread
+FunctionPipeline* enterFunctionPipeline(ThreadPool *pool) {
+    FunctionPipeline *pipeline = (FunctionPipeline*)pool->shared;
+    symbolTable = pipeline->symbols;
+    return pipeline;
+}
+
+// Task lowering one function to intermediate code
+void lowerFunctionTask(ThreadPool *pool, int worker, void *argument) {
+    FunctionPipeline *pipeline = enterFunctionPipeline(pool);
+    FunctionJob *job = (FunctionJob*)argument;
+
+    generateFunctionCode(&pipeline->workers[worker].generator, job->node,
+                         &pipeline->program->functions[job - pipeline->jobs]);
+}
+
+// Task running the optimization passes over one function
+void optimizeFunctionTask(ThreadPool *pool, int worker, void *argument) {
+    FunctionPipeline *pipeline = enterFunctionPipeline(pool);
+    FunctionJob *job = (FunctionJob*)argument;
+
+    optimizeFunction(&pipeline->program->functions[job - pipeline->jobs], &pipeline->workers[worker].passStats);
+}
+
+// Task allocating the registers of one function and generating its assembly
+void emitFunctionTask(ThreadPool *pool, int worker, void *argument) {
+    FunctionPipeline *pipeline = enterFunctionPipeline(pool);
+    FunctionJob *job = (FunctionJob*)argument;
+    const IRFunction *ir = &pipeline->program->functions[job - pipeline->jobs];
+    RegisterAllocation *allocation = &pipeline->workers[worker].allocation;
+
+    allocateRegisters(ir, allocation);
+    if (options.target == TARGET_X86_64) {
+        generateX86Function(&job->output, ir, allocation);
+    } else {
+        generateFunctionAssembly(&job->output, ir, allocation);
+    }
+    job->stats = allocation->stats;
+}
+
+// Function to compile the functions of a parsed unit on a thread pool. The
+// global declarations are lowered first on the calling thread; then every
+// function is lowered, optimized and (when assembly is not NULL) allocated and
+// emitted as a chain of tasks, and the assembly is joined in source order.
+void compileFunctionsParallel(const AST *ast, IRProgram *program, PassStats *passStats, OutputBuffer *assembly,
+                              AllocationReport *report, int workerCount) {
+    FunctionPipeline pipeline;
+    ThreadPool pool;
+    TaskGraph graph;
+    CodeGenerator generator;
+    int functionCount = 0;
+
+    if (ast->root == NO_NODE) {
+        return;
+    }
+
+    // Globals, and one IR function per definition so their order is fixed up front
+    initCodeGenerator(&generator, ast);
+    generator.ir = &program->globals;
+    for (int node = ast->nodes[ast->root].firstChild; node != NO_NODE; node = ast->nodes[node].nextSibling) {
+        if (ast->nodes[node].nodeType == AST_DECLARATION) {
+            generateDeclarationCode(&generator, node);
+        } else if (ast->nodes[node].nodeType == AST_FUNCTION) {
+            addIRFunction(program, ast->nodes[node].symbolId);
+            functionCount++;
+        }
+    }
+    freeCodeGenerator(&generator);
+
+    pipeline.ast = ast;
+    pipeline.symbols = symbolTable;
+    pipeline.program = program;
+    pipeline.jobs = (FunctionJob*)calloc((size_t)(functionCount > 0 ? functionCount : 1), sizeof(FunctionJob));
+    initThreadPool(&pool, workerCount, &pipeline);
+    pipeline.workers = (FunctionWorker*)malloc((size_t)pool.workerCount * sizeof(FunctionWorker));
+    if (pipeline.jobs == NULL || pipeline.workers == NULL) {
+        fprintf(stderr, "Error: Out of memory for the function pipeline\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool.workerCount; i++) {
+        initCodeGenerator(&pipeline.workers[i].generator, ast);
+        initRegisterAllocation(&pipeline.workers[i].allocation);
+        initPassStats(&pipeline.workers[i].passStats);
+    }
+
+    initTaskGraph(&graph);
+    int function = 0;
+    for (int node = ast->nodes[ast->root].firstChild; node != NO_NODE; node = ast->nodes[node].nextSibling) {
+        if (ast->nodes[node].nodeType != AST_FUNCTION) {
+            continue;
+        }
+        FunctionJob *job = &pipeline.jobs[function++];
+        job->node = node;
+        initOutputBuffer(&job->output, STDOUT_FILENO, 0);
+
+        int last = addGraphTask(&graph, lowerFunctionTask, job);
+        if (options.optimize) {
+            int optimize = addGraphTask(&graph, optimizeFunctionTask, job);
+            addTaskDependency(&graph, last, optimize);
+            last = optimize;
+        }
+        if (assembly != NULL) {
+            addTaskDependency(&graph, last, addGraphTask(&graph, emitFunctionTask, job));
+        }
+    }
+    runTaskGraph(&graph, &pool);
+    freeTaskGraph(&graph);
+
+    for (int i = 0; i < pool.workerCount; i++) {
+        FunctionWorker *worker = &pipeline.workers[i];
+        for (int p = 0; p < PASS_COUNT; p++) {
+            passStats->before[p] += worker->passStats.before[p];
+            passStats->after[p] += worker->passStats.after[p];
+            passStats->seconds[p] += worker->passStats.seconds[p];
+        }
+        passStats->functions += worker->passStats.functions;
+        freeCodeGenerator(&worker->generator);
+        freeRegisterAllocation(&worker->allocation);
+    }
+
+    if (assembly != NULL) {
+        if (options.target == TARGET_X86_64) {
+            generateX86Data(assembly, &program->globals);
+        } else {
+            generateFunctionAssembly(assembly, &program->globals, NULL);
+        }
+        for (int i = 0; i < functionCount; i++) {
+            bufferAppend(assembly, pipeline.jobs[i].output.data, pipeline.jobs[i].output.length);
+            if (report != NULL) {
+                addAllocationStats(report, &pipeline.jobs[i].stats);
+            }
+        }
+        if (options.target == TARGET_X86_64) {
+            bufferPuts(assembly, "\t.section\t.note.GNU-stack,\"\",@progbits\n");
+        }
+    }
+    for (int i = 0; i < functionCount; i++) {
+        freeOutputBuffer(&pipeline.jobs[i].output);
+    }
+    freeThreadPool(&pool);
+    free(pipeline.workers);
+    free(pipeline.jobs);
+}
+
+// Allocators whose footprint the profile follows
+enum {
+    MEMORY_SOURCE,   // Mapped or read input
+    MEMORY_TOKENS,
+    MEMORY_AST,
+    MEMORY_SYMBOLS,  // Entries, hash slots and the name arena
+    MEMORY_IR,       // Instructions, constant pools and temporary names
+    MEMORY_OUTPUT,   // Assembly buffer
+    MEMORY_KINDS
+};
+
+const char *memoryKindNames[] = { "source", "tokens", "ast", "symbols", "ir", "output" };
+
+#define MAX_PROFILE_PHASES 16
+
+// One timed phase; times are offsets from the start of the profile
+typedef struct {
+    const char *name;
+    double start;
+    double wallSeconds;
+    double cpuStart;
+    double cpuSeconds;  // Process CPU time, so it exceeds the wall time on a busy pool
+} ProfilePhase;
+
+// Footprint of every allocator at the end of a phase
+typedef struct {
+    double time;
+    size_t bytes[MEMORY_KINDS];
+} MemorySample;
+
+// Measurements of one compilation for --time-report and --trace
+typedef struct {
+    double origin;
+    ProfilePhase phases[MAX_PROFILE_PHASES];
+    int phaseCount;
+    MemorySample samples[MAX_PROFILE_PHASES];
+    int sampleCount;
+    size_t peakBytes[MEMORY_KINDS];
+    long tokens;
+    long nodes;
+    long instructions;  // Intermediate instructions after the optimization passes
+    long symbols;
+    long functions;
+} Profile;
+
+// Function to get the CPU time used by the process (all threads) in seconds
+double cpuSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Function to start a profile
+void initProfile(Profile *profile) {
+    memset(profile, 0, sizeof(Profile));
+    profile->origin = nowSeconds();
+}
+
+// Function to open a phase; a NULL profile records nothing
+void beginPhase(Profile *profile, const char *name) {
+    if (profile == NULL || profile->phaseCount == MAX_PROFILE_PHASES) {
+        return;
+    }
+    ProfilePhase *phase = &profile->phases[profile->phaseCount];
+    phase->name = name;
+    phase->start = nowSeconds() - profile->origin;
+    phase->cpuStart = cpuSeconds();
+}
+
+// Function to close the phase opened last
+void endPhase(Profile *profile) {
+    if (profile == NULL || profile->phaseCount == MAX_PROFILE_PHASES) {
+        return;
+    }
+    ProfilePhase *phase = &profile->phases[profile->phaseCount++];
+    phase->wallSeconds = nowSeconds() - profile->origin - phase->start;
+    phase->cpuSeconds = cpuSeconds() - phase->cpuStart;
+}
+
+// Function to get the bytes held by the intermediate code of a program
+size_t irProgramBytes(const IRProgram *program) {
+    size_t bytes = (size_t)program->capacity * sizeof(IRFunction);
+    for (int i = -1; i < program->count; i++) {
+        const IRFunction *ir = i < 0 ? &program->globals : &program->functions[i];
+        bytes += (size_t)ir->capacity * sizeof(IntermediateCode) + (size_t)ir->constantCapacity * sizeof(long) +
+                 (size_t)ir->tempCapacity * sizeof(int);
+        if (ir->constantSlots != NULL) {
+            bytes += ((size_t)ir->constantSlotMask + 1) * sizeof(int);
+        }
+    }
+    return bytes;
+}
+
+// Function to sample the allocators of a compilation; stages that have not
+// started yet are passed as NULL
+void sampleMemory(Profile *profile, const SourceBuffer *source, const TokenStream *tokens, const AST *ast,
+                  const IRProgram *program, const OutputBuffer *output) {
+    if (profile == NULL || profile->sampleCount == MAX_PROFILE_PHASES) {
+        return;
+    }
+    MemorySample *sample = &profile->samples[profile->sampleCount++];
+    sample->time = nowSeconds() - profile->origin;
+    sample->bytes[MEMORY_SOURCE] = source != NULL ? source->length : 0;
+    sample->bytes[MEMORY_TOKENS] = tokens != NULL ? (size_t)tokens->capacity * sizeof(Token) : 0;
+    sample->bytes[MEMORY_AST] = ast != NULL ? (size_t)ast->capacity * sizeof(TreeNode) : 0;
+    sample->bytes[MEMORY_SYMBOLS] = (size_t)symbolTable->capacity * sizeof(SymbolEntry) +
+                                    ((size_t)symbolTable->slotMask + 1) * sizeof(int) +
+                                    symbolTable->strings.bytesReserved;
+    sample->bytes[MEMORY_IR] = program != NULL ? irProgramBytes(program) : 0;
+    sample->bytes[MEMORY_OUTPUT] = output != NULL ? output->capacity : 0;
+    for (int k = 0; k < MEMORY_KINDS; k++) {
+        if (sample->bytes[k] > profile->peakBytes[k]) {
+            profile->peakBytes[k] = sample->bytes[k];
+        }
+    }
+}
+
+// Function to record the sizes of the compiled unit
+void countProfile(Profile *profile, const TokenStream *tokens, const AST *ast, const IRProgram *program) {
+    if (profile == NULL) {
+        return;
+    }
+    profile->tokens = tokens->count;
+    profile->nodes = ast->count;
+    profile->symbols = symbolTable->count;
+    profile->functions = program->count;
+    profile->instructions = countInstructions(&program->globals);
+    for (int i = 0; i < program->count; i++) {
+        profile->instructions += countInstructions(&program->functions[i]);
+    }
+}
+
+// Function to get the peak resident set size of the process in KB
+long maxResidentKilobytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Function to print the phase table, the allocator footprints and the counts
+void displayProfile(FILE *out, const Profile *profile) {
+    const MemorySample *last = profile->sampleCount > 0 ? &profile->samples[profile->sampleCount - 1] : NULL;
+    double wall = 0.0, cpu = 0.0;
+
+    for (int i = 0; i < profile->phaseCount; i++) {
+        wall += profile->phases[i].wallSeconds;
+        cpu += profile->phases[i].cpuSeconds;
+    }
+    fprintf(out, "\nTime report:\n");
+    fprintf(out, "%-12s %12s %12s %8s\n", "phase", "wall(ms)", "cpu(ms)", "wall%");
+    for (int i = 0; i < profile->phaseCount; i++) {
+        const ProfilePhase *phase = &profile->phases[i];
+        fprintf(out, "%-12s %12.3f %12.3f %7.1f%%\n", phase->name, phase->wallSeconds * 1e3, phase->cpuSeconds * 1e3,
+                wall > 0.0 ? phase->wallSeconds * 100.0 / wall : 0.0);
+    }
+    fprintf(out, "%-12s %12.3f %12.3f %7.1f%%\n", "total", wall * 1e3, cpu * 1e3, 100.0);
+
+    fprintf(out, "\n%-12s %12s %12s\n", "allocator", "current(KB)", "peak(KB)");
+    for (int k = 0; k < MEMORY_KINDS; k++) {
+        fprintf(out, "%-12s %12.1f %12.1f\n", memoryKindNames[k], last != NULL ? last->bytes[k] / 1024.0 : 0.0,
+                profile->peakBytes[k] / 1024.0);
+    }
+    fprintf(out, "\n%ld tokens, %ld AST nodes, %ld symbols, %ld functions, %ld IR instructions; "
+            "max resident %ld KB\n", profile->tokens, profile->nodes, profile->symbols, profile->functions,
+            profile->instructions, maxResidentKilobytes());
+}
+
+// Function to dump a profile as a JSON object
+void jsonProfile(OutputBuffer *json, const Profile *profile) {
+    const MemorySample *last = profile->sampleCount > 0 ? &profile->samples[profile->sampleCount - 1] : NULL;
+
+    bufferPuts(json, "{\"phases\":[");
+    for (int i = 0; i < profile->phaseCount; i++) {
+        const ProfilePhase *phase = &profile->phases[i];
+        bufferPrintf(json, "%s{\"name\":\"%s\",\"start\":%.9f,\"wallSeconds\":%.9f,\"cpuSeconds\":%.9f}",
+                     i == 0 ? "" : ",", phase->name, phase->start, phase->wallSeconds, phase->cpuSeconds);
+    }
+    bufferPuts(json, "],\"memory\":[");
+    for (int k = 0; k < MEMORY_KINDS; k++) {
+        bufferPrintf(json, "%s{\"allocator\":\"%s\",\"currentBytes\":%zu,\"peakBytes\":%zu}", k == 0 ? "" : ",",
+                     memoryKindNames[k], last != NULL ? last->bytes[k] : 0, profile->peakBytes[k]);
+    }
+    bufferPrintf(json, "],\"counts\":{\"tokens\":%ld,\"astNodes\":%ld,\"symbols\":%ld,\"functions\":%ld,"
+                 "\"irInstructions\":%ld},\"maxResidentKB\":%ld}", profile->tokens, profile->nodes, profile->symbols,
+                 profile->functions, profile->instructions, maxResidentKilobytes());
+}
+
+// Function to write the phases and memory samples as Chrome trace events
+// (chrome://tracing, Perfetto): one complete event per phase and one
+// counter event per sample
+int writeChromeTrace(const char *path, const Profile *profile) {
+    OutputBuffer trace;
+    int ok;
+
+    initOutputBuffer(&trace, -1, 0);
+    bufferPuts(&trace, "{\"traceEvents\":[\n");
+    bufferPuts(&trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"compiler\"}}");
+    for (int i = 0; i < profile->phaseCount; i++) {
+        const ProfilePhase *phase = &profile->phases[i];
+        bufferPrintf(&trace, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                     "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cpuMs\":%.3f}}", phase->name, phase->start * 1e6,
+                     phase->wallSeconds * 1e6, phase->cpuSeconds * 1e3);
+    }
+    for (int i = 0; i < profile->sampleCount; i++) {
+        const MemorySample *sample = &profile->samples[i];
+        bufferPrintf(&trace, ",\n{\"name\":\"memory\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", sample->time * 1e6);
+        for (int k = 0; k < MEMORY_KINDS; k++) {
+            bufferPrintf(&trace, "%s\"%s\":%zu", k == 0 ? "" : ",", memoryKindNames[k], sample->bytes[k]);
+        }
+        bufferPuts(&trace, "}}");
+    }
+    bufferPuts(&trace, "\n]}\n");
+    ok = writeOutputFile(path, &trace);
+    freeOutputBuffer(&trace);
+    return ok;
+}
+
+// Header in front of the assembly of every cache entry
+typedef struct {
+    char magic[8];                   // CACHE_MAGIC; the digit is the format version
+    unsigned long long key;          // Hash of the settings and the source bytes
+    unsigned long long sourceLength; // Checked as well, so a hash collision also needs equal lengths
+    unsigned long long outputLength;
+} CacheEntryHeader;
+
+// Hits, misses and stores of this process; folded into the directory's totals at exit
+typedef struct {
+    _Atomic long hits;
+    _Atomic long misses;
+    _Atomic long stores;
+    _Atomic long storedBytes;
+    _Atomic unsigned int temporaries;  // Names the temporary files of this process
+} CacheCounters;
+
+CacheCounters cacheCounters;
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ull
+#define HASH_PRIME5 0x27D4EB2F165667C5ull
+
+// Function to rotate a 64-bit value left
+unsigned long long rotateLeft64(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Function to mix one 8-byte word into a hash lane
+unsigned long long hashRound(unsigned long long lane, unsigned long long word) {
+    lane += word * HASH_PRIME2;
+    return rotateLeft64(lane, 31) * HASH_PRIME1;
+}
+
+// Function to hash a byte range (the XXH64 algorithm): four independent
+// lanes take 32 bytes per step, so hashing runs at memory speed
+unsigned long long hashBytes(const void *data, size_t length, unsigned long long seed) {
+    const unsigned char *p = (const unsigned char*)data;
+    const unsigned char *end = p + length;
+    unsigned long long hash;
+    unsigned long long word;
+    unsigned int half;
+
+    if (length >= 32) {
+        unsigned long long lanes[4] = { seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1 };
+        for (; end - p >= 32; p += 32) {
+            for (int i = 0; i < 4; i++) {
+                memcpy(&word, p + 8 * i, 8);
+                lanes[i] = hashRound(lanes[i], word);
+            }
+        }
+        hash = rotateLeft64(lanes[0], 1) + rotateLeft64(lanes[1], 7) + rotateLeft64(lanes[2], 12) +
+               rotateLeft64(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ hashRound(0, lanes[i])) * HASH_PRIME1 + HASH_PRIME4;
+        }
+    } else {
+        hash = seed + HASH_PRIME5;
+    }
+    hash += length;
+
+    for (; end - p >= 8; p += 8) {
+        memcpy(&word, p, 8);
+        hash = rotateLeft64(hash ^ hashRound(0, word), 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (end - p >= 4) {
+        memcpy(&half, p, 4);
+        hash = rotateLeft64(hash ^ (half * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = rotateLeft64(hash ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+// Function to compute the cache key of a source: the compiler build and
+// every option that changes the assembly seed the hash of the bytes
+unsigned long long cacheKey(const SourceBuffer *source) {
+    char settings[128];
+    int length = snprintf(settings, sizeof(settings), "%s %s %s target=%d optimize=%d", COMPILER_VERSION, __DATE__,
+                          __TIME__, options.target, options.optimize);
+    return hashBytes(source->data, source->length, hashBytes(settings, (size_t)length, 0));
+}
+
+// Function to build the path of a file in the cache directory
+void cachePath(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", options.cacheDirectory, name);
+}
+
+// Function to open the cache entry of a compilation; returns a descriptor
+// positioned at the assembly, or -1 on a miss. A hit refreshes the entry's
+// modification time, which is the recency the eviction goes by.
+int openCacheEntry(unsigned long long key, size_t sourceLength, CacheEntryHeader *header) {
+    char name[32];
+    char path[PATH_MAX];
+    struct stat info;
+    int fd;
+
+    snprintf(name, sizeof(name), "%016llx", key);
+    cachePath(path, sizeof(path), name);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0 && (read(fd, header, sizeof(*header)) != (ssize_t)sizeof(*header) ||
+                    memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->key != key ||
+                    header->sourceLength != sourceLength || fstat(fd, &info) != 0 ||
+                    (unsigned long long)info.st_size != sizeof(*header) + header->outputLength)) {
+        // Damaged or from another format; the store after the compilation replaces it
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        futimens(fd, NULL);
+    }
+    atomic_fetch_add(fd >= 0 ? &cacheCounters.hits : &cacheCounters.misses, 1);
+    return fd;
+}
+
+// Function to look a compilation up in the cache and append its assembly to
+// an output buffer; returns 1 on a hit
+int lookupCache(unsigned long long key, size_t sourceLength, OutputBuffer *output) {
+    CacheEntryHeader header;
+    int fd = openCacheEntry(key, sourceLength, &header);
+    size_t done = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    reserveOutput(output, (size_t)header.outputLength);
+    while (done < header.outputLength) {
+        ssize_t count = read(fd, output->data + output->length + done, (size_t)header.outputLength - done);
+        if (count <= 0) {
+            break;
+        }
+        done += (size_t)count;
+    }
+    close(fd);
+    output->length += done;
+    return done == header.outputLength;
+}
+
+// Function to copy the assembly of a cache entry to a file or stdout. The
+// kernel copies it (sendfile), so a hit never brings the assembly into the
+// process; returns 0 on a write error.
+int copyCacheEntry(int entry, size_t length, const char *outputPath) {
+    int fd = outputPath != NULL ? open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    size_t done = 0;
+    int written = fd >= 0;
+
+    fflush(stdout);  // Keep ordering with anything printed through stdio
+    while (written && done < length) {
+        ssize_t count = sendfile(fd, entry, NULL, length - done);
+        if (count < 0 && done == 0) {
+            // Descriptors sendfile cannot write to are served by plain reads
+            char block[65536];
+            count = read(entry, block, sizeof(block));
+            written = count > 0 && write(fd, block, (size_t)count) == count;
+        } else {
+            written = count > 0;
+        }
+        done += written ? (size_t)count : 0;
+    }
+    if (outputPath != NULL && fd >= 0) {
+        written = close(fd) == 0 && written;
+    }
+    return written;
+}
+
+// Function to store the assembly of a compilation in the cache. The entry is
+// written to a temporary file and renamed into place, so readers (other
+// threads or processes) see either no entry or a complete one.
+void storeCache(unsigned long long key, size_t sourceLength, const OutputBuffer *output) {
+    char name[64];
+    char path[PATH_MAX];
+    char temporary[PATH_MAX];
+    CacheEntryHeader header;
+    int fd;
+    int written;
+
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.sourceLength = sourceLength;
+    header.outputLength = output->length;
+
+    snprintf(name, sizeof(name), "tmp-%ld-%u", (long)getpid(), atomic_fetch_add(&cacheCounters.temporaries, 1));
+    cachePath(temporary, sizeof(temporary), name);
+    fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return;  // The cache is an optimization; an unwritable directory only costs the hits
+    }
+    written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+    for (size_t done = 0; written && done < output->length;) {
+        ssize_t count = write(fd, output->data + done, output->length - done);
+        written = count > 0;
+        done += written ? (size_t)count : 0;
+    }
+    written = close(fd) == 0 && written;
+
+    snprintf(name, sizeof(name), "%016llx", key);
+    cachePath(path, sizeof(path), name);
+    if (!written || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return;
+    }
+    atomic_fetch_add(&cacheCounters.stores, 1);
+    atomic_fetch_add(&cacheCounters.storedBytes, (long)(sizeof(header) + output->length));
+}
+
+// One file found while scanning the cache directory
+typedef struct {
+    char name[32];
+    time_t modified;
+    long long bytes;
+} CacheFile;
+
+// Function to order cache files from the least to the most recently used
+int compareCacheFiles(const void *a, const void *b) {
+    const CacheFile *first = (const CacheFile*)a;
+    const CacheFile *second = (const CacheFile*)b;
+    return (first->modified > second->modified) - (first->modified < second->modified);
+}
+
+// Function to delete the least recently used entries until the cache is back
+// under three quarters of its limit; returns the bytes left and counts the
+// deleted entries. Temporary files older than an hour were left by a
+// process that died while storing and are removed as well.
+long long evictCache(long *evicted) {
+    DIR *directory = opendir(options.cacheDirectory);
+    CacheFile *files = NULL;
+    int count = 0;
+    int capacity = 0;
+    long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *item;
+    char path[PATH_MAX];
+    struct stat info;
+
+    *evicted = 0;
+    if (directory == NULL) {
+        return 0;
+    }
+    while ((item = readdir(directory)) != NULL) {
+        int isEntry = strlen(item->d_name) == 16 && strspn(item->d_name, "0123456789abcdef") == 16;
+        int isTemporary = strncmp(item->d_name, "tmp-", 4) == 0;
+
+        cachePath(path, sizeof(path), item->d_name);
+        if ((!isEntry && !isTemporary) || stat(path, &info) != 0) {
+            continue;
+        }
+        if (isTemporary) {
+            if (now - info.st_mtime > 3600) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            files = (CacheFile*)realloc(files, (size_t)capacity * sizeof(CacheFile));
+            if (files == NULL) {
+                fprintf(stderr, "Error: Out of memory for the cache index\n");
+                exit(1);
+            }
+        }
+        memcpy(files[count].name, item->d_name, 17);
+        files[count].modified = info.st_mtime;
+        files[count].bytes = (long long)info.st_size;
+        total += files[count].bytes;
+        count++;
+    }
+    closedir(directory);
+
+    qsort(files, (size_t)count, sizeof(CacheFile), compareCacheFiles);
+    for (int i = 0; i < count && total > (long long)(options.cacheBytes / 4 * 3); i++) {
+        cachePath(path, sizeof(path), files[i].name);
+        if (unlink(path) == 0) {
+            total -= files[i].bytes;
+            (*evicted)++;
+        }
+    }
+    free(files);
+    return total;
+}
+
+// Function to fold this process's counters into the totals kept in the
+// cache directory and evict once the stored bytes pass the size limit.
+// The stats file is locked, so concurrent compilers keep the totals exact;
+// only the byte count is an estimate between two directory scans.
+void finishCache(void) {
+    char path[PATH_MAX];
+    char text[256];
+    long hits = 0, misses = 0, stores = 0, evictions = 0;
+    long long bytes = 0;
+    long evicted = 0;
+    int fd;
+
+    cachePath(path, sizeof(path), "stats");
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        fprintf(stderr, "Error: Cannot update the cache statistics in %s\n", options.cacheDirectory);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+    text[length > 0 ? length : 0] = '\0';
+    sscanf(text, "hits %ld misses %ld stores %ld evictions %ld bytes %lld", &hits, &misses, &stores, &evictions,
+           &bytes);
+
+    hits += atomic_load(&cacheCounters.hits);
+    misses += atomic_load(&cacheCounters.misses);
+    stores += atomic_load(&cacheCounters.stores);
+    bytes += atomic_load(&cacheCounters.storedBytes);
+    if (bytes > (long long)options.cacheBytes) {
+        // Entries replaced in place were counted twice; the scan measures the real size
+        bytes = evictCache(&evicted);
+        evictions += evicted;
+    }
+
+    length = snprintf(text, sizeof(text), "hits %ld misses %ld stores %ld evictions %ld bytes %lld\n", hits, misses,
+                      stores, evictions, bytes);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, text, (size_t)length, 0) != length) {
+        fprintf(stderr, "Error: Cannot update the cache statistics in %s\n", options.cacheDirectory);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (options.cacheStats) {
+        fprintf(stderr, "Cache: %ld hits, %ld misses, %ld stored, %ld evicted\n", atomic_load(&cacheCounters.hits),
+                atomic_load(&cacheCounters.misses), atomic_load(&cacheCounters.stores), evicted);
+        fprintf(stderr, "Cache totals: %ld hits, %ld misses (%.1f%% hit rate), %ld stored, %ld evicted, "
+                "%.1f of %.1f MB used\n", hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+                stores, evictions, bytes / 1048576.0, options.cacheBytes / 1048576.0);
+    }
+}
+
+// Function to prepare the cache directory; returns 0 if it cannot be used
+int openCache(void) {
+    struct stat info;
+
+    if (mkdir(options.cacheDirectory, 0755) != 0 && (stat(options.cacheDirectory, &info) != 0 ||
+                                                     !S_ISDIR(info.st_mode))) {
+        fprintf(stderr, "Error: Cannot use %s as the cache directory\n", options.cacheDirectory);
+        return 0;
+    }
+    return 1;
+}
+
+// Header of a program image: the symbols, the AST and the intermediate code
+// of one unit, stored as the flat arrays the compiler works on. Sections are
+// addressed by offsets from the start of the image, so the image can be
+// mapped anywhere and used in place.
+typedef struct {
+    char magic[8];                  // IMAGE_MAGIC
+    unsigned int version;           // IMAGE_VERSION of the compiler that wrote it
+    unsigned int byteOrder;         // 0x01020304 as written by the producer
+    unsigned int nodeSize;          // sizeof(TreeNode) and sizeof(IntermediateCode) of the producer
+    unsigned int instructionSize;
+    unsigned int symbolCount;
+    unsigned int nodeCount;
+    int root;
+    unsigned int functionCount;     // The global initializers first, then the functions in source order
+    unsigned long long symbolsOffset;
+    unsigned long long stringsOffset;
+    unsigned long long nodesOffset;
+    unsigned long long functionsOffset;
+    unsigned long long imageBytes;
+} ImageHeader;
+
+// Symbol table entry of an image; the text is in the strings section
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+    int isIdentifier;
+    int isGlobal;
+} ImageSymbol;
+
+// IR function of an image; its arrays are sections of the image
+typedef struct {
+    int name;
+    int count;
+    int constantCount;
+    int tempCount;
+    int labelCount;
+    int firstVersion;
+    unsigned long long codeOffset;
+    unsigned long long constantsOffset;
+    unsigned long long tempNamesOffset;
+} ImageFunction;
+
+// Function to append a section to an image under construction, padded to 8
+// bytes so every array in the image is aligned; returns its offset
+unsigned long long appendImageSection(OutputBuffer *image, const void *data, size_t length) {
+    static const char padding[8];
+    unsigned long long offset = image->length;
+
+    if (length > 0) {
+        bufferAppend(image, (const char*)data, length);
+    }
+    bufferAppend(image, padding, (8 - image->length % 8) % 8);
+    return offset;
+}
+
+// Function to write the symbols, the AST and the intermediate code of a unit
+// as a program image. The file is written under a temporary name and renamed,
+// so a stage reading the image never sees a partial one. Returns 0 on an error.
+int writeProgramImage(const char *path, const AST *ast, const IRProgram *program) {
+    OutputBuffer image;
+    ImageHeader header;
+    ImageSymbol *symbols = (ImageSymbol*)malloc(((size_t)symbolTable->count + 1) * sizeof(ImageSymbol));
+    ImageFunction *functions = (ImageFunction*)malloc(((size_t)program->count + 1) * sizeof(ImageFunction));
+    char temporary[PATH_MAX];
+    int written;
+
+    if (symbols == NULL || functions == NULL) {
+        fprintf(stderr, "Error: Out of memory for the program image\n");
+        exit(1);
+    }
+    initOutputBuffer(&image, -1, 0);
+    memset(&header, 0, sizeof(header));
+    appendImageSection(&image, &header, sizeof(header));  // Filled in once the offsets are known
+
+    // Strings first, so the symbols can point at them
+    header.stringsOffset = image.length;
+    for (int i = 0; i < symbolTable->count; i++) {
+        const SymbolEntry *entry = &symbolTable->entries[i];
+        symbols[i].offset = (unsigned int)(image.length - header.stringsOffset);
+        symbols[i].length = entry->length;
+        symbols[i].isIdentifier = entry->isIdentifier;
+        symbols[i].isGlobal = entry->isGlobal;
+        bufferAppend(&image, entry->lexeme, entry->length);
+    }
+    appendImageSection(&image, NULL, 0);
+    header.symbolsOffset = appendImageSection(&image, symbols, (size_t)symbolTable->count * sizeof(ImageSymbol));
+    header.nodesOffset = appendImageSection(&image, ast->nodes, (size_t)ast->count * sizeof(TreeNode));
+
+    for (int i = 0; i <= program->count; i++) {
+        const IRFunction *ir = i == 0 ? &program->globals : &program->functions[i - 1];
+        ImageFunction *function = &functions[i];
+        function->name = ir->name;
+        function->count = ir->count;
+        function->constantCount = ir->constantCount;
+        function->tempCount = ir->tempCount;
+        function->labelCount = ir->labelCount;
+        function->firstVersion = ir->firstVersion;
+        function->codeOffset = appendImageSection(&image, ir->code, (size_t)ir->count * sizeof(IntermediateCode));
+        function->constantsOffset = appendImageSection(&image, ir->constants, (size_t)ir->constantCount * sizeof(long));
+        function->tempNamesOffset = appendImageSection(&image, ir->tempNames, (size_t)ir->tempCount * sizeof(int));
+    }
+    header.functionsOffset = appendImageSection(&image, functions, ((size_t)program->count + 1) * sizeof(ImageFunction));
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = 0x01020304u;
+    header.nodeSize = sizeof(TreeNode);
+    header.instructionSize = sizeof(IntermediateCode);
+    header.symbolCount = (unsigned int)symbolTable->count;
+    header.nodeCount = (unsigned int)ast->count;
+    header.root = ast->root;
+    header.functionCount = (unsigned int)program->count + 1;
+    header.imageBytes = image.length;
+    memcpy(image.data, &header, sizeof(header));
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp-%ld", path, (long)getpid());
+    written = writeOutputFile(temporary, &image) && rename(temporary, path) == 0;
+    if (!written) {
+        unlink(temporary);
+    }
+    freeOutputBuffer(&image);
+    free(symbols);
+    free(functions);
+    return written;
+}
+
+// Function to tell a program image from source text by its first bytes
+int isProgramImage(const SourceBuffer *source) {
+    return source->length >= sizeof(ImageHeader) && memcmp(source->data, IMAGE_MAGIC, 8) == 0;
+}
+
+// Function to check that an array of an image lies inside it
+int imageSectionFits(const ImageHeader *header, unsigned long long offset, unsigned long long count, size_t size) {
+    return offset % 8 == 0 && offset <= header->imageBytes && count <= (header->imageBytes - offset) / size;
+}
+
+// Function to check that a node reference of an image is NO_NODE or one of its nodes
+int imageNodeValid(const ImageHeader *header, int node) {
+    return node == NO_NODE || (node >= 0 && (unsigned int)node < header->nodeCount);
+}
+
+// Function to check that every node of an image has a known type, names one of
+// its symbols and links only to its nodes
+int imageNodesValid(const ImageHeader *header, const TreeNode *nodes) {
+    for (unsigned int i = 0; i < header->nodeCount; i++) {
+        const TreeNode *node = &nodes[i];
+        if (node->nodeType < AST_PROGRAM || node->nodeType > AST_NE ||
+            (node->symbolId != NO_SYMBOL && (node->symbolId < 0 || (unsigned int)node->symbolId >= header->symbolCount)) ||
+            !imageNodeValid(header, node->firstChild) || !imageNodeValid(header, node->nextSibling) ||
+            !imageNodeValid(header, node->lastChild)) {
+            return 0;
+        }
+    }
+    return imageNodeValid(header, header->root);
+}
+
+// Function to check that an operand of an image function is absent or names one
+// of the image's symbols or the function's temporaries, constants or labels;
+// isLabel tells whether the operation expects a branch target in that position
+int imageOperandValid(const ImageHeader *header, const ImageFunction *function, Operand operand, int isLabel) {
+    unsigned int payload = (unsigned int)OPERAND_PAYLOAD(operand);
+
+    if (operand == NO_OPERAND) {
+        return !isLabel;
+    }
+    switch (OPERAND_TAG(operand)) {
+        case OPERAND_SYMBOL: return !isLabel && payload < header->symbolCount;
+        case OPERAND_TEMP: return !isLabel && payload < (unsigned int)function->tempCount;
+        case OPERAND_CONST: return !isLabel && payload < (unsigned int)function->constantCount;
+        default: return isLabel && payload < (unsigned int)function->labelCount;
+    }
+}
+
+// Function to check that no label of an image function is placed twice and
+// that every branch targets a label that is placed, so a branch has exactly
+// one destination; the operands must already be known to be in range
+int imageLabelsValid(const ImageFunction *function, const IntermediateCode *code) {
+    unsigned char *placements = (unsigned char*)calloc((size_t)function->labelCount + 1, 1);
+    int valid = 1;
+
+    if (placements == NULL) {
+        fprintf(stderr, "Error: Out of memory for the program image\n");
+        exit(1);
+    }
+    for (int i = 0; i < function->count && valid; i++) {
+        if (code[i].op == OP_LABEL) {
+            valid = placements[OPERAND_PAYLOAD(code[i].arg1)]++ == 0;
+        }
+    }
+    for (int i = 0; i < function->count && valid; i++) {
+        int op = code[i].op;
+        if (op == OP_GOTO) {
+            valid = placements[OPERAND_PAYLOAD(code[i].arg1)] == 1;
+        } else if (op == OP_IF || op == OP_IF_FALSE) {
+            valid = placements[OPERAND_PAYLOAD(code[i].arg2)] == 1;
+        }
+    }
+    free(placements);
+    return valid;
+}
+
+// Function to check the code of an image function against what lowering
+// produces: the global initializers only assign constants to globals, and a
+// function ends with a return and uses no operation that only the optimizer
+// creates. Every operand must be in range, with branch targets exactly where
+// the operation expects them, temporaries must name image symbols and every
+// branch target must be placed exactly once.
+int imageCodeValid(const ImageHeader *header, const ImageFunction *function, const IntermediateCode *code,
+                   int isGlobals, const int *tempNames) {
+    // Lowering places every label it creates, so a function has at most one label per instruction
+    if (function->labelCount < 0 || function->labelCount > function->count || function->firstVersion < -1 ||
+        function->firstVersion > function->tempCount ||
+        (isGlobals ? function->name != NO_SYMBOL
+                   : function->name < 0 || (unsigned int)function->name >= header->symbolCount ||
+                     function->count == 0 || code[function->count - 1].op != OP_RETURN)) {
+        return 0;
+    }
+    for (int i = 0; i < function->count; i++) {
+        const IntermediateCode *instruction = &code[i];
+        int op = instruction->op;
+        if (isGlobals && (op != OP_ASSIGN || OPERAND_TAG(instruction->result) != OPERAND_SYMBOL ||
+                          OPERAND_TAG(instruction->arg1) != OPERAND_CONST)) {
+            return 0;
+        }
+        if (op < OP_ASSIGN || op >= OP_NOP || op == OP_JUMP || op == OP_READ || op == OP_WRITE ||
+            !imageOperandValid(header, function, instruction->result, 0) ||
+            !imageOperandValid(header, function, instruction->arg1, op == OP_LABEL || op == OP_GOTO) ||
+            !imageOperandValid(header, function, instruction->arg2, op == OP_IF || op == OP_IF_FALSE)) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < function->tempCount; i++) {
+        if (tempNames[i] != NO_SYMBOL && (tempNames[i] < 0 || (unsigned int)tempNames[i] >= header->symbolCount)) {
+            return 0;
+        }
+    }
+    return imageLabelsValid(function, code);
+}
+
+// Function to load a program image from a source buffer: the symbols are
+// interned into the current symbol table (their ids are unchanged) and the AST
+// and the intermediate code are used in place, without parsing or copying
+// any node or instruction. The buffer must stay alive while they are in use.
+// Returns 0 and reports why if the image cannot be used.
+int loadProgramImage(SourceBuffer *source, AST *ast, IRProgram *program) {
+    const ImageHeader *header = (const ImageHeader*)source->data;
+    const ImageSymbol *symbols;
+    const ImageFunction *functions;
+    const char *strings;
+    int valid;
+
+    // The byte order comes first: with the other one, the version would be read byte-swapped
+    if (header->byteOrder != 0x01020304u) {
+        fprintf(diagnosticOutput, "Error: The program image was written with a different byte order\n");
+        return 0;
+    }
+    if (header->version != IMAGE_VERSION) {
+        fprintf(diagnosticOutput, "Error: The program image has version %u, this compiler reads version %d\n",
+                header->version, IMAGE_VERSION);
+        return 0;
+    }
+    if (header->nodeSize != sizeof(TreeNode) || header->instructionSize != sizeof(IntermediateCode)) {
+        fprintf(diagnosticOutput, "Error: The program image has %u-byte nodes and %u-byte instructions, "
+                "this compiler uses %zu and %zu bytes\n", header->nodeSize, header->instructionSize,
+                sizeof(TreeNode), sizeof(IntermediateCode));
+        return 0;
+    }
+    // The sections must lie inside the image, and every reference in the nodes and
+    // instructions must stay inside its array: linear passes over each section
+    valid = header->imageBytes <= source->length && header->functionCount >= 1 &&
+            imageSectionFits(header, header->symbolsOffset, header->symbolCount, sizeof(ImageSymbol)) &&
+            imageSectionFits(header, header->nodesOffset, header->nodeCount, sizeof(TreeNode)) &&
+            imageSectionFits(header, header->functionsOffset, header->functionCount, sizeof(ImageFunction)) &&
+            header->stringsOffset <= header->symbolsOffset;
+    for (unsigned int i = 0; valid && i < header->functionCount; i++) {
+        const ImageFunction *function = (const ImageFunction*)(source->data + header->functionsOffset) + i;
+        valid = function->count >= 0 && function->constantCount >= 0 && function->tempCount >= 0 &&
+                imageSectionFits(header, function->codeOffset, (unsigned long long)function->count,
+                                 sizeof(IntermediateCode)) &&
+                imageSectionFits(header, function->constantsOffset, (unsigned long long)function->constantCount,
+                                 sizeof(long)) &&
+                imageSectionFits(header, function->tempNamesOffset, (unsigned long long)function->tempCount,
+                                 sizeof(int)) &&
+                imageCodeValid(header, function, (const IntermediateCode*)(source->data + function->codeOffset), i == 0,
+                               (const int*)(source->data + function->tempNamesOffset));
+    }
+    valid = valid && imageNodesValid(header, (const TreeNode*)(source->data + header->nodesOffset));
+    if (!valid) {
+        fprintf(diagnosticOutput, "Error: The program image is damaged\n");
+        return 0;
+    }
+
+    // The optimizer rewrites instructions in place; a private mapping turns that into copy-on-write
+    if (source->isMapped && mprotect(source->data, source->length, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(diagnosticOutput, "Error: Cannot map the program image\n");
+        return 0;
+    }
+
+    strings = source->data + header->stringsOffset;
+    symbols = (const ImageSymbol*)(source->data + header->symbolsOffset);
+    for (unsigned int i = 0; i < header->symbolCount; i++) {
+        if ((unsigned long long)symbols[i].offset + symbols[i].length > header->symbolsOffset - header->stringsOffset ||
+            internSymbol(symbolTable, strings + symbols[i].offset, symbols[i].length, symbols[i].isIdentifier) !=
+                (int)i) {
+            fprintf(diagnosticOutput, "Error: The program image is damaged\n");
+            return 0;
+        }
+        symbolTable->entries[i].isGlobal = symbols[i].isGlobal;
+    }
+
+    ast->nodes = (TreeNode*)(source->data + header->nodesOffset);
+    ast->count = (int)header->nodeCount;
+    ast->capacity = ast->count;
+    ast->root = header->root;
+
+    functions = (const ImageFunction*)(source->data + header->functionsOffset);
+    initIRProgram(program);
+    program->count = (int)header->functionCount - 1;
+    program->capacity = program->count;
+    program->functions = (IRFunction*)malloc(((size_t)program->count + 1) * sizeof(IRFunction));
+    if (program->functions == NULL) {
+        fprintf(stderr, "Error: Out of memory for intermediate code\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < header->functionCount; i++) {
+        IRFunction *ir = i == 0 ? &program->globals : &program->functions[i - 1];
+        initIRFunction(ir);
+        ir->name = functions[i].name;
+        ir->code = (IntermediateCode*)(source->data + functions[i].codeOffset);
+        ir->count = ir->capacity = functions[i].count;
+        ir->constants = (long*)(source->data + functions[i].constantsOffset);
+        ir->constantCount = ir->constantCapacity = functions[i].constantCount;
+        ir->tempNames = (int*)(source->data + functions[i].tempNamesOffset);
+        ir->tempCount = ir->tempCapacity = functions[i].tempCount;
+        ir->labelCount = functions[i].labelCount;
+        ir->firstVersion = functions[i].firstVersion;
+        ir->borrowed = BORROWED_CODE | BORROWED_CONSTANTS | BORROWED_TEMP_NAMES;
+    }
+    return 1;
+}
+
+// Function to print the --time-report table or JSON object and write the
+// --trace file of a compilation (with --json the profile is in the document)
+void reportProfile(Profile *profile) {
+    if (options.timeReport == TIME_REPORT_TABLE && options.outputMode != OUTPUT_JSON) {
+        displayProfile(stderr, profile);
+    } else if (options.timeReport == TIME_REPORT_JSON && options.outputMode != OUTPUT_JSON) {
+        OutputBuffer json;
+        initOutputBuffer(&json, STDERR_FILENO, 0);
+        jsonProfile(&json, profile);
+        bufferPuts(&json, "\n");
+        flushOutputBuffer(&json);
+        freeOutputBuffer(&json);
+    }
+    if (options.tracePath != NULL && !writeChromeTrace(options.tracePath, profile)) {
+        fprintf(diagnosticOutput, "Error writing trace file.\n");
+    }
+}
+
+// Function to run the staged pipeline on one file and report it in the selected output mode
+int compileFile(CompilationContext *context, const char *inputPath) {
+    SourceBuffer source;
+    TokenStream tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    SourceLocator locator;
+    OutputBuffer assembly;
+    IRProgram program;
+    PassStats passStats;
+    AllocationReport allocationReport;
+    JitReport jitReport = { 0 };
+    VMReport vmReport = { 0 };
+    int verbose = options.outputMode == OUTPUT_VERBOSE;
+    int parallel = options.jobs > 1 && options.imagePath == NULL;
+    int fromImage;
+    int failed;
+    // Only the assembly is cached, so the listings that show every stage and a
+    // program image, which needs the AST and the intermediate code, always compile
+    int cached = options.cacheDirectory != NULL && options.outputMode == OUTPUT_SILENT &&
+                 options.execute == EXECUTE_NONE && options.imagePath == NULL;
+    unsigned long long cacheKeyValue = 0;
+    int lexErrors;
+    Profile profileData;
+    Profile *profile = NULL;
+
+    if (options.timeReport != TIME_REPORT_NONE || options.tracePath != NULL) {
+        profile = &profileData;
+        initProfile(profile);
+    }
+    beginPhase(profile, "read");
+    int status = loadSourceFile(inputPath, &source);
+    if (status != LOAD_OK) {
+        fprintf(diagnosticOutput, "%s\n", loadErrorText(status));
+        return 1;
+    }
+    endPhase(profile);
+
+    beginCompilation(context);
+    if (cached) {
+        // A hit replaces everything from lexing to code generation
+        beginPhase(profile, "hash");
+        cacheKeyValue = cacheKey(&source);
+        endPhase(profile);
+        beginPhase(profile, "cache");
+        CacheEntryHeader header;
+        int entry = openCacheEntry(cacheKeyValue, source.length, &header);
+        int written = entry < 0 || copyCacheEntry(entry, (size_t)header.outputLength, options.outputPath);
+        endPhase(profile);
+        if (entry >= 0) {
+            close(entry);
+            if (!written) {
+                fprintf(diagnosticOutput, "Error writing output file.\n");
+            }
+            sampleMemory(profile, &source, NULL, NULL, NULL, NULL);
+            reportProfile(profile);
+            releaseSource(&source);
+            return !written;
+        }
+    }
+
+    initTokenStream(&tokens, source.data);
+    initIRProgram(&program);
+    initSourceLocator(&locator, source.data);
+    // A program image replaces the front end: lexing, parsing and lowering
+    fromImage = isProgramImage(&source);
+    if (fromImage) {
+        parallel = 0;  // The functions are lowered already
+        lexErrors = 0;
+        beginPhase(profile, "image");
+        int loaded = loadProgramImage(&source, &ast, &program);
+        endPhase(profile);
+        if (!loaded) {
+            freeIRProgram(&program);
+            freeTokenStream(&tokens);
+            releaseSource(&source);
+            return 1;
+        }
+        sampleMemory(profile, &source, &tokens, &ast, &program, NULL);
+        if (verbose) {
+            printf("1.Program Image:\n");
+            printf("\n");
+            printf("Loaded %d symbols, %d AST nodes and %d functions from %s\n", symbolTable->count, ast.count,
+                   program.count, inputPath);
+            printf("**************************************\n");
+        }
+    } else {
+        if (verbose) {
+            printf("1.Lexical Analysis:\n");
+            printf("\n");
+        }
+        beginPhase(profile, "lex");
+        lexErrors = lexicalAnalysis(&source, &tokens, NULL, NULL);
+        endPhase(profile);
+        sampleMemory(profile, &source, &tokens, NULL, NULL, NULL);
+        if (verbose) {
+            printf("**************************************\n");
+
+            // Perform parsing
+            printf("\n2.Parsing:\n");
+            printf("\n");
+        }
+        beginPhase(profile, "parse");
+        initAST(&ast);
+        parse(&tokens, &ast, &diagnostics);
+        endPhase(profile);
+        sampleMemory(profile, &source, &tokens, &ast, NULL, NULL);
+        if (options.outputMode != OUTPUT_JSON) {
+            printDiagnostics(&diagnostics, &locator);
+        }
+        if (verbose) {
+            printf("Completed Parsing\n");
+            printf("**************************************\n");
+        }
+    }
+    if (verbose) {
+        // Display the symbol table
+        displaySymbolTable();
+        printf("**************************************\n");
+
+        printf("\n3.Semantic Analysis:\n");
+
+        // Display the AST
+        printf("\nAbstract Syntax Tree (Tree Representation):\n");
+        displayAST(&ast);
+        printf("**************************************\n");
+    }
+
+    // A source with errors is only listed: no code is generated, run or written out
+    failed = lexErrors > 0 || diagnostics.count > 0;
+    if (failed && options.imagePath != NULL) {
+        fprintf(diagnosticOutput, "Error: No program image is written for a source with errors.\n");
+    }
+
+    // The assembly is collected in memory and written with one large write
+    initOutputBuffer(&assembly, STDOUT_FILENO, 0);
+    initAllocationReport(&allocationReport);
+    initPassStats(&passStats);
+    if (failed) {
+        // Nothing to lower
+    } else if (parallel) {
+        // Lowering, optimization and (for assembly output) code generation run per function on the pool
+        beginPhase(profile, "functions");
+        compileFunctionsParallel(&ast, &program, &passStats, options.execute == EXECUTE_NONE ? &assembly : NULL,
+                                 &allocationReport, options.jobs);
+        endPhase(profile);
+    } else {
+        if (!fromImage) {
+            beginPhase(profile, "lower");
+            generateIntermediateCode(&ast, &program);
+            endPhase(profile);
+        }
+        // The image keeps the code as lowered, so the stage that loads it chooses the optimization
+        if (options.imagePath != NULL) {
+            beginPhase(profile, "write image");
+            if (!writeProgramImage(options.imagePath, &ast, &program)) {
+                fprintf(diagnosticOutput, "Error writing program image.\n");
+            }
+            endPhase(profile);
+        }
+        if (options.optimize) {
+            beginPhase(profile, "optimize");
+            optimizeProgram(&program, &passStats);
+            endPhase(profile);
+        }
+    }
+    sampleMemory(profile, &source, &tokens, &ast, &program, &assembly);
+    if (verbose) {
+        printf("\n4.Intermediate Code Generation:\n");
+
+        // Display generated intermediate code
+        displayIntermediateCode(&program);
+        if (passStats.functions > 0) {
+            displayPassStats(&passStats);
+        }
+        printf("**************************************\n");
+    }
+
+    if (failed) {
+        // Nothing to run or to generate
+    } else if (options.execute == EXECUTE_JIT) {
+        beginPhase(profile, "jit");
+        runJitProgram(&program, &allocationReport, &jitReport);
+        endPhase(profile);
+    } else if (options.execute == EXECUTE_VM) {
+        if (verbose) {
+            printf("\n5.VM Execution:\n");
+        }
+        beginPhase(profile, "vm");
+        interpretProgram(&program, &vmReport, verbose);
+        endPhase(profile);
+    } else if (parallel) {
+        // Already generated by the function pipeline
+    } else {
+        beginPhase(profile, "codegen");
+        if (options.target == TARGET_X86_64) {
+            generateX86Assembly(&assembly, &program, &allocationReport);
+        } else {
+            generateAssemblyCode(&assembly, &program, &allocationReport);
+        }
+        endPhase(profile);
+    }
+    sampleMemory(profile, &source, &tokens, &ast, &program, &assembly);
+    countProfile(profile, &tokens, &ast, &program);
+    // Inputs with errors are not cached: a hit could not repeat their diagnostics
+    if (cached && !failed) {
+        storeCache(cacheKeyValue, source.length, &assembly);
+    }
+    if (options.execute == EXECUTE_NONE && options.outputPath != NULL && !failed &&
+        !writeOutputFile(options.outputPath, &assembly)) {
+        fprintf(diagnosticOutput, "Error writing output file.\n");
+    }
+
+    if (verbose && failed) {
+        printf("\n5.Code Generation:\n");
+        printf("\n");
+        printf("Skipped: the source has errors\n");
+        printf("**************************************\n");
+    } else if (verbose && options.execute == EXECUTE_JIT) {
+        printf("\n5.JIT Execution:\n");
+        printf("\n");
+        if (jitReport.succeeded) {
+            printf("main returned %ld\n", jitReport.result);
+            printf("%zu bytes of machine code, %d globals, compiled in %.3f ms, ran in %.3f ms\n",
+                   jitReport.codeBytes, jitReport.globals, jitReport.encodeSeconds * 1e3, jitReport.runSeconds * 1e3);
+        }
+        if (allocationReport.count > 0) {
+            displayAllocationReport(&allocationReport);
+        }
+        printf("**************************************\n");
+    } else if (verbose && options.execute == EXECUTE_VM) {
+        if (vmReport.succeeded) {
+            printf("\nmain returned %ld\n", vmReport.result);
+            printf("%ld instructions executed in %.3f ms (%.2f ns/op), %d words of bytecode\n", vmReport.executed,
+                   vmReport.runSeconds * 1e3, vmReport.executed > 0 ? vmReport.runSeconds * 1e9 / vmReport.executed : 0.0,
+                   vmReport.codeWords);
+        }
+        printf("**************************************\n");
+    } else if (verbose) {
+        printf("\n5.Generated Assembly Code:\n");
+        printf("\n");
+        if (options.outputPath != NULL) {
+            printf("Written to %s\n", options.outputPath);
+        } else {
+            flushOutputBuffer(&assembly);
+        }
+        if (allocationReport.count > 0) {
+            displayAllocationReport(&allocationReport);
+        }
+        printf("**************************************\n");
+    } else if (options.outputMode == OUTPUT_SILENT && options.execute == EXECUTE_JIT) {
+        if (jitReport.succeeded) {
+            printf("%ld\n", jitReport.result);
+        }
+    } else if (options.outputMode == OUTPUT_SILENT && options.execute == EXECUTE_VM) {
+        if (vmReport.succeeded) {
+            printf("%ld\n", vmReport.result);
+        }
+    } else if (options.outputMode == OUTPUT_SILENT && options.outputPath == NULL) {
+        flushOutputBuffer(&assembly);
+    } else if (options.outputMode == OUTPUT_JSON) {
+        OutputBuffer json;
+        initOutputBuffer(&json, STDOUT_FILENO, 0);
+        initSourceLocator(&locator, source.data);
+
+        bufferPuts(&json, "{\"tokens\":");
+        jsonTokens(&json, &tokens);
+        bufferPuts(&json, ",\n\"diagnostics\":");
+        jsonDiagnostics(&json, &diagnostics, &locator);
+        bufferPuts(&json, ",\n\"symbols\":");
+        jsonSymbolTable(&json);
+        bufferPuts(&json, ",\n\"ast\":");
+        jsonAST(&json, &ast);
+        bufferPuts(&json, ",\n\"intermediateCode\":");
+        jsonIntermediateCode(&json, &program);
+        bufferPuts(&json, ",\n\"passes\":");
+        jsonPassStats(&json, &passStats);
+        bufferPuts(&json, ",\n\"registerAllocation\":");
+        jsonAllocationReport(&json, &allocationReport);
+        if (options.execute == EXECUTE_JIT) {
+            bufferPuts(&json, ",\n\"jit\":");
+            jsonJitReport(&json, &jitReport);
+        } else if (options.execute == EXECUTE_VM) {
+            bufferPuts(&json, ",\n\"vm\":");
+            jsonVMReport(&json, &vmReport);
+        } else {
+            bufferPuts(&json, ",\n\"assembly\":");
+            bufferAppendJsonString(&json, assembly.data, assembly.length);
+        }
+        if (options.timeReport != TIME_REPORT_NONE) {
+            bufferPuts(&json, ",\n\"profile\":");
+            jsonProfile(&json, profile);
+        }
+        bufferPuts(&json, "}\n");
+        flushOutputBuffer(&json);
+        freeOutputBuffer(&json);
+    }
+
+    reportProfile(profile);
+
+    // Free the AST and the intermediate code; a loaded AST goes with the image
+    freeOutputBuffer(&assembly);
+    if (!fromImage) {
+        freeAST(&ast);
+    }
+    freeDiagnostics(&diagnostics);
+    freeIRProgram(&program);
+    freeAllocationReport(&allocationReport);
+
+    freeTokenStream(&tokens);
+    releaseSource(&source);
+
+    if (failed) {
+        return 1;
+    }
+    if (options.execute == EXECUTE_JIT) {
+        return !jitReport.succeeded;
+    }
+    return options.execute == EXECUTE_VM && !vmReport.succeeded;
+}
+
+// One input of a batch compilation and what it produced
+typedef struct {
+    const char *path;
+    OutputBuffer output;    // Assembly
+    OutputBuffer messages;  // Diagnostics, prefixed with the path
+    int failed;
+} CompilationUnit;
+
+// Function to compile a source held in memory with a worker's context: the
+// assembly is appended to output and the diagnostics, prefixed with the
+// name, to messages. Returns the number of errors found.
+int compileSource(CompilationContext *context, const char *name, const SourceBuffer *source, OutputBuffer *output,
+                  OutputBuffer *messages) {
+    TokenStream tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    SourceLocator locator;
+    IRProgram program;
+    PassStats passStats;
+    unsigned long long key = 0;
+    int errors;
+
+    if (isProgramImage(source)) {
+        bufferPrintf(messages, "%s: Error: Program images are compiled one at a time\n", name);
+        return 1;
+    }
+    if (options.cacheDirectory != NULL) {
+        key = cacheKey(source);
+        if (lookupCache(key, source->length, output)) {
+            return 0;
+        }
+    }
+
+    beginCompilation(context);
+    initTokenStream(&tokens, source->data);
+    errors = lexicalAnalysis(source, &tokens, messages, name);
+    initAST(&ast);
+    parse(&tokens, &ast, &diagnostics);
+    initSourceLocator(&locator, source->data);
+    appendDiagnostics(messages, name, &diagnostics, &locator);
+    errors += diagnostics.count;
+
+    // A source with errors gets its diagnostics but no assembly
+    if (errors == 0) {
+        initIRProgram(&program);
+        generateIntermediateCode(&ast, &program);
+        initPassStats(&passStats);
+        if (options.optimize) {
+            optimizeProgram(&program, &passStats);
+        }
+        if (options.target == TARGET_X86_64) {
+            generateX86Assembly(output, &program, NULL);
+        } else {
+            generateAssemblyCode(output, &program, NULL);
+        }
+        if (options.cacheDirectory != NULL) {
+            storeCache(key, source->length, output);
+        }
+        freeIRProgram(&program);
+    }
+
+    freeAST(&ast);
+    freeDiagnostics(&diagnostics);
+    freeTokenStream(&tokens);
+    return errors;
+}
+
+// Function to compile one unit with a worker's context; the assembly and the
+// diagnostics stay in the unit until the batch is written out in input order
+void compileUnit(CompilationContext *context, CompilationUnit *unit) {
+    SourceBuffer source;
+
+    initOutputBuffer(&unit->output, STDOUT_FILENO, 0);
+    initOutputBuffer(&unit->messages, STDERR_FILENO, 0);
+    unit->failed = 0;
+    int loaded = loadSourceFile(unit->path, &source);
+    if (loaded != LOAD_OK) {
+        bufferPrintf(&unit->messages, "%s: %s\n", unit->path, loadErrorText(loaded));
+        unit->failed = 1;
+        return;
+    }
+    unit->failed = compileSource(context, unit->path, &source, &unit->output, &unit->messages) > 0;
+    releaseSource(&source);
+}
+
+// Function run by the pool for one unit
+void runCompilationTask(ThreadPool *pool, int worker, void *argument) {
+    CompilationContext *contexts = (CompilationContext*)pool->shared;
+    compileUnit(&contexts[worker], (CompilationUnit*)argument);
+}
+
+// Figures of a batch compilation
+typedef struct {
+    int workers;
+    long steals;
+    double seconds;
+} BatchStats;
+
+// Function to compile many units concurrently; every worker has its own
+// context, whose symbol arena is reused from one unit to the next
+void compileBatch(CompilationUnit *units, int count, int workers, BatchStats *stats) {
+    ThreadPool pool;
+    CompilationContext *contexts;
+    double start = nowSeconds();
+
+    if (workers > count) {
+        workers = count;
+    }
+    contexts = (CompilationContext*)malloc((size_t)(workers < 1 ? 1 : workers) * sizeof(CompilationContext));
+    if (contexts == NULL) {
+        fprintf(stderr, "Error: Out of memory for compilation contexts\n");
+        exit(1);
+    }
+    initThreadPool(&pool, workers, contexts);
+    for (int i = 0; i < pool.workerCount; i++) {
+        initCompilationContext(&contexts[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        submitTask(&pool, -1, runCompilationTask, &units[i]);
+    }
+    runThreadPool(&pool);
+
+    stats->workers = pool.workerCount;
+    stats->steals = atomic_load(&pool.steals);
+    stats->seconds = nowSeconds() - start;
+    for (int i = 0; i < pool.workerCount; i++) {
+        freeCompilationContext(&contexts[i]);
+    }
+    freeThreadPool(&pool);
+    free(contexts);
+}
+
+// Function to compile several files on a thread pool and write their
+// assembly in the order the files were given
+int compileFiles(const char **paths, int count, int workers) {
+    CompilationUnit *units = (CompilationUnit*)calloc((size_t)count, sizeof(CompilationUnit));
+    OutputBuffer assembly;
+    BatchStats stats;
+    int failed = 0;
+    int outputFd = STDOUT_FILENO;
+
+    if (units == NULL) {
+        fprintf(stderr, "Error: Out of memory for compilation units\n");
+        return 1;
+    }
+    if (options.outputPath != NULL) {
+        outputFd = open(options.outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) {
+            fprintf(diagnosticOutput, "Error opening output file.\n");
+            free(units);
+            return 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        units[i].path = paths[i];
+    }
+    compileBatch(units, count, workers, &stats);
+
+    initOutputBuffer(&assembly, outputFd, 1);
+    for (int i = 0; i < count; i++) {
+        CompilationUnit *unit = &units[i];
+        if (unit->messages.length > 0) {
+            // The diagnostics of a unit must not overtake the assembly before it
+            flushOutputBuffer(&assembly);
+            fwrite(unit->messages.data, 1, unit->messages.length, diagnosticOutput);
+            fflush(diagnosticOutput);
+        }
+        if (!unit->failed) {
+            if (count > 1) {
+                bufferPrintf(&assembly, "# %s\n", unit->path);
+            }
+            bufferAppend(&assembly, unit->output.data, unit->output.length);
+        }
+        failed |= unit->failed;
+        freeOutputBuffer(&unit->output);
+        freeOutputBuffer(&unit->messages);
+    }
+    flushOutputBuffer(&assembly);
+    freeOutputBuffer(&assembly);
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
+
+    if (options.outputMode == OUTPUT_VERBOSE) {
+        // On stderr, so the assembly on stdout stays assemblable
+        fprintf(stderr, "Compiled %d files on %d threads in %.3f ms (%ld tasks stolen)\n", count, stats.workers,
+                stats.seconds * 1e3, stats.steals);
+    }
+    free(units);
+    return failed;
+}
+
+// Kinds of compile server requests
+enum {
+    REQUEST_COMPILE,   // A name and a source follow the header
+    REQUEST_SHUTDOWN   // Stop the server once the running requests are answered
+};
+
+// Outcomes of a compile server request
+enum {
+    RESPONSE_COMPILED,  // The assembly and no diagnostics
+    RESPONSE_ERRORS,    // Diagnostics only; no assembly is generated for a source with errors
+    RESPONSE_REFUSED    // Malformed request or different settings; the reason is in the messages
+};
+
+// Header of a compile server request
+typedef struct {
+    unsigned int magic;       // SERVER_MAGIC
+    unsigned int kind;
+    unsigned int settings;    // Target and optimization the client expects, see serverSettings
+    unsigned int nameLength;  // Bytes of the name shown in diagnostics, sent first
+    unsigned int length;      // Source bytes that follow the name
+} ServerRequest;
+
+// Header of a compile server response; the assembly and the messages follow
+typedef struct {
+    unsigned int status;
+    unsigned int outputLength;
+    unsigned int messagesLength;
+} ServerResponse;
+
+// State shared by the threads of a compile server
+typedef struct {
+    int listenFd;
+    int eventFd;             // epoll instance the workers wait on, one-shot for every socket
+    int wakeFds[2];          // Pipe that becomes readable, and stays so, once the server stops
+    unsigned int settings;
+    _Atomic int stopping;
+    _Atomic long requests;
+    _Atomic long connections;
+} CompileServer;
+
+CompileServer *activeServer;  // Reached by the signal handler
+
+// Function to pack the options that change the assembly into one word; a
+// server only answers clients that expect the same code
+unsigned int serverSettings(void) {
+    return (unsigned int)options.target | (unsigned int)options.optimize << 8;
+}
+
+// Function to read exactly length bytes; returns 0 on end of file or an error
+int readFully(int fd, void *data, size_t length) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t count = read(fd, (char*)data + done, length - done);
+        if (count <= 0) {
+            return 0;
+        }
+        done += (size_t)count;
+    }
+    return 1;
+}
+
+// Function to read exactly length bytes into an empty buffer, growing it only
+// as the bytes arrive, so a header that promises more than is sent costs
+// nothing; returns 0 on end of file or an error
+int readIntoBuffer(int fd, OutputBuffer *buffer, size_t length) {
+    while (buffer->length < length) {
+        size_t block = length - buffer->length < READ_BLOCK_SIZE ? length - buffer->length : READ_BLOCK_SIZE;
+        reserveOutput(buffer, block);
+        if (!readFully(fd, buffer->data + buffer->length, block)) {
+            return 0;
+        }
+        buffer->length += block;
+    }
+    return 1;
+}
+
+// Function to write a header and up to two payloads with as few system calls
+// as possible; returns 0 on an error
+int writeMessage(int fd, const void *header, size_t headerLength, const char *first, size_t firstLength,
+                 const char *second, size_t secondLength) {
+    struct iovec parts[3] = {
+        { (void*)header, headerLength }, { (void*)first, firstLength }, { (void*)second, secondLength }
+    };
+    struct iovec *part = parts;
+    int remaining = 3;
+
+    while (remaining > 0) {
+        ssize_t count = writev(fd, part, remaining);
+        if (count < 0) {
+            return 0;
+        }
+        // Skip what was written, which may end inside a part
+        while (remaining > 0 && (size_t)count >= part->iov_len) {
+            count -= (ssize_t)part->iov_len;
+            part++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            part->iov_base = (char*)part->iov_base + count;
+            part->iov_len -= (size_t)count;
+        }
+    }
+    return 1;
+}
+
+// Function to stop the server: every worker wakes up and exits once the
+// request it is answering is done. Only async-signal-safe calls, since the
+// signal handler uses it.
+void stopServer(CompileServer *server) {
+    char wake = 1;
+
+    atomic_store(&server->stopping, 1);
+    if (write(server->wakeFds[1], &wake, 1) < 0) {
+        // The pipe is full, so it is readable already
+    }
+}
+
+// Function to stop the server on SIGINT or SIGTERM
+void handleServerSignal(int signalNumber) {
+    (void)signalNumber;
+    if (activeServer != NULL) {
+        stopServer(activeServer);
+    }
+}
+
+// Function to answer one request on a connection whose header has arrived or
+// is arriving. The context, the receive buffer and the output buffers belong
+// to the worker and are reused, so a warm request allocates next to nothing.
+// Returns 1 if the connection can carry another request, 0 to close it.
+int serveRequest(CompileServer *server, int fd, CompilationContext *context, OutputBuffer *received,
+                 OutputBuffer *output, OutputBuffer *messages) {
+    ServerRequest request;
+    ServerResponse response;
+    char name[PATH_MAX];
+
+    if (!readFully(fd, &request, sizeof(request))) {
+        return 0;  // The client hung up, or stalled in the middle of a header
+    }
+    if (request.magic != SERVER_MAGIC || request.nameLength >= PATH_MAX) {
+        return 0;  // Not a client of this server; the stream cannot be trusted any more
+    }
+    if (request.kind == REQUEST_SHUTDOWN) {
+        stopServer(server);
+        return 0;
+    }
+    if (!readFully(fd, name, request.nameLength)) {
+        return 0;
+    }
+    name[request.nameLength] = '\0';
+
+    output->length = 0;
+    messages->length = 0;
+    if (request.length > MAX_REQUEST_SIZE) {
+        // The source is not read, so the stream ends with the answer
+        bufferPrintf(messages, "%s: Error: The source is larger than the server accepts (%u bytes)\n", name,
+                     MAX_REQUEST_SIZE);
+        response.status = RESPONSE_REFUSED;
+        response.outputLength = 0;
+        response.messagesLength = (unsigned int)messages->length;
+        writeMessage(fd, &response, sizeof(response), NULL, 0, messages->data, messages->length);
+        return 0;
+    }
+    received->length = 0;
+    if (!readIntoBuffer(fd, received, request.length)) {
+        return 0;
+    }
+
+    if (request.settings != server->settings) {
+        bufferPrintf(messages, "%s: Error: The server compiles with different --target or -O0 settings\n", name);
+        response.status = RESPONSE_REFUSED;
+    } else {
+        SourceBuffer source = { received->data, request.length, 0 };
+        response.status = compileSource(context, name, &source, output, messages) > 0 ? RESPONSE_ERRORS
+                                                                                       : RESPONSE_COMPILED;
+    }
+    response.outputLength = (unsigned int)output->length;
+    response.messagesLength = (unsigned int)messages->length;
+    if (!writeMessage(fd, &response, sizeof(response), output->data, output->length, messages->data,
+                      messages->length)) {
+        return 0;
+    }
+    atomic_fetch_add(&server->requests, 1);
+    return 1;
+}
+
+// Function to watch a socket again for its next event; the one-shot event
+// gives it to a single worker, which holds it until it calls this
+void rearmSocket(CompileServer *server, int fd) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = fd;
+    epoll_ctl(server->eventFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+// Function run by every worker thread: wait for a new connection or for a
+// request on an open one, answer that one request and watch the connection
+// again, so an idle client holds no thread. Exits once the server stops.
+void* runServerWorker(void *argument) {
+    CompileServer *server = (CompileServer*)argument;
+    CompilationContext context;
+    OutputBuffer received, output, messages;
+
+    initCompilationContext(&context);
+    initOutputBuffer(&received, -1, 0);
+    initOutputBuffer(&output, -1, 0);
+    initOutputBuffer(&messages, -1, 0);
+    while (!atomic_load(&server->stopping)) {
+        struct epoll_event event;
+        if (epoll_wait(server->eventFd, &event, 1, -1) <= 0 || event.data.fd == server->wakeFds[0]) {
+            continue;  // Interrupted by a signal, or the server stopped
+        }
+
+        if (event.data.fd == server->listenFd) {
+            int fd = accept(server->listenFd, NULL, NULL);
+            rearmSocket(server, server->listenFd);
+            if (fd < 0) {
+                continue;  // The client hung up before it was accepted
+            }
+            // A client that stops in the middle of a request only holds its worker this long
+            struct timeval timeout = { SERVER_IO_TIMEOUT, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.fd = fd;
+            if (epoll_ctl(server->eventFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                continue;
+            }
+            atomic_fetch_add(&server->connections, 1);
+            continue;
+        }
+
+        // Closing the connection also takes it out of the epoll instance
+        if (serveRequest(server, event.data.fd, &context, &received, &output, &messages)) {
+            rearmSocket(server, event.data.fd);
+        } else {
+            close(event.data.fd);
+        }
+    }
+    freeOutputBuffer(&received);
+    freeOutputBuffer(&output);
+    freeOutputBuffer(&messages);
+    freeCompilationContext(&context);
+    return NULL;
+}
+
+// Function to fill in the address of a Unix socket; returns 0 if the path is too long
+int socketAddress(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path);
+        return 0;
+    }
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+// Function to run the compile server: every worker thread waits on one epoll
+// instance for new connections and for requests on open ones and answers them
+// one at a time with its own warm compilation context, until a client sends a
+// shutdown request or the process gets SIGINT or SIGTERM
+int runServer(const char *socketPath, int workers) {
+    CompileServer server;
+    struct sockaddr_un address;
+    pthread_t *threads;
+    struct sigaction action;
+
+    if (!socketAddress(socketPath, &address)) {
+        return 1;
+    }
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listenFd < 0) {
+        fprintf(stderr, "Error: Cannot create a socket\n");
+        return 1;
+    }
+    // A socket file left by a server that is gone is replaced; a live server is not
+    if (connect(server.listenFd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "Error: A server is already listening on %s\n", socketPath);
+        close(server.listenFd);
+        return 1;
+    }
+    close(server.listenFd);
+    unlink(socketPath);
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listenFd < 0 || bind(server.listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server.listenFd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", socketPath);
+        if (server.listenFd >= 0) {
+            close(server.listenFd);
+        }
+        return 1;
+    }
+    // The wake pipe is never read, so once written it wakes every worker
+    server.eventFd = epoll_create1(0);
+    if (server.eventFd < 0 || pipe(server.wakeFds) != 0) {
+        fprintf(stderr, "Error: Cannot create the server's epoll instance\n");
+        close(server.listenFd);
+        unlink(socketPath);
+        return 1;
+    }
+    fcntl(server.wakeFds[1], F_SETFL, O_NONBLOCK);
+    // A client that connects and hangs up before accept must not block a worker
+    fcntl(server.listenFd, F_SETFL, O_NONBLOCK);
+    struct epoll_event event = { EPOLLIN, { .fd = server.wakeFds[0] } };
+    epoll_ctl(server.eventFd, EPOLL_CTL_ADD, server.wakeFds[0], &event);
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = server.listenFd;
+    epoll_ctl(server.eventFd, EPOLL_CTL_ADD, server.listenFd, &event);
+    server.settings = serverSettings();
+    atomic_init(&server.stopping, 0);
+    atomic_init(&server.requests, 0);
+    atomic_init(&server.connections, 0);
+
+    // A client that hangs up early must not kill the server while it answers
+    signal(SIGPIPE, SIG_IGN);
+    activeServer = &server;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleServerSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    threads = (pthread_t*)malloc((size_t)workers * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Error: Out of memory for server threads\n");
+        exit(1);
+    }
+    // Clients' diagnostics go back to them; the lexer's own listing is dropped
+    diagnosticOutput = fopen("/dev/null", "w");
+    if (diagnosticOutput == NULL) {
+        diagnosticOutput = stderr;
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, runServerWorker, &server);
+    }
+    fprintf(stderr, "Serving on %s with %d threads\n", socketPath, workers);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    activeServer = NULL;
+    close(server.listenFd);
+    unlink(socketPath);
+    // Idle connections stay open until the process exits
+    close(server.eventFd);
+    close(server.wakeFds[0]);
+    close(server.wakeFds[1]);
+    free(threads);
+    if (diagnosticOutput != stderr) {
+        fclose(diagnosticOutput);
+    }
+    diagnosticOutput = stderr;
+    fprintf(stderr, "Served %ld requests on %ld connections\n", atomic_load(&server.requests),
+            atomic_load(&server.connections));
+    return 0;
+}
+
+// Function to compare two latencies for qsort
+int compareSeconds(const void *a, const void *b) {
+    double first = *(const double*)a;
+    double second = *(const double*)b;
+    return (first > second) - (first < second);
+}
+
+// Function to send the input files to a compile server over one connection
+// and print what comes back like a local compile would. With repeat above 1
+// every file is sent that many times and the request latencies are reported.
+// Returns 1 if a request failed or had errors.
+int runClient(const char *socketPath, const char **paths, int count, long repeat, int shutdownServer) {
+    struct sockaddr_un address;
+    OutputBuffer reply;
+    double *latencies = NULL;
+    long latencyCount = 0;
+    int failed = 0;
+    int errors = 0;  // A file with errors does not stop the others, as in a batch compile
+    int fd;
+
+    if (!socketAddress(socketPath, &address)) {
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: No server is listening on %s\n", socketPath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    if (shutdownServer) {
+        ServerRequest request = { SERVER_MAGIC, REQUEST_SHUTDOWN, serverSettings(), 0, 0 };
+        failed = !writeMessage(fd, &request, sizeof(request), NULL, 0, NULL, 0);
+        close(fd);
+        return failed;
+    }
+    if (repeat > 1) {
+        latencies = (double*)malloc((size_t)repeat * (size_t)count * sizeof(double));
+        if (latencies == NULL) {
+            fprintf(stderr, "Error: Out of memory for latencies\n");
+            exit(1);
+        }
+    }
+
+    initOutputBuffer(&reply, STDOUT_FILENO, 0);
+    for (int i = 0; i < count && !failed; i++) {
+        SourceBuffer source;
+        int loaded = loadSourceFile(paths[i], &source);
+        if (loaded != LOAD_OK) {
+            fprintf(stderr, "%s: %s\n", paths[i], loadErrorText(loaded));
+            failed = 1;
+            break;
+        }
+        if (source.length > MAX_REQUEST_SIZE) {
+            fprintf(stderr, "%s: Error: The source is larger than the server accepts (%u bytes)\n", paths[i],
+                    MAX_REQUEST_SIZE);
+            releaseSource(&source);
+            failed = 1;
             break;
+        }
+        for (long r = 0; r < (repeat > 1 ? repeat : 1); r++) {
+            ServerRequest request = { SERVER_MAGIC, REQUEST_COMPILE, serverSettings(), (unsigned int)strlen(paths[i]),
+                                      (unsigned int)source.length };
+            ServerResponse response;
+            double start = nowSeconds();
+
+            if (!writeMessage(fd, &request, sizeof(request), paths[i], request.nameLength, source.data,
+                              source.length) ||
+                !readFully(fd, &response, sizeof(response))) {
+                fprintf(stderr, "Error: The server closed the connection\n");
+                failed = 1;
+                break;
+            }
+            reply.length = 0;
+            reserveOutput(&reply, (size_t)response.outputLength + response.messagesLength);
+            if (!readFully(fd, reply.data, (size_t)response.outputLength + response.messagesLength)) {
+                fprintf(stderr, "Error: The server closed the connection\n");
+                failed = 1;
+                break;
+            }
+            if (latencies != NULL) {
+                latencies[latencyCount++] = nowSeconds() - start;
+            }
+            // The first answer for each file is printed, the repeats only timed
+            if (r == 0) {
+                fwrite(reply.data + response.outputLength, 1, response.messagesLength, stderr);
+                if (count > 1 && response.status == RESPONSE_COMPILED) {
+                    printf("# %s\n", paths[i]);
+                }
+                fwrite(reply.data, 1, response.outputLength, stdout);
+                fflush(stdout);
+            }
+            errors |= response.status != RESPONSE_COMPILED;
+        }
+        releaseSource(&source);
+    }
+    freeOutputBuffer(&reply);
+    close(fd);
+
+    if (latencyCount > 0) {
+        double total = 0.0;
+        for (long i = 0; i < latencyCount; i++) {
+            total += latencies[i];
+        }
+        qsort(latencies, (size_t)latencyCount, sizeof(double), compareSeconds);
+        fprintf(stderr, "%ld requests: mean %.1f us, median %.1f us, 99th percentile %.1f us\n", latencyCount,
+                total / latencyCount * 1e6, latencies[latencyCount / 2] * 1e6,
+                latencies[latencyCount * 99 / 100] * 1e6);
+    }
+    free(latencies);
+    return failed || errors;
+}
+
+// Function to write a program whose main function has about the given number
+// of statements over more locals than there are registers, with loops and calls
+int writeRegisterPressureSource(const char *path, long statements) {
+    FILE *out = fopen(path, "w");
+    const int locals = 24;
+
+    if (out == NULL) {
+        return 0;
+    }
+    fprintf(out, "int g0;\nint g1;\nint helper() {\n    g1 = g1 + 1;\n    return g0 + g1;\n}\nint main() {\n");
+    for (int v = 0; v < locals; v++) {
+        fprintf(out, "    int v%d = g0 + %d;\n", v, v);
+    }
+    for (long s = 0; s < statements; s++) {
+        int a = (int)(s % locals), b = (int)((s * 7 + 3) % locals), c = (int)((s * 13 + 5) % locals);
+        if (s % 64 == 63) {
+            fprintf(out, "    v%d = helper() + v%d;\n", a, b);
+        } else if (s % 32 == 31) {
+            fprintf(out, "    while (v%d > 1000) { v%d = v%d / 2; }\n", a, a, a);
+        } else {
+            fprintf(out, "    v%d = v%d %s v%d;\n", a, b, s % 3 == 0 ? "*" : s % 3 == 1 ? "+" : "-", c);
+        }
+    }
+    fprintf(out, "    return v0");
+    for (int v = 1; v < locals; v++) {
+        fprintf(out, " + v%d", v);
+    }
+    fprintf(out, ";\n}\n");
+    return fclose(out) == 0;
+}
+
+// Function to measure the register allocator on growing functions
+void benchmarkRegisterAllocator(long maxStatements) {
+    char path[] = "/tmp/rabenchXXXXXX";
+    int fd = mkstemp(path);
+    CompilationContext context;
 
-        case AST_TYPE:
-            // For simplicity, ignore types in expressions
+    if (fd < 0) {
+        fprintf(stderr, "Error creating benchmark file.\n");
+        return;
+    }
+    close(fd);
+    traceEnabled = 0;
+
+    initCompilationContext(&context);
+    printf("%10s %12s %10s %10s %10s %12s %10s\n", "Statements", "Instrs", "Intervals", "Spilled", "Coalesced",
+           "Alloc(ms)", "ns/instr");
+    for (long statements = 1000; statements <= maxStatements; statements *= 2) {
+        SourceBuffer source;
+        TokenStream tokens;
+        AST ast;
+        DiagnosticList diagnostics = { NULL, 0, 0 };
+        IRProgram program;
+        PassStats passStats;
+        RegisterAllocation allocation;
+
+        if (!writeRegisterPressureSource(path, statements) || loadSourceFile(path, &source) != LOAD_OK) {
+            fprintf(stderr, "Error writing benchmark file.\n");
             break;
+        }
+        beginCompilation(&context);
+        initTokenStream(&tokens, source.data);
+        lexicalAnalysis(&source, &tokens, NULL, NULL);
+        initAST(&ast);
+        parse(&tokens, &ast, &diagnostics);
+        initIRProgram(&program);
+        generateIntermediateCode(&ast, &program);
+        initPassStats(&passStats);
+        if (options.optimize) {
+            optimizeProgram(&program, &passStats);
+        }
 
-        // Add cases for other node types as needed
+        // main is the last function and carries all of the pressure
+        IRFunction *ir = &program.functions[program.count - 1];
+        initRegisterAllocation(&allocation);
+        allocateRegisters(ir, &allocation);
+        printf("%10ld %12d %10d %10d %10d %12.3f %10.1f\n", statements, ir->count, allocation.stats.intervals,
+               allocation.stats.spilled, allocation.stats.coalesced, allocation.stats.seconds * 1e3,
+               allocation.stats.seconds * 1e9 / ir->count);
+
+        freeRegisterAllocation(&allocation);
+        freeIRProgram(&program);
+        freeDiagnostics(&diagnostics);
+        freeAST(&ast);
+        freeTokenStream(&tokens);
+        releaseSource(&source);
+    }
 
-        default:
-            printf("Error: Unsupported expression node type\n");
+    freeCompilationContext(&context);
+    unlink(path);
+}
+
+// Function to measure batch compilation of many small units on 1, 2, 4, ...
+// threads up to the number of processors
+void benchmarkParallel(int unitCount) {
+    char directory[] = "/tmp/parbenchXXXXXX";
+    char (*paths)[64];
+    CompilationUnit *units;
+    int processors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double single = 0.0;
+
+    if (unitCount < 1 || mkdtemp(directory) == NULL) {
+        fprintf(stderr, "Error creating benchmark directory.\n");
+        return;
+    }
+    paths = malloc((size_t)unitCount * sizeof(*paths));
+    units = (CompilationUnit*)calloc((size_t)unitCount, sizeof(CompilationUnit));
+    if (paths == NULL || units == NULL) {
+        fprintf(stderr, "Error: Out of memory for benchmark units\n");
+        exit(1);
+    }
+    for (int i = 0; i < unitCount; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/unit%d.c", directory, i);
+        if (!writeRegisterPressureSource(paths[i], 100 + i % 7 * 50)) {
+            fprintf(stderr, "Error writing benchmark file.\n");
+            unitCount = i;
             break;
+        }
+    }
+    traceEnabled = 0;
+    diagnosticOutput = stderr;
+
+    printf("%8s %8s %12s %10s %10s\n", "Units", "Threads", "Time(ms)", "Speedup", "Stolen");
+    for (int workers = 1; workers <= processors || workers == 1; workers *= 2) {
+        BatchStats stats;
+
+        for (int i = 0; i < unitCount; i++) {
+            units[i].path = paths[i];
+        }
+        compileBatch(units, unitCount, workers, &stats);
+        for (int i = 0; i < unitCount; i++) {
+            freeOutputBuffer(&units[i].output);
+            freeOutputBuffer(&units[i].messages);
+        }
+        if (workers == 1) {
+            single = stats.seconds;
+        }
+        printf("%8d %8d %12.3f %9.2fx %10ld\n", unitCount, stats.workers, stats.seconds * 1e3,
+               single / stats.seconds, stats.steals);
     }
+
+    for (int i = 0; i < unitCount; i++) {
+        unlink(paths[i]);
+    }
+    rmdir(directory);
+    free(units);
+    free(paths);
 }
 
+// Shapes of generated programs, each stressing a different part of the compiler
+enum {
+    SHAPE_DECLARATIONS,  // Global declarations: symbol table and AST size
+    SHAPE_NESTING,       // Deeply parenthesized expressions: parser recursion, temporaries
+    SHAPE_IDENTIFIERS,   // Locals with long names: lexer, hashing and the name arena
+    SHAPE_STRINGS,       // Long string literals with escapes: lexer only, they are not in the grammar
+    SHAPE_FUNCTIONS,     // Many small functions calling each other: per-function overhead
+    SHAPE_CHAINS,        // Long unparenthesized operator chains: AST depth, lowering, temporaries
+    SHAPE_COUNT
+};
+
+const char *shapeNames[] = { "declarations", "nesting", "identifiers", "strings", "functions", "chains" };
+
+#define NESTING_DEPTH 48           // Parentheses around each generated expression
+#define CHAIN_TERMS 4096           // Operands of each generated operator chain
+#define STATEMENTS_PER_FUNCTION 64 // Generated functions are closed after this many statements
 
+// Function to write one piece of a generated program; returns the bytes written
+int writeShapePiece(FILE *out, int shape, size_t piece) {
+    int count = 0;
+
+    switch (shape) {
+        case SHAPE_DECLARATIONS:
+            return fprintf(out, "int global_%zu;\n", piece);
+        case SHAPE_NESTING:
+            if (piece % STATEMENTS_PER_FUNCTION == 0) {
+                count += fprintf(out, "%sint nested%zu() {\n    int a = %zu;\n    int b = 1;\n",
+                                 piece == 0 ? "" : "    return a;\n}\n", piece / STATEMENTS_PER_FUNCTION, piece % 97);
+            }
+            count += fprintf(out, "    a = ");
+            for (int d = 0; d < NESTING_DEPTH; d++) {
+                fputc('(', out);
+            }
+            count += NESTING_DEPTH;
+            count += fprintf(out, "a");
+            for (int d = 0; d < NESTING_DEPTH; d++) {
+                count += fprintf(out, " %c %s)", "+-*+"[d % 4], d % 3 == 0 ? "b" : "3");
+            }
+            return count + fprintf(out, ";\n");
+        case SHAPE_IDENTIFIERS:
+            if (piece % STATEMENTS_PER_FUNCTION == 0) {
+                count += fprintf(out, "%sint function_with_a_rather_long_descriptive_name_%zu() {\n"
+                                 "    int accumulated_total_of_the_generated_benchmark_values = 0;\n",
+                                 piece == 0 ? "" : "    return accumulated_total_of_the_generated_benchmark_values;\n}\n",
+                                 piece / STATEMENTS_PER_FUNCTION);
+            }
+            return count + fprintf(out, "    int intermediate_value_computed_by_statement_number_%zu_of_the_benchmark = %zu;\n"
+                                   "    accumulated_total_of_the_generated_benchmark_values = "
+                                   "accumulated_total_of_the_generated_benchmark_values + "
+                                   "intermediate_value_computed_by_statement_number_%zu_of_the_benchmark;\n",
+                                   piece, piece % 1000, piece);
+        case SHAPE_STRINGS:
+            return fprintf(out, "\"message %zu: the quick brown fox jumps over the lazy dog \\\"twice\\\"\\n"
+                           "and then some more text so that the literal is long enough to matter\";\n", piece);
+        case SHAPE_CHAINS:
+            if (piece % STATEMENTS_PER_FUNCTION == 0) {
+                count += fprintf(out, "%sint chain%zu() {\n    int a = %zu;\n    int b = 1;\n",
+                                 piece == 0 ? "" : "    return a;\n}\n", piece / STATEMENTS_PER_FUNCTION, piece % 97);
+            }
+            count += fprintf(out, "    a = a");
+            for (int t = 1; t < CHAIN_TERMS; t++) {
+                count += t % 3 == 0 ? fprintf(out, " %c %d", "+-*+"[t % 4], t % 97)
+                                    : fprintf(out, " %c %c", "+-*+"[t % 4], t % 3 == 1 ? 'b' : 'a');
+                if (t % 16 == 0) {
+                    count += fprintf(out, "\n       ");
+                }
+            }
+            return count + fprintf(out, ";\n");
+        default:
+            if (piece == 0) {
+                return fprintf(out, "int f0() {\n    return 1;\n}\n");
+            }
+            return fprintf(out, "int f%zu() {\n    int x = f%zu();\n    if (x > %zu) {\n        x = x - 1;\n    }\n"
+                           "    return x + 1;\n}\n", piece, piece - 1, piece % 50);
+    }
+}
 
+// Function to generate a program of the given shape and roughly the given
+// size; out may be stdout
+int generateSource(FILE *out, int shape, size_t targetBytes) {
+    size_t written = 0;
 
+    for (size_t piece = 0; written < targetBytes; piece++) {
+        int count = writeShapePiece(out, shape, piece);
+        if (count < 0) {
+            return 0;
+        }
+        written += (size_t)count;
+    }
+    if (shape == SHAPE_NESTING || shape == SHAPE_CHAINS) {
+        fprintf(out, "    return a;\n}\n");
+    } else if (shape == SHAPE_IDENTIFIERS) {
+        fprintf(out, "    return accumulated_total_of_the_generated_benchmark_values;\n}\n");
+    }
+    if (shape != SHAPE_STRINGS) {
+        fprintf(out, "int main() {\n    return 0;\n}\n");
+    }
+    return !ferror(out);
+}
 
-void generateAssemblyCode(IntermediateCode* intermediateCode, int codeIndex);
+// Function to find a shape by name; returns -1 for an unknown name
+int findShape(const char *name) {
+    for (int s = 0; s < SHAPE_COUNT; s++) {
+        if (strcmp(shapeNames[s], name) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
 
-void generateAssemblyCode(IntermediateCode* intermediateCode, int codeIndex) {
-    printf("\n5.Generated Assembly Code:\n");
-    printf("\n");
+// Stored time of one stage of one benchmark input
+typedef struct {
+    char shape[32];
+    size_t bytes;
+    char stage[16];
+    double seconds;
+} BaselineEntry;
 
-    for (int i = 0; i < codeIndex; i++) {
-        switch (intermediateCode[i].op) {
-            case ASM_MOVE:
-                printf("MOV %s, %s\n", intermediateCode[i].result, intermediateCode[i].arg1);
-                break;
-            case ASM_ADD:
-                printf("ADD %s, %s, %s\n", intermediateCode[i].result, intermediateCode[i].arg1, intermediateCode[i].arg2);
-                break;
-            case ASM_SUB:
-                printf("SUB %s, %s, %s\n", intermediateCode[i].result, intermediateCode[i].arg1, intermediateCode[i].arg2);
-                break;
-            case ASM_MUL:
-                printf("MUL %s, %s, %s\n", intermediateCode[i].result, intermediateCode[i].arg1, intermediateCode[i].arg2);
-                break;
-            case ASM_DIV:
-                printf("DIV %s, %s, %s\n", intermediateCode[i].result, intermediateCode[i].arg1, intermediateCode[i].arg2);
-                break;
-            // Add more cases for other operations as needed
-            default:
-                printf("Unknown operation\n");
-                break;
+// Baseline times loaded from a file of "shape bytes stage seconds" lines
+typedef struct {
+    BaselineEntry *entries;
+    int count;
+    int capacity;
+} Baseline;
+
+// Function to load a baseline file; lines starting with # are comments
+int loadBaseline(const char *path, Baseline *baseline) {
+    FILE *in = fopen(path, "r");
+    char line[256];
+
+    baseline->entries = NULL;
+    baseline->count = 0;
+    baseline->capacity = 0;
+    if (in == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        BaselineEntry entry;
+        if (line[0] == '#' || sscanf(line, "%31s %zu %15s %lf", entry.shape, &entry.bytes, entry.stage,
+                                     &entry.seconds) != 4) {
+            continue;
+        }
+        baseline->entries = (BaselineEntry*)reserveArray(baseline->entries, &baseline->capacity, baseline->count + 1,
+                                                         sizeof(BaselineEntry));
+        baseline->entries[baseline->count++] = entry;
+    }
+    fclose(in);
+    return 1;
+}
+
+// Function to look up the stored time of a stage; returns a negative time when there is none
+double baselineSeconds(const Baseline *baseline, const char *shape, size_t bytes, const char *stage) {
+    for (int i = 0; i < baseline->count; i++) {
+        const BaselineEntry *entry = &baseline->entries[i];
+        if (entry->bytes == bytes && strcmp(entry->shape, shape) == 0 && strcmp(entry->stage, stage) == 0) {
+            return entry->seconds;
         }
     }
+    return -1.0;
 }
 
-int main() {
-    FILE *inputFile;
-    Token tokens[MAX_TOKENS];
-    int numTokens = 0;
+// Function to compile a file once with every stage timed into a profile;
+// lexOnly stops after the lexer
+void profilePipeline(CompilationContext *context, const char *path, int lexOnly, Profile *profile) {
+    SourceBuffer source;
+    TokenStream tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    IRProgram program;
+    PassStats passStats;
+    OutputBuffer assembly;
+
+    initProfile(profile);
+    beginPhase(profile, "read");
+    if (loadSourceFile(path, &source) != LOAD_OK) {
+        return;
+    }
+    endPhase(profile);
+    beginCompilation(context);
+    beginPhase(profile, "lex");
+    initTokenStream(&tokens, source.data);
+    lexicalAnalysis(&source, &tokens, NULL, NULL);
+    endPhase(profile);
+    if (!lexOnly) {
+        beginPhase(profile, "parse");
+        initAST(&ast);
+        parse(&tokens, &ast, &diagnostics);
+        endPhase(profile);
+        beginPhase(profile, "lower");
+        initIRProgram(&program);
+        generateIntermediateCode(&ast, &program);
+        endPhase(profile);
+        initPassStats(&passStats);
+        if (options.optimize) {
+            beginPhase(profile, "optimize");
+            optimizeProgram(&program, &passStats);
+            endPhase(profile);
+        }
+        beginPhase(profile, "codegen");
+        initOutputBuffer(&assembly, STDOUT_FILENO, 0);
+        if (options.target == TARGET_X86_64) {
+            generateX86Assembly(&assembly, &program, NULL);
+        } else {
+            generateAssemblyCode(&assembly, &program, NULL);
+        }
+        endPhase(profile);
+        sampleMemory(profile, &source, &tokens, &ast, &program, &assembly);
+        countProfile(profile, &tokens, &ast, &program);
+
+        freeOutputBuffer(&assembly);
+        freeIRProgram(&program);
+        freeDiagnostics(&diagnostics);
+        freeAST(&ast);
+    } else {
+        sampleMemory(profile, &source, &tokens, NULL, NULL, NULL);
+        profile->tokens = tokens.count;
+    }
+    freeTokenStream(&tokens);
+    releaseSource(&source);
+}
 
-    inputFile = fopen("input.txt", "r");
-    if (inputFile == NULL) {
-        printf("Error opening input file.\n");
+// Function to run every shape at 1 KB, 16 KB, 256 KB, ... up to maxMegabytes,
+// time each stage (best of several runs for small inputs), compare the times
+// with a baseline file and optionally store them as the new baseline. Returns
+// 1 when a stage is slower than its baseline by more than threshold percent.
+// Stages are measured in CPU time, which unlike wall time does not grow when
+// the machine is busy with other work; the pipeline runs on one thread.
+int benchmarkSuite(size_t maxMegabytes, const char *baselinePath, const char *savePath, double threshold) {
+    char path[] = "/tmp/suitebenchXXXXXX";
+    int fd = mkstemp(path);
+    CompilationContext context;
+    Baseline baseline = { NULL, 0, 0 };
+    FILE *save = NULL;
+    int regressions = 0;
+
+    if (fd < 0) {
+        fprintf(stderr, "Error creating benchmark file.\n");
         return 1;
     }
+    close(fd);
+    if (baselinePath != NULL && !loadBaseline(baselinePath, &baseline)) {
+        fprintf(stderr, "Error reading baseline %s.\n", baselinePath);
+        unlink(path);
+        return 1;
+    }
+    if (savePath != NULL && (save = fopen(savePath, "w")) == NULL) {
+        fprintf(stderr, "Error writing baseline %s.\n", savePath);
+        unlink(path);
+        return 1;
+    }
+    if (save != NULL) {
+        fprintf(save, "# shape bytes stage seconds (%s, %s)\n", options.optimize ? "-O" : "-O0",
+                options.target == TARGET_X86_64 ? "x86-64" : "pseudo");
+    }
+    traceEnabled = 0;
+    diagnosticOutput = stderr;
+
+    printf("CPU time per stage in ms\n");
+    printf("%-12s %10s %10s %10s %10s %10s %10s %10s %10s %9s %10s\n", "Shape", "Size(KB)", "read", "lex", "parse",
+           "lower", "optimize", "codegen", "total", "MB/s", "Peak(MB)");
+    for (int shape = 0; shape < SHAPE_COUNT; shape++) {
+        for (size_t bytes = 1024; bytes <= (maxMegabytes << 20); bytes *= 16) {
+            FILE *out = fopen(path, "w");
+            Profile best, run;
+            // Best of 3 to 20 runs up to 4 MB; larger inputs run once
+            int repeat = bytes > (4u << 20) ? 1 : (4u << 20) / bytes > 20 ? 20 : (4u << 20) / bytes < 3 ? 3 :
+                         (int)((4u << 20) / bytes);
+            double total = 0.0;
+            size_t peak = 0;
+            struct stat info;
+
+            if (out == NULL || !generateSource(out, shape, bytes) || fclose(out) != 0 || stat(path, &info) != 0) {
+                fprintf(stderr, "Error writing benchmark file.\n");
+                break;
+            }
+            // A fresh context per input, so the symbol memory of a larger input does not show up in the next one
+            initCompilationContext(&context);
+            for (int r = 0; r < repeat; r++) {
+                profilePipeline(&context, path, shape == SHAPE_STRINGS, &run);
+                if (r == 0) {
+                    best = run;
+                }
+                for (int p = 0; p < run.phaseCount && p < best.phaseCount; p++) {
+                    if (run.phases[p].cpuSeconds < best.phases[p].cpuSeconds) {
+                        best.phases[p].cpuSeconds = run.phases[p].cpuSeconds;
+                    }
+                }
+            }
+            freeCompilationContext(&context);
+
+            printf("%-12s %10.0f", shapeNames[shape], bytes / 1024.0);
+            const char *stages[] = { "read", "lex", "parse", "lower", "optimize", "codegen" };
+            for (int s = 0; s < 6; s++) {
+                const ProfilePhase *phase = NULL;
+                for (int p = 0; p < best.phaseCount; p++) {
+                    if (strcmp(best.phases[p].name, stages[s]) == 0) {
+                        phase = &best.phases[p];
+                    }
+                }
+                if (phase == NULL) {
+                    printf(" %10s", "-");
+                    continue;
+                }
+                printf(" %10.3f", phase->cpuSeconds * 1e3);
+                total += phase->cpuSeconds;
+            }
+            for (int k = 0; k < MEMORY_KINDS; k++) {
+                peak += best.peakBytes[k];
+            }
+            printf(" %10.3f %9.1f %10.1f\n", total * 1e3, (double)info.st_size / (1 << 20) / total,
+                   (double)peak / (1 << 20));
+
+            // Every stage is compared on its own, so a slower parser is not hidden by a faster lexer
+            for (int p = 0; p < best.phaseCount; p++) {
+                const ProfilePhase *phase = &best.phases[p];
+                double stored = baselineSeconds(&baseline, shapeNames[shape], bytes, phase->name);
+                if (save != NULL) {
+                    fprintf(save, "%s %zu %s %.9f\n", shapeNames[shape], bytes, phase->name, phase->cpuSeconds);
+                }
+                // Differences under 0.1 ms are timer noise
+                if (stored >= 0.0 && phase->cpuSeconds > stored * (1.0 + threshold / 100.0) &&
+                    phase->cpuSeconds - stored > 1e-4) {
+                    printf("    REGRESSION %s: %.3f ms, baseline %.3f ms (%+.0f%%)\n", phase->name,
+                           phase->cpuSeconds * 1e3, stored * 1e3, (phase->cpuSeconds / stored - 1.0) * 100.0);
+                    regressions++;
+                }
+            }
+        }
+    }
+
+    if (baselinePath != NULL) {
+        printf("%d stages slower than the baseline by more than %.0f%%\n", regressions, threshold);
+    }
+    if (save != NULL) {
+        fclose(save);
+        printf("Baseline written to %s\n", savePath);
+    }
+    free(baseline.entries);
+    unlink(path);
+    return regressions > 0;
+}
+
+// Token spellings and fragments the parser fuzzer strings together
+const char *fuzzFragments[] = {
+    "int", "char", "float", "if", "else", "while", "for", "return", "break", "continue", "x", "y", "main", "f",
+    "0", "42", "(", ")", "{", "}", ";", "=", "+", "-", "*", "/", "<", ">=", "==", "!=", "\"s\"", "@",
+    "int x;", "int main() {", "x = 1;", "if (x < 2) {", "while (x) {", "return x;", "f();", "} else {"
+};
+#define FUZZ_FRAGMENT_COUNT ((int)(sizeof(fuzzFragments) / sizeof(fuzzFragments[0])))
+
+// Productions the parser may enter per token: an expression descends
+// through five of them before it consumes its first token
+#define PARSE_WORK_PER_TOKEN 16
+
+// Function to draw the next number of a xorshift generator
+unsigned long long nextRandom(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Function to write random source text: fragments picked at random, or
+// (one time in eight) one fragment repeated to build deep nesting. With
+// closeEvery set, the open braces are closed after that many fragments, so
+// one stray '{' cannot make recovery skip the rest of the text at once.
+void writeFuzzSource(OutputBuffer *text, unsigned long long *state, int fragments, int closeEvery) {
+    int repeated = nextRandom(state) % 8 == 0 ? (int)(nextRandom(state) % FUZZ_FRAGMENT_COUNT) : -1;
+    int open = 0;
+
+    text->length = 0;
+    for (int i = 0; i < fragments; i++) {
+        int pick = repeated >= 0 ? repeated : (int)(nextRandom(state) % FUZZ_FRAGMENT_COUNT);
+        const char *fragment = fuzzFragments[pick];
+        bufferPuts(text, fragment);
+        bufferPuts(text, nextRandom(state) % 4 == 0 ? "\n" : " ");
+        open += (strchr(fragment, '{') != NULL) - (strchr(fragment, '}') != NULL);
+        if (closeEvery > 0 && (i + 1) % closeEvery == 0) {
+            for (; open > 0; open--) {
+                bufferPuts(text, "}\n");
+            }
+            open = 0;  // Stray '}' before this point do not close later braces
+        }
+    }
+}
 
-    printf("1.Lexical Analysis:\n");
-    printf("\n");
-    lexicalAnalysis(inputFile, tokens, &numTokens);
-    printf("**************************************\n");
+// Function to lex and parse one text and check that the parser finished
+// within its work bound; returns 0 and describes the failure otherwise
+int fuzzParseOnce(CompilationContext *context, OutputBuffer *text, long *work, int *tokenCount, int *errors) {
+    SourceBuffer source = { text->data, text->length, 0 };
+    TokenStream stream;
+    TokenSource tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    Parser parser = { .tokens = &tokens, .ast = &ast, .diagnostics = &diagnostics };
+    int ok;
+
+    beginCompilation(context);
+    initTokenStream(&stream, source.data);
+    lexicalAnalysis(&source, &stream, NULL, NULL);
+    initAST(&ast);
+    initStreamTokenSource(&tokens, &stream);
+    parseTokens(&parser);
+
+    *work = parser.work;
+    *tokenCount = stream.count;
+    *errors = diagnostics.count;
+    ok = tokens.position == stream.count && parser.depth == 0 &&
+         parser.work <= (long)PARSE_WORK_PER_TOKEN * (stream.count + 1) &&
+         (options.maxErrors == 0 || diagnostics.count <= options.maxErrors + 1);
+
+    freeAST(&ast);
+    freeDiagnostics(&diagnostics);
+    freeTokenStream(&stream);
+    return ok;
+}
 
-    // Perform parsing
-    printf("\n2.Parsing:\n");
-    printf("\n");
-    parse(tokens, numTokens);
-    printf("Completed Parsing\n");
-     printf("**************************************\n");
+// Terms of the longest operator chain the fuzzer compiles and runs
+#define FUZZ_CHAIN_TERMS (1 << 18)
+
+// Function to write a program whose main returns one unparenthesized chain
+// of '+', '-' and '*' over random digits, or with global set a global
+// initialized by the chain; returns the value C gives it. The chain parses
+// into a left-leaning tree as deep as it has operators.
+long writeChainSource(OutputBuffer *text, unsigned long long *state, int terms, int global) {
+    unsigned long sum = 0, product = 1;
+    int subtract = 0;
+
+    text->length = 0;
+    bufferPuts(text, global ? "int g = 1" : "int main() {\n    return 1");
+    for (int i = 1; i < terms; i++) {
+        unsigned long digit = nextRandom(state) % 10;
+        char op = nextRandom(state) % 8 == 0 ? '*' : nextRandom(state) % 2 == 0 ? '+' : '-';
+        if (op == '*') {
+            product *= digit;
+        } else {
+            sum = subtract ? sum - product : sum + product;
+            product = digit;
+            subtract = op == '-';
+        }
+        bufferPrintf(text, i % 16 == 0 ? "\n        %c %lu" : " %c %lu", op, digit);
+    }
+    bufferPuts(text, global ? ";\nint main() {\n    return g;\n}\n" : ";\n}\n");
+    return (long)(subtract ? sum - product : sum + product);
+}
 
-    // Display the symbol table
-    displaySymbolTable();
-     printf("**************************************\n");
+// Function to compile a program held in memory at the given optimization
+// level and run it in the VM
+int runVMSource(CompilationContext *context, SourceBuffer *source, int optimize, VMReport *report);
+
+// Function to feed random token streams to the parser and assert that every
+// parse consumes the whole input, reports at most the error limit and enters
+// at most PARSE_WORK_PER_TOKEN productions per token; then run operator
+// chains of growing length through the whole compiler, and parse garbage of
+// growing size without an error limit, so recovery runs over all of it, to
+// show that parse time stays linear. Returns 1 on a failed check.
+int fuzzParser(long iterations, unsigned long long seed) {
+    CompilationContext context;
+    OutputBuffer text;
+    unsigned long long state = seed != 0 ? seed : 0x9E3779B97F4A7C15ull;
+    long worst = 0;
+    double worstRatio = 0.0;
+    int failures = 0;
+
+    traceEnabled = 0;
+    diagnosticOutput = fopen("/dev/null", "w");
+    if (diagnosticOutput == NULL) {
+        diagnosticOutput = stderr;
+    }
+    initCompilationContext(&context);
+    initOutputBuffer(&text, -1, 0);
+
+    for (long i = 0; i < iterations; i++) {
+        long work;
+        int tokenCount, errors;
+        int fragments = 1 + (int)(nextRandom(&state) % (i % 64 == 63 ? 20000 : 400));
+
+        writeFuzzSource(&text, &state, fragments, 0);
+        if (!fuzzParseOnce(&context, &text, &work, &tokenCount, &errors)) {
+            printf("Failed: iteration %ld (seed %llu): %d tokens, %ld productions, %d errors\n", i, seed, tokenCount,
+                   work, errors);
+            failures++;
+            continue;
+        }
+        if ((double)work / (tokenCount + 1) > worstRatio) {
+            worstRatio = (double)work / (tokenCount + 1);
+            worst = i;
+        }
+    }
+    printf("%ld random inputs parsed, %d failed; at most %.2f productions per token (iteration %ld, bound %d)\n",
+           iterations, failures, worstRatio, worst, PARSE_WORK_PER_TOKEN);
+
+    // Long chains must be lowered, and folded as global initializers, without
+    // recursing once per operator
+    printf("%12s %12s %12s\n", "Terms", "-O0(ms)", "-O(ms)");
+    for (int terms = 1 << 12; terms <= FUZZ_CHAIN_TERMS; terms <<= 2) {
+        for (int global = 0; global <= 1; global++) {
+            long expected = writeChainSource(&text, &state, terms, global);
+            double seconds[2];
+            int ok = 1;
+
+            for (int optimize = 0; optimize <= 1; optimize++) {
+                SourceBuffer source = { text.data, text.length, 0 };
+                VMReport report;
+                double start = nowSeconds();
+                ok &= runVMSource(&context, &source, optimize, &report) && report.result == expected;
+                seconds[optimize] = nowSeconds() - start;
+            }
+            printf("%12d %12.3f %12.3f%s%s\n", terms, seconds[0] * 1e3, seconds[1] * 1e3,
+                   global ? "  (global)" : "", ok ? "" : "  FAILED");
+            failures += !ok;
+        }
+    }
 
-    printf("\n3.Semantic Analysis:\n");
-    TreeNode* astRoot = parseAndBuildAST(tokens, numTokens);
-    //printf("Completed Parsing and Building AST\n");
+    // Garbage of growing size: time per token must stay flat
+    int maxErrors = options.maxErrors;
+    options.maxErrors = 0;
+    printf("%12s %12s %12s %10s\n", "Tokens", "Time(ms)", "ns/token", "Work/token");
+    for (int fragments = 1 << 14; fragments <= 1 << 20; fragments <<= 2) {
+        long work;
+        int tokenCount, errors;
+
+        state = seed != 0 ? seed : 0x9E3779B97F4A7C15ull;
+        writeFuzzSource(&text, &state, fragments, 64);
+        double start = nowSeconds();
+        int ok = fuzzParseOnce(&context, &text, &work, &tokenCount, &errors);
+        double seconds = nowSeconds() - start;
+        printf("%12d %12.3f %12.1f %10.3f%s\n", tokenCount, seconds * 1e3, seconds * 1e9 / (tokenCount + 1),
+               (double)work / (tokenCount + 1), ok ? "" : "  FAILED");
+        failures += !ok;
+    }
+    options.maxErrors = maxErrors;
 
+    freeOutputBuffer(&text);
+    freeCompilationContext(&context);
+    if (diagnosticOutput != stderr) {
+        fclose(diagnosticOutput);
+    }
+    diagnosticOutput = stderr;
+    return failures > 0;
+}
 
+// Loop-heavy program of the VM benchmark; the %ld in the source is replaced
+// by the iteration count divided by divisor
+typedef struct {
+    const char *name;
+    long divisor;
+    const char *source;
+} VMBenchmark;
+
+const VMBenchmark vmBenchmarks[] = {
+    { "sum", 1,
+      "int main() {\n    int sum = 0;\n    int i;\n    for (i = 0; i < %ld; i = i + 1) {\n"
+      "        sum = sum + i * i - i / 3;\n    }\n    return sum;\n}\n" },
+    { "nested", 1000,
+      "int main() {\n    int count = 0;\n    int i;\n    int j;\n    for (i = 0; i < %ld; i = i + 1) {\n"
+      "        for (j = 0; j < 1000; j = j + 1) {\n"
+      "            if (i + j > 1000) { count = count + 1; } else { count = count - 1; }\n"
+      "        }\n    }\n    return count;\n}\n" },
+    { "collatz", 100,
+      "int main() {\n    int best = 0;\n    int n;\n    int x;\n    int steps;\n"
+      "    for (n = 1; n < %ld; n = n + 1) {\n        x = n;\n        steps = 0;\n        while (x != 1) {\n"
+      "            if (x - x / 2 * 2 == 0) { x = x / 2; } else { x = 3 * x + 1; }\n"
+      "            steps = steps + 1;\n        }\n        if (steps > best) { best = steps; }\n    }\n"
+      "    return best;\n}\n" },
+    { "primes", 20,
+      "int main() {\n    int count = 0;\n    int n;\n    int d;\n    int prime;\n"
+      "    for (n = 2; n < %ld; n = n + 1) {\n        prime = 1;\n"
+      "        for (d = 2; d * d <= n; d = d + 1) {\n            if (n - n / d * d == 0) { prime = 0; break; }\n"
+      "        }\n        count = count + prime;\n    }\n    return count;\n}\n" },
+    { "calls", 10,
+      "int g;\nint h;\nint step() {\n    g = g + h;\n    h = h + 1;\n    return g;\n}\n"
+      "int main() {\n    int last = 0;\n    int i;\n    for (i = 0; i < %ld; i = i + 1) {\n"
+      "        last = step() - last;\n    }\n    return last + g;\n}\n" }
+};
+#define VM_BENCHMARK_COUNT (int)(sizeof(vmBenchmarks) / sizeof(vmBenchmarks[0]))
+
+// Function to compile a program held in memory at the given optimization
+// level and run it in the VM
+int runVMSource(CompilationContext *context, SourceBuffer *source, int optimize, VMReport *report) {
+    TokenStream tokens;
+    AST ast;
+    DiagnosticList diagnostics = { NULL, 0, 0 };
+    IRProgram program;
+    PassStats passStats;
+
+    beginCompilation(context);
+    initTokenStream(&tokens, source->data);
+    lexicalAnalysis(source, &tokens, NULL, NULL);
+    initAST(&ast);
+    parse(&tokens, &ast, &diagnostics);
+    initIRProgram(&program);
+    generateIntermediateCode(&ast, &program);
+    initPassStats(&passStats);
+    if (optimize) {
+        optimizeProgram(&program, &passStats);
+    }
+    interpretProgram(&program, report, 0);
 
-    // Display the AST
-     printf("\nAbstract Syntax Tree (Tree Representation):\n");
-    displayAST(astRoot, 0);
-     printf("**************************************\n");
+    freeIRProgram(&program);
+    freeDiagnostics(&diagnostics);
+    freeAST(&ast);
+    freeTokenStream(&tokens);
+    return report->succeeded;
+}
 
-    printf("\n4.Intermediate Code Generation:\n");
-    IntermediateCode intermediateCode[MAX_TOKENS];
-    int codeIndex = 0;
-    generateIntermediateCode(astRoot, intermediateCode, &codeIndex);
+// Function to compile a program file at the given optimization level and run it in the VM
+int runVMBenchmark(CompilationContext *context, const char *path, int optimize, VMReport *report) {
+    SourceBuffer source;
+    int succeeded;
 
-    // Display generated intermediate code
-    printf("\nGenerated Intermediate Code:\n");
-    for (int i = 0; i < codeIndex; i++) {
-        printf("%d: ", i + 1);
+    if (loadSourceFile(path, &source) != LOAD_OK) {
+        return 0;
+    }
+    succeeded = runVMSource(context, &source, optimize, report);
+    releaseSource(&source);
+    return succeeded;
+}
 
-        switch (intermediateCode[i].op) {
-            case OP_ASSIGN:
-                printf("%s = %s\n", intermediateCode[i].result, intermediateCode[i].arg1);
-                break;
-            // Add cases for other operations as needed
-            default:
-                printf("Unknown operation\n");
-                break;
+// Expression whose value depends on the precedence and associativity of its operators
+typedef struct {
+    const char *expression;
+    long expected;
+} PrecedenceCase;
+
+const PrecedenceCase precedenceCases[] = {
+    { "1 == 2 < 3", 1 },
+    { "0 == 1 < 0", 1 },
+    { "3 != 2 > 1", 1 },
+    { "5 > 4 > 3", 0 },
+    { "1 < 2 == 2 < 1", 0 },
+    { "2 + 3 * 4 - 6 / 2", 11 },
+    { "10 - 4 - 3", 3 }
+};
+#define PRECEDENCE_CASE_COUNT (int)(sizeof(precedenceCases) / sizeof(precedenceCases[0]))
+
+// Function to check the parser's operator precedence by running expressions
+// with a known C value in the VM, without and with the optimization passes.
+// Returns the number of failed checks.
+int checkPrecedence(void) {
+    CompilationContext context;
+    char text[128];
+    int failures = 0;
+
+    traceEnabled = 0;
+    initCompilationContext(&context);
+    for (int c = 0; c < PRECEDENCE_CASE_COUNT; c++) {
+        int length = snprintf(text, sizeof(text), "int main() {\n    return %s;\n}\n", precedenceCases[c].expression);
+        for (int optimize = 0; optimize <= 1; optimize++) {
+            SourceBuffer source = { text, (size_t)length, 0 };
+            VMReport report;
+            if (!runVMSource(&context, &source, optimize, &report) || report.result != precedenceCases[c].expected) {
+                printf("Failed: %s should be %ld (%s)\n", precedenceCases[c].expression, precedenceCases[c].expected,
+                       optimize ? "-O" : "-O0");
+                failures++;
+            }
         }
     }
-     printf("**************************************\n");
-     generateAssemblyCode(intermediateCode, codeIndex);
-      printf("**************************************\n");
+    printf("%d precedence checks, %d failed\n", PRECEDENCE_CASE_COUNT * 2, failures);
+    freeCompilationContext(&context);
+    return failures;
+}
 
+// Function to run the loop-heavy programs in the VM without and with the
+// optimization passes, reporting executed instructions and time per instruction
+void benchmarkVM(long iterations) {
+    char path[] = "/tmp/vmbenchXXXXXX";
+    int fd = mkstemp(path);
+    CompilationContext context;
 
-    // ... (Free AST and close file as before)
+    if (fd < 0) {
+        fprintf(stderr, "Error creating benchmark file.\n");
+        return;
+    }
+    close(fd);
+    traceEnabled = 0;
+
+    initCompilationContext(&context);
+    printf("Dispatch: %s\n", VM_THREADED_DISPATCH ? "computed goto" : "switch");
+    printf("%-10s %4s %14s %10s %12s %8s %16s\n", "Program", "Opt", "Executed", "Words", "Time(ms)", "ns/op",
+           "Result");
+    for (int b = 0; b < VM_BENCHMARK_COUNT; b++) {
+        FILE *out = fopen(path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error writing benchmark file.\n");
+            break;
+        }
+        fprintf(out, vmBenchmarks[b].source, iterations / vmBenchmarks[b].divisor);
+        fclose(out);
+
+        for (int optimize = 0; optimize <= 1; optimize++) {
+            VMReport report;
+            if (!runVMBenchmark(&context, path, optimize, &report)) {
+                printf("%-10s %4s failed\n", vmBenchmarks[b].name, optimize ? "-O" : "-O0");
+                continue;
+            }
+            printf("%-10s %4s %14ld %10d %12.3f %8.2f %16ld\n", vmBenchmarks[b].name, optimize ? "-O" : "-O0",
+                   report.executed, report.codeWords, report.runSeconds * 1e3,
+                   report.executed > 0 ? report.runSeconds * 1e9 / report.executed : 0.0, report.result);
+        }
+    }
 
+    freeCompilationContext(&context);
+    unlink(path);
+}
 
-    // Free the AST
-    freeAST(astRoot);
+// Function to print the command line usage
+void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [--silent | --json] [-o output] [-O0] [--target pseudo|x86-64 | --jit | --vm]\n"
+            "       [--stream [--lexer-thread] | -j threads] [--max-errors n] [--time-report[=json]] [--trace file]\n"
+            "       [--cache dir [--cache-size MB] [--cache-stats]] [--emit-image file] [input | image]\n",
+            program);
+    fprintf(stderr, "       %s [--silent] [-o output] [-O0] [--target pseudo|x86-64] [-j threads] [--cache dir]\n"
+            "       input...\n", program);
+    fprintf(stderr, "       %s --bench-lex [maxMB] | --bench-keywords [iterations] | --bench-arena [declarations]\n",
+            program);
+    fprintf(stderr, "       %s [-O0] --bench-regalloc [statements] | --bench-vm [iterations]\n", program);
+    fprintf(stderr, "       %s [-O0] [--target pseudo|x86-64] --bench-parallel [units]\n", program);
+    fprintf(stderr, "       %s [-O0] [--target pseudo|x86-64] --bench-suite [maxMB] [--baseline file]\n"
+            "       [--save-baseline file] [--threshold percent]\n", program);
+    fprintf(stderr, "       %s --generate declarations|nesting|identifiers|strings|functions|chains bytes [file]\n",
+            program);
+    fprintf(stderr, "       %s [-O0] [--target pseudo|x86-64] [-j threads] [--cache dir] --serve socket\n", program);
+    fprintf(stderr, "       %s [-O0] [--target pseudo|x86-64] --client socket [--repeat n] input... | --shutdown\n",
+            program);
+    fprintf(stderr, "       %s --fuzz-parser [iterations] [seed]\n", program);
+}
 
-    fclose(inputFile);
+int main(int argc, char *argv[]) {
+    const char **inputPaths;
+    int inputCount = 0;
+    int jobs = 0;
+    int suite = 0;
+    size_t suiteMegabytes = 4;
+    const char *baselinePath = NULL;
+    const char *saveBaselinePath = NULL;
+    double threshold = 25.0;
+    int streaming = 0;
+    int lexerThread = 0;
+    const char *serveSocket = NULL;
+    const char *clientSocket = NULL;
+    long repeat = 1;
+    int shutdownServer = 0;
+    CompilationContext context;
+    int status;
+
+    initLexerTables();
+    diagnosticOutput = stdout;
+
+    // --bench-lex [maxMB] measures lexer throughput instead of compiling
+    if (argc > 1 && strcmp(argv[1], "--bench-lex") == 0) {
+        benchmarkLexer(argc > 2 ? (size_t)strtoul(argv[2], NULL, 10) : 64);
+        return 0;
+    }
 
-    return 0;
-}
+    // --bench-arena [declarations] compares malloc/free with the AST arena
+    if (argc > 1 && strcmp(argv[1], "--bench-arena") == 0) {
+        benchmarkArena(argc > 2 ? strtol(argv[2], NULL, 10) : 1000000L);
+        return 0;
+    }
+
+    // --bench-vm [iterations] runs loop-heavy programs in the bytecode VM
+    if (argc > 1 && strcmp(argv[1], "--bench-vm") == 0) {
+        benchmarkVM(argc > 2 ? strtol(argv[2], NULL, 10) : 10000000L);
+        return 0;
+    }
+
+    // --generate shape bytes [file] writes a synthetic program of the given shape and size
+    if (argc > 3 && strcmp(argv[1], "--generate") == 0) {
+        int shape = findShape(argv[2]);
+        FILE *out = argc > 4 ? fopen(argv[4], "w") : stdout;
+        if (shape < 0 || out == NULL) {
+            fprintf(stderr, "Error: Unknown shape or unwritable file (shapes: declarations, nesting, identifiers, "
+                    "strings, functions, chains)\n");
+            return 1;
+        }
+        status = !generateSource(out, shape, (size_t)strtoull(argv[3], NULL, 10));
+        return (out != stdout && fclose(out) != 0) || status;
+    }
+
+    // --fuzz-parser [iterations] [seed] checks operator precedence, then the parser's work bound on random
+    // token streams
+    if (argc > 1 && strcmp(argv[1], "--fuzz-parser") == 0) {
+        status = checkPrecedence() > 0;
+        return fuzzParser(argc > 2 ? strtol(argv[2], NULL, 10) : 10000L,
+                          argc > 3 ? strtoull(argv[3], NULL, 10) : 0) || status;
+    }
+
+    // --bench-keywords [iterations] compares keyword recognition strategies
+    if (argc > 1 && strcmp(argv[1], "--bench-keywords") == 0) {
+        benchmarkKeywords(argc > 2 ? strtol(argv[2], NULL, 10) : 50000000L);
+        return 0;
+    }
+
+    inputPaths = (const char**)malloc((size_t)argc * sizeof(char*));
+    if (inputPaths == NULL) {
+        fprintf(stderr, "Error: Out of memory for arguments\n");
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--silent") == 0) {
+            options.outputMode = OUTPUT_SILENT;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.outputMode = OUTPUT_JSON;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.outputPath = argv[++i];
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            // Compile declaration by declaration in bounded memory
+            streaming = 1;
+        } else if (strcmp(argv[i], "--lexer-thread") == 0) {
+            lexerThread = 1;
+        } else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "x86-64") == 0) {
+                options.target = TARGET_X86_64;
+            } else if (strcmp(argv[i], "pseudo") == 0) {
+                options.target = TARGET_PSEUDO;
+            } else {
+                printUsage(argv[0]);
+                free(inputPaths);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-O0") == 0) {
+            options.optimize = 0;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            // Compile to machine code in memory and run main
+            options.execute = EXECUTE_JIT;
+        } else if (strcmp(argv[i], "--vm") == 0) {
+            // Translate to bytecode and run main in the VM
+            options.execute = EXECUTE_VM;
+        } else if (strcmp(argv[i], "--bench-regalloc") == 0) {
+            // --bench-regalloc [statements] times the register allocator on growing functions
+            benchmarkRegisterAllocator(i + 1 < argc ? strtol(argv[i + 1], NULL, 10) : 64000L);
+            free(inputPaths);
+            return 0;
+        } else if (strcmp(argv[i], "--bench-suite") == 0) {
+            // --bench-suite [maxMB] times every stage on generated programs of every shape
+            suite = 1;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+                suiteMegabytes = (size_t)strtoul(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc) {
+            saveBaselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            // Percentage a stage may be slower than its baseline
+            threshold = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--bench-parallel") == 0) {
+            // --bench-parallel [units] compiles a batch of small units on growing thread counts
+            benchmarkParallel(i + 1 < argc ? (int)strtol(argv[i + 1], NULL, 10) : 2000);
+            free(inputPaths);
+            return 0;
+        } else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) {
+            // Stop reporting (and parsing) after this many errors; 0 means no limit
+            options.maxErrors = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            // Report phase times, allocator footprints and counts on stderr
+            options.timeReport = TIME_REPORT_TABLE;
+        } else if (strcmp(argv[i], "--time-report=json") == 0) {
+            options.timeReport = TIME_REPORT_JSON;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            // Write the phases as Chrome trace events
+            options.tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            // Reuse the assembly of sources compiled before with the same settings
+            options.cacheDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            options.cacheBytes = (size_t)strtoull(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            options.cacheStats = 1;
+        } else if (strcmp(argv[i], "--emit-image") == 0 && i + 1 < argc) {
+            // Also write the symbols, AST and intermediate code as a program image
+            options.imagePath = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            // Stay resident and compile the sources clients send over this socket
+            serveSocket = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            // Have the server on this socket compile the input files
+            clientSocket = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            // Send every file this many times and report the request latencies
+            repeat = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--shutdown") == 0) {
+            shutdownServer = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            // Compile the input files, or the functions of a single file, on this many threads
+            jobs = (int)strtol(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-') {
+            inputPaths[inputCount++] = argv[i];
+        } else {
+            printUsage(argv[0]);
+            free(inputPaths);
+            return 1;
+        }
+    }
+
+    if (suite) {
+        free(inputPaths);
+        return benchmarkSuite(suiteMegabytes, baselinePath, saveBaselinePath, threshold);
+    }
+
+    if (inputCount == 0) {
+        inputPaths[inputCount++] = "input.txt";
+    }
+    if (options.cacheDirectory != NULL && (streaming || !openCache())) {
+        if (streaming) {
+            fprintf(stderr, "Error: --cache is not available with --stream\n");
+        }
+        free(inputPaths);
+        return 1;
+    }
+
+    // The compile server and its client only exchange assembly and diagnostics
+    if (serveSocket != NULL || clientSocket != NULL) {
+        if (streaming || options.outputMode == OUTPUT_JSON || options.execute != EXECUTE_NONE ||
+            options.timeReport != TIME_REPORT_NONE || options.tracePath != NULL || options.imagePath != NULL) {
+            fprintf(stderr, "Error: The compile server only produces assembly\n");
+            free(inputPaths);
+            return 1;
+        }
+        traceEnabled = 0;
+        diagnosticOutput = stderr;
+        if (serveSocket != NULL) {
+            status = runServer(serveSocket, jobs > 0 ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN));
+            if (options.cacheDirectory != NULL) {
+                finishCache();
+            }
+        } else {
+            status = runClient(clientSocket, inputPaths, inputCount, repeat, shutdownServer);
+        }
+        free(inputPaths);
+        return status;
+    }
+
+    // Several files go to the thread pool, which only collects assembly
+    if (inputCount > 1) {
+        if (streaming || options.outputMode == OUTPUT_JSON || options.execute != EXECUTE_NONE ||
+            options.timeReport != TIME_REPORT_NONE || options.tracePath != NULL || options.imagePath != NULL) {
+            fprintf(stderr, "Error: Several input files only produce assembly\n");
+            free(inputPaths);
+            return 1;
+        }
+        if (jobs <= 0) {
+            jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        traceEnabled = 0;
+        diagnosticOutput = stderr;
+        status = compileFiles(inputPaths, inputCount, jobs);
+        if (options.cacheDirectory != NULL) {
+            finishCache();
+        }
+        free(inputPaths);
+        return status;
+    }
 
+    // Only the verbose listing traces stages and mixes diagnostics into stdout
+    traceEnabled = options.outputMode == OUTPUT_VERBOSE && !streaming;
+    if (options.outputMode != OUTPUT_VERBOSE) {
+        diagnosticOutput = stderr;
+    }
 
+    initCompilationContext(&context);
+    if (streaming) {
+        if (options.outputMode == OUTPUT_JSON || options.execute != EXECUTE_NONE) {
+            fprintf(stderr, "Error: %s is not available with --stream\n",
+                    options.execute == EXECUTE_JIT ? "--jit" : options.execute == EXECUTE_VM ? "--vm" : "--json");
+            freeCompilationContext(&context);
+            free(inputPaths);
+            return 1;
+        }
+        if (options.timeReport != TIME_REPORT_NONE || options.tracePath != NULL || options.imagePath != NULL) {
+            fprintf(stderr, "Error: --time-report, --trace and --emit-image are not available with --stream\n");
+            freeCompilationContext(&context);
+            free(inputPaths);
+            return 1;
+        }
+        status = compileStreaming(&context, inputPaths[0], lexerThread);
+    } else {
+        options.jobs = jobs > 1 ? jobs : 1;
+        status = compileFile(&context, inputPaths[0]);
+        if (options.cacheDirectory != NULL) {
+            finishCache();
+        }
+    }
+    freeCompilationContext(&context);
+    free(inputPaths);
+    return status;
+}